@@ -0,0 +1,157 @@
+// Connection-rate benchmark for heartbeat_server.
+// Opens N concurrent client connections, each repeatedly connecting to the
+// server, sending one JSON heartbeat and waiting for the reply, and reports
+// completed connections per second. With -p it also samples the server's
+// thread count and resident memory so the threaded and event-loop models can
+// be compared side by side.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static const char *heartbeat_json =
+    "{\"local_ip\":\"192.168.1.10\",\"public_ip\":\"8.8.8.8\","
+    "\"cpu_usage\":45.5,\"memory_usage\":60.2,\"disk_usage\":75.0,"
+    "\"availability\":99.9,\"latency\":12.5}";
+
+static struct sockaddr_in server_addr;
+static atomic_ulong completed;
+static atomic_ulong failed;
+static atomic_int running = 1;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *client_worker(void *arg) {
+    (void)arg;
+    char reply[256];
+    size_t len = strlen(heartbeat_json);
+
+    while (atomic_load(&running)) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            atomic_fetch_add(&failed, 1);
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+            send(fd, heartbeat_json, len, MSG_NOSIGNAL) != (ssize_t)len) {
+            atomic_fetch_add(&failed, 1);
+            close(fd);
+            continue;
+        }
+        ssize_t n;
+        while ((n = read(fd, reply, sizeof(reply))) > 0) {
+        }
+        close(fd);
+        atomic_fetch_add(n == 0 ? &completed : &failed, 1);
+    }
+    return NULL;
+}
+
+// Read "Threads:" and "VmRSS:" from /proc/<pid>/status
+static void sample_process(int pid, long *threads, long *rss_kb) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "Threads: %ld", threads);
+        sscanf(line, "VmRSS: %ld kB", rss_kb);
+    }
+    fclose(f);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-P port] [-c connections] [-d seconds] [-p server_pid]\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 8081;
+    int connections = 64;
+    int duration = 5;
+    int server_pid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:P:c:d:p:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'p': server_pid = atoi(optarg); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (connections < 1 || duration < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "invalid address: %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    if (!threads) {
+        perror("calloc failed");
+        return EXIT_FAILURE;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], NULL, client_worker, NULL) != 0) {
+            perror("could not create client thread");
+            connections = i;
+            break;
+        }
+    }
+
+    long peak_threads = 0, peak_rss = 0;
+    while (now_seconds() - start < duration) {
+        usleep(100000);
+        if (server_pid) {
+            long t = 0, r = 0;
+            sample_process(server_pid, &t, &r);
+            if (t > peak_threads) peak_threads = t;
+            if (r > peak_rss) peak_rss = r;
+        }
+    }
+    // Count only what finished inside the measurement window
+    double elapsed = now_seconds() - start;
+    unsigned long ok = atomic_load(&completed);
+    atomic_store(&running, 0);
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("concurrent connections: %d\n", connections);
+    printf("completed:              %lu\n", ok);
+    printf("failed:                 %lu\n", atomic_load(&failed));
+    printf("throughput:             %.0f conn/s\n", ok / elapsed);
+    if (server_pid) {
+        printf("server peak threads:    %ld\n", peak_threads);
+        printf("server peak RSS:        %ld kB\n", peak_rss);
+    }
+
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Raw sample compression benchmark: encodes synthetic per-host series into
+// Gorilla blocks the way the TSDB does, then reports bytes per value, the
+// ratio against uncompressed TsSample and HeartbeatNode storage, and how
+// fast blocks decode. Values are rounded to the precision agents report.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "heartbeat_server.h"
+#include "heartbeat_tsdb.h"
+#include "heartbeat_gorilla.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double round_to(double v, double unit) {
+    return round(v / unit) * unit;
+}
+
+static double clamp(double v, double lo, double hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+// One host's signals: CPU is a noisy random walk, memory drifts slowly,
+// disk grows a little, availability is mostly 100 and latency jitters
+// around a per-host baseline
+static void generate(TsSample *out, size_t count, unsigned seed) {
+    srand(seed);
+    double cpu = 20 + rand() % 40;
+    double memory = 30 + rand() % 50;
+    double disk = 40 + rand() % 40;
+    double latency = 5 + rand() % 50;
+    time_t ts = 1700000000;
+    for (size_t i = 0; i < count; i++) {
+        ts += 10 + (rand() % 50 == 0 ? rand() % 3 - 1 : 0);
+        cpu = clamp(cpu + (rand() % 101 - 50) / 10.0, 0, 100);
+        if (rand() % 20 == 0) memory = clamp(memory + (rand() % 11 - 5) / 10.0, 0, 100);
+        if (rand() % 360 == 0) disk = clamp(disk + 0.1, 0, 100);
+        out[i].timestamp = ts;
+        out[i].values[METRIC_CPU_USAGE] = round_to(cpu, 0.1);
+        out[i].values[METRIC_MEMORY_USAGE] = round_to(memory, 0.1);
+        out[i].values[METRIC_DISK_USAGE] = round_to(disk, 0.1);
+        out[i].values[METRIC_AVAILABILITY] = rand() % 500 == 0 ? 99.9 : 100.0;
+        out[i].values[METRIC_LATENCY] = round_to(latency + (rand() % 41 - 20) / 10.0, 0.1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t hosts = 100;
+    size_t samples = 8640;      // a day at 10 s
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:n:")) != -1) {
+        switch (opt) {
+        case 'H': hosts = (size_t)atol(optarg); break;
+        case 'n': samples = (size_t)atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-H hosts] [-n samples_per_host]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (hosts == 0 || samples == 0) return EXIT_FAILURE;
+
+    TsSample *series = malloc(samples * sizeof(TsSample));
+    size_t max_blocks = (samples + TSDB_RAW_BLOCK_SAMPLES - 1) / TSDB_RAW_BLOCK_SAMPLES;
+    GorillaBlock **blocks = malloc(hosts * max_blocks * sizeof(GorillaBlock *));
+    if (!series || !blocks) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    size_t block_count = 0;
+    size_t encoded_bytes = 0;
+    double encode_time = 0;
+    for (size_t h = 0; h < hosts; h++) {
+        generate(series, samples, (unsigned)h + 1);
+        double start = now_seconds();
+        GorillaEncoder enc;
+        gorilla_encoder_init(&enc);
+        for (size_t i = 0; i < samples; i++) {
+            gorilla_append(&enc, series[i].timestamp, series[i].values);
+            if (enc.count == TSDB_RAW_BLOCK_SAMPLES || i + 1 == samples) {
+                GorillaBlock *block = gorilla_seal(&enc);
+                encoded_bytes += sizeof(GorillaBlock) + (block->bits + 7) / 8;
+                blocks[block_count++] = block;
+            }
+        }
+        gorilla_encoder_free(&enc);
+        encode_time += now_seconds() - start;
+    }
+
+    // Decode everything a few times and keep the best pass
+    double decode_time = 1e9;
+    double checksum = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        double start = now_seconds();
+        for (size_t b = 0; b < block_count; b++) {
+            GorillaDecoder dec;
+            TsSample sample;
+            gorilla_decoder_init(&dec, blocks[b]);
+            while (gorilla_next(&dec, &sample)) checksum += sample.values[METRIC_CPU_USAGE];
+        }
+        double elapsed = now_seconds() - start;
+        if (elapsed < decode_time) decode_time = elapsed;
+    }
+
+    double total = (double)hosts * samples;
+    double values = total * (METRIC_COUNT + 1);
+    printf("hosts: %zu, samples per host: %zu, block size: %d samples\n",
+           hosts, samples, TSDB_RAW_BLOCK_SAMPLES);
+    printf("compressed:           %.1f MB, %.2f bytes/sample, %.2f bytes/value (timestamp counted)\n",
+           encoded_bytes / 1e6, encoded_bytes / total, encoded_bytes / values);
+    printf("vs TsSample (%zu B):   %.1fx smaller\n",
+           sizeof(TsSample), total * sizeof(TsSample) / encoded_bytes);
+    printf("vs HeartbeatNode (%zu B): %.1fx smaller\n",
+           sizeof(HeartbeatNode), total * sizeof(HeartbeatNode) / encoded_bytes);
+    printf("encode: %.1f M samples/s\n", total / encode_time / 1e6);
+    printf("decode: %.1f M samples/s (%.0f MB/s of samples) [checksum %.0f]\n",
+           total / decode_time / 1e6, total * sizeof(TsSample) / decode_time / 1e6, checksum);
+    printf("a week at 10 s for 10k hosts: %.1f GB compressed, %.1f GB as HeartbeatNode\n",
+           60480.0 * 10000 * encoded_bytes / total / 1e9,
+           60480.0 * 10000 * sizeof(HeartbeatNode) / 1e9);
+
+    for (size_t b = 0; b < block_count; b++) free(blocks[b]);
+    free(blocks);
+    free(series);
+    return 0;
+}
@@ -0,0 +1,142 @@
+// Ingest scaling benchmark: T threads call add_to_history_at as fast as they
+// can, first all sharing one history shard (the old single-ring path), then
+// each appending to its own shard as the event loops do with --shards. Each
+// thread reports as its own host, so the per-host series never collide; what
+// differs between the runs is the shared ring, its writer_mutex and the
+// fleet window's lock.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "heartbeat_server.h"
+#include "heartbeat_history.h"
+#include "heartbeat_tsdb.h"
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int shard;
+    unsigned long appended;
+} Worker;
+
+static atomic_int running;
+static atomic_int ready;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = arg;
+    set_thread_history_shard(w->shard);
+
+    HeartbeatData data = {
+        .public_ip = "8.8.8.8",
+        .cpu_usage = 45.5,
+        .memory_usage = 60.2,
+        .disk_usage = 75.0,
+        .availability = 99.9,
+        .latency = 12.5
+    };
+    snprintf(data.local_ip, sizeof(data.local_ip), "10.200.%u.%u",
+             (unsigned char)(w->id / 256), (unsigned char)(w->id % 256));
+
+    atomic_fetch_add(&ready, 1);
+    while (!atomic_load(&running)) {
+    }
+    time_t now = time(NULL);
+    while (atomic_load_explicit(&running, memory_order_relaxed) == 1) {
+        add_to_history_at(&data, now);
+        w->appended++;
+        if ((w->appended & 1023) == 0) now = time(NULL);
+    }
+    return NULL;
+}
+
+// Returns heartbeats per second across all threads
+static double run(int threads, bool sharded, double duration) {
+    if (!set_history_shards(sharded ? (size_t)threads : 1)) {
+        fprintf(stderr, "could not split history into %d shards\n", threads);
+        exit(EXIT_FAILURE);
+    }
+    tsdb_clear();
+
+    Worker workers[MAX_HISTORY_SHARDS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    atomic_store(&running, 0);
+    atomic_store(&ready, 0);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){ .id = i, .shard = sharded ? i : -1 };
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("could not create worker thread");
+            exit(EXIT_FAILURE);
+        }
+        if (cpus > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            pthread_setaffinity_np(workers[i].thread, sizeof(set), &set);
+        }
+    }
+    while (atomic_load(&ready) < threads) {
+    }
+
+    double start = now_seconds();
+    atomic_store(&running, 1);
+    usleep((useconds_t)(duration * 1e6));
+    atomic_store(&running, 2);
+    double elapsed = now_seconds() - start;
+
+    unsigned long total = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].appended;
+    }
+    return total / elapsed;
+}
+
+// Thread counts to run: powers of two below max, then max itself
+static int next_thread_count(int t, int max) {
+    if (t == max) return max + 1;
+    return t * 2 < max ? t * 2 : max;
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < 1 ? 1 : cpus > MAX_HISTORY_SHARDS ? MAX_HISTORY_SHARDS : (int)cpus;
+    double duration = 2.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t max_threads] [-d seconds_per_run]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_threads < 1) max_threads = 1;
+    if (max_threads > MAX_HISTORY_SHARDS) max_threads = MAX_HISTORY_SHARDS;
+    if (duration <= 0) duration = 2.0;
+
+    set_history_capacity(100000);
+    printf("cpus online: %ld\n", cpus);
+    printf("threads   one shard (hb/s)   sharded (hb/s)   sharded speedup vs 1 thread\n");
+    double base = 0;
+    for (int t = 1; t <= max_threads; t = next_thread_count(t, max_threads)) {
+        double shared = run(t, false, duration);
+        double sharded = run(t, true, duration);
+        if (t == 1) base = sharded;
+        printf("%7d   %16.0f   %14.0f   %.2fx\n", t, shared, sharded, sharded / base);
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+// Microbenchmark for heartbeat decoding: the single-pass decoder used by
+// process_json_data against the json-c object-tree path it replaced.
+// Both decoders are run over the same set of payloads and the results are
+// cross-checked before timing.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "heartbeat_server.h"
+
+static const char *payloads[] = {
+    // What heartbeat_client sends
+    "{\"local_ip\":\"192.168.1.10\",\"public_ip\":\"8.8.8.8\","
+    "\"cpu_usage\":45.5,\"memory_usage\":60.2,\"disk_usage\":75.0,"
+    "\"availability\":99.9,\"latency\":12.5}",
+    // json-c pretty output, with a hostname and integer values
+    "{\n  \"local_ip\": \"10.0.4.17\",\n  \"public_ip\": \"203.0.113.9\",\n"
+    "  \"hostname\": \"web-17\",\n  \"cpu_usage\": 3,\n  \"memory_usage\": 81.25,\n"
+    "  \"disk_usage\": 40,\n  \"availability\": 100,\n  \"latency\": 0.734\n}",
+    // Rejected: latency out of range
+    "{\"local_ip\":\"192.168.1.10\",\"public_ip\":\"8.8.8.8\","
+    "\"cpu_usage\":45.5,\"memory_usage\":60.2,\"disk_usage\":75.0,"
+    "\"availability\":99.9,\"latency\":12000}",
+};
+#define PAYLOAD_COUNT (sizeof(payloads) / sizeof(payloads[0]))
+
+typedef bool (*Decoder)(const char *json, HeartbeatData *hb_data);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns nanoseconds per decode
+static double run(Decoder decode, long iterations, unsigned long *accepted) {
+    HeartbeatData hb_data;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        memset(&hb_data, 0, sizeof(hb_data));
+        *accepted += decode(payloads[i % PAYLOAD_COUNT], &hb_data);
+    }
+    return (now_seconds() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations < 1) iterations = 1;
+
+    for (size_t i = 0; i < PAYLOAD_COUNT; i++) {
+        HeartbeatData a, b;
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        bool fast = process_json_data(payloads[i], &a);
+        bool generic = process_json_data_generic(payloads[i], &b);
+        if (fast != generic || (fast && memcmp(&a, &b, sizeof(a)) != 0)) {
+            fprintf(stderr, "decoders disagree on payload %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    unsigned long fast_accepted = 0, generic_accepted = 0;
+    double generic_ns = run(process_json_data_generic, iterations, &generic_accepted);
+    double fast_ns = run(process_json_data, iterations, &fast_accepted);
+
+    printf("iterations:        %ld\n", iterations);
+    printf("json-c:            %8.1f ns/heartbeat\n", generic_ns);
+    printf("single-pass:       %8.1f ns/heartbeat\n", fast_ns);
+    printf("speedup:           %8.1fx\n", generic_ns / fast_ns);
+    return fast_accepted == generic_accepted ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,133 @@
+// Per-sample cost of the agent's metric reads: the sampler (open /proc
+// files, one pread each, hand-written scanners) against the original
+// functions (fopen/fgets/sscanf per read, getifaddrs every cycle), which are
+// reproduced here as they were.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include "heartbeat_sampler.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double legacy_cpu(void) {
+    static double last_total, last_idle;
+    double user, nice, system, idle;
+    char line[256];
+    FILE *file = fopen("/proc/stat", "r");
+    if (!file) return -1;
+    if (!fgets(line, sizeof(line), file)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    sscanf(line, "%*s %lf %lf %lf %lf", &user, &nice, &system, &idle);
+    double total = user + nice + system + idle;
+    double usage = total > last_total
+                 ? (total - last_total - (idle - last_idle)) / (total - last_total) * 100 : 0;
+    last_total = total;
+    last_idle = idle;
+    return usage;
+}
+
+static double legacy_memory(void) {
+    unsigned long long mem_total = 0, mem_free = 0, buffers = 0, cached = 0;
+    char line[256];
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (!meminfo) return -1;
+    while (fgets(line, sizeof(line), meminfo)) {
+        if (sscanf(line, "MemTotal: %llu kB", &mem_total) == 1 ||
+            sscanf(line, "MemFree: %llu kB", &mem_free) == 1 ||
+            sscanf(line, "Buffers: %llu kB", &buffers) == 1 ||
+            sscanf(line, "Cached: %llu kB", &cached) == 1)
+            continue;
+    }
+    fclose(meminfo);
+    return (double)(mem_total - mem_free - buffers - cached) / mem_total * 100;
+}
+
+static double legacy_disk(void) {
+    struct statvfs fs;
+    if (statvfs("/", &fs) != 0) return -1;
+    return (double)(fs.f_blocks - fs.f_bfree) / fs.f_blocks * 100;
+}
+
+static void legacy_local_ip(char *ip, size_t size) {
+    struct ifaddrs *ifaddr;
+    if (getifaddrs(&ifaddr) == -1) return;
+    for (struct ifaddrs *ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET && strcmp(ifa->ifa_name, "lo") != 0) {
+            getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in), ip, size, NULL, 0, NI_NUMERICHOST);
+            break;
+        }
+    }
+    freeifaddrs(ifaddr);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n samples]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations <= 0) return EXIT_FAILURE;
+
+    char ip[NI_MAXHOST] = "";
+    double checksum = 0;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        checksum += legacy_cpu() + legacy_memory() + legacy_disk();
+    }
+    double legacy = (now_seconds() - start) / iterations;
+
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        legacy_local_ip(ip, sizeof(ip));
+    }
+    double ifaddrs = (now_seconds() - start) / iterations;
+
+    Sampler *sampler = malloc(sizeof(Sampler));
+    if (!sampler || sampler_open(sampler, "/") != 0) {
+        perror("sampler_open");
+        return EXIT_FAILURE;
+    }
+    SamplerReading *reading = malloc(sizeof(SamplerReading));
+    if (!reading) return EXIT_FAILURE;
+    start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        if (!sampler_read(sampler, reading)) {
+            fprintf(stderr, "sampler_read failed\n");
+            return EXIT_FAILURE;
+        }
+        checksum += reading->cpu_usage + reading->memory_usage + reading->disk_usage;
+    }
+    double sampled = (now_seconds() - start) / iterations;
+
+    printf("samples: %ld, cores: %d\n", iterations, reading->cpu_count);
+    printf("legacy cpu+memory+disk:   %7.2f us/sample\n", legacy * 1e6);
+    printf("legacy with getifaddrs:   %7.2f us/sample\n", (legacy + ifaddrs) * 1e6);
+    printf("sampler (total+per-core): %7.2f us/sample (%.1fx faster than legacy, %.1fx with getifaddrs)\n",
+           sampled * 1e6, legacy / sampled, (legacy + ifaddrs) / sampled);
+    printf("last sample: cpu %.1f%%, memory %.1f%%, disk %.1f%% [checksum %.0f]\n",
+           reading->cpu_usage, reading->memory_usage, reading->disk_usage, checksum);
+
+    sampler_close(sampler);
+    free(reading);
+    free(sampler);
+    return 0;
+}
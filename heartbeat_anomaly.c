@@ -0,0 +1,165 @@
+#include "heartbeat_anomaly.h"
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+const HeartbeatMetric anomaly_metrics[ANOMALY_METRIC_COUNT] = {
+    METRIC_CPU_USAGE,
+    METRIC_LATENCY
+};
+
+typedef struct {
+    uint32_t ip;                        // network byte order
+    uint16_t samples;                   // 0 marks a free slot; saturates
+    float mean[ANOMALY_METRIC_COUNT];
+    float var[ANOMALY_METRIC_COUNT];
+} HostState;
+
+// One stripe of the host table (see heartbeat_hash.h)
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t hosts;
+    HostState slots[ANOMALY_STRIPE_SLOTS];
+} Stripe;
+
+static Stripe stripes[ANOMALY_TABLE_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static AnomalyEvent event_log[ANOMALY_LOG_CAPACITY];
+static uint64_t event_head;             // events ever logged
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t host_total;
+static uint64_t untracked;
+static uint64_t flagged;
+
+static void init_stripes(void) {
+    for (size_t i = 0; i < ANOMALY_TABLE_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+}
+
+// The host's slot, claiming a free one for a new host; NULL when the stripe
+// is full. Caller holds the stripe's lock.
+static HostState *find_host(Stripe *stripe, uint32_t ip, uint32_t hash) {
+    for (uint32_t i = probe_start(hash, ANOMALY_STRIPE_SLOTS);; i = probe_next(i, ANOMALY_STRIPE_SLOTS)) {
+        HostState *host = &stripe->slots[i];
+        if (host->samples == 0) {
+            if (stripe_full(stripe->hosts, ANOMALY_STRIPE_SLOTS)) return NULL;
+            stripe->hosts++;
+            __atomic_fetch_add(&host_total, 1, __ATOMIC_RELAXED);
+            host->ip = ip;
+            return host;
+        }
+        if (host->ip == ip) return host;
+    }
+}
+
+static void log_events(const AnomalyEvent *events, size_t count) {
+    pthread_mutex_lock(&event_mutex);
+    for (size_t i = 0; i < count; i++) {
+        event_log[event_head++ % ANOMALY_LOG_CAPACITY] = events[i];
+    }
+    pthread_mutex_unlock(&event_mutex);
+}
+
+uint8_t anomaly_observe(const HeartbeatData *data, time_t timestamp) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, data->local_ip, &addr) != 1) return 0;
+    pthread_once(&stripes_once, init_stripes);
+
+    uint32_t hash = hash_mix32(addr.s_addr);
+    Stripe *stripe = &stripes[stripe_of(hash, ANOMALY_TABLE_STRIPES)];
+    AnomalyEvent events[ANOMALY_METRIC_COUNT];
+    size_t event_count = 0;
+    uint8_t flags = 0;
+
+    pthread_mutex_lock(&stripe->lock);
+    HostState *host = find_host(stripe, addr.s_addr, hash);
+    if (!host) {
+        pthread_mutex_unlock(&stripe->lock);
+        __atomic_fetch_add(&untracked, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // Until the EWMA has seen 1 / ANOMALY_ALPHA samples, weigh them equally
+    // so the early mean and variance are not biased towards the first one
+    double alpha = host->samples > 0 && 1.0 / (host->samples + 1) > ANOMALY_ALPHA
+                 ? 1.0 / (host->samples + 1) : ANOMALY_ALPHA;
+    for (int i = 0; i < ANOMALY_METRIC_COUNT; i++) {
+        double x = heartbeat_metric_value(data, anomaly_metrics[i]);
+        if (host->samples == 0) {
+            host->mean[i] = (float)x;
+            host->var[i] = 0.0f;
+            continue;
+        }
+
+        double mean = host->mean[i];
+        double stddev = sqrt(host->var[i]);
+        if (stddev < ANOMALY_MIN_STDDEV) stddev = ANOMALY_MIN_STDDEV;
+        double z = (x - mean) / stddev;
+        if (host->samples >= ANOMALY_WARMUP_SAMPLES && fabs(z) > ANOMALY_Z_THRESHOLD) {
+            flags |= (uint8_t)(1u << anomaly_metrics[i]);
+            AnomalyEvent *event = &events[event_count++];
+            event->timestamp = timestamp;
+            memcpy(event->local_ip, data->local_ip, MAX_IP_LEN);
+            memcpy(event->hostname, data->hostname, MAX_HOSTNAME_LEN);
+            event->metric = anomaly_metrics[i];
+            event->value = x;
+            event->mean = mean;
+            event->stddev = stddev;
+            event->z = z;
+        }
+
+        double diff = x - mean;
+        double incr = alpha * diff;
+        host->mean[i] = (float)(mean + incr);
+        host->var[i] = (float)((1.0 - alpha) * (host->var[i] + diff * incr));
+    }
+    if (host->samples < UINT16_MAX) host->samples++;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (event_count > 0) {
+        log_events(events, event_count);
+        __atomic_fetch_add(&flagged, event_count, __ATOMIC_RELAXED);
+    }
+    return flags;
+}
+
+size_t anomaly_recent(const char *host, AnomalyEvent *out, size_t max) {
+    size_t n = 0;
+    pthread_mutex_lock(&event_mutex);
+    uint64_t first = event_head > ANOMALY_LOG_CAPACITY ? event_head - ANOMALY_LOG_CAPACITY : 0;
+    for (uint64_t i = event_head; i > first && n < max; i--) {
+        const AnomalyEvent *event = &event_log[(i - 1) % ANOMALY_LOG_CAPACITY];
+        if (host && strcmp(host, event->local_ip) != 0 && strcmp(host, event->hostname) != 0) {
+            continue;
+        }
+        out[n++] = *event;
+    }
+    pthread_mutex_unlock(&event_mutex);
+    return n;
+}
+
+void anomaly_get_stats(AnomalyStats *stats) {
+    stats->hosts = __atomic_load_n(&host_total, __ATOMIC_RELAXED);
+    stats->untracked = __atomic_load_n(&untracked, __ATOMIC_RELAXED);
+    stats->flagged = __atomic_load_n(&flagged, __ATOMIC_RELAXED);
+}
+
+void anomaly_clear(void) {
+    pthread_once(&stripes_once, init_stripes);
+    for (size_t i = 0; i < ANOMALY_TABLE_STRIPES; i++) {
+        pthread_mutex_lock(&stripes[i].lock);
+        memset(stripes[i].slots, 0, sizeof(stripes[i].slots));
+        stripes[i].hosts = 0;
+        pthread_mutex_unlock(&stripes[i].lock);
+    }
+    pthread_mutex_lock(&event_mutex);
+    event_head = 0;
+    pthread_mutex_unlock(&event_mutex);
+    __atomic_store_n(&host_total, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&untracked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&flagged, 0, __ATOMIC_RELAXED);
+}
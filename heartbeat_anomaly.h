@@ -0,0 +1,61 @@
+#ifndef HEARTBEAT_ANOMALY_H
+#define HEARTBEAT_ANOMALY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+#include "heartbeat_hash.h"
+
+// Streaming outlier detection on ingest. Every host keeps an exponentially
+// weighted mean and variance of each watched metric; a sample more than
+// ANOMALY_Z_THRESHOLD standard deviations from its host's mean is flagged.
+// Hosts are keyed by their IPv4 address in a fixed table of 24-byte entries,
+// so ANOMALY_MAX_HOSTS (about 114k) hosts take 3 MB.
+
+#define ANOMALY_ALPHA 0.05              // EWMA weight of each new sample
+#define ANOMALY_Z_THRESHOLD 4.0
+#define ANOMALY_WARMUP_SAMPLES 20       // samples a host needs before it is judged
+#define ANOMALY_MIN_STDDEV 1.0          // percentage points or ms; keeps flat series quiet
+#define ANOMALY_TABLE_STRIPES 64
+#define ANOMALY_STRIPE_SLOTS 2048       // power of two
+#define ANOMALY_MAX_HOSTS (ANOMALY_TABLE_STRIPES * STRIPE_LOAD_LIMIT(ANOMALY_STRIPE_SLOTS))
+#define ANOMALY_LOG_CAPACITY 1024       // flagged samples kept for the endpoint
+
+// Metrics watched, by HeartbeatMetric; flags use bit (1 << metric)
+#define ANOMALY_METRIC_COUNT 2
+extern const HeartbeatMetric anomaly_metrics[ANOMALY_METRIC_COUNT];
+
+// One flagged sample
+typedef struct {
+    time_t timestamp;
+    char local_ip[MAX_IP_LEN];
+    char hostname[MAX_HOSTNAME_LEN];
+    HeartbeatMetric metric;
+    double value;
+    double mean;                        // the host's EWMA before this sample
+    double stddev;
+    double z;
+} AnomalyEvent;
+
+typedef struct {
+    uint64_t hosts;                     // hosts with detector state
+    uint64_t untracked;                 // samples from hosts the table had no room for
+    uint64_t flagged;                   // anomalous metric values seen
+} AnomalyStats;
+
+// Fold one heartbeat into its host's state. Returns the metrics it flagged
+// as bits (1 << HeartbeatMetric), 0 if none.
+uint8_t anomaly_observe(const HeartbeatData *data, time_t timestamp);
+
+// Copy up to max of the most recent flagged samples, newest first, that
+// match host (a local_ip or hostname; NULL for all). Returns the count.
+size_t anomaly_recent(const char *host, AnomalyEvent *out, size_t max);
+
+void anomaly_get_stats(AnomalyStats *stats);
+
+// Forget every host and flagged sample (for testing)
+void anomaly_clear(void);
+
+#endif /* HEARTBEAT_ANOMALY_H */
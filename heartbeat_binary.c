@@ -0,0 +1,132 @@
+#include "heartbeat_binary.h"
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+bool hb_is_frame_start(const uint8_t *data, size_t len) {
+    return len > 0 && data[0] == (HB_MAGIC >> 8);
+}
+
+HbParseStatus hb_parse_frame(const uint8_t *data, size_t len, HbFrame *frame, size_t *consumed) {
+    if (len < HB_HEADER_SIZE) {
+        // Reject a bad magic as early as possible
+        if (len >= 2 && get_u16(data) != HB_MAGIC) return HB_PARSE_ERROR;
+        return HB_PARSE_INCOMPLETE;
+    }
+    if (get_u16(data) != HB_MAGIC || data[2] != HB_VERSION) return HB_PARSE_ERROR;
+
+    frame->version = data[2];
+    frame->type = data[3];
+    frame->length = get_u16(data + 4);
+    frame->seq = get_u32(data + 6);
+    if (len < HB_HEADER_SIZE + (size_t)frame->length) return HB_PARSE_INCOMPLETE;
+
+    frame->payload = data + HB_HEADER_SIZE;
+    *consumed = HB_HEADER_SIZE + frame->length;
+    return HB_PARSE_COMPLETE;
+}
+
+void hb_encode_header(uint8_t *out, HbFrameType type, uint16_t length, uint32_t seq) {
+    put_u16(out, HB_MAGIC);
+    out[2] = HB_VERSION;
+    out[3] = (uint8_t)type;
+    put_u16(out + 4, length);
+    put_u32(out + 6, seq);
+}
+
+long hb_samples_count(const HbFrame *frame) {
+    if (frame->type != HB_FRAME_SAMPLES || frame->length < 2) return -1;
+    long count = get_u16(frame->payload);
+    if (frame->length != 2 + (size_t)count * HB_SAMPLE_SIZE) return -1;
+    return count;
+}
+
+void hb_frame_sample(const HbFrame *frame, size_t index, HbSample *sample) {
+    hb_decode_sample(frame->payload + 2 + index * HB_SAMPLE_SIZE, sample);
+}
+
+void hb_encode_sample(uint8_t *out, const HbSample *sample) {
+    // Addresses are already in network order
+    memcpy(out, &sample->local_ip, 4);
+    memcpy(out + 4, &sample->public_ip, 4);
+    put_u32(out + 8, sample->timestamp);
+    put_u16(out + 12, sample->cpu_usage);
+    put_u16(out + 14, sample->memory_usage);
+    put_u16(out + 16, sample->disk_usage);
+    put_u16(out + 18, sample->availability);
+    put_u32(out + 20, sample->latency);
+}
+
+void hb_decode_sample(const uint8_t *in, HbSample *sample) {
+    memcpy(&sample->local_ip, in, 4);
+    memcpy(&sample->public_ip, in + 4, 4);
+    sample->timestamp = get_u32(in + 8);
+    sample->cpu_usage = get_u16(in + 12);
+    sample->memory_usage = get_u16(in + 14);
+    sample->disk_usage = get_u16(in + 16);
+    sample->availability = get_u16(in + 18);
+    sample->latency = get_u32(in + 20);
+}
+
+// Fixed-point with two decimals, saturating at the field's range
+static uint32_t to_fixed(double value, uint32_t max) {
+    if (!(value > 0.0)) return 0;
+    double scaled = round(value * 100.0);
+    return scaled >= max ? max : (uint32_t)scaled;
+}
+
+bool hb_sample_from_heartbeat(const HeartbeatData *data, time_t timestamp, HbSample *sample) {
+    if (inet_pton(AF_INET, data->local_ip, &sample->local_ip) != 1 ||
+        inet_pton(AF_INET, data->public_ip, &sample->public_ip) != 1) {
+        return false;
+    }
+    sample->timestamp = timestamp > 0 ? (uint32_t)timestamp : 0;
+    sample->cpu_usage = (uint16_t)to_fixed(data->cpu_usage, UINT16_MAX);
+    sample->memory_usage = (uint16_t)to_fixed(data->memory_usage, UINT16_MAX);
+    sample->disk_usage = (uint16_t)to_fixed(data->disk_usage, UINT16_MAX);
+    sample->availability = (uint16_t)to_fixed(data->availability, UINT16_MAX);
+    sample->latency = to_fixed(data->latency, UINT32_MAX);
+    return true;
+}
+
+void hb_sample_to_heartbeat(const HbSample *sample, HeartbeatData *data) {
+    memset(data, 0, sizeof(*data));
+    inet_ntop(AF_INET, &sample->local_ip, data->local_ip, MAX_IP_LEN);
+    inet_ntop(AF_INET, &sample->public_ip, data->public_ip, MAX_IP_LEN);
+    data->cpu_usage = sample->cpu_usage / 100.0;
+    data->memory_usage = sample->memory_usage / 100.0;
+    data->disk_usage = sample->disk_usage / 100.0;
+    data->availability = sample->availability / 100.0;
+    data->latency = sample->latency / 100.0;
+}
+
+bool hb_sample_time(const HbSample *sample, time_t now, time_t *timestamp) {
+    if (sample->timestamp == 0) {
+        *timestamp = now;
+        return true;
+    }
+    time_t t = (time_t)sample->timestamp;
+    if (t > now + HB_MAX_CLOCK_SKEW || t < now - HB_MAX_SAMPLE_AGE) return false;
+    *timestamp = t;
+    return true;
+}
@@ -0,0 +1,103 @@
+#ifndef HEARTBEAT_BINARY_H
+#define HEARTBEAT_BINARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+
+// Binary heartbeat protocol, version 1. All integers are big-endian.
+//
+// Frame header (10 bytes):
+//   magic   u16   0xBEA7 (the first byte is never ASCII, so the server can
+//                 tell frames from HTTP and raw JSON on the same port)
+//   version u8    HB_VERSION
+//   type    u8    HbFrameType
+//   length  u16   payload bytes following the header
+//   seq     u32   sender's frame counter, echoed in the ACK
+//
+// Payloads:
+//   HELLO    version u8, hostname_len u8, hostname. The client offers the
+//            highest version it speaks; the server answers with a HELLO
+//            carrying the version it chose (and no hostname). The hostname
+//            applies to every sample on the connection.
+//   SAMPLES  count u16, then count samples of HB_SAMPLE_SIZE bytes:
+//            local_ip u32, public_ip u32, timestamp u32 (Unix seconds,
+//            0 = time of receipt; see hb_sample_time), cpu/memory/disk/availability u16 each in
+//            hundredths of a percent, latency u32 in hundredths of a ms.
+//   ACK      accepted u16, rejected u16 for the SAMPLES frame with this seq.
+//
+// A single sample travels in 36 bytes against ~200 for the JSON form.
+
+#define HB_MAGIC 0xBEA7
+#define HB_VERSION 1
+#define HB_HEADER_SIZE 10
+#define HB_SAMPLE_SIZE 24
+#define HB_MAX_PAYLOAD 65535
+#define HB_MAX_SAMPLES ((HB_MAX_PAYLOAD - 2) / HB_SAMPLE_SIZE)
+#define HB_MAX_CLOCK_SKEW 300               // seconds a sample may be ahead of the server
+#define HB_MAX_SAMPLE_AGE (7 * 24 * 3600)   // as far back as the hourly rollups reach
+
+typedef enum {
+    HB_FRAME_HELLO = 1,
+    HB_FRAME_SAMPLES = 2,
+    HB_FRAME_ACK = 3
+} HbFrameType;
+
+typedef enum {
+    HB_PARSE_INCOMPLETE,
+    HB_PARSE_COMPLETE,
+    HB_PARSE_ERROR
+} HbParseStatus;
+
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    uint16_t length;
+    uint32_t seq;
+    const uint8_t *payload;
+} HbFrame;
+
+// One sample as carried on the wire
+typedef struct {
+    uint32_t local_ip;          // network byte order, as in struct in_addr
+    uint32_t public_ip;
+    uint32_t timestamp;
+    uint16_t cpu_usage;         // hundredths of a percent
+    uint16_t memory_usage;
+    uint16_t disk_usage;
+    uint16_t availability;
+    uint32_t latency;           // hundredths of a millisecond
+} HbSample;
+
+// Does data start like a binary frame?
+bool hb_is_frame_start(const uint8_t *data, size_t len);
+
+// Parse the frame at the start of data. On HB_PARSE_COMPLETE the frame spans
+// the first *consumed bytes and frame->payload points into data.
+HbParseStatus hb_parse_frame(const uint8_t *data, size_t len, HbFrame *frame, size_t *consumed);
+
+// Write a frame header to out[0..HB_HEADER_SIZE)
+void hb_encode_header(uint8_t *out, HbFrameType type, uint16_t length, uint32_t seq);
+
+// Number of samples in a SAMPLES frame, or -1 if its length does not match
+long hb_samples_count(const HbFrame *frame);
+
+// Sample index of a SAMPLES frame whose count has been checked
+void hb_frame_sample(const HbFrame *frame, size_t index, HbSample *sample);
+
+void hb_encode_sample(uint8_t *out, const HbSample *sample);
+void hb_decode_sample(const uint8_t *in, HbSample *sample);
+
+// Convert between wire samples and HeartbeatData. hb_sample_from_heartbeat
+// fails if an address is not dotted-quad IPv4.
+bool hb_sample_from_heartbeat(const HeartbeatData *data, time_t timestamp, HbSample *sample);
+void hb_sample_to_heartbeat(const HbSample *sample, HeartbeatData *data);
+
+// When a received sample was taken: its timestamp, or now if it has none.
+// False if the timestamp is more than HB_MAX_CLOCK_SKEW ahead of now or
+// older than HB_MAX_SAMPLE_AGE; such a sample must not be stored.
+bool hb_sample_time(const HbSample *sample, time_t now, time_t *timestamp);
+
+#endif /* HEARTBEAT_BINARY_H */
@@ -14,13 +14,14 @@
 #include <pthread.h>
 #include <time.h>
 #include <curl/curl.h>
-#include <sys/statvfs.h> // For statvfs
 #include <netinet/in.h>   // For NI_MAXHOST and in_addr
+#include <netinet/tcp.h>  // For TCP_NODELAY
 #include <errno.h>        // For gai_strerror
 #include <sys/utsname.h>  // For uname
 #include <sys/sysinfo.h>  // For sysinfo
 
-#include "sysinfo.h"      // Include sysinfo header
+#include "heartbeat_binary.h"  // Binary frame format shared with the server
+#include "heartbeat_sampler.h" // CPU, memory and disk readings from /proc
 
 #define INTERVAL 10 // 发送间隔时间（秒）
 // Update this line to match your server's real address
@@ -35,80 +36,6 @@
 #define NI_NUMERICHOST 1
 #endif
 
-// 获取CPU使用率
-double get_cpu_usage() {
-    FILE* file;
-    char line[256];
-    double user, nice, system, idle;
-
-    file = fopen("/proc/stat", "r");
-    if (!file) {
-        perror("Failed to open /proc/stat");
-        return -1;
-    }
-    if (fgets(line, sizeof(line), file) == NULL) {
-        perror("Failed to read /proc/stat");
-        fclose(file);
-        return -1;
-    }
-    sscanf(line, "%*s %lf %lf %lf %lf", &user, &nice, &system, &idle);
-
-    fclose(file);
-
-    double total_time = user + nice + system + idle;
-    static double last_total_time = -1.0;
-    static double last_idle_time = -1.0;
-    if (last_total_time == -1) {
-        last_total_time = total_time;
-        last_idle_time = idle;
-        sleep(1);
-        return get_cpu_usage();
-    }
-
-    double cpu_usage = (total_time - last_total_time - (idle - last_idle_time)) / (total_time - last_total_time) * 100;
-    last_total_time = total_time;
-    last_idle_time = idle;
-
-    return cpu_usage;
-}
-
-// 获取内存使用率
-double get_memory_usage() {
-    FILE* meminfo = fopen("/proc/meminfo", "r");
-    if (!meminfo) {
-        perror("Failed to open /proc/meminfo");
-        return -1;
-    }
-
-    unsigned long long mem_total = 0, mem_free = 0, buffers = 0, cached = 0;
-    char line[256]; // Declare line here
-
-    while (fgets(line, sizeof(line), meminfo)) {
-        if (sscanf(line, "MemTotal: %llu kB", &mem_total) == 1 ||
-            sscanf(line, "MemFree: %llu kB", &mem_free) == 1 ||
-            sscanf(line, "Buffers: %llu kB", &buffers) == 1 ||
-            sscanf(line, "Cached: %llu kB", &cached) == 1)
-            continue;
-    }
-    fclose(meminfo);
-
-    unsigned long long used_mem = mem_total - mem_free - buffers - cached;
-    return ((double)used_mem / mem_total) * 100;
-}
-
-// 获取硬盘使用率
-double get_disk_usage(const char* path) {
-    struct statvfs fs_stats; // Include sys/statvfs.h for this structure
-    if (statvfs(path, &fs_stats) != 0) {
-        perror("Failed to statvfs");
-        return -1;
-    }
-
-    uint64_t blocks_used = fs_stats.f_blocks - fs_stats.f_bfree;
-    uint64_t blocks_total = fs_stats.f_blocks;
-    return ((double)blocks_used / blocks_total) * 100;
-}
-
 // 获取本地IP地址
 void get_local_ip(char* ip_buffer, size_t buffer_size) {
     struct ifaddrs *ifaddr, *ifa;
@@ -144,134 +71,426 @@ void get_local_ip(char* ip_buffer, size_t buffer_size) {
 }
 
 // 获取公网IP地址
+#define PUBLIC_IP_URL "https://api.ipify.org/"
+#define PUBLIC_IP_TTL 3600          // seconds a looked-up public IP is reused
+#define PUBLIC_IP_RETRY 30          // seconds before retrying a failed lookup
+
+// Response body collected into a fixed buffer; anything beyond it is dropped
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+} ResponseBuffer;
+
 size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
-    strncat(userp, contents, realsize);
+    ResponseBuffer *buf = userp;
+    size_t room = buf->size - 1 - buf->len;
+    size_t take = realsize < room ? realsize : room;
+    memcpy(buf->data + buf->len, contents, take);
+    buf->len += take;
+    buf->data[buf->len] = '\0';
     return realsize;
 }
 
-void get_public_ip(char* ip_buffer, size_t buffer_size) {
-    CURL *curl;
-    CURLcode res;
-    char public_ip[INET_ADDRSTRLEN] = "";
+// The handle lives for the whole run so libcurl can keep its connection
+// (and the TLS session) open between lookups instead of reconnecting
+static CURL *public_ip_curl;
 
+static void init_public_ip_curl(void) {
     curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-
-    if(curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.ipify.org/");
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, public_ip);
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK)
-            fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                    curl_easy_strerror(res));
-
-        curl_easy_cleanup(curl);
+    public_ip_curl = curl_easy_init();
+
+    if (public_ip_curl) {
+        curl_easy_setopt(public_ip_curl, CURLOPT_URL, PUBLIC_IP_URL);
+        curl_easy_setopt(public_ip_curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        curl_easy_setopt(public_ip_curl, CURLOPT_TIMEOUT_MS, 5000L);
+        curl_easy_setopt(public_ip_curl, CURLOPT_CONNECTTIMEOUT_MS, 3000L);
+        curl_easy_setopt(public_ip_curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(public_ip_curl, CURLOPT_TCP_KEEPALIVE, 1L);
     }
-
-    curl_global_cleanup();
-    strncpy(ip_buffer, public_ip, buffer_size);
 }
 
-// 计算与服务器的时延
-double calculate_latency(const char* server_url) {
-    CURL *curl;
-    CURLcode res;
-    double latency = 0.0;
+// Look the public address up once over the cached handle. Returns false
+// (leaving ip_buffer untouched) unless the answer is an IPv4 address.
+bool get_public_ip(char* ip_buffer, size_t buffer_size) {
+    if (!public_ip_curl) return false;
+
+    char public_ip[64] = "";
+    ResponseBuffer body = { public_ip, sizeof(public_ip), 0 };
+    curl_easy_setopt(public_ip_curl, CURLOPT_WRITEDATA, &body);
+    CURLcode res = curl_easy_perform(public_ip_curl);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        return false;
+    }
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-
-    if(curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, server_url);
-        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L); // Perform a HEAD request
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 5000L); // Timeout after 5 seconds
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 2L);
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 3000L);
-        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
-        curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 120L);
-        curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 60L);
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK) {
-            curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &latency);
-        } else {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n",
-                    curl_easy_strerror(res));
-        }
+    public_ip[strcspn(public_ip, " \r\n")] = '\0';
+    struct in_addr addr;
+    if (inet_pton(AF_INET, public_ip, &addr) != 1) {
+        fprintf(stderr, "Unexpected public IP lookup answer: %s\n", public_ip);
+        return false;
+    }
+    snprintf(ip_buffer, buffer_size, "%s", public_ip);
+    return true;
+}
+
+// The last public IP looked up; a background thread refreshes it every ttl
+// seconds so the send loop never waits on the lookup
+static struct {
+    pthread_mutex_t lock;
+    char ip[INET_ADDRSTRLEN];       // empty until a lookup succeeds
+    int ttl;
+} public_ip_cache = { PTHREAD_MUTEX_INITIALIZER, "", PUBLIC_IP_TTL };
+
+static void store_public_ip(const char *ip) {
+    pthread_mutex_lock(&public_ip_cache.lock);
+    snprintf(public_ip_cache.ip, sizeof(public_ip_cache.ip), "%s", ip);
+    pthread_mutex_unlock(&public_ip_cache.lock);
+}
 
-        curl_easy_cleanup(curl);
+static void *refresh_public_ip(void *arg) {
+    (void)arg;
+    bool ok = true;                 // main did the first lookup
+    while (1) {
+        sleep(ok ? (unsigned)public_ip_cache.ttl : PUBLIC_IP_RETRY);
+        char ip[INET_ADDRSTRLEN];
+        ok = get_public_ip(ip, sizeof(ip));
+        if (ok) store_public_ip(ip);
     }
+    return NULL;
+}
 
-    curl_global_cleanup();
-    return latency;
+// Copy the cached public IP, or fallback while no lookup has succeeded
+static void cached_public_ip(char *ip_buffer, size_t buffer_size, const char *fallback) {
+    pthread_mutex_lock(&public_ip_cache.lock);
+    snprintf(ip_buffer, buffer_size, "%s", public_ip_cache.ip[0] ? public_ip_cache.ip : fallback);
+    pthread_mutex_unlock(&public_ip_cache.lock);
 }
 
-#define SERVER_PORT 8080
 #define SERVER_IP "127.0.0.1"
+#define BINARY_PORT TCP_PORT        // raw TCP port, where binary frames are accepted
+#define JSON_PORT TCP_PORT          // and raw JSON heartbeats, answered with "OK"
+#define NEGOTIATE_TIMEOUT 2         // seconds to wait for the server's HELLO
+#define REPLY_TIMEOUT 5             // seconds to wait for an ACK or "OK"
+#define MAX_PENDING_SAMPLES 64      // samples kept while the server is unreachable
+
+static const char *server_ip = SERVER_IP;
+static Sampler sampler;
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Connect to the server on port; returns the socket or -1
+static int connect_to_server(int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("socket creation failed");
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0 ||
+        connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connection failed");
+        close(sockfd);
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    struct timeval timeout = { .tv_sec = REPLY_TIMEOUT, .tv_usec = 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sockfd;
+}
+
+static bool send_all(int sockfd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sockfd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
 
-// Function to send heartbeat data over socket
-void send_heartbeat(int sockfd, const char *data) {
-    if (send(sockfd, data, strlen(data), 0) < 0) {
+// Send one JSON heartbeat on the open socket and wait for the server's
+// answer; *rtt_ms is set to the round trip
+static bool send_heartbeat(int sockfd, const char *data, double *rtt_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!send_all(sockfd, (const uint8_t *)data, strlen(data))) {
         perror("send failed");
-        exit(EXIT_FAILURE);
+        return false;
+    }
+
+    char reply[64];
+    ssize_t n = recv(sockfd, reply, sizeof(reply) - 1, 0);
+    if (n <= 0) return false;
+    reply[n] = '\0';
+    *rtt_ms = elapsed_ms(&start);
+    if (strncmp(reply, "OK", 2) != 0) {
+        fprintf(stderr, "Heartbeat rejected: %s\n", reply);
+    } else {
+        printf("Sent heartbeat data successfully\n");
     }
-    printf("Sent heartbeat data successfully\n");
+    return true;
 }
 
-int main() {
-    int sockfd;
-    struct sockaddr_in server_addr;
+// Read one whole frame of at most cap bytes into buf
+static bool recv_frame(int sockfd, uint8_t *buf, size_t cap, HbFrame *frame) {
+    size_t len = 0, frame_len;
+    while (1) {
+        HbParseStatus status = hb_parse_frame(buf, len, frame, &frame_len);
+        if (status == HB_PARSE_COMPLETE) return true;
+        if (status == HB_PARSE_ERROR || len == cap) return false;
+        ssize_t n = recv(sockfd, buf + len, cap - len, 0);
+        if (n <= 0) return false;
+        len += (size_t)n;
+    }
+}
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket creation failed");
-        exit(EXIT_FAILURE);
+// Offer the binary protocol. A server that does not speak it answers with
+// something that is not a HELLO frame (or nothing), and the caller falls
+// back to JSON.
+static bool negotiate_binary(int sockfd, const char *hostname) {
+    uint8_t hello[HB_HEADER_SIZE + 2 + MAX_HOSTNAME_LEN];
+    size_t name_len = strnlen(hostname, MAX_HOSTNAME_LEN - 1);
+    hb_encode_header(hello, HB_FRAME_HELLO, (uint16_t)(2 + name_len), 0);
+    hello[HB_HEADER_SIZE] = HB_VERSION;
+    hello[HB_HEADER_SIZE + 1] = (uint8_t)name_len;
+    memcpy(hello + HB_HEADER_SIZE + 2, hostname, name_len);
+
+    struct timeval timeout = { .tv_sec = NEGOTIATE_TIMEOUT, .tv_usec = 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint8_t reply[64];
+    HbFrame frame;
+    bool ok = send_all(sockfd, hello, HB_HEADER_SIZE + 2 + name_len) &&
+              recv_frame(sockfd, reply, sizeof(reply), &frame) &&
+              frame.type == HB_FRAME_HELLO && frame.length >= 1 && frame.payload[0] >= 1;
+
+    timeout.tv_sec = REPLY_TIMEOUT;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (ok) printf("Negotiated binary protocol version %u\n", frame.payload[0]);
+    return ok;
+}
+
+// Send every pending sample in one SAMPLES frame and wait for its ACK.
+// *rtt_ms is set to the round trip, which becomes the next sample's latency.
+static bool send_samples(int sockfd, const HbSample *samples, size_t count,
+                         uint32_t seq, double *rtt_ms) {
+    uint8_t frame_buf[HB_HEADER_SIZE + 2 + MAX_PENDING_SAMPLES * HB_SAMPLE_SIZE];
+    size_t payload_len = 2 + count * HB_SAMPLE_SIZE;
+    hb_encode_header(frame_buf, HB_FRAME_SAMPLES, (uint16_t)payload_len, seq);
+    frame_buf[HB_HEADER_SIZE] = (uint8_t)(count >> 8);
+    frame_buf[HB_HEADER_SIZE + 1] = (uint8_t)count;
+    for (size_t i = 0; i < count; i++) {
+        hb_encode_sample(frame_buf + HB_HEADER_SIZE + 2 + i * HB_SAMPLE_SIZE, &samples[i]);
     }
 
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
-        perror("invalid address");
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint8_t reply[64];
+    HbFrame ack;
+    if (!send_all(sockfd, frame_buf, HB_HEADER_SIZE + payload_len) ||
+        !recv_frame(sockfd, reply, sizeof(reply), &ack) ||
+        ack.type != HB_FRAME_ACK || ack.seq != seq || ack.length < 4) {
+        return false;
+    }
+
+    *rtt_ms = elapsed_ms(&start);
+    printf("Sent %zu sample(s) in %zu bytes: %u accepted, %u rejected\n",
+           count, HB_HEADER_SIZE + payload_len,
+           ack.payload[0] << 8 | ack.payload[1], ack.payload[2] << 8 | ack.payload[3]);
+    return true;
+}
+
+// Connect and pick a protocol: binary frames when the server offers them,
+// otherwise JSON on the same port. Returns the socket or -1.
+static int open_session(const char *hostname, bool *binary) {
+    int sockfd = connect_to_server(BINARY_PORT);
+    if (sockfd >= 0 && negotiate_binary(sockfd, hostname)) {
+        *binary = true;
+        printf("Connected to server at %s:%d (binary)\n", server_ip, BINARY_PORT);
+        return sockfd;
+    }
+    if (sockfd >= 0) close(sockfd);
+    sockfd = connect_to_server(JSON_PORT);
+    if (sockfd >= 0) {
+        *binary = false;
+        printf("Connected to server at %s:%d\n", server_ip, JSON_PORT);
+    }
+    return sockfd;
+}
+
+// A host with only a loopback interface reports 127.0.0.1
+static void refresh_local_ip(char ip[INET_ADDRSTRLEN]) {
+    get_local_ip(ip, INET_ADDRSTRLEN);
+    if (ip[0] == '\0') strcpy(ip, "127.0.0.1");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s server_ip] [-i interval] [-t ip_ttl] [-n count] [-m sample_ms] [-L]\n"
+            "  -s IP      server address (default %s)\n"
+            "  -i SECONDS time between heartbeats (default %d)\n"
+            "  -t SECONDS how long a looked-up public IP is reused (default %d)\n"
+            "  -n COUNT   exit after COUNT heartbeats (default: run forever)\n"
+            "  -m MS      how often CPU, memory and disk are sampled (default %d)\n"
+            "  -L         local stand-in: report the local address as the public one\n"
+            "             and make no outside requests (for tests)\n",
+            prog, SERVER_IP, INTERVAL, PUBLIC_IP_TTL, SAMPLER_DEFAULT_INTERVAL_MS);
+}
+
+int main(int argc, char *argv[]) {
+    int interval = INTERVAL;
+    long count = -1;
+    long sample_ms = SAMPLER_DEFAULT_INTERVAL_MS;
+    bool local = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:i:t:n:m:L")) != -1) {
+        switch (opt) {
+        case 's': server_ip = optarg; break;
+        case 'i': interval = atoi(optarg); break;
+        case 't': public_ip_cache.ttl = atoi(optarg); break;
+        case 'n': count = atol(optarg); break;
+        case 'm': sample_ms = atol(optarg); break;
+        case 'L': local = true; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (interval < 0 || public_ip_cache.ttl <= 0 || sample_ms <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct utsname system_info;
+    if (uname(&system_info) != 0) {
+        perror("uname failed");
         exit(EXIT_FAILURE);
     }
 
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connection failed");
+    // Addresses change rarely: the local one is re-read once per TTL and the
+    // public one is refreshed in the background
+    char local_ip[INET_ADDRSTRLEN] = "";
+    refresh_local_ip(local_ip);
+    time_t local_ip_checked = time(NULL);
+    if (!local) {
+        init_public_ip_curl();
+        char public_ip[INET_ADDRSTRLEN];
+        if (get_public_ip(public_ip, sizeof(public_ip))) {
+            store_public_ip(public_ip);
+        }
+        pthread_t refresher;
+        if (pthread_create(&refresher, NULL, refresh_public_ip, NULL) != 0) {
+            perror("could not start public IP refresh thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(refresher);
+    }
+
+    // Metrics are sampled on their own timer; wait for the first reading
+    if (sampler_open(&sampler, "/") != 0 || sampler_start(&sampler, (unsigned)sample_ms) != 0) {
+        perror("could not start the metrics sampler");
+        exit(EXIT_FAILURE);
+    }
+    SamplerReading first;
+    do {
+        usleep(10000);
+        sampler_latest(&sampler, &first);
+    } while (first.seq == 0);
+
+    // Prefer binary frames on the raw TCP port; fall back to JSON
+    bool binary = false;
+    int sockfd = open_session(system_info.nodename, &binary);
+    if (sockfd < 0) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Connected to server at %s:%d\n", SERVER_IP, SERVER_PORT);
+    HbSample pending[MAX_PENDING_SAMPLES];
+    size_t pending_count = 0;
+    uint32_t seq = 0;
+    double latency = 0.0;
 
-    while (1) {
-        char local_ip[INET_ADDRSTRLEN], public_ip[INET_ADDRSTRLEN];
-        memset(local_ip, 0, INET_ADDRSTRLEN);
-        memset(public_ip, 0, INET_ADDRSTRLEN);
+    for (long sent = 0; count < 0 || sent < count; sent++) {
+        if (sent > 0) sleep((unsigned)interval);
 
-        get_local_ip(local_ip, INET_ADDRSTRLEN);
-        get_public_ip(public_ip, INET_ADDRSTRLEN);
+        time_t now = time(NULL);
+        if (now - local_ip_checked >= public_ip_cache.ttl) {
+            refresh_local_ip(local_ip);
+            local_ip_checked = now;
+        }
+        // Until a lookup succeeds the local address stands in, so the
+        // heartbeat still passes the server's address validation
+        char public_ip[INET_ADDRSTRLEN];
+        cached_public_ip(public_ip, sizeof(public_ip), local_ip);
+
+        // The sampler thread keeps this current; sending never reads /proc
+        SamplerReading reading;
+        sampler_latest(&sampler, &reading);
+        double cpu_usage = reading.cpu_usage;
+        double memory_usage = reading.memory_usage;
+        double disk_usage = reading.disk_usage;
+
+        // Binary samples are queued while the server is away; JSON ones are
+        // not. The server answers one raw JSON heartbeat per connection and
+        // then closes it, so each JSON heartbeat gets a connection of its own.
+        if (sockfd < 0) {
+            sockfd = binary ? open_session(system_info.nodename, &binary) : connect_to_server(JSON_PORT);
+        }
+        if (sockfd < 0 && !binary) {
+            fprintf(stderr, "Server unreachable, heartbeat skipped\n");
+            continue;
+        }
 
-        double cpu_usage = get_cpu_usage();
-        double memory_usage = get_memory_usage();
-        double disk_usage = get_disk_usage("/");
+        if (binary) {
+            HeartbeatData data;
+            memset(&data, 0, sizeof(data));
+            strncpy(data.local_ip, local_ip, MAX_IP_LEN - 1);
+            strncpy(data.public_ip, public_ip, MAX_IP_LEN - 1);
+            data.cpu_usage = cpu_usage;
+            data.memory_usage = memory_usage;
+            data.disk_usage = disk_usage;
+            data.availability = 100.0;
+            data.latency = latency;
+
+            // Keep the newest samples while the server is unreachable
+            if (pending_count == MAX_PENDING_SAMPLES) {
+                memmove(pending, pending + 1, (MAX_PENDING_SAMPLES - 1) * sizeof(HbSample));
+                pending_count--;
+            }
+            if (hb_sample_from_heartbeat(&data, now, &pending[pending_count])) {
+                pending_count++;
+            } else {
+                fprintf(stderr, "Skipping sample: no IPv4 address\n");
+            }
 
-        // Get system information using sysinfo
-        struct utsname system_info;
-        if (uname(&system_info) != 0) {
-            perror("uname failed");
-            exit(EXIT_FAILURE);
+            if (sockfd >= 0 && pending_count > 0) {
+                if (send_samples(sockfd, pending, pending_count, ++seq, &latency)) {
+                    pending_count = 0;
+                } else {
+                    fprintf(stderr, "Send failed, %zu sample(s) kept for retry\n", pending_count);
+                    close(sockfd);
+                    sockfd = -1;
+                }
+            }
+            continue;
         }
 
         // Format heartbeat data as JSON
-        char heartbeat_data[1024];
-        snprintf(heartbeat_data, sizeof(heartbeat_data),
+        char heartbeat_data[1024 + SAMPLER_MAX_CPUS * 8];
+        int len = snprintf(heartbeat_data, sizeof(heartbeat_data),
                 "{"
                 "\"timestamp\":\"%ld\","
                 "\"hostname\":\"%s\","
@@ -282,9 +501,11 @@ int main() {
                 "\"public_ip\":\"%s\","
                 "\"cpu_usage\":%.2f,"
                 "\"memory_usage\":%.2f,"
-                "\"disk_usage\":%.2f"
-                "}",
-                time(NULL),
+                "\"disk_usage\":%.2f,"
+                "\"availability\":100.0,"
+                "\"latency\":%.2f,"
+                "\"cpu_cores\":[",
+                (long)now,
                 system_info.nodename,
                 system_info.sysname, system_info.release,
                 system_info.version,
@@ -293,17 +514,27 @@ int main() {
                 public_ip,
                 cpu_usage,
                 memory_usage,
-                disk_usage
+                disk_usage,
+                latency
         );
+        // Per-core usage rides along; the server skips fields it does not know
+        for (int i = 0; i < reading.cpu_count && len > 0 && (size_t)len < sizeof(heartbeat_data); i++) {
+            len += snprintf(heartbeat_data + len, sizeof(heartbeat_data) - (size_t)len,
+                            "%s%.1f", i > 0 ? "," : "", reading.core_usage[i]);
+        }
+        if (len > 0 && (size_t)len < sizeof(heartbeat_data)) {
+            snprintf(heartbeat_data + len, sizeof(heartbeat_data) - (size_t)len, "]}");
+        }
 
-        // Send heartbeat data
-        send_heartbeat(sockfd, heartbeat_data);
-        
-        // Wait for the next interval
-        sleep(INTERVAL);
+        // Send heartbeat data; the round trip is the next heartbeat's latency
+        if (!send_heartbeat(sockfd, heartbeat_data, &latency)) {
+            fprintf(stderr, "Send failed, heartbeat skipped\n");
+        }
+        close(sockfd);
+        sockfd = -1;
     }
 
-    // Close socket (this part is never reached in this example)
-    close(sockfd);
+    if (sockfd >= 0) close(sockfd);
+    sampler_close(&sampler);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,141 @@
+#include "heartbeat_compress.h"
+#include "heartbeat_log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int compress_level = COMPRESS_DEFAULT_LEVEL;
+static size_t compress_min_size = COMPRESS_DEFAULT_MIN_SIZE;
+
+bool compress_set_level(int level) {
+    if (level < 0 || level > 9) return false;
+    compress_level = level;
+    return true;
+}
+
+int compress_get_level(void) {
+    return compress_level;
+}
+
+void compress_set_min_size(size_t bytes) {
+    compress_min_size = bytes;
+}
+
+size_t compress_get_min_size(void) {
+    return compress_min_size;
+}
+
+const char *content_coding_name(ContentCoding coding) {
+    switch (coding) {
+    case CODING_GZIP: return "gzip";
+    case CODING_DEFLATE: return "deflate";
+    default: return NULL;
+    }
+}
+
+// The q-value of one Accept-Encoding element's parameters (";q=0.5"), 1 if
+// it has none
+static double element_quality(const char *params, const char *end) {
+    while (params < end) {
+        while (params < end && (*params == ';' || *params == ' ' || *params == '\t')) params++;
+        if (end - params >= 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+            char digits[8];
+            size_t n = 0;
+            params += 2;
+            while (params < end && n < sizeof(digits) - 1 && *params != ';') digits[n++] = *params++;
+            digits[n] = '\0';
+            return atof(digits);
+        }
+        while (params < end && *params != ';') params++;
+    }
+    return 1.0;
+}
+
+ContentCoding compress_negotiate(const HttpRequest *req) {
+    if (compress_level == 0) return CODING_IDENTITY;
+    size_t len;
+    const char *value = http_get_header(req, "Accept-Encoding", &len);
+    if (!value) return CODING_IDENTITY;
+
+    double gzip_q = -1, deflate_q = -1, any_q = -1;
+    const char *p = value, *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = (size_t)(p - name);
+        const char *element_end = p;
+        while (element_end < end && *element_end != ',') element_end++;
+        double q = element_quality(p, element_end);
+        p = element_end;
+
+        if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0) {
+            deflate_q = q;
+        } else if (name_len == 1 && *name == '*') {
+            any_q = q;
+        }
+    }
+    // "*" covers the codings not listed by name
+    if (gzip_q < 0) gzip_q = any_q;
+    if (deflate_q < 0) deflate_q = any_q;
+
+    if (gzip_q > 0 && gzip_q >= deflate_q) return CODING_GZIP;
+    if (deflate_q > 0) return CODING_DEFLATE;
+    return CODING_IDENTITY;
+}
+
+bool compress_worthwhile(ContentCoding coding, size_t len) {
+    return coding != CODING_IDENTITY && compress_level > 0 && len >= compress_min_size;
+}
+
+bool compressor_init(Compressor *c, ContentCoding coding) {
+    memset(c, 0, sizeof(*c));
+    // windowBits 15 gives the zlib wrapper; adding 16 asks for gzip instead
+    int window_bits = coding == CODING_GZIP ? 15 + 16 : 15;
+    int level = compress_level > 0 ? compress_level : Z_DEFAULT_COMPRESSION;
+    if (deflateInit2(&c->zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_error("deflate_init_failed", "coding=%s", content_coding_name(coding));
+        return false;
+    }
+    c->active = true;
+    return true;
+}
+
+bool compressor_write(Compressor *c, OutputBuffer *out, const char *data, size_t len, bool finish) {
+    if (!c->active) return false;
+    c->zs.next_in = (Bytef *)data;
+    c->zs.avail_in = (uInt)len;
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+
+    for (;;) {
+        size_t room = deflateBound(&c->zs, c->zs.avail_in) + 64;
+        if (!output_buffer_reserve(out, room)) return false;
+        c->zs.next_out = (Bytef *)out->data + out->len;
+        c->zs.avail_out = (uInt)room;
+        int rc = deflate(&c->zs, flush);
+        out->len += room - c->zs.avail_out;
+        if (rc == Z_STREAM_END) return true;
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return false;
+        // Without Z_FINISH, deflate is done once it has taken all the input
+        // and had output space left over
+        if (!finish && c->zs.avail_in == 0 && c->zs.avail_out > 0) return true;
+    }
+}
+
+void compressor_end(Compressor *c) {
+    if (c->active) {
+        deflateEnd(&c->zs);
+        c->active = false;
+    }
+}
+
+bool compress_buffer(ContentCoding coding, const char *data, size_t len, OutputBuffer *out) {
+    Compressor c;
+    if (!compressor_init(&c, coding)) return false;
+    bool ok = compressor_write(&c, out, data, len, true);
+    compressor_end(&c);
+    return ok;
+}
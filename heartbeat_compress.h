@@ -0,0 +1,61 @@
+#ifndef HEARTBEAT_COMPRESS_H
+#define HEARTBEAT_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+#include "heartbeat_server.h"
+#include "heartbeat_http.h"
+
+// Response compression. Clients that send Accept-Encoding: gzip (or deflate)
+// get API bodies of at least the configured size compressed; smaller bodies
+// are not worth the CPU or the gzip framing.
+
+// Fastest level: history JSON repeats the same keys and addresses in every
+// record, so higher levels shrink it little more for several times the CPU
+#define COMPRESS_DEFAULT_LEVEL 1
+#define COMPRESS_DEFAULT_MIN_SIZE 1024
+
+typedef enum {
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_DEFLATE,         // the zlib format, as HTTP's "deflate" means
+    CODING_COUNT
+} ContentCoding;
+
+// 0 turns compression off; otherwise a zlib level from 1 to 9
+bool compress_set_level(int level);
+int compress_get_level(void);
+
+void compress_set_min_size(size_t bytes);
+size_t compress_get_min_size(void);
+
+// The coding to answer req with: gzip or deflate if its Accept-Encoding
+// allows one and compression is on, identity otherwise
+ContentCoding compress_negotiate(const HttpRequest *req);
+
+// Content-Encoding value; NULL for identity
+const char *content_coding_name(ContentCoding coding);
+
+// True if a len byte body should be sent with coding rather than identity
+bool compress_worthwhile(ContentCoding coding, size_t len);
+
+// Streaming compressor: feed the body in pieces, output is appended to out
+// as it is produced
+typedef struct {
+    z_stream zs;
+    bool active;
+} Compressor;
+
+bool compressor_init(Compressor *c, ContentCoding coding);
+
+// Compress len bytes into out; finish flushes everything and writes the
+// trailer. Returns false on allocation or zlib failure.
+bool compressor_write(Compressor *c, OutputBuffer *out, const char *data, size_t len, bool finish);
+
+void compressor_end(Compressor *c);
+
+// Compress a complete body into out
+bool compress_buffer(ContentCoding coding, const char *data, size_t len, OutputBuffer *out);
+
+#endif /* HEARTBEAT_COMPRESS_H */
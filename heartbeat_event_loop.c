@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+
+#include "heartbeat_event_loop.h"
+#include "heartbeat_history.h"
+#include "heartbeat_log.h"
+#include "heartbeat_metrics.h"
+#include "heartbeat_ratelimit.h"
+#include "heartbeat_stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+static EventLoop event_loops[MAX_EVENT_LOOPS];
+static int event_loop_count = 0;
+
+// Listener sockets shared by every loop when not sharded; EPOLLEXCLUSIVE
+// wakes only one
+static Connection http_listener = { .fd = -1, .kind = CONN_LISTENER, .port = HTTP_PORT };
+static Connection tcp_listener = { .fd = -1, .kind = CONN_LISTENER, .port = TCP_PORT };
+
+static const char *port_name(int port) {
+    return port == HTTP_PORT ? "HTTP" : "TCP";
+}
+
+// Create a non-blocking listening socket bound to port
+static int create_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("listener socket creation failed");
+        return -1;
+    }
+
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("listener socket options configuration failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("listener bind failed");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
+        perror("listener listen failed");
+        close(fd);
+        return -1;
+    }
+
+    printf("%s Server listening on port %d...\n", port_name(port), port);
+    return fd;
+}
+
+// Client connections are kept in order of last activity, so the idle sweep
+// only ever looks at the head of the list. Streams are kept apart: they are
+// never idle-closed, since keepalive comments show whether the peer is there.
+static void unlink_connection(EventLoop *loop, Connection *conn) {
+    bool stream = conn->kind == CONN_STREAM;
+    Connection **head = stream ? &loop->streams : &loop->idle_head;
+    if (conn->prev) conn->prev->next = conn->next;
+    else if (*head == conn) *head = conn->next;
+    else return;    // not linked yet
+    if (conn->next) conn->next->prev = conn->prev;
+    else if (!stream) loop->idle_tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+static void touch_connection(EventLoop *loop, Connection *conn) {
+    conn->last_active = time(NULL);
+    if (conn->kind == CONN_STREAM) return;
+
+    unlink_connection(loop, conn);
+    conn->prev = loop->idle_tail;
+    if (loop->idle_tail) loop->idle_tail->next = conn;
+    else loop->idle_head = conn;
+    loop->idle_tail = conn;
+}
+
+static void close_connection(EventLoop *loop, Connection *conn) {
+    unlink_connection(loop, conn);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    protocol_state_free(&conn->protocol);
+    output_buffer_free(&conn->in);
+    output_buffer_free(&conn->out);
+    free(conn);
+    loop->closed++;
+    metrics_inc(COUNTER_CONNECTIONS_CLOSED);
+}
+
+static void set_interest(EventLoop *loop, Connection *conn, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Write as much pending output as the socket takes. While output is pending
+// the connection waits for EPOLLOUT only, so a pipelining client cannot make
+// the response backlog grow without bound. Returns false if conn was closed.
+static bool flush_connection(EventLoop *loop, Connection *conn) {
+    uint64_t start = conn->out_sent < conn->out.len ? metrics_now() : 0;
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = send(conn->fd, conn->out.data + conn->out_sent,
+                         conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metrics_observe(STAGE_RESPOND, start);
+                if (!conn->want_write) {
+                    set_interest(loop, conn, EPOLLOUT);
+                    conn->want_write = true;
+                }
+                return true;
+            }
+            close_connection(loop, conn);
+            return false;
+        }
+        conn->out_sent += (size_t)n;
+        metrics_add(COUNTER_BYTES_WRITTEN, (uint64_t)n);
+    }
+    if (start) metrics_observe(STAGE_RESPOND, start);
+
+    if (conn->close_after) {
+        close_connection(loop, conn);
+        return false;
+    }
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    return true;
+}
+
+// The last request turned conn into an event stream
+static void start_stream(EventLoop *loop, Connection *conn) {
+    unlink_connection(loop, conn);
+    conn->kind = CONN_STREAM;
+    conn->next = loop->streams;
+    if (loop->streams) loop->streams->prev = conn;
+    loop->streams = conn;
+}
+
+// Run whatever complete requests are buffered and send their responses
+static void process_connection(EventLoop *loop, Connection *conn, bool eof) {
+    size_t consumed = process_input(&conn->protocol, conn->in.data, conn->in.len, eof,
+                                    &conn->out, &conn->close_after);
+    memmove(conn->in.data, conn->in.data + consumed, conn->in.len - consumed);
+    conn->in.len -= consumed;
+    if (conn->kind == CONN_CLIENT && conn->protocol.mode == PROTO_STREAM) {
+        start_stream(loop, conn);
+    }
+
+    if (flush_connection(loop, conn) && conn->want_write && conn->out_sent == 0) {
+        set_interest(loop, conn, EPOLLIN | EPOLLRDHUP);
+        conn->want_write = false;
+    }
+}
+
+static void on_readable(EventLoop *loop, Connection *conn) {
+    // Keep one spare byte past the data for the parser's NUL terminator
+    if (!output_buffer_reserve(&conn->in, BUFFER_SIZE + 1)) {
+        close_connection(loop, conn);
+        return;
+    }
+    uint64_t start = metrics_now();
+    ssize_t n = read(conn->fd, conn->in.data + conn->in.len, BUFFER_SIZE);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    metrics_observe(STAGE_READ, start);
+    if (n < 0 || (n == 0 && conn->in.len == 0)) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    conn->in.len += (size_t)n;
+    metrics_add(COUNTER_BYTES_READ, (uint64_t)n);
+    touch_connection(loop, conn);
+    process_connection(loop, conn, n == 0);
+}
+
+static void on_writable(EventLoop *loop, Connection *conn) {
+    touch_connection(loop, conn);
+    if (!flush_connection(loop, conn) || conn->out_sent > 0) return;
+
+    // Requests that arrived while the previous responses were queued
+    process_connection(loop, conn, false);
+}
+
+// Close keep-alive connections that have been quiet for too long
+static void close_idle_connections(EventLoop *loop) {
+    time_t cutoff = time(NULL) - HTTP_KEEPALIVE_TIMEOUT;
+    while (loop->idle_head && loop->idle_head->last_active <= cutoff) {
+        close_connection(loop, loop->idle_head);
+    }
+}
+
+// Send each stream what was published since its last pump. A subscriber
+// whose socket is still backed up is skipped; if it stays slow, the
+// broadcast ring laps it and it gets a resync event instead of a backlog.
+static void pump_streams(EventLoop *loop) {
+    time_t now = time(NULL);
+    Connection *next;
+    for (Connection *conn = loop->streams; conn; conn = next) {
+        next = conn->next;
+        if (conn->want_write) continue;
+        if (stream_pump(&conn->protocol.stream, &conn->out, now)) {
+            flush_connection(loop, conn);
+        }
+    }
+}
+
+static void accept_connections(EventLoop *loop, Connection *listener) {
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        uint64_t start = metrics_now();
+        int fd = accept4(listener->fd, (struct sockaddr *)&address, &addrlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept failed");
+            }
+            return;
+        }
+
+        // Over-limit sources are turned away before anything is read
+        if (!ratelimit_admit(fd, &address, listener->port, start)) continue;
+
+        if (log_enabled(LOG_LEVEL_DEBUG)) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip));
+            log_debug("accept", "port=%s loop=%d peer=%s:%d",
+                      port_name(listener->port), loop->id, ip, ntohs(address.sin_port));
+        }
+
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        Connection *conn = malloc(sizeof(Connection));
+        if (!conn) {
+            perror("malloc failed");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->kind = CONN_CLIENT;
+        conn->port = listener->port;
+        conn->out_sent = 0;
+        conn->close_after = false;
+        conn->want_write = false;
+        conn->prev = conn->next = NULL;
+        output_buffer_init(&conn->in);
+        output_buffer_init(&conn->out);
+        protocol_state_init(&conn->protocol);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl add client failed");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        touch_connection(loop, conn);
+        loop->accepted++;
+        metrics_inc(COUNTER_CONNECTIONS_ACCEPTED);
+        metrics_observe(STAGE_ACCEPT, start);
+    }
+}
+
+void *run_event_loop(void *arg) {
+    EventLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (loop->sharded) {
+        set_thread_history_shard(loop->id);
+    }
+
+    while (1) {
+        // Wake at least once a second to expire idle connections, and more
+        // often while there are streams to pump
+        int timeout = loop->streams ? STREAM_FLUSH_INTERVAL_MS : 1000;
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            uint32_t mask = events[i].events;
+
+            if (conn->kind == CONN_LISTENER) {
+                accept_connections(loop, conn);
+            } else if (mask & EPOLLOUT) {
+                on_writable(loop, conn);
+            } else if (mask & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                on_readable(loop, conn);
+            }
+        }
+
+        if (loop->streams) pump_streams(loop);
+        close_idle_connections(loop);
+    }
+
+    close(loop->epoll_fd);
+    return NULL;
+}
+
+static int add_listener(EventLoop *loop, Connection *listener) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = listener };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listener->fd, &ev) < 0) {
+        perror("epoll_ctl add listener failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Give loop its own pair of listeners; SO_REUSEPORT lets every loop bind
+static int create_loop_listeners(EventLoop *loop) {
+    loop->http_listener = (Connection){ .fd = -1, .kind = CONN_LISTENER, .port = HTTP_PORT };
+    loop->tcp_listener = (Connection){ .fd = -1, .kind = CONN_LISTENER, .port = TCP_PORT };
+    loop->http_listener.fd = create_listener(HTTP_PORT);
+    loop->tcp_listener.fd = create_listener(TCP_PORT);
+    if (loop->http_listener.fd < 0 || loop->tcp_listener.fd < 0) {
+        if (loop->http_listener.fd >= 0) close(loop->http_listener.fd);
+        if (loop->tcp_listener.fd >= 0) close(loop->tcp_listener.fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Best effort: an unpinned loop still works, it just may share a core
+static void pin_loop(EventLoop *loop) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(loop->id % cpus, &set);
+    if (pthread_setaffinity_np(loop->thread, sizeof(set), &set) != 0) {
+        log_warn("loop_affinity_failed", "loop=%d cpu=%ld", loop->id, loop->id % cpus);
+    }
+}
+
+int start_event_loops(int num_loops, bool sharded) {
+    if (num_loops < 1) num_loops = 1;
+    if (num_loops > MAX_EVENT_LOOPS) num_loops = MAX_EVENT_LOOPS;
+
+    if (!sharded) {
+        http_listener.fd = create_listener(HTTP_PORT);
+        tcp_listener.fd = create_listener(TCP_PORT);
+        if (http_listener.fd < 0 || tcp_listener.fd < 0) {
+            if (http_listener.fd >= 0) close(http_listener.fd);
+            if (tcp_listener.fd >= 0) close(tcp_listener.fd);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_loops; i++) {
+        EventLoop *loop = &event_loops[i];
+        loop->id = i;
+        loop->sharded = sharded;
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            return -1;
+        }
+        if (sharded && create_loop_listeners(loop) < 0) {
+            return -1;
+        }
+        Connection *http = sharded ? &loop->http_listener : &http_listener;
+        Connection *tcp = sharded ? &loop->tcp_listener : &tcp_listener;
+        if (add_listener(loop, http) < 0 || add_listener(loop, tcp) < 0) {
+            return -1;
+        }
+        if (pthread_create(&loop->thread, NULL, run_event_loop, loop) != 0) {
+            perror("could not create event loop thread");
+            return -1;
+        }
+        if (sharded) {
+            pin_loop(loop);
+        }
+        event_loop_count++;
+    }
+
+    printf("Started %d event loop thread(s)%s\n", event_loop_count,
+           sharded ? " with per-loop listeners and history shards" : "");
+    return 0;
+}
+
+void join_event_loops(void) {
+    for (int i = 0; i < event_loop_count; i++) {
+        pthread_join(event_loops[i].thread, NULL);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef HEARTBEAT_EVENT_LOOP_H
+#define HEARTBEAT_EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "heartbeat_server.h"
+#include "heartbeat_http.h"
+
+#define MAX_EVENT_LOOPS 64
+#define MAX_EVENTS 256
+#define LISTEN_BACKLOG 1024
+
+typedef enum {
+    CONN_LISTENER,
+    CONN_CLIENT,
+    CONN_STREAM         // a client switched to an event stream
+} ConnectionKind;
+
+// Per-socket state owned by exactly one event loop
+typedef struct Connection {
+    int fd;
+    ConnectionKind kind;
+    int port;
+    OutputBuffer in;            // unconsumed input; may hold partial requests
+    OutputBuffer out;
+    size_t out_sent;
+    ProtocolState protocol;
+    bool close_after;           // close once out is flushed
+    bool want_write;            // waiting for EPOLLOUT instead of EPOLLIN
+    time_t last_active;
+    struct Connection *prev;    // loop's idle list (least recently active first)
+    struct Connection *next;    // or, for streams, its stream list
+} Connection;
+
+typedef struct {
+    int id;
+    int epoll_fd;
+    pthread_t thread;
+    unsigned long accepted;
+    unsigned long closed;
+    Connection *idle_head;
+    Connection *idle_tail;
+    Connection *streams;        // pumped every STREAM_FLUSH_INTERVAL_MS
+    bool sharded;               // owns the listeners below and history shard id
+    Connection http_listener;
+    Connection tcp_listener;
+} EventLoop;
+
+// Start num_loops event-loop threads serving both HTTP_PORT and TCP_PORT.
+// Normally every loop waits on one shared listener per port. With sharded,
+// each loop binds its own SO_REUSEPORT listeners so the kernel spreads
+// connections across them, is pinned to a CPU, and appends to its own
+// history shard (set_history_shards must have been called with num_loops).
+// Returns 0 on success, -1 if the listeners or loops could not be set up.
+int start_event_loops(int num_loops, bool sharded);
+
+// Block until every event-loop thread exits
+void join_event_loops(void);
+
+void *run_event_loop(void *arg);
+
+#endif /* HEARTBEAT_EVENT_LOOP_H */
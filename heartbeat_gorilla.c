@@ -0,0 +1,205 @@
+#include "heartbeat_gorilla.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_WINDOW 0xff
+
+// Worst case per sample: a 68-bit timestamp and five 77-bit values
+#define MAX_SAMPLE_BITS (68 + METRIC_COUNT * 77)
+
+void gorilla_encoder_init(GorillaEncoder *enc) {
+    memset(enc, 0, sizeof(*enc));
+    memset(enc->leading, NO_WINDOW, sizeof(enc->leading));
+}
+
+void gorilla_encoder_free(GorillaEncoder *enc) {
+    free(enc->buf);
+    gorilla_encoder_init(enc);
+}
+
+// Make room for one more sample; new bytes are zeroed since put_bits ORs
+static bool reserve_sample(GorillaEncoder *enc) {
+    size_t need = (enc->bits + MAX_SAMPLE_BITS + 7) / 8;
+    if (need <= enc->cap) return true;
+    size_t cap = enc->cap ? enc->cap * 2 : 128;
+    while (cap < need) cap *= 2;
+    uint8_t *buf = realloc(enc->buf, cap);
+    if (!buf) return false;
+    memset(buf + enc->cap, 0, cap - enc->cap);
+    enc->buf = buf;
+    enc->cap = cap;
+    return true;
+}
+
+// Write the low n bits of v, most significant first
+static void put_bits(GorillaEncoder *enc, uint64_t v, int n) {
+    while (n > 0) {
+        int room = 8 - (int)(enc->bits & 7);
+        int take = n < room ? n : room;
+        uint8_t chunk = (uint8_t)((v >> (n - take)) & ((1u << take) - 1));
+        enc->buf[enc->bits >> 3] |= (uint8_t)(chunk << (room - take));
+        enc->bits += (size_t)take;
+        n -= take;
+    }
+}
+
+static uint64_t get_bits(GorillaDecoder *dec, int n) {
+    uint64_t v = 0;
+    while (n > 0) {
+        int avail = 8 - (int)(dec->pos & 7);
+        int take = n < avail ? n : avail;
+        uint8_t byte = dec->data[dec->pos >> 3];
+        v = (v << take) | ((byte >> (avail - take)) & ((1u << take) - 1));
+        dec->pos += (size_t)take;
+        n -= take;
+    }
+    return v;
+}
+
+static void put_timestamp(GorillaEncoder *enc, time_t timestamp) {
+    int64_t delta = (int64_t)(timestamp - enc->prev_timestamp);
+    int64_t dod = delta - enc->prev_delta;
+    if (dod == 0) {
+        put_bits(enc, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        put_bits(enc, 0x2, 2);
+        put_bits(enc, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+        put_bits(enc, 0x6, 3);
+        put_bits(enc, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        put_bits(enc, 0xe, 4);
+        put_bits(enc, (uint64_t)(dod + 2047), 12);
+    } else {
+        // The paper stops at 32 bits; a clock jump can need more
+        put_bits(enc, 0xf, 4);
+        put_bits(enc, (uint64_t)dod, 64);
+    }
+    enc->prev_delta = delta;
+    enc->prev_timestamp = timestamp;
+}
+
+static void put_value(GorillaEncoder *enc, int m, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t x = bits ^ enc->prev_value[m];
+    enc->prev_value[m] = bits;
+    if (x == 0) {
+        put_bits(enc, 0, 1);
+        return;
+    }
+    put_bits(enc, 1, 1);
+
+    int leading = __builtin_clzll(x);
+    int trailing = __builtin_ctzll(x);
+    if (leading > 31) leading = 31;     // five bits in the header
+    if (enc->leading[m] != NO_WINDOW && leading >= enc->leading[m] && trailing >= enc->trailing[m]) {
+        int length = 64 - enc->leading[m] - enc->trailing[m];
+        put_bits(enc, 0, 1);
+        put_bits(enc, x >> enc->trailing[m], length);
+        return;
+    }
+    int length = 64 - leading - trailing;
+    put_bits(enc, 1, 1);
+    put_bits(enc, (uint64_t)leading, 5);
+    put_bits(enc, (uint64_t)(length & 63), 6);     // 64 is written as 0
+    put_bits(enc, x >> trailing, length);
+    enc->leading[m] = (uint8_t)leading;
+    enc->trailing[m] = (uint8_t)trailing;
+}
+
+bool gorilla_append(GorillaEncoder *enc, time_t timestamp, const double values[METRIC_COUNT]) {
+    if (!reserve_sample(enc)) return false;
+
+    if (enc->count == 0) {
+        // The block header holds the first timestamp; values start raw
+        enc->first = timestamp;
+        enc->prev_timestamp = timestamp;
+        enc->prev_delta = 0;
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            memcpy(&enc->prev_value[m], &values[m], sizeof(uint64_t));
+            put_bits(enc, enc->prev_value[m], 64);
+        }
+    } else {
+        put_timestamp(enc, timestamp);
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            put_value(enc, m, values[m]);
+        }
+    }
+    enc->count++;
+    return true;
+}
+
+GorillaBlock *gorilla_seal(GorillaEncoder *enc) {
+    if (enc->count == 0) return NULL;
+    size_t bytes = (enc->bits + 7) / 8;
+    GorillaBlock *block = malloc(sizeof(GorillaBlock) + bytes);
+    if (!block) return NULL;
+    block->first = enc->first;
+    block->last = enc->prev_timestamp;
+    block->count = enc->count;
+    block->bits = (uint32_t)enc->bits;
+    memcpy(block->data, enc->buf, bytes);
+
+    // Keep the buffer for the next block
+    memset(enc->buf, 0, bytes);
+    enc->bits = 0;
+    enc->count = 0;
+    memset(enc->leading, NO_WINDOW, sizeof(enc->leading));
+    return block;
+}
+
+static void decoder_init(GorillaDecoder *dec, const uint8_t *data, uint32_t count, time_t first) {
+    memset(dec, 0, sizeof(*dec));
+    dec->data = data;
+    dec->remaining = count;
+    dec->timestamp = first;
+}
+
+void gorilla_decoder_init(GorillaDecoder *dec, const GorillaBlock *block) {
+    decoder_init(dec, block->data, block->count, block->first);
+}
+
+void gorilla_decoder_init_open(GorillaDecoder *dec, const GorillaEncoder *enc) {
+    decoder_init(dec, enc->buf, enc->count, enc->first);
+}
+
+static int64_t get_dod(GorillaDecoder *dec) {
+    if (get_bits(dec, 1) == 0) return 0;
+    if (get_bits(dec, 1) == 0) return (int64_t)get_bits(dec, 7) - 63;
+    if (get_bits(dec, 1) == 0) return (int64_t)get_bits(dec, 9) - 255;
+    if (get_bits(dec, 1) == 0) return (int64_t)get_bits(dec, 12) - 2047;
+    return (int64_t)get_bits(dec, 64);
+}
+
+static void get_value(GorillaDecoder *dec, int m) {
+    if (get_bits(dec, 1) == 0) return;
+    if (get_bits(dec, 1) == 1) {
+        dec->leading[m] = (uint8_t)get_bits(dec, 5);
+        int length = (int)get_bits(dec, 6);
+        dec->length[m] = (uint8_t)(length == 0 ? 64 : length);
+    }
+    int trailing = 64 - dec->leading[m] - dec->length[m];
+    dec->value[m] ^= get_bits(dec, dec->length[m]) << trailing;
+}
+
+bool gorilla_next(GorillaDecoder *dec, TsSample *out) {
+    if (dec->remaining == 0) return false;
+    if (!dec->started) {
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            dec->value[m] = get_bits(dec, 64);
+        }
+        dec->started = true;
+    } else {
+        dec->delta += get_dod(dec);
+        dec->timestamp += dec->delta;
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            get_value(dec, m);
+        }
+    }
+    dec->remaining--;
+
+    out->timestamp = dec->timestamp;
+    memcpy(out->values, dec->value, sizeof(out->values));
+    return true;
+}
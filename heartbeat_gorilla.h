@@ -0,0 +1,72 @@
+#ifndef HEARTBEAT_GORILLA_H
+#define HEARTBEAT_GORILLA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+#include "heartbeat_tsdb.h"
+
+// Gorilla-style compressed sample blocks (Pelkonen et al., VLDB 2015).
+// Timestamps are stored as delta-of-deltas: a host reporting on a steady
+// interval costs one bit per sample. Each metric column is XORed with its
+// previous value and only the meaningful bits are written, reusing the
+// previous leading/trailing zero window when the new bits fit in it; an
+// unchanged value costs one bit. Decoding is a single forward pass.
+
+// A sealed block, allocated to its exact size
+typedef struct {
+    time_t first;                       // timestamp of the first sample
+    time_t last;
+    uint32_t count;
+    uint32_t bits;                      // encoded length
+    uint8_t data[];
+} GorillaBlock;
+
+// The block being appended to
+typedef struct {
+    uint8_t *buf;
+    size_t cap;                         // bytes
+    size_t bits;
+    uint32_t count;
+    time_t first;
+    time_t prev_timestamp;
+    int64_t prev_delta;
+    uint64_t prev_value[METRIC_COUNT];
+    uint8_t leading[METRIC_COUNT];      // window of the last value written with
+    uint8_t trailing[METRIC_COUNT];     // a header; leading 0xff: none yet
+} GorillaEncoder;
+
+void gorilla_encoder_init(GorillaEncoder *enc);
+void gorilla_encoder_free(GorillaEncoder *enc);
+
+// Append a sample; timestamps must not decrease. False if the buffer could
+// not grow, in which case the encoder is unchanged.
+bool gorilla_append(GorillaEncoder *enc, time_t timestamp, const double values[METRIC_COUNT]);
+
+// Copy the samples appended so far into a new block and empty the encoder.
+// NULL if the encoder is empty or allocation fails (the samples are kept).
+GorillaBlock *gorilla_seal(GorillaEncoder *enc);
+
+typedef struct {
+    const uint8_t *data;
+    size_t pos;                         // bits consumed
+    uint32_t remaining;
+    bool started;
+    time_t timestamp;
+    int64_t delta;
+    uint64_t value[METRIC_COUNT];
+    uint8_t leading[METRIC_COUNT];
+    uint8_t length[METRIC_COUNT];       // meaningful bits of the current window
+} GorillaDecoder;
+
+void gorilla_decoder_init(GorillaDecoder *dec, const GorillaBlock *block);
+
+// Decode from the open encoder's buffer; valid until its next append
+void gorilla_decoder_init_open(GorillaDecoder *dec, const GorillaEncoder *enc);
+
+// Decode the next sample; false once the block is exhausted
+bool gorilla_next(GorillaDecoder *dec, TsSample *out);
+
+#endif /* HEARTBEAT_GORILLA_H */
@@ -0,0 +1,43 @@
+#ifndef HEARTBEAT_HASH_H
+#define HEARTBEAT_HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers for the striped open-addressed tables (anomaly detector state,
+// alert rule state, rate limit buckets). Each table is split into stripes
+// with their own lock, so keys hashing to different stripes never contend.
+// A stripe is a power-of-two array of slots probed linearly and filled to
+// at most STRIPE_LOAD_LIMIT so probe runs stay short.
+
+#define STRIPE_LOAD_LIMIT(slots) ((slots) / 8 * 7)
+
+// murmur3's finalizer: every input bit affects the stripe and slot bits
+static inline uint32_t hash_mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// The high bits pick the stripe, the low ones the slot
+static inline size_t stripe_of(uint32_t hash, size_t stripes) {
+    return (hash >> 16) % stripes;
+}
+
+static inline uint32_t probe_start(uint32_t hash, uint32_t slots) {
+    return hash & (slots - 1);
+}
+
+static inline uint32_t probe_next(uint32_t i, uint32_t slots) {
+    return (i + 1) & (slots - 1);
+}
+
+static inline bool stripe_full(uint32_t used, uint32_t slots) {
+    return used >= STRIPE_LOAD_LIMIT(slots);
+}
+
+#endif /* HEARTBEAT_HASH_H */
@@ -0,0 +1,144 @@
+#include "heartbeat_history.h"
+#include <stdlib.h>
+#include <string.h>
+
+void history_ring_init(HistoryRing *ring, HistorySlot *slots, size_t capacity) {
+    ring->slots = slots;
+    ring->capacity = capacity;
+    ring->owns_slots = false;
+    atomic_init(&ring->head, 0);
+    pthread_mutex_init(&ring->writer_mutex, NULL);
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&slots[i].seq, 0);
+        slots[i].node.next = NULL;
+    }
+}
+
+bool history_ring_alloc(HistoryRing *ring, size_t capacity) {
+    if (capacity == 0) return false;
+
+    HistorySlot *slots = calloc(capacity, sizeof(HistorySlot));
+    if (!slots) return false;
+
+    history_ring_init(ring, slots, capacity);
+    ring->owns_slots = true;
+    return true;
+}
+
+void history_ring_destroy(HistoryRing *ring) {
+    if (ring->owns_slots) {
+        free(ring->slots);
+    }
+    ring->slots = NULL;
+    ring->capacity = 0;
+    pthread_mutex_destroy(&ring->writer_mutex);
+}
+
+void history_ring_append(HistoryRing *ring, const HeartbeatData *data, time_t timestamp,
+                         uint8_t anomalies) {
+    size_t cap = ring->capacity;
+    uint64_t n = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    HistorySlot *slot = &ring->slots[n % cap];
+
+    atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->node.data = *data;
+    slot->node.timestamp = timestamp;
+    slot->node.anomalies = anomalies;
+    slot->node.next = (n > 0 && cap > 1) ? &ring->slots[(n - 1) % cap].node : NULL;
+
+    // The slot after this one now holds the oldest record; cut the list there
+    // so walking from the newest node stops after capacity records.
+    if (n + 1 >= cap) {
+        ring->slots[(n + 1) % cap].node.next = NULL;
+    }
+
+    atomic_store_explicit(&slot->seq, 2 * (n + 1), memory_order_release);
+    atomic_store_explicit(&ring->head, n + 1, memory_order_release);
+}
+
+void history_ring_reset(HistoryRing *ring) {
+    for (size_t i = 0; i < ring->capacity; i++) {
+        atomic_store_explicit(&ring->slots[i].seq, 0, memory_order_relaxed);
+        ring->slots[i].node.next = NULL;
+    }
+    atomic_store_explicit(&ring->head, 0, memory_order_release);
+}
+
+size_t history_ring_count(HistoryRing *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head < ring->capacity ? (size_t)head : ring->capacity;
+}
+
+HeartbeatNode *history_ring_newest(HistoryRing *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == 0) return NULL;
+    return &ring->slots[(head - 1) % ring->capacity].node;
+}
+
+uint64_t history_ring_head(HistoryRing *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+bool history_ring_read(HistoryRing *ring, uint64_t index, HeartbeatNode *out) {
+    HistorySlot *slot = &ring->slots[index % ring->capacity];
+    uint64_t expect = 2 * (index + 1);
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != expect) return false;
+    *out = slot->node;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == expect;
+}
+
+size_t history_ring_snapshot(HistoryRing *ring, HeartbeatNode *out, size_t max) {
+    uint64_t head = history_ring_head(ring);
+    uint64_t avail = head < ring->capacity ? head : ring->capacity;
+    if (avail > max) avail = max;
+
+    size_t n = 0;
+    for (uint64_t i = 0; i < avail; i++) {
+        // A slot that no longer holds this append was lapped by the writer,
+        // and so was everything older than it: the snapshot ends here.
+        if (!history_ring_read(ring, head - 1 - i, &out[n])) break;
+
+        out[n].next = NULL;
+        if (n > 0) out[n - 1].next = &out[n];
+        n++;
+    }
+    return n;
+}
+
+static void merge_fill(HistoryMerge *merge, size_t i) {
+    merge->has_pending[i] = merge->next[i] > 0 &&
+                            history_ring_read(merge->rings[i], merge->next[i] - 1,
+                                              &merge->pending[i]);
+    // A lapped slot means everything older is gone as well
+    if (merge->has_pending[i]) merge->next[i]--;
+}
+
+void history_merge_init(HistoryMerge *merge, HistoryRing *const *rings, size_t count) {
+    if (count > MAX_HISTORY_SHARDS) count = MAX_HISTORY_SHARDS;
+    merge->count = count;
+    for (size_t i = 0; i < count; i++) {
+        merge->rings[i] = rings[i];
+        merge->next[i] = history_ring_head(rings[i]);
+        merge_fill(merge, i);
+    }
+}
+
+bool history_merge_next(HistoryMerge *merge, HeartbeatNode *out) {
+    size_t best = merge->count;
+    for (size_t i = 0; i < merge->count; i++) {
+        if (merge->has_pending[i] &&
+            (best == merge->count || merge->pending[i].timestamp > merge->pending[best].timestamp)) {
+            best = i;
+        }
+    }
+    if (best == merge->count) return false;
+
+    *out = merge->pending[best];
+    out->next = NULL;
+    merge_fill(merge, best);
+    return true;
+}
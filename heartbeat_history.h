@@ -0,0 +1,102 @@
+#ifndef HEARTBEAT_HISTORY_H
+#define HEARTBEAT_HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "heartbeat_server.h"
+
+#define MAX_HISTORY_SHARDS 64
+
+// One ring slot. seq is a per-slot seqlock: it is odd while the slot is being
+// written and 2 * (n + 1) once append number n has been published into it.
+typedef struct {
+    HeartbeatNode node;
+    _Atomic uint64_t seq;
+} HistorySlot;
+
+// Preallocated, fixed-capacity history. Appends are lock-free for a single
+// writer; concurrent producers serialize on writer_mutex, which readers never
+// take. Readers copy a consistent snapshot with history_ring_snapshot.
+typedef struct {
+    HistorySlot *slots;
+    size_t capacity;
+    _Atomic uint64_t head;          // number of appends published so far
+    pthread_mutex_t writer_mutex;
+    bool owns_slots;
+} HistoryRing;
+
+// Initialize a ring over caller-provided storage
+void history_ring_init(HistoryRing *ring, HistorySlot *slots, size_t capacity);
+
+// Initialize a ring with heap storage for capacity records
+bool history_ring_alloc(HistoryRing *ring, size_t capacity);
+
+void history_ring_destroy(HistoryRing *ring);
+
+// Append one record; the caller must be the only writer (hold writer_mutex)
+void history_ring_append(HistoryRing *ring, const HeartbeatData *data, time_t timestamp,
+                         uint8_t anomalies);
+
+// Drop every record; the caller must hold writer_mutex
+void history_ring_reset(HistoryRing *ring);
+
+// Number of records currently retained
+size_t history_ring_count(HistoryRing *ring);
+
+// Most recent record, or NULL when empty. Only stable while no append runs.
+HeartbeatNode *history_ring_newest(HistoryRing *ring);
+
+// Number of appends published so far; append n lives in slot n % capacity
+uint64_t history_ring_head(HistoryRing *ring);
+
+// Copy append number index into out. Returns false if the slot has since been
+// overwritten (or is mid-write), in which case every older append is gone too.
+bool history_ring_read(HistoryRing *ring, uint64_t index, HeartbeatNode *out);
+
+// Copy up to max of the newest records, newest first, into out. The copies
+// are linked through next so the result can be walked like the old list.
+size_t history_ring_snapshot(HistoryRing *ring, HeartbeatNode *out, size_t max);
+
+// Newest-first walk over several rings at once. Each ring is read newest
+// first; the next record is whichever ring's pending record is newest.
+typedef struct {
+    HistoryRing *rings[MAX_HISTORY_SHARDS];
+    uint64_t next[MAX_HISTORY_SHARDS];      // one past the append to read next
+    HeartbeatNode pending[MAX_HISTORY_SHARDS];
+    bool has_pending[MAX_HISTORY_SHARDS];
+    size_t count;
+} HistoryMerge;
+
+void history_merge_init(HistoryMerge *merge, HistoryRing *const *rings, size_t count);
+
+// Copy the next record into out; false once every ring is exhausted
+bool history_merge_next(HistoryMerge *merge, HeartbeatNode *out);
+
+// The server's history (defined in heartbeat_server.c). It is split into
+// shards: event loops started with their own listeners append to a private
+// shard, other writers pick one by host, and readers merge all of them.
+HistoryRing *get_history_shard(size_t shard);
+size_t get_history_shard_count(void);
+
+// All MAX_HISTORY_SHARDS rings; the first get_history_shard_count() are in use
+HistoryRing *const *get_history_rings(void);
+
+// Changes whenever a record is appended or the history is cleared or
+// resized, and only ever increases
+uint64_t get_history_generation(void);
+
+// Records retained across every shard
+size_t get_history_count(void);
+
+// Re-split the history into shards, dropping its contents. Must be called
+// before any reader or writer threads are started.
+bool set_history_shards(size_t shards);
+
+// Make the calling thread append to shard (-1: choose by host)
+void set_thread_history_shard(int shard);
+int get_thread_history_shard(void);
+
+#endif /* HEARTBEAT_HISTORY_H */
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include "heartbeat_http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+void http_parser_reset(HttpParser *parser) {
+    memset(parser, 0, sizeof(*parser));
+}
+
+static bool span_equals(const char *data, HttpSpan span, const char *str) {
+    return span.len == strlen(str) && strncasecmp(data + span.off, str, span.len) == 0;
+}
+
+static HttpParseStatus parse_error(HttpParser *parser, int status) {
+    parser->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+// Does a comma-separated header value contain token (case-insensitive)?
+static bool has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && value[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+        if (end - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parse the request line and header fields of the block data[0..header_len)
+static HttpParseStatus parse_head(HttpParser *parser, const char *data) {
+    const char *end = data + parser->header_len - 2;     // at the final CRLF
+    const char *p = data;
+
+    // Request line: METHOD SP target SP HTTP/1.x CRLF
+    const char *sp = p;
+    while (sp < end && isupper((unsigned char)*sp)) sp++;
+    if (sp == p || sp >= end || *sp != ' ') return parse_error(parser, 400);
+    parser->method = (HttpSpan){ 0, (size_t)(sp - p) };
+
+    const char *target = sp + 1;
+    const char *target_end = target;
+    while (target_end < end && *target_end != ' ' && *target_end != '\r') target_end++;
+    if (target_end == target || *target_end != ' ' || *target != '/') {
+        return parse_error(parser, 400);
+    }
+    parser->target = (HttpSpan){ (size_t)(target - data), (size_t)(target_end - target) };
+
+    const char *version = target_end + 1;
+    if (end - version < 10 || strncmp(version, "HTTP/1.", 7) != 0) {
+        return parse_error(parser, 400);
+    }
+    if (version[7] != '0' && version[7] != '1') return parse_error(parser, 505);
+    if (version[8] != '\r' || version[9] != '\n') return parse_error(parser, 400);
+    parser->minor_version = version[7] - '0';
+    parser->keep_alive = parser->minor_version == 1;
+
+    // Header fields
+    bool have_length = false;
+    p = version + 10;
+    while (p < end) {
+        const char *eol = memchr(p, '\r', (size_t)(end - p) + 1);
+        if (!eol || eol[1] != '\n') return parse_error(parser, 400);
+
+        const char *colon = memchr(p, ':', (size_t)(eol - p));
+        if (!colon || colon == p) return parse_error(parser, 400);
+        if (parser->header_count == HTTP_MAX_HEADERS) return parse_error(parser, 431);
+
+        const char *value = colon + 1;
+        const char *value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+        HttpSpan name = { (size_t)(p - data), (size_t)(colon - p) };
+        HttpSpan val = { (size_t)(value - data), (size_t)(value_end - value) };
+        parser->header_names[parser->header_count] = name;
+        parser->header_values[parser->header_count] = val;
+        parser->header_count++;
+
+        if (span_equals(data, name, "Content-Length")) {
+            if (val.len == 0 || val.len > 12) return parse_error(parser, 400);
+            size_t length = 0;
+            for (size_t i = 0; i < val.len; i++) {
+                if (!isdigit((unsigned char)value[i])) return parse_error(parser, 400);
+                length = length * 10 + (size_t)(value[i] - '0');
+            }
+            if (have_length && length != parser->content_length) return parse_error(parser, 400);
+            if (length > HTTP_MAX_BODY_SIZE) return parse_error(parser, 413);
+            parser->content_length = length;
+            have_length = true;
+        } else if (span_equals(data, name, "Transfer-Encoding")) {
+            return parse_error(parser, 501);
+        } else if (span_equals(data, name, "Expect")) {
+            parser->expect_continue = has_token(value, val.len, "100-continue");
+        } else if (span_equals(data, name, "Connection")) {
+            if (has_token(value, val.len, "close")) parser->keep_alive = false;
+            else if (has_token(value, val.len, "keep-alive")) parser->keep_alive = true;
+        }
+
+        p = eol + 2;
+    }
+
+    return HTTP_PARSE_COMPLETE;
+}
+
+HttpParseStatus http_parse(HttpParser *parser, char *data, size_t len,
+                           HttpRequest *req, size_t *consumed) {
+    if (!parser->headers_done) {
+        // Resume the search a few bytes back in case the terminator straddles reads
+        size_t start = parser->scan_pos > 3 ? parser->scan_pos - 3 : 0;
+        const char *blank = start < len ? memmem(data + start, len - start, "\r\n\r\n", 4) : NULL;
+        if (!blank) {
+            parser->scan_pos = len;
+            if (len > HTTP_MAX_HEADER_SIZE) return parse_error(parser, 431);
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        parser->header_len = (size_t)(blank - data) + 4;
+        if (parser->header_len > HTTP_MAX_HEADER_SIZE) return parse_error(parser, 431);
+        if (parse_head(parser, data) != HTTP_PARSE_COMPLETE) return HTTP_PARSE_ERROR;
+        // The query is copied out whole for the handlers; never clip it
+        const char *target = data + parser->target.off;
+        const char *question = memchr(target, '?', parser->target.len);
+        if (question && parser->target.len - (size_t)(question + 1 - target) > HTTP_MAX_QUERY_LEN) {
+            return parse_error(parser, 414);
+        }
+        parser->headers_done = true;
+    }
+
+    size_t total = parser->header_len + parser->content_length;
+    if (len < total) return HTTP_PARSE_INCOMPLETE;
+
+    req->method = data + parser->method.off;
+    req->method_len = parser->method.len;
+    req->path = data + parser->target.off;
+    req->path_len = parser->target.len;
+    req->query = NULL;
+    req->query_buf[0] = '\0';
+
+    const char *question = memchr(req->path, '?', req->path_len);
+    if (question) {
+        size_t query_len = req->path_len - (size_t)(question + 1 - req->path);
+        memcpy(req->query_buf, question + 1, query_len);
+        req->query_buf[query_len] = '\0';
+        req->query = req->query_buf;
+        req->path_len = (size_t)(question - req->path);
+    }
+
+    req->minor_version = parser->minor_version;
+    req->header_count = parser->header_count;
+    for (size_t i = 0; i < parser->header_count; i++) {
+        req->headers[i].name = data + parser->header_names[i].off;
+        req->headers[i].name_len = parser->header_names[i].len;
+        req->headers[i].value = data + parser->header_values[i].off;
+        req->headers[i].value_len = parser->header_values[i].len;
+    }
+
+    req->body = data + parser->header_len;
+    req->body_len = parser->content_length;
+    parser->saved_byte = req->body[req->body_len];
+    req->body[req->body_len] = '\0';
+    req->keep_alive = parser->keep_alive;
+    req->head = req->method_len == 4 && memcmp(req->method, "HEAD", 4) == 0;
+
+    *consumed = total;
+    return HTTP_PARSE_COMPLETE;
+}
+
+void http_request_done(HttpParser *parser, char *data, size_t consumed) {
+    data[consumed] = parser->saved_byte;
+    http_parser_reset(parser);
+}
+
+const char *http_get_header(const HttpRequest *req, const char *name, size_t *value_len) {
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < req->header_count; i++) {
+        const HttpHeader *h = &req->headers[i];
+        if (h->name_len == name_len && strncasecmp(h->name, name, name_len) == 0) {
+            if (value_len) *value_len = h->value_len;
+            return h->value;
+        }
+    }
+    return NULL;
+}
+
+const char *http_status_text(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 414: return "URI Too Long";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Unknown";
+    }
+}
+
+void http_respond(OutputBuffer *out, const HttpRequest *req, int status,
+                  const char *content_type, const char *body, size_t len) {
+    http_respond_meta(out, req, status, content_type, NULL, body, len);
+}
+
+static void append_meta(OutputBuffer *out, const HttpResponseMeta *meta) {
+    if (!meta) return;
+    if (meta->etag) {
+        output_buffer_printf(out, "ETag: %s\r\n", meta->etag);
+    }
+    if (meta->content_encoding) {
+        output_buffer_printf(out, "Content-Encoding: %s\r\n", meta->content_encoding);
+    }
+    if (meta->vary_encoding) {
+        output_buffer_printf(out, "Vary: Accept-Encoding\r\n");
+    }
+}
+
+void http_respond_meta(OutputBuffer *out, const HttpRequest *req, int status,
+                       const char *content_type, const HttpResponseMeta *meta,
+                       const char *body, size_t len) {
+    bool keep_alive = req && req->keep_alive;
+    output_buffer_printf(out,
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n",
+        status, http_status_text(status), content_type);
+    append_meta(out, meta);
+    output_buffer_printf(out,
+        "Connection: %s\r\n"
+        "Content-Length: %zu\r\n\r\n",
+        keep_alive ? "keep-alive" : "close", len);
+    if (!req || !req->head) {
+        output_buffer_append(out, body, len);
+    }
+}
+
+void http_respond_chunked(OutputBuffer *out, const HttpRequest *req, int status,
+                          const char *content_type, const HttpResponseMeta *meta) {
+    output_buffer_printf(out,
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n",
+        status, http_status_text(status), content_type);
+    append_meta(out, meta);
+    output_buffer_printf(out,
+        "Connection: %s\r\n"
+        "Transfer-Encoding: chunked\r\n\r\n",
+        req->keep_alive ? "keep-alive" : "close");
+}
+
+// A 304 carries no body and, unlike other responses, no Content-Length: the
+// one it could send would have to be that of the 200 it stands in for.
+void http_respond_not_modified(OutputBuffer *out, const HttpRequest *req,
+                               const HttpResponseMeta *meta) {
+    output_buffer_printf(out, "HTTP/1.1 304 Not Modified\r\n");
+    HttpResponseMeta headers = *meta;
+    headers.content_encoding = NULL;
+    append_meta(out, &headers);
+    output_buffer_printf(out, "Connection: %s\r\n\r\n",
+                         req->keep_alive ? "keep-alive" : "close");
+}
+
+bool http_etag_matches(const HttpRequest *req, const char *etag) {
+    size_t len;
+    const char *value = http_get_header(req, "If-None-Match", &len);
+    if (!value) return false;
+    
+    size_t etag_len = strlen(etag);
+    const char *p = value, *end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *tag = p;
+        while (p < end && *p != ',') p++;
+        const char *tag_end = p;
+        while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) tag_end--;
+        
+        if (tag_end - tag == 1 && *tag == '*') return true;
+        // If-None-Match uses the weak comparison, so W/ is ignored
+        if (tag_end - tag > 2 && tag[0] == 'W' && tag[1] == '/') tag += 2;
+        if ((size_t)(tag_end - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) return true;
+    }
+    return false;
+}
+
+// Chunk sizes are written as fixed-width hex (leading zeros are allowed), so
+// the header can be reserved up front and patched once the data is in place.
+#define CHUNK_HEADER_LEN 10     // "%08zx\r\n"
+
+size_t http_chunk_begin(OutputBuffer *out) {
+    size_t mark = out->len;
+    output_buffer_append(out, "00000000\r\n", CHUNK_HEADER_LEN);
+    return mark;
+}
+
+void http_chunk_end(OutputBuffer *out, size_t mark) {
+    size_t size = out->len - mark - CHUNK_HEADER_LEN;
+    if (size == 0) {
+        // A zero-size chunk would end the body early
+        out->len = mark;
+        return;
+    }
+    // Callers keep chunks far below 4 GB, so eight digits always suffice
+    char header[32];
+    snprintf(header, sizeof(header), "%08zx\r\n", size);
+    memcpy(out->data + mark, header, CHUNK_HEADER_LEN);
+    output_buffer_append(out, "\r\n", 2);
+}
+
+void http_chunk_finish(OutputBuffer *out) {
+    output_buffer_append(out, "0\r\n\r\n", 5);
+}
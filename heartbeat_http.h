@@ -0,0 +1,146 @@
+#ifndef HEARTBEAT_HTTP_H
+#define HEARTBEAT_HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "heartbeat_server.h"
+#include "heartbeat_stream.h"
+
+#define HTTP_MAX_HEADER_SIZE 8192
+#define HTTP_MAX_BODY_SIZE (16 * 1024 * 1024)
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_QUERY_LEN (BUFFER_SIZE - 1)   // longer query strings get 414
+#define HTTP_KEEPALIVE_TIMEOUT 30   // seconds an idle persistent connection is kept
+
+typedef enum {
+    HTTP_PARSE_INCOMPLETE,
+    HTTP_PARSE_COMPLETE,
+    HTTP_PARSE_ERROR
+} HttpParseStatus;
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} HttpHeader;
+
+// A parsed request. Pointers refer into the connection's input buffer and
+// stay valid until the request is consumed. body is NUL-terminated.
+typedef struct {
+    const char *method;
+    size_t method_len;
+    const char *path;
+    size_t path_len;
+    const char *query;          // text after '?', NUL-terminated copy
+    int minor_version;          // 0 for HTTP/1.0, 1 for HTTP/1.1
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t header_count;
+    char *body;
+    size_t body_len;
+    bool keep_alive;
+    bool head;                  // HEAD request: send headers only
+    StreamSubscriber *stream;   // the connection's; a handler may subscribe it
+    char query_buf[HTTP_MAX_QUERY_LEN + 1];
+} HttpRequest;
+
+typedef struct {
+    size_t off;
+    size_t len;
+} HttpSpan;
+
+// Resumable parser state. Offsets are kept rather than pointers so the
+// input buffer may grow (and move) between calls.
+typedef struct {
+    bool headers_done;
+    size_t scan_pos;            // where to resume looking for "\r\n\r\n"
+    size_t header_len;          // bytes up to and including the blank line
+    size_t content_length;
+    HttpSpan method;
+    HttpSpan target;
+    int minor_version;
+    HttpSpan header_names[HTTP_MAX_HEADERS];
+    HttpSpan header_values[HTTP_MAX_HEADERS];
+    size_t header_count;
+    bool keep_alive;
+    bool expect_continue;       // client sent "Expect: 100-continue"
+    bool continue_sent;
+    int error_status;           // HTTP status to answer with on HTTP_PARSE_ERROR
+    char saved_byte;            // byte replaced by the body's NUL terminator
+} HttpParser;
+
+typedef enum {
+    PROTO_UNKNOWN,      // nothing received yet
+    PROTO_HTTP,
+    PROTO_RAW_JSON,     // a bare JSON heartbeat, as sent to the TCP port
+    PROTO_BINARY,       // binary heartbeat frames (heartbeat_binary.h)
+    PROTO_STREAM        // an event stream; further input is ignored
+} ProtocolMode;
+
+// What a connection is speaking and how far its current request got
+struct ProtocolState {
+    ProtocolMode mode;
+    HttpParser http;
+    size_t json_scan;
+    int json_depth;
+    bool json_in_string;
+    bool json_escape;
+    char hostname[MAX_HOSTNAME_LEN];    // from the binary HELLO
+    StreamSubscriber stream;            // active in PROTO_STREAM
+};
+
+void http_parser_reset(HttpParser *parser);
+
+// Feed the bytes buffered so far (data[0..len)). On HTTP_PARSE_COMPLETE the
+// request occupies the first *consumed bytes and req describes it. The byte
+// after the body is temporarily replaced with NUL, so data needs one spare
+// byte past len; call http_request_done once the request is handled.
+HttpParseStatus http_parse(HttpParser *parser, char *data, size_t len,
+                           HttpRequest *req, size_t *consumed);
+
+// Restore the byte after a completed request and reset for the next one
+void http_request_done(HttpParser *parser, char *data, size_t consumed);
+
+// Case-insensitive header lookup; returns NULL when absent
+const char *http_get_header(const HttpRequest *req, const char *name, size_t *value_len);
+
+// Reason phrase for a status code
+const char *http_status_text(int status);
+
+// Append a complete response. Honors the request's keep-alive and HEAD.
+void http_respond(OutputBuffer *out, const HttpRequest *req, int status,
+                  const char *content_type, const char *body, size_t len);
+
+// Optional response headers
+typedef struct {
+    const char *etag;               // quoted entity tag
+    const char *content_encoding;   // the body's coding, e.g. "gzip"
+    bool vary_encoding;             // the body depends on Accept-Encoding
+} HttpResponseMeta;
+
+// http_respond with the headers in meta (which may be NULL)
+void http_respond_meta(OutputBuffer *out, const HttpRequest *req, int status,
+                       const char *content_type, const HttpResponseMeta *meta,
+                       const char *body, size_t len);
+
+// Start a response whose body follows as chunks (HTTP/1.1 only). meta may be
+// NULL. For HEAD requests, send no chunks and skip http_chunk_finish.
+void http_respond_chunked(OutputBuffer *out, const HttpRequest *req, int status,
+                          const char *content_type, const HttpResponseMeta *meta);
+
+// 304 for a conditional request whose If-None-Match matched meta->etag
+void http_respond_not_modified(OutputBuffer *out, const HttpRequest *req,
+                               const HttpResponseMeta *meta);
+
+// True if the request's If-None-Match lists etag (or is "*")
+bool http_etag_matches(const HttpRequest *req, const char *etag);
+
+// Reserve a chunk header; append the chunk data, then call http_chunk_end
+// with the returned mark to fill in its size.
+size_t http_chunk_begin(OutputBuffer *out);
+void http_chunk_end(OutputBuffer *out, size_t mark);
+
+// Terminate a chunked body
+void http_chunk_finish(OutputBuffer *out);
+
+#endif /* HEARTBEAT_HTTP_H */
@@ -0,0 +1,468 @@
+#include "heartbeat_json.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+static void append_literal(OutputBuffer *out, const char *str) {
+    output_buffer_append(out, str, strlen(str));
+}
+
+// The names of the metrics set in an anomaly bitmask, as a JSON array
+static void append_anomalies(OutputBuffer *out, uint8_t anomalies) {
+    const char *sep = "[";
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        if (anomalies & (1u << m)) {
+            output_buffer_printf(out, "%s\"%s\"", sep, metric_names[m]);
+            sep = ",";
+        }
+    }
+    append_literal(out, "]");
+}
+
+void json_append_heartbeat(OutputBuffer *out, const HeartbeatNode *node, bool pretty) {
+    const HeartbeatData *data = &node->data;
+
+    // Field order matches what the json-c based encoder used to produce
+    if (pretty) {
+        append_literal(out, "  {\n    \"local_ip\": ");
+        output_buffer_append_json_string(out, data->local_ip);
+        append_literal(out, ",\n    \"public_ip\": ");
+        output_buffer_append_json_string(out, data->public_ip);
+        output_buffer_printf(out,
+            ",\n    \"cpu_usage\": %.15g"
+            ",\n    \"memory_usage\": %.15g"
+            ",\n    \"disk_usage\": %.15g"
+            ",\n    \"availability\": %.15g"
+            ",\n    \"latency\": %.15g"
+            ",\n    \"timestamp\": %lld",
+            data->cpu_usage, data->memory_usage, data->disk_usage,
+            data->availability, data->latency, (long long)node->timestamp);
+        if (node->anomalies) {
+            append_literal(out, ",\n    \"anomalies\": ");
+            append_anomalies(out, node->anomalies);
+        }
+        append_literal(out, "\n  }");
+    } else {
+        append_literal(out, "{\"local_ip\":");
+        output_buffer_append_json_string(out, data->local_ip);
+        append_literal(out, ",\"public_ip\":");
+        output_buffer_append_json_string(out, data->public_ip);
+        output_buffer_printf(out,
+            ",\"cpu_usage\":%.15g,\"memory_usage\":%.15g,\"disk_usage\":%.15g"
+            ",\"availability\":%.15g,\"latency\":%.15g,\"timestamp\":%lld",
+            data->cpu_usage, data->memory_usage, data->disk_usage,
+            data->availability, data->latency, (long long)node->timestamp);
+        if (node->anomalies) {
+            append_literal(out, ",\"anomalies\":");
+            append_anomalies(out, node->anomalies);
+        }
+        append_literal(out, "}");
+    }
+}
+
+void history_json_writer_init(HistoryJsonWriter *writer, HistoryRing *const *rings,
+                              size_t ring_count, size_t limit, bool pretty) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < ring_count; i++) {
+        count += history_ring_count(rings[i]);
+    }
+    if (limit > 0 && limit < count) count = limit;
+
+    history_merge_init(&writer->merge, rings, ring_count);
+    writer->remaining = (size_t)count;
+    writer->written = 0;
+    writer->pretty = pretty;
+    writer->started = false;
+    writer->done = false;
+}
+
+bool history_json_write(HistoryJsonWriter *writer, OutputBuffer *out, size_t max_bytes) {
+    if (writer->done) return true;
+
+    size_t start = out->len;
+    if (!writer->started) {
+        output_buffer_append(out, "[", 1);
+        writer->started = true;
+    }
+
+    while (writer->remaining > 0 && out->len - start < max_bytes) {
+        HeartbeatNode node;
+        if (!history_merge_next(&writer->merge, &node)) {
+            writer->remaining = 0;
+            break;
+        }
+        if (writer->written > 0) output_buffer_append(out, ",", 1);
+        if (writer->pretty) output_buffer_append(out, "\n", 1);
+        json_append_heartbeat(out, &node, writer->pretty);
+        writer->remaining--;
+        writer->written++;
+    }
+
+    if (writer->remaining == 0) {
+        if (writer->pretty && writer->written > 0) output_buffer_append(out, "\n", 1);
+        output_buffer_append(out, "]", 1);
+        writer->done = true;
+    }
+    return writer->done;
+}
+
+// ---------------------------------------------------------------------------
+// Heartbeat decoder
+//
+// Accepts the strict RFC 8259 subset that agents actually send and decodes
+// it in one pass with no allocations. The results have to match the json-c
+// path exactly: duplicate keys keep the last value, numeric fields follow
+// json_object_get_double's coercions, and IP fields must be strings. Any
+// syntax json-c is lenient about (comments, single quotes, NaN, \u escapes,
+// trailing commas, ...) returns JSON_DECODE_FALLBACK rather than a verdict.
+
+// Strings longer than this are left to json-c
+#define JSON_FIELD_MAX 256
+#define JSON_KEY_MAX 16
+// json-c rejects documents nested deeper than 32; stay well inside that
+#define JSON_SKIP_DEPTH 16
+
+typedef enum {
+    FIELD_LOCAL_IP,
+    FIELD_PUBLIC_IP,
+    FIELD_HOSTNAME,
+    FIELD_CPU_USAGE,
+    FIELD_MEMORY_USAGE,
+    FIELD_DISK_USAGE,
+    FIELD_AVAILABILITY,
+    FIELD_LATENCY,
+    FIELD_COUNT,
+    FIELD_UNKNOWN = FIELD_COUNT
+} HeartbeatField;
+
+typedef struct {
+    bool present[FIELD_COUNT];
+    bool is_string[FIELD_COUNT];
+    double number[FIELD_COUNT];
+    char local_ip[JSON_FIELD_MAX];
+    char public_ip[JSON_FIELD_MAX];
+    char hostname[JSON_FIELD_MAX];
+} DecodedHeartbeat;
+
+// Exactly representable powers of ten for the fast double path
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static HeartbeatField lookup_field(const char *key, size_t len) {
+#define FIELD_IS(name) (memcmp(key, name, sizeof(name) - 1) == 0)
+    switch (len) {
+    case 7:
+        if (FIELD_IS("latency")) return FIELD_LATENCY;
+        break;
+    case 8:
+        if (FIELD_IS("local_ip")) return FIELD_LOCAL_IP;
+        if (FIELD_IS("hostname")) return FIELD_HOSTNAME;
+        break;
+    case 9:
+        if (FIELD_IS("public_ip")) return FIELD_PUBLIC_IP;
+        if (FIELD_IS("cpu_usage")) return FIELD_CPU_USAGE;
+        break;
+    case 10:
+        if (FIELD_IS("disk_usage")) return FIELD_DISK_USAGE;
+        break;
+    case 12:
+        if (FIELD_IS("memory_usage")) return FIELD_MEMORY_USAGE;
+        if (FIELD_IS("availability")) return FIELD_AVAILABILITY;
+        break;
+    }
+    return FIELD_UNKNOWN;
+#undef FIELD_IS
+}
+
+static const char *skip_ws(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Parse a string starting at the opening quote. The unescaped text goes to
+// buf (NUL-terminated) when buf is non-NULL. Returns the position after the
+// closing quote, or NULL to fall back.
+static const char *parse_string(const char *p, char *buf, size_t cap, size_t *out_len) {
+    size_t len = 0;
+    p++;
+    while (*p != '"') {
+        unsigned char c = (unsigned char)*p++;
+        if (c < 0x20) return NULL;          // includes the terminating NUL
+        if (c == '\\') {
+            switch (*p++) {
+            case '"': c = '"'; break;
+            case '\\': c = '\\'; break;
+            case '/': c = '/'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            default: return NULL;           // \u and anything invalid
+            }
+        }
+        if (buf) {
+            if (len + 1 >= cap) return NULL;
+            buf[len] = (char)c;
+        }
+        len++;
+    }
+    if (buf) buf[len] = '\0';
+    if (out_len) *out_len = len;
+    return p + 1;
+}
+
+// Parse a number in strict JSON syntax. Integers convert the way json-c's
+// int64 path does; decimals with at most 19 significant digits and a small
+// exponent are computed exactly (both operands are exact doubles, so the one
+// rounding step gives the same result as strtod), anything else uses strtod.
+static const char *parse_number(const char *p, double *value) {
+    const char *start = p;
+    bool negative = false;
+    if (*p == '-') {
+        negative = true;
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;                 // significant digits in mantissa
+    bool truncated = false;
+    int exponent = 0;
+    bool is_double = false;
+
+    if (*p == '0') {
+        p++;
+        if (is_digit(*p)) return NULL;
+    } else if (!is_digit(*p)) {
+        return NULL;
+    }
+    for (; is_digit(*p); p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            if (mantissa) digits++;
+        } else {
+            truncated = true;
+            exponent++;
+        }
+    }
+
+    if (*p == '.') {
+        is_double = true;
+        p++;
+        if (!is_digit(*p)) return NULL;
+        for (; is_digit(*p); p++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        is_double = true;
+        p++;
+        bool exp_negative = false;
+        if (*p == '+' || *p == '-') exp_negative = *p++ == '-';
+        if (!is_digit(*p)) return NULL;
+        int exp_value = 0;
+        for (; is_digit(*p); p++) {
+            if (exp_value < 100000) exp_value = exp_value * 10 + (*p - '0');
+        }
+        exponent += exp_negative ? -exp_value : exp_value;
+    }
+
+    if (!is_double) {
+        // json-c reads these with strtoll; leave overflow handling to it
+        if (truncated || digits > 18) return NULL;
+        int64_t n = (int64_t)mantissa;
+        *value = (double)(negative ? -n : n);
+    } else if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double d = (double)mantissa;
+        d = exponent < 0 ? d / pow10_table[-exponent] : d * pow10_table[exponent];
+        *value = negative ? -d : d;
+    } else {
+        *value = strtod(start, NULL);
+    }
+    return p;
+}
+
+static const char *skip_value(const char *p, int depth);
+
+static const char *skip_container(const char *p, int depth) {
+    char close = *p == '{' ? '}' : ']';
+    bool is_object = close == '}';
+    if (depth >= JSON_SKIP_DEPTH) return NULL;
+
+    p = skip_ws(p + 1);
+    if (*p == close) return p + 1;
+    while (1) {
+        if (is_object) {
+            if (*p != '"' || !(p = parse_string(p, NULL, 0, NULL))) return NULL;
+            p = skip_ws(p);
+            if (*p++ != ':') return NULL;
+            p = skip_ws(p);
+        }
+        if (!(p = skip_value(p, depth + 1))) return NULL;
+        p = skip_ws(p);
+        if (*p == close) return p + 1;
+        if (*p++ != ',') return NULL;
+        p = skip_ws(p);
+    }
+}
+
+static const char *match_literal(const char *p, const char *literal, size_t len) {
+    return strncmp(p, literal, len) == 0 ? p + len : NULL;
+}
+
+static const char *skip_value(const char *p, int depth) {
+    double unused;
+    switch (*p) {
+    case '"': return parse_string(p, NULL, 0, NULL);
+    case '{':
+    case '[': return skip_container(p, depth);
+    case 't': return match_literal(p, "true", 4);
+    case 'f': return match_literal(p, "false", 5);
+    case 'n': return match_literal(p, "null", 4);
+    default: return parse_number(p, &unused);
+    }
+}
+
+// json_object_get_double on a string value
+static double string_to_double(const char *str) {
+    char *end;
+    errno = 0;
+    double d = strtod(str, &end);
+    if (end == str || *end != '\0') return 0.0;
+    if ((d == HUGE_VAL || d == -HUGE_VAL) && errno == ERANGE) return 0.0;
+    return d;
+}
+
+static char *field_string(DecodedHeartbeat *hb, HeartbeatField field) {
+    switch (field) {
+    case FIELD_LOCAL_IP: return hb->local_ip;
+    case FIELD_PUBLIC_IP: return hb->public_ip;
+    case FIELD_HOSTNAME: return hb->hostname;
+    default: return NULL;
+    }
+}
+
+// Copy a decoded string into a fixed field, truncating to fit
+static void copy_field(char *dst, size_t size, const char *src) {
+    size_t len = strnlen(src, size - 1);
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+// Decode one member value into hb
+static const char *parse_field(const char *p, HeartbeatField field, DecodedHeartbeat *hb) {
+    char *str = field_string(hb, field);
+    char scratch[JSON_FIELD_MAX];
+    double number = 0.0;
+    bool is_string = false;
+
+    switch (*p) {
+    case '"':
+        p = parse_string(p, str ? str : scratch, JSON_FIELD_MAX, NULL);
+        if (!p) return NULL;
+        is_string = true;
+        if (!str) number = string_to_double(scratch);
+        break;
+    case 't':
+        p = match_literal(p, "true", 4);
+        number = 1.0;
+        break;
+    case 'f':
+        p = match_literal(p, "false", 5);
+        break;
+    case 'n':
+    case '{':
+    case '[':
+        p = skip_value(p, 1);
+        break;
+    default:
+        p = parse_number(p, &number);
+        break;
+    }
+    if (!p) return NULL;
+
+    hb->present[field] = true;
+    hb->is_string[field] = is_string;
+    hb->number[field] = number;
+    return p;
+}
+
+JsonDecodeResult json_decode_heartbeat(const char *json, HeartbeatData *hb_data) {
+    DecodedHeartbeat hb;
+    memset(hb.present, 0, sizeof(hb.present));
+
+    const char *p = skip_ws(json);
+    if (*p != '{') return JSON_DECODE_FALLBACK;
+    p = skip_ws(p + 1);
+
+    if (*p != '}') {
+        while (1) {
+            char key[JSON_KEY_MAX];
+            size_t key_len;
+            if (*p != '"') return JSON_DECODE_FALLBACK;
+
+            // Keys too long for key[] cannot be one of ours
+            const char *after = parse_string(p, key, sizeof(key), &key_len);
+            HeartbeatField field = FIELD_UNKNOWN;
+            if (after) {
+                field = lookup_field(key, key_len);
+            } else if (!(after = parse_string(p, NULL, 0, NULL))) {
+                return JSON_DECODE_FALLBACK;
+            }
+
+            p = skip_ws(after);
+            if (*p++ != ':') return JSON_DECODE_FALLBACK;
+            p = skip_ws(p);
+            p = field == FIELD_UNKNOWN ? skip_value(p, 1) : parse_field(p, field, &hb);
+            if (!p) return JSON_DECODE_FALLBACK;
+
+            p = skip_ws(p);
+            if (*p == '}') break;
+            if (*p++ != ',') return JSON_DECODE_FALLBACK;
+            p = skip_ws(p);
+        }
+    }
+    if (*skip_ws(p + 1) != '\0') return JSON_DECODE_FALLBACK;
+
+    // The document is well formed; apply process_json_data's rules
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        if (f != FIELD_HOSTNAME && !hb.present[f]) return JSON_DECODE_REJECT;
+    }
+    if (!hb.is_string[FIELD_LOCAL_IP] || !hb.is_string[FIELD_PUBLIC_IP] ||
+        !validate_ip(hb.local_ip) || !validate_ip(hb.public_ip)) {
+        return JSON_DECODE_REJECT;
+    }
+    if (!validate_percentage(hb.number[FIELD_CPU_USAGE]) ||
+        !validate_percentage(hb.number[FIELD_MEMORY_USAGE]) ||
+        !validate_percentage(hb.number[FIELD_DISK_USAGE]) ||
+        !validate_percentage(hb.number[FIELD_AVAILABILITY]) ||
+        !validate_latency(hb.number[FIELD_LATENCY])) {
+        return JSON_DECODE_REJECT;
+    }
+
+    copy_field(hb_data->local_ip, sizeof(hb_data->local_ip), hb.local_ip);
+    copy_field(hb_data->public_ip, sizeof(hb_data->public_ip), hb.public_ip);
+    if (hb.present[FIELD_HOSTNAME] && hb.is_string[FIELD_HOSTNAME]) {
+        copy_field(hb_data->hostname, sizeof(hb_data->hostname), hb.hostname);
+    }
+    hb_data->cpu_usage = hb.number[FIELD_CPU_USAGE];
+    hb_data->memory_usage = hb.number[FIELD_MEMORY_USAGE];
+    hb_data->disk_usage = hb.number[FIELD_DISK_USAGE];
+    hb_data->availability = hb.number[FIELD_AVAILABILITY];
+    hb_data->latency = hb.number[FIELD_LATENCY];
+    return JSON_DECODE_ACCEPT;
+}
@@ -0,0 +1,49 @@
+#ifndef HEARTBEAT_JSON_H
+#define HEARTBEAT_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "heartbeat_server.h"
+#include "heartbeat_history.h"
+
+// Output produced per call when streaming the history in chunks
+#define HISTORY_CHUNK_SIZE 16384
+
+// Resumable serializer for the history array. Records are read one slot at a
+// time straight from the rings (no snapshot copy, no history_mutex) and
+// formatted directly into the caller's output buffer, newest first across
+// all rings.
+typedef struct {
+    HistoryMerge merge;
+    size_t remaining;       // records still to write
+    size_t written;         // records written so far
+    bool pretty;
+    bool started;
+    bool done;
+} HistoryJsonWriter;
+
+// Prepare to write up to limit of the newest records of the given rings
+// (0 means all retained)
+void history_json_writer_init(HistoryJsonWriter *writer, HistoryRing *const *rings,
+                              size_t ring_count, size_t limit, bool pretty);
+
+// Append records to out until roughly max_bytes have been added or the
+// history is exhausted. Returns true once the closing bracket is written.
+bool history_json_write(HistoryJsonWriter *writer, OutputBuffer *out, size_t max_bytes);
+
+// Format one record as a JSON object
+void json_append_heartbeat(OutputBuffer *out, const HeartbeatNode *node, bool pretty);
+
+typedef enum {
+    JSON_DECODE_ACCEPT,     // valid heartbeat, stored in hb_data
+    JSON_DECODE_REJECT,     // well formed but not a valid heartbeat
+    JSON_DECODE_FALLBACK    // outside the fast subset; ask json-c
+} JsonDecodeResult;
+
+// Single-pass, allocation-free decoder for the heartbeat schema. hb_data is
+// only written on JSON_DECODE_ACCEPT, and then exactly as process_json_data's
+// json-c path would write it.
+JsonDecodeResult json_decode_heartbeat(const char *json, HeartbeatData *hb_data);
+
+#endif /* HEARTBEAT_JSON_H */
@@ -0,0 +1,433 @@
+// Open-loop load generator for heartbeat_server.
+// Each of N connections sends heartbeats on a fixed schedule so that the
+// total rate matches -r. Latency is measured from when a request was due,
+// not from when it was actually sent, so a stalled server is charged for the
+// requests it delayed (coordinated omission); the uncorrected service time
+// is reported alongside. Results are written as JSON so runs can be compared
+// across commits, e.g. -l $(git rev-parse --short HEAD).
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Log-linear histogram of microseconds: 64 sub-buckets per power of two,
+// so every recorded value is within about 1.5% of its bucket bound
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define RESPONSE_MAX (1024 * 1024)   // batch replies carry one status per record
+
+typedef enum { MODE_JSON, MODE_FORM, MODE_BATCH, MODE_RAW } LoadMode;
+
+static const char *mode_names[] = { "json", "form", "batch", "raw" };
+
+typedef struct {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t first_due_ns;
+    uint64_t interval_ns;       // 0: closed loop, send as soon as the reply arrives
+    uint64_t requests;
+    uint64_t errors;
+    Histogram latency;          // from the scheduled send time
+    Histogram service;          // from the actual send time
+} Worker;
+
+static struct sockaddr_in server_addr;
+static LoadMode mode = MODE_JSON;
+static int batch_size = 100;
+static uint64_t end_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ns / 1000000000ull),
+        .tv_nsec = (long)(deadline_ns % 1000000000ull)
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+// Largest value that falls in bucket index
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB) return (uint64_t)index;
+    int shift = index / HIST_SUB - 1;
+    uint64_t sub = (uint64_t)(index % HIST_SUB) + HIST_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *h, uint64_t us) {
+    h->counts[hist_index(us)]++;
+    h->total++;
+    h->sum += (double)us;
+    if (us > h->max) h->max = us;
+}
+
+static void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_SIZE; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(p * (double)h->total + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#define HEARTBEAT_JSON \
+    "{\"local_ip\":\"%s\",\"public_ip\":\"8.8.8.8\",\"cpu_usage\":%.1f," \
+    "\"memory_usage\":60.2,\"disk_usage\":75.0,\"availability\":99.9,\"latency\":12.5}"
+#define RECORD_ROOM 192         // bytes reserved per heartbeat in a request
+#define HEADER_ROOM 256
+
+// Build request number n of worker id into buf; returns its length
+static size_t build_request(char *buf, size_t size, int id, uint64_t n) {
+    char local_ip[32];
+    snprintf(local_ip, sizeof(local_ip), "10.%d.%d.%d", (id >> 16) & 255, (id >> 8) & 255, id & 255);
+    double cpu = (double)(n % 100);
+
+    // Body first, after room for the headers, which then go in front of it
+    char *body = buf + HEADER_ROOM;
+    size_t room = size - HEADER_ROOM;
+    size_t body_len = 0;
+    const char *path = "/api/heartbeat";
+    const char *type = "application/json";
+
+    switch (mode) {
+    case MODE_FORM:
+        type = "application/x-www-form-urlencoded";
+        body_len = (size_t)snprintf(body, room,
+            "local_ip=%s&public_ip=8.8.8.8&cpu_usage=%.1f&memory_usage=60.2"
+            "&disk_usage=75.0&availability=99.9&latency=12.5", local_ip, cpu);
+        break;
+    case MODE_BATCH:
+        path = "/api/heartbeat/batch";
+        type = "application/x-ndjson";
+        for (int i = 0; i < batch_size; i++) {
+            body_len += (size_t)snprintf(body + body_len, room - body_len,
+                                         HEARTBEAT_JSON "\n", local_ip, (double)(i % 100));
+        }
+        break;
+    default:
+        body_len = (size_t)snprintf(body, room, HEARTBEAT_JSON, local_ip, cpu);
+        break;
+    }
+
+    if (mode == MODE_RAW) {
+        memmove(buf, body, body_len);
+        return body_len;
+    }
+    int header_len = snprintf(buf, HEADER_ROOM,
+        "POST %s HTTP/1.1\r\nHost: loadgen\r\nContent-Type: %s\r\n"
+        "Content-Length: %zu\r\n\r\n", path, type, body_len);
+    memmove(buf + header_len, body, body_len);
+    return (size_t)header_len + body_len;
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Read one HTTP response. Returns its status, or -1 if the connection failed.
+// *keep_alive is cleared when the server will close the connection.
+static int read_response(int fd, char *buf, bool *keep_alive) {
+    size_t len = 0;
+    char *body = NULL;
+    size_t content_length = 0;
+
+    while (1) {
+        if (len == RESPONSE_MAX) return -1;
+        ssize_t n = read(fd, buf + len, RESPONSE_MAX - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len += (size_t)n;
+
+        if (!body) {
+            char *blank = memmem(buf, len, "\r\n\r\n", 4);
+            if (!blank) continue;
+            body = blank + 4;
+            *blank = '\0';
+            char *cl = strcasestr(buf, "\r\nContent-Length:");
+            if (cl) content_length = strtoul(cl + 17, NULL, 10);
+            if (strcasestr(buf, "\r\nConnection: close")) *keep_alive = false;
+        }
+        if ((size_t)(buf + len - body) >= content_length) break;
+    }
+
+    int status = 0;
+    if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1) return -1;
+    return status;
+}
+
+// Send one request and wait for its reply. Returns false on failure.
+static bool do_request(int *fd, const char *request, size_t len, char *response) {
+    if (*fd < 0 && (*fd = connect_server()) < 0) return false;
+
+    if (mode == MODE_RAW) {
+        // One heartbeat per connection; the server answers and closes
+        bool ok = send_all(*fd, request, len);
+        ssize_t n, total = 0;
+        while (ok && (n = read(*fd, response, RESPONSE_MAX)) > 0) total += n;
+        close(*fd);
+        *fd = -1;
+        return ok && total == 2 && memcmp(response, "OK", 2) == 0;
+    }
+
+    bool keep_alive = true;
+    int status = send_all(*fd, request, len) ? read_response(*fd, response, &keep_alive) : -1;
+    if (status < 0 || !keep_alive) {
+        close(*fd);
+        *fd = -1;
+    }
+    return status == 200;
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = arg;
+    size_t request_size = HEADER_ROOM + (size_t)batch_size * RECORD_ROOM;
+    char *request = malloc(request_size);
+    char *response = malloc(RESPONSE_MAX + 1);
+    if (!request || !response) {
+        free(request);
+        free(response);
+        return NULL;
+    }
+    int fd = -1;
+
+    uint64_t due = w->first_due_ns;
+    for (uint64_t n = 0; ; n++) {
+        uint64_t now = now_ns();
+        if (w->interval_ns) {
+            if (due >= end_ns) break;
+            if (due > now) {
+                sleep_until(due);
+                now = now_ns();
+            }
+        } else {
+            if (now >= end_ns) break;
+            due = now;
+        }
+
+        size_t len = build_request(request, request_size, w->id, n);
+        uint64_t sent = now;
+        bool ok = do_request(&fd, request, len, response);
+        uint64_t done = now_ns();
+
+        w->requests++;
+        if (ok) {
+            hist_record(&w->latency, (done - due) / 1000);
+            hist_record(&w->service, (done - sent) / 1000);
+        } else {
+            w->errors++;
+        }
+        due += w->interval_ns;
+    }
+
+    if (fd >= 0) close(fd);
+    free(request);
+    free(response);
+    return NULL;
+}
+
+static void write_histogram(FILE *out, const char *name, const Histogram *h) {
+    fprintf(out,
+        "  \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+        "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+        name, (unsigned long long)h->total, h->total ? h->sum / (double)h->total : 0.0,
+        (unsigned long long)hist_percentile(h, 0.50),
+        (unsigned long long)hist_percentile(h, 0.90),
+        (unsigned long long)hist_percentile(h, 0.99),
+        (unsigned long long)hist_percentile(h, 0.999),
+        (unsigned long long)h->max);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-P port] [-c connections] [-d seconds] [-r rate]\n"
+            "          [-m json|form|batch|raw] [-b batch_size] [-l label] [-o file]\n"
+            "  -r rate   total requests per second across all connections;\n"
+            "            0 runs closed-loop as fast as replies arrive (default 1000)\n"
+            "  -m raw    one JSON heartbeat per TCP connection (use -P 8081)\n"
+            "  -l label  recorded in the results, e.g. a commit hash\n"
+            "  -o file   write the JSON results there instead of stdout\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    const char *label = "";
+    const char *output = NULL;
+    int port = 8080;
+    int connections = 16;
+    int duration = 10;
+    double rate = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:P:c:d:r:m:b:l:o:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'b': batch_size = atoi(optarg); break;
+        case 'l': label = optarg; break;
+        case 'o': output = optarg; break;
+        case 'm': {
+            int m;
+            for (m = 0; m <= MODE_RAW && strcmp(optarg, mode_names[m]) != 0; m++) {
+            }
+            if (m > MODE_RAW) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            mode = (LoadMode)m;
+            break;
+        }
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (connections < 1 || duration < 1 || rate < 0 || batch_size < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "invalid address: %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    Worker *workers = calloc((size_t)connections, sizeof(Worker));
+    if (!workers) {
+        perror("calloc failed");
+        return EXIT_FAILURE;
+    }
+
+    // Spread the connections' schedules evenly over one interval
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * connections / rate) : 0;
+    uint64_t start = now_ns() + 10000000ull;
+    end_ns = start + (uint64_t)duration * 1000000000ull;
+    int started = 0;
+    for (int i = 0; i < connections; i++) {
+        workers[i].id = i + 1;
+        workers[i].interval_ns = interval;
+        workers[i].first_due_ns = start + interval * (uint64_t)i / (uint64_t)connections;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("could not create worker thread");
+            break;
+        }
+        started++;
+    }
+
+    Histogram *latency = calloc(1, sizeof(Histogram));
+    Histogram *service = calloc(1, sizeof(Histogram));
+    if (!latency || !service) {
+        perror("calloc failed");
+        return EXIT_FAILURE;
+    }
+    uint64_t requests = 0, errors = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        hist_merge(latency, &workers[i].latency);
+        hist_merge(service, &workers[i].service);
+    }
+    // Replies to requests due near the end may land after end_ns
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    uint64_t ok = requests - errors;
+    uint64_t per_request = mode == MODE_BATCH ? (uint64_t)batch_size : 1;
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        perror("could not open output file");
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"%s\",\n", label);
+    fprintf(out, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+    fprintf(out, "  \"host\": \"%s\",\n  \"port\": %d,\n", host, port);
+    fprintf(out, "  \"mode\": \"%s\",\n", mode_names[mode]);
+    if (mode == MODE_BATCH) fprintf(out, "  \"batch_size\": %d,\n", batch_size);
+    fprintf(out, "  \"connections\": %d,\n", started);
+    fprintf(out, "  \"duration_s\": %.3f,\n", elapsed);
+    fprintf(out, "  \"target_rate\": %.1f,\n", rate);
+    fprintf(out, "  \"requests\": %llu,\n  \"errors\": %llu,\n",
+            (unsigned long long)requests, (unsigned long long)errors);
+    fprintf(out, "  \"throughput_rps\": %.1f,\n", (double)ok / elapsed);
+    fprintf(out, "  \"heartbeats_per_s\": %.1f,\n", (double)(ok * per_request) / elapsed);
+    write_histogram(out, "latency_us", latency);
+    fprintf(out, ",\n");
+    write_histogram(out, "service_time_us", service);
+    fprintf(out, "\n}\n");
+    if (output) fclose(out);
+
+    free(latency);
+    free(service);
+    free(workers);
+    return errors > 0 && ok == 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+
+#include "heartbeat_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct LogBuffer {
+    pthread_mutex_t lock;   // owner thread vs. flusher
+    size_t len;
+    struct LogBuffer *next;
+    char data[LOG_BUFFER_SIZE];
+} LogBuffer;
+
+static const char *level_names[] = { "debug", "info", "warn", "error", "off" };
+
+int log_threshold = LOG_DEFAULT_LEVEL;
+static unsigned sample_rate = LOG_DEFAULT_SAMPLE_RATE;
+static int output_fd = STDOUT_FILENO;
+static bool flusher_running = false;
+static uint64_t dropped;
+
+// Every live thread's buffer. Draining holds registry_lock throughout, so
+// the scratch copy is shared.
+static LogBuffer *registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static char scratch[LOG_BUFFER_SIZE];
+
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static pthread_t flusher_thread;
+
+static __thread LogBuffer *thread_buffer;
+static __thread unsigned sample_counter;
+static __thread time_t ts_second = -1;
+static __thread char ts_prefix[24];    // "2026-01-02T03:04:05" for ts_second
+
+static void write_all(const char *data, size_t len) {
+    int fd = __atomic_load_n(&output_fd, __ATOMIC_RELAXED);
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Thread exit: write out what is left and forget the buffer
+static void release_buffer(void *arg) {
+    LogBuffer *buf = arg;
+    pthread_mutex_lock(&registry_lock);
+    for (LogBuffer **p = &registry; *p; p = &(*p)->next) {
+        if (*p == buf) {
+            *p = buf->next;
+            break;
+        }
+    }
+    pthread_mutex_lock(&buf->lock);
+    write_all(buf->data, buf->len);
+    pthread_mutex_unlock(&buf->lock);
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_destroy(&buf->lock);
+    free(buf);
+}
+
+static void create_buffer_key(void) {
+    pthread_key_create(&buffer_key, release_buffer);
+}
+
+static LogBuffer *get_thread_buffer(void) {
+    if (thread_buffer) return thread_buffer;
+
+    pthread_once(&buffer_key_once, create_buffer_key);
+    LogBuffer *buf = malloc(sizeof(LogBuffer));
+    if (!buf) return NULL;
+    pthread_mutex_init(&buf->lock, NULL);
+    buf->len = 0;
+
+    pthread_mutex_lock(&registry_lock);
+    buf->next = registry;
+    registry = buf;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(buffer_key, buf);
+    thread_buffer = buf;
+    return buf;
+}
+
+void log_set_level(LogLevel level) {
+    __atomic_store_n(&log_threshold, (int)level, __ATOMIC_RELAXED);
+}
+
+LogLevel log_get_level(void) {
+    return (LogLevel)__atomic_load_n(&log_threshold, __ATOMIC_RELAXED);
+}
+
+bool log_parse_level(const char *name, LogLevel *level) {
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_OFF; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void log_set_sample_rate(unsigned rate) {
+    __atomic_store_n(&sample_rate, rate, __ATOMIC_RELAXED);
+}
+
+bool log_sample(void) {
+    unsigned rate = __atomic_load_n(&sample_rate, __ATOMIC_RELAXED);
+    if (rate <= 1) return true;
+    return sample_counter++ % rate == 0;
+}
+
+void log_set_output(int fd) {
+    __atomic_store_n(&output_fd, fd, __ATOMIC_RELAXED);
+}
+
+// "ts=... level=... event=... " into line; returns its length
+static size_t format_prefix(char *line, size_t size, LogLevel level, const char *event) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // gmtime_r and strftime only run once a second per thread
+    if (now.tv_sec != ts_second) {
+        struct tm tm;
+        gmtime_r(&now.tv_sec, &tm);
+        strftime(ts_prefix, sizeof(ts_prefix), "%Y-%m-%dT%H:%M:%S", &tm);
+        ts_second = now.tv_sec;
+    }
+
+    int n = snprintf(line, size, "ts=%s.%03ldZ level=%s event=%s ",
+                     ts_prefix, now.tv_nsec / 1000000, level_names[level], event);
+    if (n < 0) return 0;
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+void log_write(LogLevel level, const char *event, const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    size_t len = format_prefix(line, sizeof(line) - 1, level, event);
+
+    // Leave room for the newline; overlong records are truncated
+    size_t avail = sizeof(line) - 1 - len;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line + len, avail, fmt, args);
+    va_end(args);
+    if (n > 0) len += (size_t)n < avail ? (size_t)n : avail - 1;
+    line[len++] = '\n';
+
+    LogBuffer *buf = get_thread_buffer();
+    if (!buf) {
+        write_all(line, len);
+        return;
+    }
+
+    bool background = __atomic_load_n(&flusher_running, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&buf->lock);
+    if (buf->len + len > LOG_BUFFER_SIZE) {
+        if (background && level < LOG_LEVEL_WARN) {
+            // The flusher is behind; never stall the caller on I/O for
+            // routine records
+            pthread_mutex_unlock(&buf->lock);
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        // Failures are never dropped: write out this thread's backlog, in
+        // order, and the record after it
+        write_all(buf->data, buf->len);
+        buf->len = 0;
+    }
+    memcpy(buf->data + buf->len, line, len);
+    buf->len += len;
+    if (!background) {
+        write_all(buf->data, buf->len);
+        buf->len = 0;
+    }
+    pthread_mutex_unlock(&buf->lock);
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&registry_lock);
+    for (LogBuffer *buf = registry; buf; buf = buf->next) {
+        // Copy out so the owner only waits for a memcpy, not the write
+        pthread_mutex_lock(&buf->lock);
+        size_t len = buf->len;
+        memcpy(scratch, buf->data, len);
+        buf->len = 0;
+        pthread_mutex_unlock(&buf->lock);
+        write_all(scratch, len);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        char line[LOG_LINE_MAX];
+        size_t len = format_prefix(line, sizeof(line), LOG_LEVEL_WARN, "log_dropped");
+        len += (size_t)snprintf(line + len, sizeof(line) - len, "count=%llu\n",
+                                (unsigned long long)lost);
+        write_all(line, len);
+    }
+}
+
+static void *run_flusher(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+int log_start_flusher(void) {
+    if (__atomic_load_n(&flusher_running, __ATOMIC_ACQUIRE)) return 0;
+    if (pthread_create(&flusher_thread, NULL, run_flusher, NULL) != 0) {
+        perror("could not create log flusher thread");
+        return -1;
+    }
+    pthread_detach(flusher_thread);
+    __atomic_store_n(&flusher_running, true, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef HEARTBEAT_LOG_H
+#define HEARTBEAT_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Structured logging. Each record is one logfmt line:
+//   ts=2026-01-02T03:04:05.678Z level=info event=heartbeat key=value ...
+// Lines are formatted into a per-thread buffer and written out by a
+// background flusher, so the calling thread never blocks on stdout. If the
+// flusher falls a whole buffer behind, debug and info records are dropped
+// (and counted); warn and error records are written through instead.
+// Records below the current level cost one relaxed load: the log_* macros
+// test the level before the arguments are evaluated or formatted.
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+} LogLevel;
+
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_WARN
+#define LOG_DEFAULT_SAMPLE_RATE 100     // sampled records: 1 in N is kept
+#define LOG_BUFFER_SIZE 65536           // per thread
+#define LOG_LINE_MAX 1024
+#define LOG_FLUSH_INTERVAL_MS 200
+
+extern int log_threshold;
+
+static inline bool log_enabled(LogLevel level) {
+    return (int)level >= __atomic_load_n(&log_threshold, __ATOMIC_RELAXED);
+}
+
+void log_set_level(LogLevel level);
+LogLevel log_get_level(void);
+
+// "debug", "info", "warn", "error" or "off"
+bool log_parse_level(const char *name, LogLevel *level);
+
+// Keep one in rate of the records logged through the *_sampled macros;
+// 0 or 1 keeps them all
+void log_set_sample_rate(unsigned rate);
+
+// True once every sample-rate calls on this thread
+bool log_sample(void);
+
+// Where lines go (default stdout)
+void log_set_output(int fd);
+
+// Start the background flusher. Until it runs, every record is written
+// as soon as it is formatted.
+int log_start_flusher(void);
+
+// Write out everything buffered by every thread
+void log_flush(void);
+
+// Format and buffer one record; use the macros below instead
+void log_write(LogLevel level, const char *event, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define LOG_AT(level, event, ...) do { \
+    if (log_enabled(level)) log_write(level, event, __VA_ARGS__); \
+} while (0)
+
+#define log_debug(event, ...) LOG_AT(LOG_LEVEL_DEBUG, event, __VA_ARGS__)
+#define log_info(event, ...)  LOG_AT(LOG_LEVEL_INFO, event, __VA_ARGS__)
+#define log_warn(event, ...)  LOG_AT(LOG_LEVEL_WARN, event, __VA_ARGS__)
+#define log_error(event, ...) LOG_AT(LOG_LEVEL_ERROR, event, __VA_ARGS__)
+
+// For high-volume successes; failures should use log_warn so none are lost
+#define log_info_sampled(event, ...) do { \
+    if (log_enabled(LOG_LEVEL_INFO) && log_sample()) \
+        log_write(LOG_LEVEL_INFO, event, __VA_ARGS__); \
+} while (0)
+
+#endif /* HEARTBEAT_LOG_H */
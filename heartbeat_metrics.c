@@ -0,0 +1,194 @@
+#include "heartbeat_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct {
+    uint64_t buckets[METRICS_BUCKETS + 1];  // the last one is overflow
+    uint64_t count;
+    uint64_t sum_ns;
+} StageHistogram;
+
+// One thread's metrics. The alignment keeps two threads' shards from
+// sharing a cache line.
+typedef struct MetricsShard {
+    uint64_t counters[COUNTER_COUNT];
+    StageHistogram stages[STAGE_COUNT];
+    struct MetricsShard *next;
+} __attribute__((aligned(64))) MetricsShard;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[COUNTER_COUNT] = {
+    { "heartbeat_connections_accepted_total", "Client connections accepted." },
+    { "heartbeat_connections_closed_total", "Client connections closed." },
+    { "heartbeat_read_bytes_total", "Bytes read from client connections." },
+    { "heartbeat_written_bytes_total", "Bytes written to client connections." },
+    { "heartbeat_http_requests_total", "HTTP requests dispatched." },
+    { "heartbeat_parse_errors_total", "Malformed HTTP requests and binary frames." },
+    { "heartbeat_heartbeats_accepted_total", "Heartbeats written to history." },
+    { "heartbeat_heartbeats_rejected_total", "TCP and HTTP heartbeats that failed decoding or validation." },
+};
+
+static const char *stage_names[STAGE_COUNT] = { "accept", "read", "parse", "store", "respond" };
+
+// Live shards, plus the totals of exited threads (and of threads whose
+// shard could not be allocated, which update it atomically)
+static MetricsShard *shards;
+static MetricsShard retired;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsShard *thread_shard;
+
+static void add_relaxed(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void fold_shard(MetricsShard *into, const MetricsShard *from) {
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        __atomic_fetch_add(&into->counters[c],
+                           __atomic_load_n(&from->counters[c], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        StageHistogram *dst = &into->stages[s];
+        const StageHistogram *src = &from->stages[s];
+        for (int b = 0; b <= METRICS_BUCKETS; b++) {
+            __atomic_fetch_add(&dst->buckets[b],
+                               __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&dst->count, __atomic_load_n(&src->count, __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dst->sum_ns, __atomic_load_n(&src->sum_ns, __ATOMIC_RELAXED),
+                           __ATOMIC_RELAXED);
+    }
+}
+
+// Thread exit: keep the thread's totals, drop its shard
+static void release_shard(void *arg) {
+    MetricsShard *shard = arg;
+    pthread_mutex_lock(&registry_lock);
+    for (MetricsShard **p = &shards; *p; p = &(*p)->next) {
+        if (*p == shard) {
+            *p = shard->next;
+            break;
+        }
+    }
+    fold_shard(&retired, shard);
+    pthread_mutex_unlock(&registry_lock);
+    free(shard);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static MetricsShard *get_shard(void) {
+    if (thread_shard) return thread_shard;
+
+    pthread_once(&shard_key_once, create_shard_key);
+    MetricsShard *shard = aligned_alloc(64, sizeof(MetricsShard));
+    if (!shard) return NULL;
+    memset(shard, 0, sizeof(*shard));
+
+    pthread_mutex_lock(&registry_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(shard_key, shard);
+    thread_shard = shard;
+    return shard;
+}
+
+void metrics_add(MetricsCounter counter, uint64_t n) {
+    MetricsShard *shard = get_shard();
+    if (shard) {
+        add_relaxed(&shard->counters[counter], n);
+    } else {
+        __atomic_fetch_add(&retired.counters[counter], n, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_observe(MetricsStage stage, uint64_t start_ns) {
+    uint64_t elapsed = metrics_now() - start_ns;
+
+    // Bucket b counts samples of at most 2^(METRICS_MIN_LOG2 + b) ns
+    int bits = elapsed > 1 ? 64 - __builtin_clzll(elapsed - 1) : 0;
+    int bucket = bits - METRICS_MIN_LOG2;
+    if (bucket < 0) bucket = 0;
+    if (bucket > METRICS_BUCKETS) bucket = METRICS_BUCKETS;
+
+    MetricsShard *shard = get_shard();
+    if (shard) {
+        StageHistogram *h = &shard->stages[stage];
+        add_relaxed(&h->buckets[bucket], 1);
+        add_relaxed(&h->count, 1);
+        add_relaxed(&h->sum_ns, elapsed);
+    } else {
+        StageHistogram *h = &retired.stages[stage];
+        __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&h->sum_ns, elapsed, __ATOMIC_RELAXED);
+    }
+}
+
+// Sum every shard into total
+static void merge_shards(MetricsShard *total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&registry_lock);
+    fold_shard(total, &retired);
+    for (MetricsShard *shard = shards; shard; shard = shard->next) {
+        fold_shard(total, shard);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+uint64_t metrics_counter_total(MetricsCounter counter) {
+    MetricsShard total;
+    merge_shards(&total);
+    return total.counters[counter];
+}
+
+void metrics_render(OutputBuffer *out) {
+    MetricsShard total;
+    merge_shards(&total);
+
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        output_buffer_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                             counter_info[c].name, counter_info[c].help,
+                             counter_info[c].name, counter_info[c].name,
+                             (unsigned long long)total.counters[c]);
+    }
+
+    output_buffer_printf(out,
+        "# HELP heartbeat_stage_duration_seconds Time spent in each request stage.\n"
+        "# TYPE heartbeat_stage_duration_seconds histogram\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const StageHistogram *h = &total.stages[s];
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += h->buckets[b];
+            double le = (double)(1ull << (METRICS_MIN_LOG2 + b)) / 1e9;
+            output_buffer_printf(out,
+                "heartbeat_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                stage_names[s], le, (unsigned long long)cumulative);
+        }
+        output_buffer_printf(out,
+            "heartbeat_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+            "heartbeat_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+            "heartbeat_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+            stage_names[s], (unsigned long long)h->count,
+            stage_names[s], (double)h->sum_ns / 1e9,
+            stage_names[s], (unsigned long long)h->count);
+    }
+}
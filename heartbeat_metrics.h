@@ -0,0 +1,55 @@
+#ifndef HEARTBEAT_METRICS_H
+#define HEARTBEAT_METRICS_H
+
+#include <stdint.h>
+#include "heartbeat_server.h"
+
+// Operational counters and stage latency histograms. Every thread records
+// into its own cache-line-aligned shard with plain relaxed stores; shards are
+// only summed when /metrics is scraped, so recording never takes a lock.
+
+typedef enum {
+    COUNTER_CONNECTIONS_ACCEPTED,
+    COUNTER_CONNECTIONS_CLOSED,
+    COUNTER_BYTES_READ,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_HTTP_REQUESTS,
+    COUNTER_PARSE_ERRORS,           // malformed HTTP requests or binary frames
+    COUNTER_HEARTBEATS_ACCEPTED,    // written to history
+    COUNTER_HEARTBEATS_REJECTED,    // TCP/HTTP payloads that failed decoding or validation
+    COUNTER_COUNT
+} MetricsCounter;
+
+typedef enum {
+    STAGE_ACCEPT,       // accept through event-loop registration
+    STAGE_READ,         // one read from a client socket
+    STAGE_PARSE,        // decoding one heartbeat payload or binary frame
+    STAGE_STORE,        // one history insert (ring, segment store, series)
+    STAGE_RESPOND,      // writing buffered responses to the socket
+    STAGE_COUNT
+} MetricsStage;
+
+// Histogram buckets are powers of two of nanoseconds, from 2^7 (128 ns) to
+// 2^35 (about 34 s); slower samples only show up in +Inf
+#define METRICS_MIN_LOG2 7
+#define METRICS_BUCKETS 29
+
+void metrics_add(MetricsCounter counter, uint64_t n);
+
+static inline void metrics_inc(MetricsCounter counter) {
+    metrics_add(counter, 1);
+}
+
+// Monotonic clock in nanoseconds, for metrics_observe
+uint64_t metrics_now(void);
+
+// Record the time since start_ns (from metrics_now) against stage
+void metrics_observe(MetricsStage stage, uint64_t start_ns);
+
+// Sum of a counter over every thread, live or exited
+uint64_t metrics_counter_total(MetricsCounter counter);
+
+// Append the counters and histograms in Prometheus text format
+void metrics_render(OutputBuffer *out);
+
+#endif /* HEARTBEAT_METRICS_H */
@@ -0,0 +1,195 @@
+#include "heartbeat_ratelimit.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+typedef struct {
+    uint32_t ip;                        // network byte order; 0 marks a free slot
+    uint8_t referenced;                 // CLOCK bit, set whenever the source is seen
+    float tokens;
+    uint64_t updated;                   // ns, when tokens was last brought up to date
+} Bucket;
+
+// Counters are kept per stripe under its lock so the hot path never
+// touches a shared cache line
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t used;
+    uint32_t hand;                      // CLOCK position
+    uint64_t allowed;
+    uint64_t limited;
+    uint64_t evictions;
+    Bucket slots[RATELIMIT_STRIPE_SLOTS];
+} __attribute__((aligned(64))) Stripe;
+
+static Stripe stripes[RATELIMIT_TABLE_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+// Set once at startup, before any listener runs
+static double rate;
+static double burst;
+static RateLimitAction action;
+static char reject_response[160];
+static size_t reject_len;
+
+static void init_stripes(void) {
+    for (size_t i = 0; i < RATELIMIT_TABLE_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+}
+
+bool ratelimit_configure(double new_rate, double new_burst, RateLimitAction new_action) {
+    if (!(new_rate >= 0) || !isfinite(new_rate) || !(new_burst >= 0) || !isfinite(new_burst)) {
+        return false;
+    }
+    pthread_once(&stripes_once, init_stripes);
+    rate = new_rate;
+    burst = new_burst < 1 ? 1 : new_burst;
+    action = new_action;
+
+    // Retry once a whole token has come back
+    long retry = rate > 0 ? (long)ceil(1.0 / rate) : 1;
+    int n = snprintf(reject_response, sizeof(reject_response),
+                     "HTTP/1.1 429 Too Many Requests\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: 18\r\n"
+                     "Retry-After: %ld\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "Too Many Requests\n", retry < 1 ? 1 : retry);
+    reject_len = n > 0 && (size_t)n < sizeof(reject_response) ? (size_t)n : 0;
+    return true;
+}
+
+bool ratelimit_enabled(void) {
+    return rate > 0;
+}
+
+// Empty slot i, shifting later entries of its probe run back so lookups
+// never stop early at the hole. Caller holds the stripe's lock.
+static void remove_slot(Stripe *stripe, uint32_t i) {
+    for (uint32_t j = probe_next(i, RATELIMIT_STRIPE_SLOTS); stripe->slots[j].ip != 0;
+         j = probe_next(j, RATELIMIT_STRIPE_SLOTS)) {
+        uint32_t home = probe_start(hash_mix32(stripe->slots[j].ip), RATELIMIT_STRIPE_SLOTS);
+        // The entry at j may fill the hole unless its home lies in (i, j]
+        bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            stripe->slots[i] = stripe->slots[j];
+            i = j;
+        }
+    }
+    stripe->slots[i].ip = 0;
+    stripe->used--;
+}
+
+static bool refilled(const Bucket *bucket, uint64_t now_ns) {
+    double elapsed = now_ns > bucket->updated ? (now_ns - bucket->updated) / 1e9 : 0;
+    return bucket->tokens + elapsed * rate >= burst;
+}
+
+// Advance the CLOCK hand to a source not seen since the hand last passed
+// it, or one whose bucket is full again, and evict it
+static void evict_one(Stripe *stripe, uint64_t now_ns) {
+    for (;;) {
+        uint32_t i = stripe->hand;
+        stripe->hand = probe_next(i, RATELIMIT_STRIPE_SLOTS);
+        Bucket *bucket = &stripe->slots[i];
+        if (bucket->ip == 0) continue;
+        if (bucket->referenced && !refilled(bucket, now_ns)) {
+            bucket->referenced = 0;
+            continue;
+        }
+        remove_slot(stripe, i);
+        stripe->evictions++;
+        return;
+    }
+}
+
+// The source's bucket, creating a full one for a new source. Caller holds
+// the stripe's lock.
+static Bucket *find_bucket(Stripe *stripe, uint32_t ip, uint32_t hash, uint64_t now_ns) {
+    for (;;) {
+        for (uint32_t i = probe_start(hash, RATELIMIT_STRIPE_SLOTS);; i = probe_next(i, RATELIMIT_STRIPE_SLOTS)) {
+            Bucket *bucket = &stripe->slots[i];
+            if (bucket->ip == ip) return bucket;
+            if (bucket->ip != 0) continue;
+            if (stripe_full(stripe->used, RATELIMIT_STRIPE_SLOTS)) break;
+            stripe->used++;
+            bucket->ip = ip;
+            bucket->tokens = (float)burst;
+            bucket->updated = now_ns;
+            return bucket;
+        }
+        // Eviction shifts entries around, so probe again from the start
+        evict_one(stripe, now_ns);
+    }
+}
+
+bool ratelimit_allow(struct in_addr addr, uint64_t now_ns) {
+    if (rate <= 0) return true;
+    // 0.0.0.0 marks free slots and is never a real peer
+    uint32_t ip = addr.s_addr ? addr.s_addr : 1;
+    uint32_t hash = hash_mix32(ip);
+    Stripe *stripe = &stripes[stripe_of(hash, RATELIMIT_TABLE_STRIPES)];
+
+    pthread_mutex_lock(&stripe->lock);
+    Bucket *bucket = find_bucket(stripe, ip, hash, now_ns);
+    bucket->referenced = 1;
+    if (now_ns > bucket->updated) {
+        double tokens = bucket->tokens + (now_ns - bucket->updated) / 1e9 * rate;
+        bucket->tokens = (float)(tokens > burst ? burst : tokens);
+        bucket->updated = now_ns;
+    }
+    bool allowed = bucket->tokens >= 1.0f;
+    if (allowed) {
+        bucket->tokens -= 1.0f;
+        stripe->allowed++;
+    } else {
+        stripe->limited++;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return allowed;
+}
+
+bool ratelimit_admit(int fd, const struct sockaddr_in *peer, int port, uint64_t now_ns) {
+    if (ratelimit_allow(peer->sin_addr, now_ns)) return true;
+    // Only the HTTP port has a way to say why; the request is never read
+    if (action == RATELIMIT_REJECT && port == HTTP_PORT && reject_len > 0) {
+        ssize_t sent = send(fd, reject_response, reject_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        (void)sent;
+    }
+    close(fd);
+    return false;
+}
+
+void ratelimit_get_stats(RateLimitStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_once(&stripes_once, init_stripes);
+    for (size_t i = 0; i < RATELIMIT_TABLE_STRIPES; i++) {
+        Stripe *stripe = &stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        stats->sources += stripe->used;
+        stats->allowed += stripe->allowed;
+        stats->limited += stripe->limited;
+        stats->evictions += stripe->evictions;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+void ratelimit_clear(void) {
+    pthread_once(&stripes_once, init_stripes);
+    for (size_t i = 0; i < RATELIMIT_TABLE_STRIPES; i++) {
+        Stripe *stripe = &stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        memset(stripe->slots, 0, sizeof(stripe->slots));
+        stripe->used = 0;
+        stripe->hand = 0;
+        stripe->allowed = 0;
+        stripe->limited = 0;
+        stripe->evictions = 0;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
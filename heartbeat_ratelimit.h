@@ -0,0 +1,55 @@
+#ifndef HEARTBEAT_RATELIMIT_H
+#define HEARTBEAT_RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "heartbeat_server.h"
+#include "heartbeat_hash.h"
+
+// Per-source admission control. Every source IPv4 address has a token
+// bucket refilled at rate tokens per second up to burst; each accepted
+// connection or UDP datagram takes one token, and a source with none left
+// is refused before anything is read from it. Buckets live in a fixed
+// striped table of open-addressed slots; when a stripe fills up, a CLOCK
+// hand evicts a source that has not been seen since its last pass (or whose
+// bucket has refilled, which loses nothing).
+
+#define RATELIMIT_TABLE_STRIPES 64
+#define RATELIMIT_STRIPE_SLOTS 1024     // power of two
+#define RATELIMIT_MAX_SOURCES (RATELIMIT_TABLE_STRIPES * STRIPE_LOAD_LIMIT(RATELIMIT_STRIPE_SLOTS))
+
+typedef enum {
+    RATELIMIT_REJECT,                   // answer HTTP connections with 429, close others
+    RATELIMIT_DROP                      // close without a response
+} RateLimitAction;
+
+typedef struct {
+    uint64_t sources;                   // buckets in the table
+    uint64_t allowed;
+    uint64_t limited;                   // connections and datagrams refused
+    uint64_t evictions;
+} RateLimitStats;
+
+// Limit every source to rate per second with bursts of up to burst (at
+// least 1). A rate of 0 turns the limit off. False if the values are invalid.
+bool ratelimit_configure(double rate, double burst, RateLimitAction action);
+
+bool ratelimit_enabled(void);
+
+// Take a token from addr's bucket at now_ns (from metrics_now). False when
+// the source is over its limit.
+bool ratelimit_allow(struct in_addr addr, uint64_t now_ns);
+
+// Admission check for a freshly accepted socket on port. When peer is over
+// its limit the socket is answered or dropped per the configured action,
+// closed, and false is returned.
+bool ratelimit_admit(int fd, const struct sockaddr_in *peer, int port, uint64_t now_ns);
+
+void ratelimit_get_stats(RateLimitStats *stats);
+
+// Forget every source and zero the counters (for testing)
+void ratelimit_clear(void);
+
+#endif /* HEARTBEAT_RATELIMIT_H */
@@ -0,0 +1,715 @@
+#include "heartbeat_rules.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+typedef enum { OP_GT, OP_GE, OP_LT, OP_LE, OP_EQ, OP_NE } RuleOp;
+
+static const char *const op_names[] = { ">", ">=", "<", "<=", "==", "!=" };
+
+// One condition; a rule's terms are consecutive and the last one is marked
+typedef struct {
+    double threshold;
+    uint8_t metric;
+    uint8_t op;
+    bool last;
+} RuleTerm;
+
+// Rules [first, first + count) share this network
+typedef struct {
+    uint32_t net;                       // host byte order
+    uint32_t first;
+    uint32_t count;
+} PrefixEntry;
+
+// Every network of one prefix length, sorted for binary search
+typedef struct {
+    uint32_t mask;
+    size_t count;
+    PrefixEntry *entries;
+} PrefixGroup;
+
+// A compiled rule set. Rules are numbered in (prefix length, network, file
+// line) order so each network's rules are a contiguous range.
+typedef struct {
+    size_t rules;
+    RuleTerm *terms;
+    uint32_t *term_first;               // per rule
+    uint32_t *need;                     // consecutive samples
+    uint32_t *cooldown;                 // seconds
+    char (*names)[RULES_NAME_LEN];
+    size_t group_count;
+    PrefixGroup groups[33];             // one per prefix length in use
+} RuleProgram;
+
+// A rule as parsed, before it is laid out in the program
+typedef struct {
+    char name[RULES_NAME_LEN];
+    RuleTerm terms[RULES_MAX_TERMS];
+    size_t term_count;
+    uint32_t need;
+    uint32_t cooldown;
+    uint32_t net;
+    int prefix_len;
+    size_t line;
+} ParsedRule;
+
+static RuleProgram *program;           // NULL when no rules are loaded
+static pthread_rwlock_t program_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Per-(rule, host) state, striped by host so a heartbeat takes one lock.
+// The arrays are parallel; a key of 0 marks a free slot.
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t used;
+    uint64_t keys[RULES_STRIPE_SLOTS];  // (rule + 1) << 32 | ip
+    uint32_t count[RULES_STRIPE_SLOTS]; // consecutive matches, saturating
+    uint32_t fired[RULES_STRIPE_SLOTS]; // time of the last firing, 0 for never
+    bool alerted[RULES_STRIPE_SLOTS];   // the current excursion has fired
+} Stripe;
+
+static Stripe stripes[RULES_TABLE_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static RuleEvent event_log[RULES_LOG_CAPACITY];
+static uint64_t event_head;             // events ever logged
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The alert file is appended to by its own thread, never on ingest.
+// file_mutex is held across the writes; event_mutex only to copy events out.
+static FILE *event_file;
+static uint64_t event_written;          // event_log position the file has reached
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool writer_running;
+
+static uint64_t evaluated;
+static uint64_t fired;
+static uint64_t state_total;
+static uint64_t untracked;
+static uint64_t file_errors;
+
+static void init_stripes(void) {
+    for (size_t i = 0; i < RULES_TABLE_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    }
+}
+
+static void reset_state(void) {
+    pthread_once(&stripes_once, init_stripes);
+    for (size_t i = 0; i < RULES_TABLE_STRIPES; i++) {
+        Stripe *stripe = &stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        memset(stripe->keys, 0, sizeof(stripe->keys));
+        memset(stripe->count, 0, sizeof(stripe->count));
+        memset(stripe->fired, 0, sizeof(stripe->fired));
+        memset(stripe->alerted, 0, sizeof(stripe->alerted));
+        stripe->used = 0;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    __atomic_store_n(&state_total, 0, __ATOMIC_RELAXED);
+}
+
+static void free_program(RuleProgram *p) {
+    if (!p) return;
+    for (size_t g = 0; g < p->group_count; g++) free(p->groups[g].entries);
+    free(p->terms);
+    free(p->term_first);
+    free(p->need);
+    free(p->cooldown);
+    free(p->names);
+    free(p);
+}
+
+static bool parse_uint(const char *token, uint32_t max, uint32_t *out) {
+    char *end;
+    unsigned long v = strtoul(token, &end, 10);
+    if (end == token || *end || token[0] == '-' || v > max) return false;
+    *out = (uint32_t)v;
+    return true;
+}
+
+static bool parse_prefix(const char *token, uint32_t *net, int *len) {
+    char addr[MAX_IP_LEN];
+    const char *slash = strchr(token, '/');
+    size_t addr_len = slash ? (size_t)(slash - token) : strlen(token);
+    if (addr_len >= sizeof(addr)) return false;
+    memcpy(addr, token, addr_len);
+    addr[addr_len] = '\0';
+
+    struct in_addr in;
+    if (inet_pton(AF_INET, addr, &in) != 1) return false;
+    uint32_t bits = 32;
+    if (slash && !parse_uint(slash + 1, 32, &bits)) return false;
+    uint32_t mask = bits ? ~0u << (32 - bits) : 0;
+    *net = ntohl(in.s_addr) & mask;
+    *len = (int)bits;
+    return true;
+}
+
+static int find_metric(const char *name) {
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        if (strcmp(name, metric_names[m]) == 0) return m;
+    }
+    return -1;
+}
+
+static int find_op(const char *name) {
+    for (size_t i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++) {
+        if (strcmp(name, op_names[i]) == 0) return (int)i;
+    }
+    return -1;
+}
+
+// Parse one line into rule. Returns 1 for a rule, 0 for a blank line and
+// -1 with err set on a syntax error.
+static int parse_line(char *line, ParsedRule *rule, char *err, size_t err_size) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char *tokens[4 * RULES_MAX_TERMS + 8];
+    size_t n = 0;
+    char *save;
+    for (char *tok = strtok_r(line, " \t\r", &save); tok; tok = strtok_r(NULL, " \t\r", &save)) {
+        if (n == sizeof(tokens) / sizeof(tokens[0])) {
+            snprintf(err, err_size, "too many tokens");
+            return -1;
+        }
+        tokens[n++] = tok;
+    }
+    if (n == 0) return 0;
+
+    memset(rule, 0, sizeof(*rule));
+    rule->need = 1;
+    if (strlen(tokens[0]) >= RULES_NAME_LEN) {
+        snprintf(err, err_size, "rule name longer than %d bytes", RULES_NAME_LEN - 1);
+        return -1;
+    }
+    strcpy(rule->name, tokens[0]);
+
+    size_t i = 1;
+    for (;;) {
+        if (i + 3 > n) {
+            snprintf(err, err_size, "expected <metric> <op> <value>");
+            return -1;
+        }
+        if (rule->term_count == RULES_MAX_TERMS) {
+            snprintf(err, err_size, "more than %d conditions", RULES_MAX_TERMS);
+            return -1;
+        }
+        int metric = find_metric(tokens[i]);
+        int op = find_op(tokens[i + 1]);
+        char *end;
+        double threshold = strtod(tokens[i + 2], &end);
+        if (metric < 0) {
+            snprintf(err, err_size, "unknown metric '%s'", tokens[i]);
+            return -1;
+        }
+        if (op < 0) {
+            snprintf(err, err_size, "unknown operator '%s'", tokens[i + 1]);
+            return -1;
+        }
+        if (end == tokens[i + 2] || *end || !isfinite(threshold)) {
+            snprintf(err, err_size, "bad threshold '%s'", tokens[i + 2]);
+            return -1;
+        }
+        RuleTerm *term = &rule->terms[rule->term_count++];
+        term->metric = (uint8_t)metric;
+        term->op = (uint8_t)op;
+        term->threshold = threshold;
+        i += 3;
+        if (i < n && strcmp(tokens[i], "and") == 0) {
+            i++;
+            continue;
+        }
+        break;
+    }
+    rule->terms[rule->term_count - 1].last = true;
+
+    while (i < n) {
+        const char *keyword = tokens[i];
+        const char *arg = i + 1 < n ? tokens[i + 1] : NULL;
+        bool ok;
+        if (strcmp(keyword, "for") == 0) {
+            ok = arg && parse_uint(arg, UINT32_MAX - 1, &rule->need) && rule->need > 0;
+        } else if (strcmp(keyword, "in") == 0) {
+            ok = arg && parse_prefix(arg, &rule->net, &rule->prefix_len);
+        } else if (strcmp(keyword, "cooldown") == 0) {
+            ok = arg && parse_uint(arg, UINT32_MAX, &rule->cooldown);
+        } else {
+            snprintf(err, err_size, "unexpected '%s'", keyword);
+            return -1;
+        }
+        if (!ok) {
+            snprintf(err, err_size, "bad value for '%s'", keyword);
+            return -1;
+        }
+        i += 2;
+    }
+    return 1;
+}
+
+static int compare_rules(const void *a, const void *b) {
+    const ParsedRule *x = a;
+    const ParsedRule *y = b;
+    if (x->prefix_len != y->prefix_len) return x->prefix_len < y->prefix_len ? -1 : 1;
+    if (x->net != y->net) return x->net < y->net ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// Lay the sorted rules out in flat arrays and build the prefix index
+static RuleProgram *build_program(const ParsedRule *parsed, size_t count) {
+    RuleProgram *p = calloc(1, sizeof(RuleProgram));
+    if (!p) return NULL;
+    size_t term_count = 0;
+    for (size_t r = 0; r < count; r++) term_count += parsed[r].term_count;
+
+    p->rules = count;
+    p->terms = malloc((term_count ? term_count : 1) * sizeof(RuleTerm));
+    p->term_first = malloc((count ? count : 1) * sizeof(uint32_t));
+    p->need = malloc((count ? count : 1) * sizeof(uint32_t));
+    p->cooldown = malloc((count ? count : 1) * sizeof(uint32_t));
+    p->names = malloc((count ? count : 1) * RULES_NAME_LEN);
+    if (!p->terms || !p->term_first || !p->need || !p->cooldown || !p->names) {
+        free_program(p);
+        return NULL;
+    }
+
+    size_t t = 0;
+    for (size_t r = 0; r < count; r++) {
+        const ParsedRule *rule = &parsed[r];
+        p->term_first[r] = (uint32_t)t;
+        memcpy(&p->terms[t], rule->terms, rule->term_count * sizeof(RuleTerm));
+        t += rule->term_count;
+        p->need[r] = rule->need;
+        p->cooldown[r] = rule->cooldown;
+        memcpy(p->names[r], rule->name, RULES_NAME_LEN);
+
+        // Sorting put each prefix length's rules together, networks ascending
+        bool new_group = r == 0 || rule->prefix_len != parsed[r - 1].prefix_len;
+        if (new_group) {
+            size_t end = r;
+            size_t networks = 0;
+            for (; end < count && parsed[end].prefix_len == rule->prefix_len; end++) {
+                if (end == r || parsed[end].net != parsed[end - 1].net) networks++;
+            }
+            PrefixGroup *group = &p->groups[p->group_count++];
+            group->mask = rule->prefix_len ? ~0u << (32 - rule->prefix_len) : 0;
+            group->entries = malloc(networks * sizeof(PrefixEntry));
+            if (!group->entries) {
+                free_program(p);
+                return NULL;
+            }
+        }
+        PrefixGroup *group = &p->groups[p->group_count - 1];
+        if (new_group || rule->net != parsed[r - 1].net) {
+            group->entries[group->count++] = (PrefixEntry){ rule->net, (uint32_t)r, 0 };
+        }
+        group->entries[group->count - 1].count++;
+    }
+    return p;
+}
+
+int rules_compile(const char *text, char *err, size_t err_size) {
+    char *copy = strdup(text);
+    size_t cap = 64;
+    size_t count = 0;
+    ParsedRule *parsed = malloc(cap * sizeof(ParsedRule));
+    if (!copy || !parsed) {
+        snprintf(err, err_size, "out of memory");
+        free(copy);
+        free(parsed);
+        return -1;
+    }
+
+    size_t line_no = 0;
+    char *save;
+    int result = 0;
+    // strtok_r would merge blank lines and throw off the line numbers
+    for (char *line = copy; line; line = save) {
+        save = strchr(line, '\n');
+        if (save) *save++ = '\0';
+        line_no++;
+
+        if (count == cap) {
+            ParsedRule *grown = realloc(parsed, cap * 2 * sizeof(ParsedRule));
+            if (!grown) {
+                snprintf(err, err_size, "out of memory");
+                result = -1;
+                break;
+            }
+            parsed = grown;
+            cap *= 2;
+        }
+        char reason[128];
+        int parsed_line = parse_line(line, &parsed[count], reason, sizeof(reason));
+        if (parsed_line < 0) {
+            snprintf(err, err_size, "line %zu: %s", line_no, reason);
+            result = -1;
+            break;
+        }
+        if (parsed_line == 0) continue;
+        if (count == RULES_MAX_RULES) {
+            snprintf(err, err_size, "line %zu: more than %d rules", line_no, RULES_MAX_RULES);
+            result = -1;
+            break;
+        }
+        parsed[count].line = line_no;
+        count++;
+    }
+    free(copy);
+
+    RuleProgram *compiled = NULL;
+    if (result == 0) {
+        qsort(parsed, count, sizeof(ParsedRule), compare_rules);
+        compiled = build_program(parsed, count);
+        if (!compiled) {
+            snprintf(err, err_size, "out of memory");
+            result = -1;
+        }
+    }
+    free(parsed);
+    if (result != 0) return -1;
+
+    // Rule numbers change with the program, so the old state means nothing
+    pthread_rwlock_wrlock(&program_lock);
+    RuleProgram *old = program;
+    __atomic_store_n(&program, compiled, __ATOMIC_RELEASE);
+    reset_state();
+    pthread_rwlock_unlock(&program_lock);
+    free_program(old);
+    return 0;
+}
+
+int rules_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("rules file open failed");
+        return -1;
+    }
+    OutputBuffer text;
+    output_buffer_init(&text);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (!output_buffer_append(&text, chunk, n)) break;
+    }
+    bool failed = ferror(file) || !output_buffer_append(&text, "", 1);
+    fclose(file);
+    if (failed) {
+        fprintf(stderr, "Failed to read rules file %s\n", path);
+        output_buffer_free(&text);
+        return -1;
+    }
+
+    char err[256];
+    int result = rules_compile(text.data, err, sizeof(err));
+    if (result != 0) fprintf(stderr, "%s: %s\n", path, err);
+    output_buffer_free(&text);
+    return result;
+}
+
+static bool write_event(FILE *file, const RuleEvent *event) {
+    OutputBuffer line;
+    output_buffer_init(&line);
+    output_buffer_printf(&line, "{\"timestamp\":%lld,\"rule\":", (long long)event->timestamp);
+    output_buffer_append_json_string(&line, event->rule);
+    output_buffer_append(&line, ",\"host\":", 8);
+    output_buffer_append_json_string(&line, event->local_ip);
+    output_buffer_append(&line, ",\"hostname\":", 12);
+    output_buffer_append_json_string(&line, event->hostname);
+    output_buffer_printf(&line, ",\"samples\":%u", event->samples);
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        output_buffer_printf(&line, ",\"%s\":%.15g", metric_names[m], event->values[m]);
+    }
+    bool ok = output_buffer_append(&line, "}\n", 2) &&
+              fwrite(line.data, 1, line.len, file) == line.len;
+    output_buffer_free(&line);
+    return ok;
+}
+
+void rules_flush_events(void) {
+    pthread_mutex_lock(&file_mutex);
+    if (!event_file) {
+        pthread_mutex_unlock(&file_mutex);
+        return;
+    }
+    RuleEvent batch[32];
+    uint64_t errors = 0;
+    for (;;) {
+        pthread_mutex_lock(&event_mutex);
+        // Firings the ring overwrote before they could be written are lost
+        uint64_t first = event_head > RULES_LOG_CAPACITY ? event_head - RULES_LOG_CAPACITY : 0;
+        if (event_written < first) {
+            errors += first - event_written;
+            event_written = first;
+        }
+        size_t n = 0;
+        while (n < sizeof(batch) / sizeof(batch[0]) && event_written + n < event_head) {
+            batch[n] = event_log[(event_written + n) % RULES_LOG_CAPACITY];
+            n++;
+        }
+        pthread_mutex_unlock(&event_mutex);
+        if (n == 0) break;
+
+        for (size_t i = 0; i < n; i++) {
+            if (!write_event(event_file, &batch[i])) errors++;
+        }
+        event_written += n;
+    }
+    if (fflush(event_file) != 0) errors++;
+    pthread_mutex_unlock(&file_mutex);
+    if (errors) __atomic_fetch_add(&file_errors, errors, __ATOMIC_RELAXED);
+}
+
+static void *run_writer(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, RULES_FLUSH_INTERVAL_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        rules_flush_events();
+    }
+    return NULL;
+}
+
+int rules_set_event_file(const char *path) {
+    FILE *file = NULL;
+    if (path) {
+        file = fopen(path, "a");
+        if (!file) {
+            perror("alert file open failed");
+            return -1;
+        }
+        if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, run_writer, NULL) != 0) {
+                perror("could not create alert writer thread");
+                fclose(file);
+                return -1;
+            }
+            pthread_detach(thread);
+            __atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+        }
+    }
+    // Finish the old file, then start the new one at the next firing
+    rules_flush_events();
+    pthread_mutex_lock(&file_mutex);
+    FILE *old = event_file;
+    event_file = file;
+    pthread_mutex_lock(&event_mutex);
+    event_written = event_head;
+    pthread_mutex_unlock(&event_mutex);
+    pthread_mutex_unlock(&file_mutex);
+    if (old) fclose(old);
+    return 0;
+}
+
+// Record firings in the ring; the writer thread appends them to the file
+static void log_events(const RuleEvent *events, size_t count) {
+    pthread_mutex_lock(&event_mutex);
+    for (size_t i = 0; i < count; i++) {
+        event_log[event_head++ % RULES_LOG_CAPACITY] = events[i];
+    }
+    pthread_mutex_unlock(&event_mutex);
+    __atomic_fetch_add(&fired, count, __ATOMIC_RELAXED);
+}
+
+// Firings collected while the locks are held, logged once they are released
+typedef struct {
+    RuleEvent *items;
+    size_t count;
+    size_t capacity;
+    RuleEvent local[16];                // enough for nearly every heartbeat
+} EventList;
+
+static RuleEvent *event_list_add(EventList *list) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity * 2;
+        RuleEvent *items = list->items == list->local
+            ? malloc(capacity * sizeof(RuleEvent))
+            : realloc(list->items, capacity * sizeof(RuleEvent));
+        if (!items) return NULL;
+        if (list->items == list->local) memcpy(items, list->local, sizeof(list->local));
+        list->items = items;
+        list->capacity = capacity;
+    }
+    return &list->items[list->count++];
+}
+
+static bool term_holds(const RuleTerm *term, const double values[METRIC_COUNT]) {
+    double v = values[term->metric];
+    switch (term->op) {
+    case OP_GT: return v > term->threshold;
+    case OP_GE: return v >= term->threshold;
+    case OP_LT: return v < term->threshold;
+    case OP_LE: return v <= term->threshold;
+    case OP_EQ: return v == term->threshold;
+    default:    return v != term->threshold;
+    }
+}
+
+static bool rule_holds(const RuleProgram *p, size_t r, const double values[METRIC_COUNT]) {
+    for (const RuleTerm *term = &p->terms[p->term_first[r]];; term++) {
+        if (!term_holds(term, values)) return false;
+        if (term->last) return true;
+    }
+}
+
+// The pair's slot, claiming a free one when claim is set; -1 if it has none
+// or the stripe is full. Caller holds the stripe's lock.
+static long find_state(Stripe *stripe, uint64_t key, bool claim) {
+    uint32_t hash = hash_mix32((uint32_t)key ^ (uint32_t)(key >> 32) * 0x9e3779b9u);
+    for (uint32_t i = probe_start(hash, RULES_STRIPE_SLOTS);; i = probe_next(i, RULES_STRIPE_SLOTS)) {
+        if (stripe->keys[i] == key) return i;
+        if (stripe->keys[i] != 0) continue;
+        if (!claim || stripe_full(stripe->used, RULES_STRIPE_SLOTS)) return -1;
+        stripe->used++;
+        __atomic_fetch_add(&state_total, 1, __ATOMIC_RELAXED);
+        stripe->keys[i] = key;
+        stripe->count[i] = 0;
+        stripe->fired[i] = 0;
+        stripe->alerted[i] = false;
+        return i;
+    }
+}
+
+static const PrefixEntry *find_network(const PrefixGroup *group, uint32_t net) {
+    size_t lo = 0;
+    size_t hi = group->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (group->entries[mid].net < net) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < group->count && group->entries[lo].net == net ? &group->entries[lo] : NULL;
+}
+
+// Evaluate rules [first, first + count) for one host, collecting firings
+static void evaluate_range(const RuleProgram *p, Stripe *stripe, uint32_t first, uint32_t count,
+                           uint32_t ip, const HeartbeatData *data, time_t timestamp,
+                           const double values[METRIC_COUNT], EventList *events) {
+    for (uint32_t r = first; r < first + count; r++) {
+        bool holds = rule_holds(p, r, values);
+        uint64_t key = (uint64_t)(r + 1) << 32 | ip;
+        long slot = find_state(stripe, key, holds);
+        if (slot < 0) {
+            if (holds) __atomic_fetch_add(&untracked, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!holds) {
+            stripe->count[slot] = 0;
+            stripe->alerted[slot] = false;
+            continue;
+        }
+        if (stripe->alerted[slot]) continue;
+        if (stripe->count[slot] < UINT32_MAX) stripe->count[slot]++;
+        if (stripe->count[slot] < p->need[r]) continue;
+
+        // An excursion that starts inside the cooldown fires once it ends
+        uint32_t last = stripe->fired[slot];
+        if (last != 0 && timestamp - (time_t)last < (time_t)p->cooldown[r]) continue;
+        // Without room for the event the pair stays unfired and tries again
+        RuleEvent *event = event_list_add(events);
+        if (!event) continue;
+        stripe->fired[slot] = (uint32_t)timestamp;
+        stripe->alerted[slot] = true;
+
+        event->timestamp = timestamp;
+        memcpy(event->rule, p->names[r], RULES_NAME_LEN);
+        memcpy(event->local_ip, data->local_ip, MAX_IP_LEN);
+        memcpy(event->hostname, data->hostname, MAX_HOSTNAME_LEN);
+        event->samples = stripe->count[slot];
+        memcpy(event->values, values, sizeof(event->values));
+    }
+}
+
+size_t rules_evaluate(const HeartbeatData *data, time_t timestamp) {
+    if (!__atomic_load_n(&program, __ATOMIC_RELAXED)) return 0;
+    struct in_addr addr;
+    if (inet_pton(AF_INET, data->local_ip, &addr) != 1) return 0;
+    uint32_t ip = ntohl(addr.s_addr);
+
+    double values[METRIC_COUNT];
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        values[m] = heartbeat_metric_value(data, (HeartbeatMetric)m);
+    }
+
+    EventList events;
+    events.items = events.local;
+    events.count = 0;
+    events.capacity = sizeof(events.local) / sizeof(events.local[0]);
+    size_t evaluated_here = 0;
+    Stripe *stripe = &stripes[stripe_of(hash_mix32(ip), RULES_TABLE_STRIPES)];
+
+    pthread_rwlock_rdlock(&program_lock);
+    const RuleProgram *p = program;
+    if (p) {
+        pthread_mutex_lock(&stripe->lock);
+        for (size_t g = 0; g < p->group_count; g++) {
+            const PrefixGroup *group = &p->groups[g];
+            const PrefixEntry *entry = find_network(group, ip & group->mask);
+            if (!entry) continue;
+            evaluated_here += entry->count;
+            evaluate_range(p, stripe, entry->first, entry->count, ip, data, timestamp,
+                           values, &events);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    pthread_rwlock_unlock(&program_lock);
+
+    size_t fired_here = events.count;
+    if (fired_here > 0) log_events(events.items, fired_here);
+    if (events.items != events.local) free(events.items);
+    if (evaluated_here) __atomic_fetch_add(&evaluated, evaluated_here, __ATOMIC_RELAXED);
+    return fired_here;
+}
+
+size_t rules_recent(const char *rule, const char *host, RuleEvent *out, size_t max) {
+    size_t n = 0;
+    pthread_mutex_lock(&event_mutex);
+    uint64_t first = event_head > RULES_LOG_CAPACITY ? event_head - RULES_LOG_CAPACITY : 0;
+    for (uint64_t i = event_head; i > first && n < max; i--) {
+        const RuleEvent *event = &event_log[(i - 1) % RULES_LOG_CAPACITY];
+        if (rule && strcmp(rule, event->rule) != 0) continue;
+        if (host && strcmp(host, event->local_ip) != 0 && strcmp(host, event->hostname) != 0) {
+            continue;
+        }
+        out[n++] = *event;
+    }
+    pthread_mutex_unlock(&event_mutex);
+    return n;
+}
+
+void rules_get_stats(RulesStats *stats) {
+    pthread_rwlock_rdlock(&program_lock);
+    stats->rules = program ? program->rules : 0;
+    pthread_rwlock_unlock(&program_lock);
+    stats->evaluated = __atomic_load_n(&evaluated, __ATOMIC_RELAXED);
+    stats->fired = __atomic_load_n(&fired, __ATOMIC_RELAXED);
+    stats->states = __atomic_load_n(&state_total, __ATOMIC_RELAXED);
+    stats->untracked = __atomic_load_n(&untracked, __ATOMIC_RELAXED);
+    stats->file_errors = __atomic_load_n(&file_errors, __ATOMIC_RELAXED);
+}
+
+void rules_clear(void) {
+    pthread_rwlock_wrlock(&program_lock);
+    RuleProgram *old = program;
+    __atomic_store_n(&program, NULL, __ATOMIC_RELEASE);
+    reset_state();
+    pthread_rwlock_unlock(&program_lock);
+    free_program(old);
+
+    pthread_mutex_lock(&file_mutex);
+    pthread_mutex_lock(&event_mutex);
+    event_head = 0;
+    event_written = 0;
+    pthread_mutex_unlock(&event_mutex);
+    pthread_mutex_unlock(&file_mutex);
+    __atomic_store_n(&evaluated, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fired, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&untracked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&file_errors, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+#ifndef HEARTBEAT_RULES_H
+#define HEARTBEAT_RULES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+#include "heartbeat_hash.h"
+
+// Threshold alert rules evaluated on ingest. A rules file holds one rule per
+// line; blank lines and text after '#' are ignored:
+//
+//   <name> <metric> <op> <value> [and <metric> <op> <value>]...
+//          [for <samples>] [in <a.b.c.d/len>] [cooldown <seconds>]
+//
+//   hot_rack   cpu_usage > 90 for 3 in 10.1.0.0/16
+//   slow_hot   cpu_usage > 80 and latency >= 500 for 2 cooldown 300
+//
+// op is one of > >= < <= == !=. A rule fires for a host when its conditions
+// have held for that many consecutive heartbeats (default 1), once per
+// excursion and at most once per cooldown (default 0); an excursion still
+// going when the cooldown ends fires then. Rules are compiled into a flat
+// array of terms and indexed by host prefix, so a heartbeat only evaluates
+// the rules whose prefix contains its local_ip. The consecutive count and
+// last fire time of each (rule, host) pair live in a fixed striped table of
+// flat arrays, created the first time the rule's conditions hold.
+
+#define RULES_MAX_RULES 65536
+#define RULES_MAX_TERMS 8               // conditions per rule
+#define RULES_NAME_LEN 64
+#define RULES_TABLE_STRIPES 64
+#define RULES_STRIPE_SLOTS 4096         // power of two
+#define RULES_MAX_STATES (RULES_TABLE_STRIPES * STRIPE_LOAD_LIMIT(RULES_STRIPE_SLOTS))
+#define RULES_LOG_CAPACITY 1024         // firings kept for the endpoint
+#define RULES_FLUSH_INTERVAL_MS 200     // alert file writer period
+
+// One rule firing
+typedef struct {
+    time_t timestamp;
+    char rule[RULES_NAME_LEN];
+    char local_ip[MAX_IP_LEN];
+    char hostname[MAX_HOSTNAME_LEN];
+    uint32_t samples;                   // consecutive heartbeats that matched
+    double values[METRIC_COUNT];        // the heartbeat that fired it
+} RuleEvent;
+
+typedef struct {
+    uint64_t rules;
+    uint64_t evaluated;                 // rule evaluations on ingest
+    uint64_t fired;
+    uint64_t states;                    // (rule, host) pairs with state
+    uint64_t untracked;                 // evaluations the state table had no room for
+    uint64_t file_errors;               // firings that could not be appended to the file
+} RulesStats;
+
+// Compile rules from text and replace the loaded rules, resetting all
+// per-host state. On a syntax error the loaded rules are kept, -1 is
+// returned and err describes the first bad line.
+int rules_compile(const char *text, char *err, size_t err_size);
+
+// Read and compile a rules file; errors are reported on stderr
+int rules_load(const char *path);
+
+// Append every firing to path as one JSON object per line (NULL to stop).
+// A writer thread appends every RULES_FLUSH_INTERVAL_MS; firings it falls
+// more than RULES_LOG_CAPACITY behind on count as file errors.
+int rules_set_event_file(const char *path);
+
+// Append the firings not yet in the alert file now
+void rules_flush_events(void);
+
+// Evaluate the rules that cover one heartbeat. Returns the number that fired.
+size_t rules_evaluate(const HeartbeatData *data, time_t timestamp);
+
+// Copy up to max of the most recent firings, newest first, that match rule
+// and host (a local_ip or hostname); NULL matches any. Returns the count.
+size_t rules_recent(const char *rule, const char *host, RuleEvent *out, size_t max);
+
+void rules_get_stats(RulesStats *stats);
+
+// Unload every rule and forget all state and firings (for testing)
+void rules_clear(void);
+
+#endif /* HEARTBEAT_RULES_H */
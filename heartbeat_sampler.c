@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include "heartbeat_sampler.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+// Re-read a whole /proc file from the start into buf, NUL-terminated
+static ssize_t read_proc(int fd, char *buf, size_t size) {
+    ssize_t n;
+    do {
+        n = pread(fd, buf, size - 1, 0);
+    } while (n < 0 && errno == EINTR);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+static const char *scan_u64(const char *p, uint64_t *out) {
+    while (*p == ' ') p++;
+    if (*p < '0' || *p > '9') return NULL;
+    uint64_t v = 0;
+    while (*p >= '0' && *p <= '9') v = v * 10 + (uint64_t)(*p++ - '0');
+    *out = v;
+    return p;
+}
+
+static const char *next_line(const char *p) {
+    p = strchr(p, '\n');
+    return p ? p + 1 : NULL;
+}
+
+// Parse the cpu lines at the top of /proc/stat:
+//   cpu  user nice system idle iowait irq softirq steal guest guest_nice
+// guest time is already counted in user. Returns the number of cores (one
+// past the highest cpuN seen), or -1 without the aggregate line.
+static int parse_stat(const char *p, CpuTimes *total, CpuTimes *cores) {
+    int core_count = 0;
+    bool have_total = false;
+    while (p && p[0] == 'c' && p[1] == 'p' && p[2] == 'u') {
+        p += 3;
+        CpuTimes *dst = NULL;
+        if (*p == ' ') {
+            dst = total;
+            have_total = true;
+        } else {
+            uint64_t cpu;
+            if (!(p = scan_u64(p, &cpu))) break;
+            if (cpu < SAMPLER_MAX_CPUS) {
+                dst = &cores[cpu];
+                if ((int)cpu >= core_count) core_count = (int)cpu + 1;
+            }
+        }
+
+        uint64_t fields[8] = {0};
+        int n = 0;
+        for (const char *q; n < 8 && (q = scan_u64(p, &fields[n])); n++) p = q;
+        if (dst && n >= 4) {
+            uint64_t sum = 0;
+            for (int i = 0; i < n; i++) sum += fields[i];
+            dst->total = sum;
+            dst->busy = sum - fields[3] - fields[4];
+        }
+        p = next_line(p);
+    }
+    return have_total ? core_count : -1;
+}
+
+// Percent busy between two readings; false if no clock tick passed
+static bool busy_percent(const CpuTimes *now, const CpuTimes *prev, double *out) {
+    if (now->total <= prev->total) return false;
+    uint64_t busy = now->busy > prev->busy ? now->busy - prev->busy : 0;
+    *out = (double)busy / (double)(now->total - prev->total) * 100.0;
+    return true;
+}
+
+// Used memory as the agent has always reported it:
+// MemTotal - MemFree - Buffers - Cached
+static bool parse_meminfo(const char *p, double *usage) {
+    static const struct { const char *key; size_t len; } keys[] = {
+        { "MemTotal:", 9 }, { "MemFree:", 8 }, { "Buffers:", 8 }, { "Cached:", 7 }
+    };
+    uint64_t values[4] = {0};
+    unsigned found = 0;
+    for (; p && found != 0xf; p = next_line(p)) {
+        for (size_t i = 0; i < 4; i++) {
+            if (memcmp(p, keys[i].key, keys[i].len) == 0) {
+                if (scan_u64(p + keys[i].len, &values[i])) found |= 1u << i;
+                break;
+            }
+        }
+    }
+    if (!(found & 1) || values[0] == 0) return false;
+    uint64_t unused = values[1] + values[2] + values[3];
+    *usage = unused < values[0] ? (double)(values[0] - unused) / values[0] * 100.0 : 0.0;
+    return true;
+}
+
+static bool read_cpu_times(Sampler *s, CpuTimes *total, CpuTimes *cores, int *core_count) {
+    if (read_proc(s->stat_fd, s->stat_buf, sizeof(s->stat_buf)) <= 0) return false;
+    *core_count = parse_stat(s->stat_buf, total, cores);
+    return *core_count >= 0;
+}
+
+int sampler_open(Sampler *s, const char *disk_path) {
+    memset(s, 0, sizeof(*s));
+    s->disk_path = disk_path;
+    s->stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    s->meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    if (s->stat_fd < 0 || s->meminfo_fd < 0 ||
+        !read_cpu_times(s, &s->prev_total, s->prev_core, &s->cpu_count)) {
+        int saved = errno ? errno : EIO;
+        if (s->stat_fd >= 0) close(s->stat_fd);
+        if (s->meminfo_fd >= 0) close(s->meminfo_fd);
+        errno = saved;
+        return -1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+bool sampler_read(Sampler *s, SamplerReading *out) {
+    CpuTimes total;
+    CpuTimes cores[SAMPLER_MAX_CPUS];
+    int core_count;
+    memcpy(cores, s->prev_core, sizeof(cores));
+    if (!read_cpu_times(s, &total, cores, &core_count)) return false;
+
+    // Keep the old baseline until a tick has passed so the next delta is real
+    if (busy_percent(&total, &s->prev_total, &s->cpu_usage)) s->prev_total = total;
+    for (int i = 0; i < core_count; i++) {
+        if (busy_percent(&cores[i], &s->prev_core[i], &s->core_usage[i])) s->prev_core[i] = cores[i];
+    }
+    s->cpu_count = core_count;
+
+    double memory_usage = 0.0;
+    if (read_proc(s->meminfo_fd, s->meminfo_buf, sizeof(s->meminfo_buf)) <= 0 ||
+        !parse_meminfo(s->meminfo_buf, &memory_usage)) {
+        return false;
+    }
+
+    double disk_usage = 0.0;
+    struct statvfs fs;
+    if (s->disk_path && statvfs(s->disk_path, &fs) == 0 && fs.f_blocks > 0) {
+        disk_usage = (double)(fs.f_blocks - fs.f_bfree) / fs.f_blocks * 100.0;
+    }
+
+    out->seq = ++s->samples;
+    clock_gettime(CLOCK_MONOTONIC, &out->taken);
+    out->cpu_usage = s->cpu_usage;
+    out->cpu_count = core_count;
+    memcpy(out->core_usage, s->core_usage, (size_t)core_count * sizeof(double));
+    out->memory_usage = memory_usage;
+    out->disk_usage = disk_usage;
+    return true;
+}
+
+static void *run_sampler(void *arg) {
+    Sampler *s = arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (__atomic_load_n(&s->running, __ATOMIC_RELAXED)) {
+        // Absolute deadlines keep the period from drifting by the read time
+        next.tv_nsec += (long)(s->interval_ms % 1000) * 1000000L;
+        next.tv_sec += s->interval_ms / 1000 + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+        }
+
+        SamplerReading reading;
+        if (!sampler_read(s, &reading)) continue;
+        pthread_mutex_lock(&s->lock);
+        s->latest = reading;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+int sampler_start(Sampler *s, unsigned interval_ms) {
+    s->interval_ms = interval_ms ? interval_ms : SAMPLER_DEFAULT_INTERVAL_MS;
+    s->running = true;
+    if (pthread_create(&s->thread, NULL, run_sampler, s) != 0) {
+        s->running = false;
+        return -1;
+    }
+    return 0;
+}
+
+void sampler_latest(Sampler *s, SamplerReading *out) {
+    pthread_mutex_lock(&s->lock);
+    *out = s->latest;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void sampler_close(Sampler *s) {
+    if (s->running) {
+        __atomic_store_n(&s->running, false, __ATOMIC_RELAXED);
+        pthread_join(s->thread, NULL);
+    }
+    close(s->stat_fd);
+    close(s->meminfo_fd);
+    pthread_mutex_destroy(&s->lock);
+}
@@ -0,0 +1,77 @@
+#ifndef HEARTBEAT_SAMPLER_H
+#define HEARTBEAT_SAMPLER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Host metrics for the agent, read from /proc with as little work per
+// sample as possible: /proc/stat and /proc/meminfo stay open and are
+// re-read with one pread each into fixed buffers, and the few fields needed
+// are picked out by hand-written scanners. CPU usage is the change in
+// /proc/stat's counters since the previous sample, in total and per core.
+// A timer thread can take samples on its own schedule so sending never
+// waits on a read.
+
+#define SAMPLER_MAX_CPUS 256
+#define SAMPLER_STAT_BUFFER 32768       // the cpu lines of SAMPLER_MAX_CPUS cores fit
+#define SAMPLER_MEMINFO_BUFFER 4096
+#define SAMPLER_DEFAULT_INTERVAL_MS 1000
+
+typedef struct {
+    uint64_t seq;                       // samples taken so far; 0: none yet
+    struct timespec taken;              // CLOCK_MONOTONIC
+    double cpu_usage;                   // percent of all cores since the previous sample
+    int cpu_count;                      // entries in core_usage
+    double core_usage[SAMPLER_MAX_CPUS];
+    double memory_usage;                // percent
+    double disk_usage;                  // percent, of the filesystem holding disk_path
+} SamplerReading;
+
+// Busy and total jiffies of one cpu line
+typedef struct {
+    uint64_t busy;
+    uint64_t total;
+} CpuTimes;
+
+typedef struct {
+    int stat_fd;
+    int meminfo_fd;
+    const char *disk_path;
+    uint64_t samples;
+    int cpu_count;
+    CpuTimes prev_total;
+    CpuTimes prev_core[SAMPLER_MAX_CPUS];
+    double cpu_usage;                   // repeated while no clock tick has passed
+    double core_usage[SAMPLER_MAX_CPUS];
+    char stat_buf[SAMPLER_STAT_BUFFER];
+    char meminfo_buf[SAMPLER_MEMINFO_BUFFER];
+
+    // Filled by the timer thread, read with sampler_latest
+    pthread_mutex_t lock;
+    SamplerReading latest;
+    pthread_t thread;
+    unsigned interval_ms;
+    bool running;
+} Sampler;
+
+// Open the /proc files and take the baseline the first sample's deltas are
+// measured from. Returns 0, or -1 with errno set.
+int sampler_open(Sampler *s, const char *disk_path);
+
+// Take one sample now. The first covers the time since sampler_open. Once
+// the timer thread is running, only it may call this.
+bool sampler_read(Sampler *s, SamplerReading *out);
+
+// Sample every interval_ms on a timer thread
+int sampler_start(Sampler *s, unsigned interval_ms);
+
+// Copy the newest sample from the timer thread (seq 0 until the first)
+void sampler_latest(Sampler *s, SamplerReading *out);
+
+// Stop the timer thread if running and close the files
+void sampler_close(Sampler *s);
+
+#endif /* HEARTBEAT_SAMPLER_H */
@@ -1,13 +1,32 @@
 #include "heartbeat_server.h"
+#include "heartbeat_history.h"
+#include "heartbeat_tsdb.h"
+#include "heartbeat_http.h"
+#include "heartbeat_json.h"
+#include "heartbeat_binary.h"
+#include "heartbeat_udp.h"
+#include "heartbeat_log.h"
+#include "heartbeat_store.h"
+#include "heartbeat_metrics.h"
+#include "heartbeat_stats.h"
+#include "heartbeat_stream.h"
+#include "heartbeat_snapshot.h"
+#include "heartbeat_compress.h"
+#include "heartbeat_anomaly.h"
+#include "heartbeat_rules.h"
+#include "heartbeat_ratelimit.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <json-c/json.h>
 
 // Global variables initialization
@@ -15,23 +34,175 @@ HeartbeatNode *heartbeat_history = NULL;
 pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
 int heartbeat_count = 0;
 
+// History shards. Shard 0 starts on static storage sized MAX_HEARTBEATS; the
+// capacity set with set_history_capacity is split evenly across the shards.
+static HistorySlot default_history_slots[MAX_HEARTBEATS];
+static HistoryRing history_rings[MAX_HISTORY_SHARDS];
+static HistoryRing *history_ring_ptrs[MAX_HISTORY_SHARDS];
+static size_t history_shard_count = 1;
+static size_t history_capacity = MAX_HEARTBEATS;
+static pthread_once_t history_once = PTHREAD_ONCE_INIT;
+static __thread int thread_history_shard = -1;
+
+// The history generation is the number of appends across every shard plus
+// history_generation_base, which absorbs the appends (and one more) each
+// time the rings are reset, so it never repeats. history_reset_seq is odd
+// while a reset is in progress.
+static uint64_t history_generation_base;
+static uint64_t history_reset_seq;
+
+static void init_history_ring(void) {
+    history_ring_init(&history_rings[0], default_history_slots, MAX_HEARTBEATS);
+    for (size_t i = 0; i < MAX_HISTORY_SHARDS; i++) {
+        history_ring_ptrs[i] = &history_rings[i];
+    }
+}
+
+HistoryRing *get_history_shard(size_t shard) {
+    pthread_once(&history_once, init_history_ring);
+    return &history_rings[shard];
+}
+
+size_t get_history_shard_count(void) {
+    return history_shard_count;
+}
+
+HistoryRing *const *get_history_rings(void) {
+    pthread_once(&history_once, init_history_ring);
+    return history_ring_ptrs;
+}
+
+size_t get_history_count(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < history_shard_count; i++) {
+        count += history_ring_count(get_history_shard(i));
+    }
+    return count;
+}
+
+uint64_t get_history_generation(void) {
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&history_reset_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        uint64_t generation = __atomic_load_n(&history_generation_base, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < history_shard_count; i++) {
+            generation += history_ring_head(get_history_shard(i));
+        }
+        if (__atomic_load_n(&history_reset_seq, __ATOMIC_ACQUIRE) == seq) return generation;
+    }
+}
+
+// Bracket a reset of the rings; the caller holds history_mutex
+static void begin_history_reset(void) {
+    uint64_t appends = 0;
+    for (size_t i = 0; i < history_shard_count; i++) {
+        appends += history_ring_head(get_history_shard(i));
+    }
+    __atomic_fetch_add(&history_reset_seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_fetch_add(&history_generation_base, appends + 1, __ATOMIC_RELAXED);
+}
+
+static void end_history_reset(void) {
+    __atomic_fetch_add(&history_reset_seq, 1, __ATOMIC_RELEASE);
+}
+
+void set_thread_history_shard(int shard) {
+    thread_history_shard = shard;
+}
+
+int get_thread_history_shard(void) {
+    return thread_history_shard;
+}
+
+// Rebuild the rings as shards rings sharing capacity records, dropping their
+// contents. Must be called before any reader or writer threads are started.
+static bool resize_history(size_t capacity, size_t shards) {
+    if (capacity == 0 || shards == 0 || shards > MAX_HISTORY_SHARDS) return false;
+    pthread_once(&history_once, init_history_ring);
+    
+    HistorySlot *slots[MAX_HISTORY_SHARDS];
+    size_t per_shard = (capacity + shards - 1) / shards;
+    for (size_t i = 0; i < shards; i++) {
+        slots[i] = calloc(per_shard, sizeof(HistorySlot));
+        if (!slots[i]) {
+            while (i > 0) free(slots[--i]);
+            return false;
+        }
+    }
+    
+    pthread_mutex_lock(&history_mutex);
+    begin_history_reset();
+    for (size_t i = 0; i < history_shard_count; i++) {
+        history_ring_destroy(&history_rings[i]);
+    }
+    for (size_t i = 0; i < shards; i++) {
+        history_ring_init(&history_rings[i], slots[i], per_shard);
+        history_rings[i].owns_slots = true;
+    }
+    history_shard_count = shards;
+    history_capacity = capacity;
+    heartbeat_history = NULL;
+    heartbeat_count = 0;
+    end_history_reset();
+    pthread_mutex_unlock(&history_mutex);
+    return true;
+}
+
+// Resize the history, dropping its contents. Must be called before any
+// reader or writer threads are started.
+bool set_history_capacity(size_t capacity) {
+    if (capacity == history_capacity) return capacity > 0;
+    return resize_history(capacity, history_shard_count);
+}
+
+bool set_history_shards(size_t shards) {
+    if (shards == history_shard_count) return true;
+    return resize_history(history_capacity, shards);
+}
+
+size_t get_history_capacity(void) {
+    size_t capacity = 0;
+    for (size_t i = 0; i < history_shard_count; i++) {
+        capacity += get_history_shard(i)->capacity;
+    }
+    return capacity;
+}
+
 // Clear heartbeat history (for testing)
 void clear_heartbeat_history(void) {
     pthread_mutex_lock(&history_mutex);
-    
-    HeartbeatNode *current = heartbeat_history;
-    while (current != NULL) {
-        HeartbeatNode *next = current->next;
-        free(current);
-        current = next;
+    begin_history_reset();
+    for (size_t i = 0; i < history_shard_count; i++) {
+        HistoryRing *ring = get_history_shard(i);
+        pthread_mutex_lock(&ring->writer_mutex);
+        history_ring_reset(ring);
+        pthread_mutex_unlock(&ring->writer_mutex);
     }
-    
     heartbeat_history = NULL;
     heartbeat_count = 0;
-    
+    end_history_reset();
     pthread_mutex_unlock(&history_mutex);
 }
 
+const char *const metric_names[METRIC_COUNT] = {
+    "cpu_usage",
+    "memory_usage",
+    "disk_usage",
+    "availability",
+    "latency"
+};
+
+double heartbeat_metric_value(const HeartbeatData *data, HeartbeatMetric metric) {
+    switch (metric) {
+    case METRIC_CPU_USAGE: return data->cpu_usage;
+    case METRIC_MEMORY_USAGE: return data->memory_usage;
+    case METRIC_DISK_USAGE: return data->disk_usage;
+    case METRIC_AVAILABILITY: return data->availability;
+    case METRIC_LATENCY: return data->latency;
+    default: return 0.0;
+    }
+}
+
 // Validation functions
 bool validate_ip(const char *ip) {
     if (ip == NULL) return false;
@@ -44,7 +215,16 @@ bool validate_percentage(double value) {
 }
 
 bool validate_latency(double value) {
-    return value >= 0.0;
+    return value >= 0.0 && value <= MAX_LATENCY_MS;
+}
+
+// Range-check every metric of an already decoded heartbeat
+bool validate_metrics(const HeartbeatData *data) {
+    return validate_percentage(data->cpu_usage) &&
+           validate_percentage(data->memory_usage) &&
+           validate_percentage(data->disk_usage) &&
+           validate_percentage(data->availability) &&
+           validate_latency(data->latency);
 }
 
 // URL decoding function
@@ -75,23 +255,70 @@ bool parse_key_value(const char *pair, char *key, size_t key_len, char *value, s
     if (!eq) return false;
     
     size_t key_size = eq - pair;
-    if (key_size >= key_len) return false;
+    if (key_size == 0 || key_size >= key_len) return false;
     
     strncpy(key, pair, key_size);
     key[key_size] = '\0';
     
     const char *val_start = eq + 1;
     size_t val_size = strlen(val_start);
-    if (val_size >= value_len) return false;
+    if (val_size == 0 || val_size >= value_len) return false;
     
     url_decode(value, val_start, value_len);
     return true;
 }
 
-// Process JSON data
+// Look up name in a URL query string ("a=1&b=2") and URL-decode its value
+bool get_query_param(const char *query, const char *name, char *value, size_t value_len) {
+    if (!query) return false;
+    size_t name_len = strlen(name);
+    
+    const char *p = query;
+    while (*p) {
+        const char *end = strchr(p, '&');
+        size_t pair_len = end ? (size_t)(end - p) : strlen(p);
+        
+        if (pair_len > name_len && strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            char raw[MAX_VALUE_LEN];
+            size_t raw_len = pair_len - name_len - 1;
+            if (raw_len >= sizeof(raw)) return false;
+            memcpy(raw, p + name_len + 1, raw_len);
+            raw[raw_len] = '\0';
+            url_decode(value, raw, value_len);
+            return true;
+        }
+        if (!end) break;
+        p = end + 1;
+    }
+    return false;
+}
+
+// Decode a heartbeat. Well-formed input takes the single-pass decoder; the
+// rest goes through json-c, which stays the reference for what is accepted.
 bool process_json_data(const char *json_str, HeartbeatData *hb_data) {
     if (json_str == NULL || hb_data == NULL) return false;
     
+    uint64_t start = metrics_now();
+    bool valid;
+    switch (json_decode_heartbeat(json_str, hb_data)) {
+    case JSON_DECODE_ACCEPT:
+        valid = true;
+        break;
+    case JSON_DECODE_REJECT:
+        valid = false;
+        break;
+    default:
+        valid = process_json_data_generic(json_str, hb_data);
+        break;
+    }
+    metrics_observe(STAGE_PARSE, start);
+    return valid;
+}
+
+// Decode a heartbeat through a json-c object tree
+bool process_json_data_generic(const char *json_str, HeartbeatData *hb_data) {
+    if (json_str == NULL || hb_data == NULL) return false;
+    
     struct json_object *parsed_json;
     struct json_object *local_ip;
     struct json_object *public_ip;
@@ -126,6 +353,13 @@ bool process_json_data(const char *json_str, HeartbeatData *hb_data) {
     strncpy(hb_data->local_ip, local_ip_str, MAX_IP_LEN - 1);
     strncpy(hb_data->public_ip, public_ip_str, MAX_IP_LEN - 1);
     
+    // hostname is optional and never makes a heartbeat invalid
+    struct json_object *hostname;
+    if (json_object_object_get_ex(parsed_json, "hostname", &hostname) &&
+        json_object_is_type(hostname, json_type_string)) {
+        strncpy(hb_data->hostname, json_object_get_string(hostname), MAX_HOSTNAME_LEN - 1);
+    }
+    
     hb_data->cpu_usage = json_object_get_double(cpu_usage);
     hb_data->memory_usage = json_object_get_double(memory_usage);
     hb_data->disk_usage = json_object_get_double(disk_usage);
@@ -145,264 +379,1499 @@ bool process_json_data(const char *json_str, HeartbeatData *hb_data) {
     return true;
 }
 
-// Add heartbeat data to history
+// Add heartbeat data to history. Appends go to the preallocated ring and
+// never take history_mutex; the oldest record is overwritten in place. When
+// a data directory is configured the record is also written to the store.
 void add_to_history(HeartbeatData *data) {
-    HeartbeatNode *new_node = malloc(sizeof(HeartbeatNode));
-    if (!new_node) return;
+    add_to_history_at(data, time(NULL));
+}
+
+// Shard data is appended to: the calling thread's own shard if it has one,
+// otherwise one picked by host so each host's records stay in order
+static HistoryRing *writer_shard(const HeartbeatData *data) {
+    if (history_shard_count == 1) return get_history_shard(0);
+    if (thread_history_shard >= 0) return get_history_shard((size_t)thread_history_shard);
+    
+    uint32_t h = 2166136261u;
+    for (const char *p = data->local_ip; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return get_history_shard(h % history_shard_count);
+}
+
+// Append count records to ring in one locked section. heartbeat_history and
+// heartbeat_count describe the single ring, so they are only kept unsharded.
+static void append_records(HistoryRing *ring, const HeartbeatData *data,
+                           const time_t *timestamps, size_t count) {
+    pthread_mutex_lock(&ring->writer_mutex);
+    for (size_t i = 0; i < count; i++) {
+        history_ring_append(ring, &data[i], timestamps[i], anomaly_observe(&data[i], timestamps[i]));
+        store_append(&data[i], timestamps[i]);
+    }
+    if (history_shard_count == 1) {
+        heartbeat_history = history_ring_newest(ring);
+        heartbeat_count = (int)history_ring_count(ring);
+    }
+    pthread_mutex_unlock(&ring->writer_mutex);
+}
+
+// Add count heartbeats; timestamps[i] belongs to data[i]
+void add_batch_to_history(const HeartbeatData *data, const time_t *timestamps, size_t count) {
+    if (count == 0) return;
+    uint64_t start = metrics_now();
     
-    memcpy(&new_node->data, data, sizeof(HeartbeatData));
-    new_node->timestamp = time(NULL);
+    if (history_shard_count > 1 && thread_history_shard < 0) {
+        for (size_t i = 0; i < count; i++) {
+            append_records(writer_shard(&data[i]), &data[i], &timestamps[i], 1);
+        }
+    } else {
+        append_records(writer_shard(data), data, timestamps, count);
+    }
     
-    pthread_mutex_lock(&history_mutex);
+    for (size_t i = 0; i < count; i++) {
+        tsdb_record(&data[i], timestamps[i]);
+        rules_evaluate(&data[i], timestamps[i]);
+    }
+    stats_record_fleet(data, timestamps, count);
+    stream_publish(data, timestamps, count);
+    metrics_add(COUNTER_HEARTBEATS_ACCEPTED, count);
+    metrics_observe(STAGE_STORE, start);
+}
+
+// Add a heartbeat that was sampled at timestamp
+void add_to_history_at(const HeartbeatData *data, time_t timestamp) {
+    uint64_t start = metrics_now();
+    
+    append_records(writer_shard(data), data, &timestamp, 1);
+    
+    tsdb_record(data, timestamp);
+    rules_evaluate(data, timestamp);
+    stats_record_fleet(data, &timestamp, 1);
+    stream_publish(data, &timestamp, 1);
+    metrics_inc(COUNTER_HEARTBEATS_ACCEPTED);
+    metrics_observe(STAGE_STORE, start);
+}
+
+// Copy the newest records (at most max) into a malloc'd array, newest first.
+// Returns the number of records copied; *out is NULL when there are none.
+size_t snapshot_history(HeartbeatNode **out, size_t max) {
+    size_t count = get_history_count();
+    if (count > max) count = max;
+    
+    *out = NULL;
+    if (count == 0) return 0;
+    
+    *out = malloc(count * sizeof(HeartbeatNode));
+    if (!*out) return 0;
+    
+    HistoryMerge *merge = malloc(sizeof(HistoryMerge));
+    if (!merge) {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    history_merge_init(merge, get_history_rings(), history_shard_count);
+    size_t n = 0;
+    while (n < count && history_merge_next(merge, &(*out)[n])) {
+        if (n > 0) (*out)[n - 1].next = &(*out)[n];
+        n++;
+    }
+    free(merge);
+    return n;
+}
+
+// Get history as compact JSON, newest first. The caller frees the result.
+char* get_history_json() {
+    HistoryJsonWriter writer;
+    history_json_writer_init(&writer, get_history_rings(), history_shard_count, 0, false);
+    
+    OutputBuffer out;
+    output_buffer_init(&out);
+    while (!history_json_write(&writer, &out, SIZE_MAX)) {
+    }
+    if (!output_buffer_append(&out, "", 1)) {
+        output_buffer_free(&out);
+        return NULL;
+    }
+    return out.data;
+}
+
+// Output buffer helpers
+void output_buffer_init(OutputBuffer *buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+// Make room for at least extra more bytes
+bool output_buffer_reserve(OutputBuffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return true;
+    
+    size_t new_cap = buf->cap ? buf->cap : BUFFER_SIZE;
+    while (new_cap < buf->len + extra) {
+        new_cap *= 2;
+    }
+    char *new_data = realloc(buf->data, new_cap);
+    if (!new_data) return false;
+    buf->data = new_data;
+    buf->cap = new_cap;
+    return true;
+}
+
+bool output_buffer_append(OutputBuffer *buf, const char *data, size_t len) {
+    if (!output_buffer_reserve(buf, len)) return false;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return true;
+}
+
+void output_buffer_free(OutputBuffer *buf) {
+    free(buf->data);
+    output_buffer_init(buf);
+}
+
+static void append_str(OutputBuffer *out, const char *str) {
+    output_buffer_append(out, str, strlen(str));
+}
+
+bool output_buffer_printf(OutputBuffer *buf, const char *fmt, ...) {
+    va_list args;
     
-    new_node->next = heartbeat_history;
-    heartbeat_history = new_node;
+    // Format straight into the spare capacity when it fits
+    size_t spare = buf->cap - buf->len;
+    va_start(args, fmt);
+    int n = vsnprintf(spare ? buf->data + buf->len : NULL, spare, fmt, args);
+    va_end(args);
+    if (n < 0) return false;
+    if ((size_t)n < spare) {
+        buf->len += (size_t)n;
+        return true;
+    }
     
-    heartbeat_count++;
+    // Grow, then format again
+    if (!output_buffer_reserve(buf, (size_t)n + 1)) return false;
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+    va_end(args);
+    buf->len += (size_t)n;
+    return true;
+}
+
+// Append str as a quoted JSON string, escaping as needed
+bool output_buffer_append_json_string(OutputBuffer *buf, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    bool ok = output_buffer_append(buf, "\"", 1);
     
-    // Remove oldest entry if we exceed MAX_HEARTBEATS
-    if (heartbeat_count > MAX_HEARTBEATS) {
-        HeartbeatNode *current = heartbeat_history;
-        HeartbeatNode *prev = NULL;
+    const char *run = str;
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
         
-        while (current->next) {
-            prev = current;
-            current = current->next;
+        ok = ok && output_buffer_append(buf, run, (size_t)(p - run));
+        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        if (c == '"' || c == '\\') {
+            esc[1] = (char)c;
+            ok = ok && output_buffer_append(buf, esc, 2);
+        } else {
+            ok = ok && output_buffer_append(buf, esc, 6);
         }
+        run = p + 1;
+    }
+    ok = ok && output_buffer_append(buf, run, strlen(run));
+    return ok && output_buffer_append(buf, "\"", 1);
+}
+
+static void respond_json_error(OutputBuffer *out, const HttpRequest *req,
+                               int status, const char *message) {
+    OutputBuffer body;
+    output_buffer_init(&body);
+    append_str(&body, "{\"error\":");
+    output_buffer_append_json_string(&body, message);
+    output_buffer_append(&body, "}", 1);
+    http_respond(out, req, status, "application/json", body.data, body.len);
+    output_buffer_free(&body);
+}
+
+// Append body as HISTORY_CHUNK_SIZE chunks, compressed on the way when c is
+// non-NULL. Ends the chunked body.
+static void append_body_chunks(OutputBuffer *out, Compressor *c, const char *body, size_t len) {
+    size_t off = 0;
+    do {
+        size_t n = len - off < HISTORY_CHUNK_SIZE ? len - off : HISTORY_CHUNK_SIZE;
+        size_t mark = http_chunk_begin(out);
+        if (c) {
+            if (!compressor_write(c, out, body + off, n, off + n == len)) {
+                log_error("compress_failed", "len=%zu", len);
+            }
+        } else {
+            output_buffer_append(out, body + off, n);
+        }
+        http_chunk_end(out, mark);
+        off += n;
+    } while (off < len);
+    http_chunk_finish(out);
+}
+
+// Send a JSON API response, compressed if the client accepts gzip or deflate
+// and the body is big enough. HTTP/1.1 responses are compressed chunk by
+// chunk straight into out.
+static void respond_json(OutputBuffer *out, const HttpRequest *req, int status,
+                         const char *body, size_t len) {
+    ContentCoding coding = compress_negotiate(req);
+    HttpResponseMeta meta = { .vary_encoding = compress_get_level() > 0 };
+    Compressor c;
+    if (!compress_worthwhile(coding, len) || !compressor_init(&c, coding)) {
+        http_respond_meta(out, req, status, "application/json", &meta, body, len);
+        return;
+    }
+    meta.content_encoding = content_coding_name(coding);
+    
+    if (req->minor_version == 0) {
+        OutputBuffer encoded;
+        output_buffer_init(&encoded);
+        if (compressor_write(&c, &encoded, body, len, true)) {
+            http_respond_meta(out, req, status, "application/json", &meta, encoded.data, encoded.len);
+        } else {
+            respond_json_error(out, req, 500, "compression failed");
+        }
+        output_buffer_free(&encoded);
+    } else {
+        http_respond_chunked(out, req, status, "application/json", &meta);
+        if (!req->head) append_body_chunks(out, &c, body, len);
+    }
+    compressor_end(&c);
+}
+
+// A JSON response written piece by piece. The body is held back until it
+// outgrows one chunk, so small bodies still go out whole through
+// respond_json. Past that, HTTP/1.1 bodies are sent as HISTORY_CHUNK_SIZE
+// chunks, compressed on the way when negotiated, and never held in full.
+typedef struct {
+    OutputBuffer *out;
+    const HttpRequest *req;
+    OutputBuffer body;                  // not yet sent
+    Compressor c;
+    bool compressing;
+    bool chunked;
+} JsonStream;
+
+static void json_stream_init(JsonStream *s, OutputBuffer *out, const HttpRequest *req) {
+    memset(s, 0, sizeof(*s));
+    s->out = out;
+    s->req = req;
+    output_buffer_init(&s->body);
+}
+
+// Send what has been written once it fills a chunk, or everything when
+// finish is set, which also ends the response
+static void json_stream_flush(JsonStream *s, bool finish) {
+    if (!s->chunked) {
+        if (finish) {
+            respond_json(s->out, s->req, 200, s->body.data, s->body.len);
+            return;
+        }
+        if (s->req->minor_version == 0 || s->body.len < HISTORY_CHUNK_SIZE) return;
         
-        if (prev) {
-            prev->next = NULL;
-            free(current);
-            heartbeat_count--;
+        ContentCoding coding = compress_negotiate(s->req);
+        HttpResponseMeta meta = { .vary_encoding = compress_get_level() > 0 };
+        s->compressing = compress_worthwhile(coding, s->body.len) && compressor_init(&s->c, coding);
+        if (s->compressing) meta.content_encoding = content_coding_name(coding);
+        http_respond_chunked(s->out, s->req, 200, "application/json", &meta);
+        s->chunked = true;
+    }
+    if (!finish && s->body.len < HISTORY_CHUNK_SIZE) return;
+    
+    if (!s->req->head) {
+        size_t mark = http_chunk_begin(s->out);
+        if (s->compressing) {
+            if (!compressor_write(&s->c, s->out, s->body.data, s->body.len, finish)) {
+                log_error("compress_failed", "len=%zu", s->body.len);
+            }
+        } else {
+            output_buffer_append(s->out, s->body.data, s->body.len);
         }
+        http_chunk_end(s->out, mark);
+        if (finish) http_chunk_finish(s->out);
     }
+    s->body.len = 0;
+}
+
+static void json_stream_free(JsonStream *s) {
+    if (s->compressing) compressor_end(&s->c);
+    output_buffer_free(&s->body);
+}
+
+static void respond_text(OutputBuffer *out, const HttpRequest *req, int status, const char *text) {
+    http_respond(out, req, status, "text/plain", text, strlen(text));
+}
+
+// Parse a time query parameter; negative values are relative to now
+static time_t get_time_param(const char *query, const char *name, time_t fallback) {
+    char value[MAX_VALUE_LEN];
+    if (!get_query_param(query, name, value, sizeof(value))) return fallback;
     
-    pthread_mutex_unlock(&history_mutex);
+    char *end;
+    long long t = strtoll(value, &end, 10);
+    if (end == value) return fallback;
+    return t < 0 ? time(NULL) + t : (time_t)t;
 }
 
-// Get history as JSON
-char* get_history_json() {
-    struct json_object *json_array = json_object_new_array();
-    if (!json_array) return NULL;
+// GET /api/heartbeat/history?host=...&since=...&until=...&step=...&limit=...
+// Answers from the per-host series: raw samples when step is 0, otherwise the
+// matching 1m/5m/1h rollup.
+static void handle_host_history(HttpRequest *req, const char *host, OutputBuffer *out) {
+    const char *query = req->query;
+    char value[MAX_VALUE_LEN];
+    int step = 0;
+    if (get_query_param(query, "step", value, sizeof(value))) {
+        step = atoi(value);
+    }
+    if (!tsdb_step_supported(step)) {
+        respond_json_error(out, req, 400, "step must be 0, 60, 300 or 3600");
+        return;
+    }
     
-    pthread_mutex_lock(&history_mutex);
+    time_t since = get_time_param(query, "since", 0);
+    time_t until = get_time_param(query, "until", (time_t)INT64_MAX);
+    size_t limit = step == 0 ? TSDB_RAW_SAMPLES : TSDB_ROLLUP_5M_BUCKETS;
+    if (get_query_param(query, "limit", value, sizeof(value)) && atol(value) > 0 &&
+        (size_t)atol(value) < limit) {
+        limit = (size_t)atol(value);
+    }
     
-    HeartbeatNode *current = heartbeat_history;
-    while (current) {
-        struct json_object *entry = json_object_new_object();
-        
-        json_object_object_add(entry, "local_ip", 
-                             json_object_new_string(current->data.local_ip));
-        json_object_object_add(entry, "public_ip", 
-                             json_object_new_string(current->data.public_ip));
-        json_object_object_add(entry, "cpu_usage", 
-                             json_object_new_double(current->data.cpu_usage));
-        json_object_object_add(entry, "memory_usage", 
-                             json_object_new_double(current->data.memory_usage));
-        json_object_object_add(entry, "disk_usage", 
-                             json_object_new_double(current->data.disk_usage));
-        json_object_object_add(entry, "availability", 
-                             json_object_new_double(current->data.availability));
-        json_object_object_add(entry, "latency", 
-                             json_object_new_double(current->data.latency));
-        json_object_object_add(entry, "timestamp", 
-                             json_object_new_int64(current->timestamp));
+    TsHostInfo info;
+    void *points = malloc(limit * (step == 0 ? sizeof(TsSample) : sizeof(TsRollup)));
+    if (!points) {
+        respond_json_error(out, req, 500, "out of memory");
+        return;
+    }
+    ssize_t n = step == 0
+        ? tsdb_query_raw(host, since, until, points, limit, &info)
+        : tsdb_query_rollup(host, step, since, until, points, limit, &info);
+    if (n < 0) {
+        free(points);
+        respond_json_error(out, req, 404, "unknown host");
+        return;
+    }
+    
+    OutputBuffer body;
+    output_buffer_init(&body);
+    append_str(&body, "{\"host\":");
+    output_buffer_append_json_string(&body, info.local_ip);
+    append_str(&body, ",\"hostname\":");
+    output_buffer_append_json_string(&body, info.hostname);
+    output_buffer_printf(&body, ",\"step\":%d,\"points\":[", step);
+    
+    for (ssize_t i = 0; i < n; i++) {
+        if (i > 0) output_buffer_append(&body, ",", 1);
+        if (step == 0) {
+            TsSample *sample = &((TsSample *)points)[i];
+            output_buffer_printf(&body, "{\"timestamp\":%lld", (long long)sample->timestamp);
+            for (int m = 0; m < METRIC_COUNT; m++) {
+                output_buffer_printf(&body, ",\"%s\":%.15g", metric_names[m], sample->values[m]);
+            }
+        } else {
+            TsRollup *bucket = &((TsRollup *)points)[i];
+            output_buffer_printf(&body, "{\"timestamp\":%lld,\"count\":%u",
+                                 (long long)bucket->start, bucket->count);
+            for (int m = 0; m < METRIC_COUNT; m++) {
+                output_buffer_printf(&body, ",\"%s\":{\"min\":%.7g,\"max\":%.7g,\"avg\":%.7g}",
+                                     metric_names[m], bucket->min[m], bucket->max[m], bucket->avg[m]);
+            }
+        }
+        output_buffer_append(&body, "}", 1);
+    }
+    output_buffer_append(&body, "]}", 2);
+    
+    respond_json(out, req, 200, body.data, body.len);
+    output_buffer_free(&body);
+    free(points);
+}
+
+// GET /api/heartbeat/history[?limit=N&pretty=1]
+// Served from the snapshot cache, so a burst of dashboard reads between two
+// heartbeats serializes the history once. Responses carry the history
+// generation as their ETag; a client revalidating with If-None-Match gets a
+// 304 without the history being looked at. HTTP/1.1 bodies still go out in
+// HISTORY_CHUNK_SIZE chunks.
+static void route_get_history(HttpRequest *req, OutputBuffer *out) {
+    char value[MAX_VALUE_LEN];
+    if (get_query_param(req->query, "host", value, sizeof(value))) {
+        handle_host_history(req, value, out);
+        return;
+    }
+    
+    size_t limit = 0;
+    if (get_query_param(req->query, "limit", value, sizeof(value)) && atol(value) > 0) {
+        limit = (size_t)atol(value);
+    }
+    bool pretty = get_query_param(req->query, "pretty", value, sizeof(value)) &&
+                  (strcmp(value, "1") == 0 || strcmp(value, "true") == 0);
+    
+    ContentCoding coding = compress_negotiate(req);
+    char etag[SNAPSHOT_ETAG_LEN];
+    history_snapshot_etag(etag, sizeof(etag), get_history_generation(), limit, pretty, coding);
+    HttpResponseMeta meta = { .etag = etag, .vary_encoding = compress_get_level() > 0 };
+    if (http_etag_matches(req, etag)) {
+        http_respond_not_modified(out, req, &meta);
+        return;
+    }
+    
+    HistorySnapshot *snap = history_snapshot_get(limit, pretty);
+    if (!snap) {
+        respond_json_error(out, req, 500, "out of memory");
+        return;
+    }
+    // The snapshot may be newer than the generation read above
+    history_snapshot_etag(etag, sizeof(etag), snap->generation, limit, pretty, coding);
+    size_t len;
+    const char *body = history_snapshot_body(snap, &coding, &len);
+    meta.content_encoding = content_coding_name(coding);
+    
+    if (req->minor_version == 0) {
+        // HTTP/1.0 has no chunked encoding
+        http_respond_meta(out, req, 200, "application/json", &meta, body, len);
+    } else {
+        http_respond_chunked(out, req, 200, "application/json", &meta);
+        if (!req->head) append_body_chunks(out, NULL, body, len);
+    }
+    history_snapshot_put(snap);
+}
+
+// Decode an application/x-www-form-urlencoded heartbeat; body is tokenized
+// in place. All seven fields must be present and valid.
+static bool process_form_data(char *body, HeartbeatData *hb_data) {
+    char *saveptr;
+    char *pair = strtok_r(body, "&", &saveptr);
+    int fields_set = 0;
+    
+    while (pair) {
+        char key[MAX_KEY_LEN];
+        char value[MAX_VALUE_LEN];
         
-        json_object_array_add(json_array, entry);
-        current = current->next;
+        if (parse_key_value(pair, key, sizeof(key), value, sizeof(value))) {
+            if (strcmp(key, "local_ip") == 0 && validate_ip(value)) {
+                strncpy(hb_data->local_ip, value, MAX_IP_LEN - 1);
+                fields_set++;
+            }
+            else if (strcmp(key, "public_ip") == 0 && validate_ip(value)) {
+                strncpy(hb_data->public_ip, value, MAX_IP_LEN - 1);
+                fields_set++;
+            }
+            else if (strcmp(key, "hostname") == 0) {
+                strncpy(hb_data->hostname, value, MAX_HOSTNAME_LEN - 1);
+            }
+            else if (strcmp(key, "cpu_usage") == 0) {
+                double val = atof(value);
+                if (validate_percentage(val)) {
+                    hb_data->cpu_usage = val;
+                    fields_set++;
+                }
+            }
+            else if (strcmp(key, "memory_usage") == 0) {
+                double val = atof(value);
+                if (validate_percentage(val)) {
+                    hb_data->memory_usage = val;
+                    fields_set++;
+                }
+            }
+            else if (strcmp(key, "disk_usage") == 0) {
+                double val = atof(value);
+                if (validate_percentage(val)) {
+                    hb_data->disk_usage = val;
+                    fields_set++;
+                }
+            }
+            else if (strcmp(key, "availability") == 0) {
+                double val = atof(value);
+                if (validate_percentage(val)) {
+                    hb_data->availability = val;
+                    fields_set++;
+                }
+            }
+            else if (strcmp(key, "latency") == 0) {
+                double val = atof(value);
+                if (validate_latency(val)) {
+                    hb_data->latency = val;
+                    fields_set++;
+                }
+            }
+        }
+        pair = strtok_r(NULL, "&", &saveptr);
     }
     
-    pthread_mutex_unlock(&history_mutex);
+    return fields_set == 7;
+}
+
+// One accepted heartbeat, sampled so a busy server is not flooded
+static void log_heartbeat(const char *source, const HeartbeatData *hb_data) {
+    log_info_sampled("heartbeat",
+        "source=%s local_ip=%s public_ip=%s cpu=%.2f memory=%.2f disk=%.2f "
+        "availability=%.2f latency_ms=%.2f",
+        source, hb_data->local_ip, hb_data->public_ip, hb_data->cpu_usage,
+        hb_data->memory_usage, hb_data->disk_usage, hb_data->availability,
+        hb_data->latency);
+}
+
+// POST /api/heartbeat with a JSON or form-encoded body
+static void route_post_heartbeat(HttpRequest *req, OutputBuffer *out) {
+    HeartbeatData hb_data = {0};
+    bool valid_data;
     
-    const char *json_str = json_object_to_json_string_ext(json_array, 
-                                                         JSON_C_TO_STRING_PRETTY);
-    char *result = strdup(json_str);
+    if (req->body[0] == '{') {
+        valid_data = process_json_data(req->body, &hb_data);
+    } else {
+        uint64_t start = metrics_now();
+        valid_data = process_form_data(req->body, &hb_data);
+        metrics_observe(STAGE_PARSE, start);
+    }
     
-    json_object_put(json_array);
-    return result;
+    if (valid_data) {
+        log_heartbeat("http", &hb_data);
+        add_to_history(&hb_data);
+        
+        respond_text(out, req, 200, "OK");
+    } else {
+        metrics_inc(COUNTER_HEARTBEATS_REJECTED);
+        log_warn("heartbeat_rejected", "source=http bytes=%zu", req->body_len);
+        respond_text(out, req, 400, "Invalid data sent");
+    }
 }
 
-// Handle client connection
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
+// Records collected from one batch request
+typedef struct {
+    HeartbeatData *data;
+    size_t count;
+    size_t cap;
+    size_t rejected;
+    OutputBuffer status;        // per-record results, as JSON array elements
+    bool too_many;
+} HeartbeatBatch;
+
+static bool is_json_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Validate one record in [start, end) and queue it if it is a heartbeat
+static void batch_add_record(HeartbeatBatch *batch, char *start, char *end) {
+    while (start < end && is_json_space(*start)) start++;
+    while (end > start && is_json_space(end[-1])) end--;
+    
+    if (batch->count + batch->rejected >= BATCH_MAX_RECORDS) {
+        batch->too_many = true;
+        return;
+    }
+    if (batch->count == batch->cap) {
+        size_t cap = batch->cap ? batch->cap * 2 : 64;
+        HeartbeatData *data = realloc(batch->data, cap * sizeof(HeartbeatData));
+        if (!data) {
+            batch->too_many = true;
+            return;
+        }
+        batch->data = data;
+        batch->cap = cap;
+    }
     
-    char buffer[BUFFER_SIZE] = {0};
-    ssize_t valread = read(client_socket, buffer, BUFFER_SIZE - 1);
+    HeartbeatData *hb_data = &batch->data[batch->count];
+    memset(hb_data, 0, sizeof(*hb_data));
+    char saved = *end;
+    *end = '\0';
+    bool valid = start < end && process_json_data(start, hb_data);
+    *end = saved;
     
-    if (valread <= 0) {
-        close(client_socket);
-        return NULL;
+    if (batch->status.len > 0) output_buffer_append(&batch->status, ",", 1);
+    if (valid) {
+        batch->count++;
+        append_str(&batch->status, "\"ok\"");
+    } else {
+        batch->rejected++;
+        append_str(&batch->status, "\"invalid\"");
     }
+}
+
+// Split a JSON array into its elements. Returns false if the array is
+// malformed; elements themselves are judged by batch_add_record.
+static bool split_json_array(HeartbeatBatch *batch, char *p, char *end) {
+    p++;    // '['
+    char *element = p;
+    bool seen_comma = false;
+    int depth = 0;
+    bool in_string = false, escape = false;
     
-    buffer[valread] = '\0';
-    printf("Received %zd bytes:\n%.*s\n", valread, (int)valread, buffer);
-    
-    if (buffer[0] == '{') {
-        HeartbeatData hb_data = {0};
-        if (process_json_data(buffer, &hb_data)) {
-            printf("JSON Heartbeat Data:\n");
-            printf("Local IP: %s\n", hb_data.local_ip);
-            printf("Public IP: %s\n", hb_data.public_ip);
-            printf("CPU Usage: %.2f%%\n", hb_data.cpu_usage);
-            printf("Memory Usage: %.2f%%\n", hb_data.memory_usage);
-            printf("Disk Usage: %.2f%%\n", hb_data.disk_usage);
-            printf("Availability: %.2f%%\n", hb_data.availability);
-            printf("Latency: %.2f ms\n", hb_data.latency);
-            printf("------------------------\n");
+    for (; p < end && !batch->too_many; p++) {
+        char c = *p;
+        if (in_string) {
+            if (escape) escape = false;
+            else if (c == '\\') escape = true;
+            else if (c == '"') in_string = false;
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && depth > 0) {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            batch_add_record(batch, element, p);
+            element = p + 1;
+            seen_comma = true;
+        } else if (c == ']') {
+            // "[]" is an empty batch, not one empty record
+            char *q = element;
+            while (q < p && is_json_space(*q)) q++;
+            if (q < p || seen_comma) batch_add_record(batch, element, p);
             
-            add_to_history(&hb_data);
+            for (p++; p < end; p++) {
+                if (!is_json_space(*p)) return false;
+            }
+            return true;
+        } else if (c == '}') {
+            return false;
+        }
+    }
+    return batch->too_many;
+}
+
+// POST /api/heartbeat/batch with a JSON array or NDJSON (one heartbeat per
+// line). Records are validated independently and every valid one is
+// committed under a single history lock.
+static void route_post_batch(HttpRequest *req, OutputBuffer *out) {
+    HeartbeatBatch batch = {0};
+    output_buffer_init(&batch.status);
+    
+    char *p = req->body;
+    char *end = req->body + req->body_len;
+    while (p < end && is_json_space(*p)) p++;
+    
+    bool well_formed = true;
+    if (p < end && *p == '[') {
+        well_formed = split_json_array(&batch, p, end);
+    } else {
+        while (p < end && !batch.too_many) {
+            char *line_end = memchr(p, '\n', (size_t)(end - p));
+            if (!line_end) line_end = end;
             
-            const char *response = "OK";
-            send(client_socket, response, strlen(response), 0);
-        } else {
-            const char *response = "Invalid JSON data";
-            send(client_socket, response, strlen(response), 0);
+            char *q = p;
+            while (q < line_end && is_json_space(*q)) q++;
+            if (q < line_end) batch_add_record(&batch, p, line_end);
+            p = line_end + 1;
         }
-        close(client_socket);
-        return NULL;
     }
     
-    if (strstr(buffer, "GET /api/heartbeat/history")) {
-        char *history_json = get_history_json();
-        if (history_json) {
-            char http_response[BUFFER_SIZE];
-            snprintf(http_response, BUFFER_SIZE,
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: application/json\r\n"
-                "Connection: close\r\n"
-                "Content-Length: %zu\r\n\r\n"
-                "%s", strlen(history_json), history_json);
-            send(client_socket, http_response, strlen(http_response), 0);
-            free(history_json);
+    if (batch.too_many) {
+        respond_json_error(out, req, 413, "too many records in batch");
+    } else if (!well_formed) {
+        respond_json_error(out, req, 400, "malformed JSON array");
+    } else if (batch.count + batch.rejected == 0) {
+        respond_json_error(out, req, 400, "empty batch");
+    } else {
+        time_t now = time(NULL);
+        time_t *timestamps = malloc((batch.count ? batch.count : 1) * sizeof(time_t));
+        if (!timestamps) {
+            respond_json_error(out, req, 500, "out of memory");
         } else {
-            const char *http_response = 
-                "HTTP/1.1 500 Internal Server Error\r\n"
-                "Content-Type: text/plain\r\n"
-                "Connection: close\r\n"
-                "Content-Length: 21\r\n\r\n"
-                "Failed to get history";
-            send(client_socket, http_response, strlen(http_response), 0);
-        }
-        close(client_socket);
-        return NULL;
+            for (size_t i = 0; i < batch.count; i++) timestamps[i] = now;
+            add_batch_to_history(batch.data, timestamps, batch.count);
+            free(timestamps);
+            if (batch.rejected > 0) {
+                metrics_add(COUNTER_HEARTBEATS_REJECTED, batch.rejected);
+                log_warn("batch", "accepted=%zu rejected=%zu", batch.count, batch.rejected);
+            } else {
+                log_info_sampled("batch", "accepted=%zu rejected=0", batch.count);
+            }
+            
+            OutputBuffer body;
+            output_buffer_init(&body);
+            output_buffer_printf(&body, "{\"accepted\":%zu,\"rejected\":%zu,\"results\":[",
+                                 batch.count, batch.rejected);
+            output_buffer_append(&body, batch.status.data, batch.status.len);
+            output_buffer_append(&body, "]}", 2);
+            respond_json(out, req, 200, body.data, body.len);
+            output_buffer_free(&body);
+        }
     }
-    else if (strstr(buffer, "POST /api/heartbeat")) {
-        char *body = strstr(buffer, "\r\n\r\n");
-        if (!body) {
-            const char *response = "HTTP/1.1 400 Bad Request\r\n\r\n";
-            send(client_socket, response, strlen(response), 0);
-            close(client_socket);
-            return NULL;
+    
+    free(batch.data);
+    output_buffer_free(&batch.status);
+}
+
+// GET /api/heartbeat/udp: UDP ingestion and loss counters
+static void route_get_udp_stats(HttpRequest *req, OutputBuffer *out) {
+    UdpStats stats;
+    udp_get_stats(&stats);
+    
+    OutputBuffer body;
+    output_buffer_init(&body);
+    output_buffer_printf(&body,
+        "{\"enabled\":%s,\"datagrams\":%llu,\"malformed\":%llu,"
+        "\"samples_accepted\":%llu,\"samples_rejected\":%llu,"
+        "\"frames_lost\":%llu,\"frames_duplicate\":%llu,"
+        "\"frames_reordered\":%llu,\"senders\":%llu}",
+        udp_listener_enabled() ? "true" : "false",
+        (unsigned long long)stats.datagrams, (unsigned long long)stats.malformed,
+        (unsigned long long)stats.samples_accepted, (unsigned long long)stats.samples_rejected,
+        (unsigned long long)stats.frames_lost, (unsigned long long)stats.frames_duplicate,
+        (unsigned long long)stats.frames_reordered, (unsigned long long)stats.senders);
+    http_respond(out, req, 200, "application/json", body.data, body.len);
+    output_buffer_free(&body);
+}
+
+// GET /api/heartbeat/stats[?host=...&window=60|300|900]
+// Fleet-wide or per-host summaries of the last window seconds, answered from
+// the incrementally maintained sketches rather than by scanning history.
+static void route_get_stats(HttpRequest *req, OutputBuffer *out) {
+    char value[MAX_VALUE_LEN];
+    int window = 300;
+    if (get_query_param(req->query, "window", value, sizeof(value))) {
+        window = atoi(value);
+    }
+    if (!stats_window_supported(window)) {
+        respond_json_error(out, req, 400, "window must be 60, 300 or 900");
+        return;
+    }
+    
+    StatsSummary summary[METRIC_COUNT];
+    TsHostInfo info;
+    bool per_host = get_query_param(req->query, "host", value, sizeof(value));
+    if (per_host) {
+        if (!tsdb_query_stats(value, window, time(NULL), summary, &info)) {
+            respond_json_error(out, req, 404, "unknown host");
+            return;
         }
+    } else {
+        stats_query_fleet(window, time(NULL), summary);
+    }
+    
+    OutputBuffer body;
+    output_buffer_init(&body);
+    output_buffer_printf(&body, "{\"window\":%d,\"scope\":\"%s\"", window, per_host ? "host" : "fleet");
+    if (per_host) {
+        append_str(&body, ",\"host\":");
+        output_buffer_append_json_string(&body, info.local_ip);
+        append_str(&body, ",\"hostname\":");
+        output_buffer_append_json_string(&body, info.hostname);
+    }
+    output_buffer_printf(&body, ",\"samples\":%llu,\"metrics\":{",
+                         (unsigned long long)summary[0].count);
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const StatsSummary *s = &summary[m];
+        output_buffer_printf(&body,
+            "%s\"%s\":{\"count\":%llu,\"min\":%.7g,\"max\":%.7g,\"mean\":%.7g,"
+            "\"p50\":%.7g,\"p95\":%.7g,\"p99\":%.7g}",
+            m > 0 ? "," : "", metric_names[m], (unsigned long long)s->count,
+            s->min, s->max, s->mean, s->p50, s->p95, s->p99);
+    }
+    append_str(&body, "}}");
+    
+    respond_json(out, req, 200, body.data, body.len);
+    output_buffer_free(&body);
+}
+
+// GET /api/heartbeat/anomalies[?host=...&limit=N]
+// The most recent samples the ingest-time detector flagged, newest first
+static void route_get_anomalies(HttpRequest *req, OutputBuffer *out) {
+    char host[MAX_VALUE_LEN];
+    char value[MAX_VALUE_LEN];
+    bool filtered = get_query_param(req->query, "host", host, sizeof(host));
+    size_t limit = 100;
+    if (get_query_param(req->query, "limit", value, sizeof(value)) && atol(value) > 0) {
+        limit = (size_t)atol(value);
+    }
+    if (limit > ANOMALY_LOG_CAPACITY) limit = ANOMALY_LOG_CAPACITY;
+    
+    AnomalyEvent *events = malloc(limit * sizeof(AnomalyEvent));
+    if (!events) {
+        respond_json_error(out, req, 500, "out of memory");
+        return;
+    }
+    size_t n = anomaly_recent(filtered ? host : NULL, events, limit);
+    AnomalyStats stats;
+    anomaly_get_stats(&stats);
+    
+    OutputBuffer body;
+    output_buffer_init(&body);
+    output_buffer_printf(&body,
+        "{\"hosts_tracked\":%llu,\"flagged_total\":%llu,\"z_threshold\":%g,\"anomalies\":[",
+        (unsigned long long)stats.hosts, (unsigned long long)stats.flagged, ANOMALY_Z_THRESHOLD);
+    for (size_t i = 0; i < n; i++) {
+        const AnomalyEvent *event = &events[i];
+        output_buffer_printf(&body, "%s{\"timestamp\":%lld,\"host\":", i > 0 ? "," : "",
+                             (long long)event->timestamp);
+        output_buffer_append_json_string(&body, event->local_ip);
+        append_str(&body, ",\"hostname\":");
+        output_buffer_append_json_string(&body, event->hostname);
+        output_buffer_printf(&body,
+            ",\"metric\":\"%s\",\"value\":%.15g,\"mean\":%.7g,\"stddev\":%.7g,\"z\":%.3f}",
+            metric_names[event->metric], event->value, event->mean, event->stddev, event->z);
+    }
+    append_str(&body, "]}");
+    
+    respond_json(out, req, 200, body.data, body.len);
+    output_buffer_free(&body);
+    free(events);
+}
+
+// GET /api/heartbeat/alerts[?rule=...&host=...&limit=N]
+// Recent alert rule firings, newest first
+static void route_get_alerts(HttpRequest *req, OutputBuffer *out) {
+    char rule[MAX_VALUE_LEN];
+    char host[MAX_VALUE_LEN];
+    char value[MAX_VALUE_LEN];
+    bool by_rule = get_query_param(req->query, "rule", rule, sizeof(rule));
+    bool by_host = get_query_param(req->query, "host", host, sizeof(host));
+    size_t limit = 100;
+    if (get_query_param(req->query, "limit", value, sizeof(value)) && atol(value) > 0) {
+        limit = (size_t)atol(value);
+    }
+    if (limit > RULES_LOG_CAPACITY) limit = RULES_LOG_CAPACITY;
+    
+    RuleEvent *events = malloc(limit * sizeof(RuleEvent));
+    if (!events) {
+        respond_json_error(out, req, 500, "out of memory");
+        return;
+    }
+    size_t n = rules_recent(by_rule ? rule : NULL, by_host ? host : NULL, events, limit);
+    RulesStats stats;
+    rules_get_stats(&stats);
+    
+    OutputBuffer body;
+    output_buffer_init(&body);
+    output_buffer_printf(&body, "{\"rules\":%llu,\"fired_total\":%llu,\"alerts\":[",
+                         (unsigned long long)stats.rules, (unsigned long long)stats.fired);
+    for (size_t i = 0; i < n; i++) {
+        const RuleEvent *event = &events[i];
+        output_buffer_printf(&body, "%s{\"timestamp\":%lld,\"rule\":", i > 0 ? "," : "",
+                             (long long)event->timestamp);
+        output_buffer_append_json_string(&body, event->rule);
+        append_str(&body, ",\"host\":");
+        output_buffer_append_json_string(&body, event->local_ip);
+        append_str(&body, ",\"hostname\":");
+        output_buffer_append_json_string(&body, event->hostname);
+        output_buffer_printf(&body, ",\"samples\":%u", event->samples);
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            output_buffer_printf(&body, ",\"%s\":%.15g", metric_names[m], event->values[m]);
+        }
+        append_str(&body, "}");
+    }
+    append_str(&body, "]}");
+    
+    respond_json(out, req, 200, body.data, body.len);
+    output_buffer_free(&body);
+    free(events);
+}
+
+// Threshold filters on the latest metric values, from ?<metric>_gt=X and
+// ?<metric>_lt=X. Metrics may also go by their short names.
+typedef struct {
+    bool has_gt[METRIC_COUNT];
+    bool has_lt[METRIC_COUNT];
+    double gt[METRIC_COUNT];
+    double lt[METRIC_COUNT];
+} MetricFilter;
+
+static const char *const metric_short_names[METRIC_COUNT] = {
+    "cpu", "mem", "disk", "availability", "latency"
+};
+
+static int find_filter_metric(const char *name, size_t len) {
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        if ((strlen(metric_names[m]) == len && memcmp(name, metric_names[m], len) == 0) ||
+            (strlen(metric_short_names[m]) == len && memcmp(name, metric_short_names[m], len) == 0)) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+// Fill filter from every *_gt and *_lt parameter. On failure writes the
+// reason to err and returns false.
+static bool parse_metric_filter(const char *query, MetricFilter *filter, char *err, size_t err_size) {
+    memset(filter, 0, sizeof(*filter));
+    const char *pair = query;
+    while (pair && *pair) {
+        const char *next = strchr(pair, '&');
+        size_t pair_len = next ? (size_t)(next - pair) : strlen(pair);
+        const char *eq = memchr(pair, '=', pair_len);
+        size_t key_len = eq ? (size_t)(eq - pair) : pair_len;
+        const char *suffix = pair + key_len - 3;
+        bool is_filter = key_len > 3 && (memcmp(suffix, "_gt", 3) == 0 || memcmp(suffix, "_lt", 3) == 0);
         
-        body += 4;
-        HeartbeatData hb_data = {0};
-        bool valid_data = false;
-        
-        if (*body == '{') {
-            valid_data = process_json_data(body, &hb_data);
-        } else {
-            char *saveptr;
-            char *pair = strtok_r(body, "&", &saveptr);
-            int fields_set = 0;
-            
-            while (pair) {
-                char key[MAX_KEY_LEN];
-                char value[MAX_VALUE_LEN];
-                
-                if (parse_key_value(pair, key, sizeof(key), value, sizeof(value))) {
-                    if (strcmp(key, "local_ip") == 0 && validate_ip(value)) {
-                        strncpy(hb_data.local_ip, value, MAX_IP_LEN - 1);
-                        fields_set++;
-                    }
-                    else if (strcmp(key, "public_ip") == 0 && validate_ip(value)) {
-                        strncpy(hb_data.public_ip, value, MAX_IP_LEN - 1);
-                        fields_set++;
-                    }
-                    else if (strcmp(key, "cpu_usage") == 0) {
-                        double val = atof(value);
-                        if (validate_percentage(val)) {
-                            hb_data.cpu_usage = val;
-                            fields_set++;
-                        }
-                    }
-                    else if (strcmp(key, "memory_usage") == 0) {
-                        double val = atof(value);
-                        if (validate_percentage(val)) {
-                            hb_data.memory_usage = val;
-                            fields_set++;
-                        }
-                    }
-                    else if (strcmp(key, "disk_usage") == 0) {
-                        double val = atof(value);
-                        if (validate_percentage(val)) {
-                            hb_data.disk_usage = val;
-                            fields_set++;
-                        }
-                    }
-                    else if (strcmp(key, "availability") == 0) {
-                        double val = atof(value);
-                        if (validate_percentage(val)) {
-                            hb_data.availability = val;
-                            fields_set++;
-                        }
-                    }
-                    else if (strcmp(key, "latency") == 0) {
-                        double val = atof(value);
-                        if (validate_latency(val)) {
-                            hb_data.latency = val;
-                            fields_set++;
-                        }
-                    }
-                }
-                pair = strtok_r(NULL, "&", &saveptr);
+        if (is_filter) {
+            char name[MAX_KEY_LEN];
+            if (key_len >= sizeof(name)) {
+                snprintf(err, err_size, "unknown metric filter");
+                return false;
+            }
+            memcpy(name, pair, key_len);
+            name[key_len] = '\0';
+            int m = find_filter_metric(name, key_len - 3);
+            if (m < 0) {
+                snprintf(err, err_size, "unknown metric filter %s", name);
+                return false;
             }
             
-            valid_data = (fields_set == 7);
+            char value[MAX_VALUE_LEN];
+            char *end = value;
+            double threshold = 0;
+            if (get_query_param(query, name, value, sizeof(value))) threshold = strtod(value, &end);
+            if (end == value || *end) {
+                snprintf(err, err_size, "%s must be a number", name);
+                return false;
+            }
+            if (suffix[1] == 'g') {
+                filter->gt[m] = threshold;
+                filter->has_gt[m] = true;
+            } else {
+                filter->lt[m] = threshold;
+                filter->has_lt[m] = true;
+            }
+        }
+        pair = next ? next + 1 : NULL;
+    }
+    return true;
+}
+
+static bool metric_filter_matches(const MetricFilter *filter, const HeartbeatData *data) {
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        double v = heartbeat_metric_value(data, (HeartbeatMetric)m);
+        if (filter->has_gt[m] && !(v > filter->gt[m])) return false;
+        if (filter->has_lt[m] && !(v < filter->lt[m])) return false;
+    }
+    return true;
+}
+
+// GET /api/hosts[?stale=true|false&<metric>_gt=X&<metric>_lt=X]
+// The latest heartbeat of every host, from the per-host series: one short
+// lock per host, no history scan and no deduplication. Rows are streamed,
+// so a large fleet is never serialized in one piece.
+static void route_get_hosts(HttpRequest *req, OutputBuffer *out) {
+    char value[MAX_VALUE_LEN];
+    int stale_filter = -1;
+    if (get_query_param(req->query, "stale", value, sizeof(value))) {
+        if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) stale_filter = 1;
+        else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0) stale_filter = 0;
+        else {
+            respond_json_error(out, req, 400, "stale must be true or false");
+            return;
+        }
+    }
+    MetricFilter filter;
+    char err[MAX_KEY_LEN + 32];
+    if (!parse_metric_filter(req->query, &filter, err, sizeof(err))) {
+        respond_json_error(out, req, 400, err);
+        return;
+    }
+    
+    time_t now = time(NULL);
+    size_t count = tsdb_host_count();
+    size_t matched = 0;
+    JsonStream stream;
+    json_stream_init(&stream, out, req);
+    OutputBuffer *body = &stream.body;
+    output_buffer_printf(body, "{\"now\":%lld,\"hosts\":[", (long long)now);
+    for (size_t id = 0; id < count; id++) {
+        TsHostState state;
+        if (!tsdb_host_state(id, &state)) break;
+        bool stale = tsdb_host_stale(&state, now);
+        if ((stale_filter >= 0 && stale != (stale_filter == 1)) ||
+            !metric_filter_matches(&filter, &state.latest)) {
+            continue;
         }
         
-        if (valid_data) {
-            printf("HTTP Heartbeat Data:\n");
-            printf("Local IP: %s\n", hb_data.local_ip);
-            printf("Public IP: %s\n", hb_data.public_ip);
-            printf("CPU Usage: %.2f%%\n", hb_data.cpu_usage);
-            printf("Memory Usage: %.2f%%\n", hb_data.memory_usage);
-            printf("Disk Usage: %.2f%%\n", hb_data.disk_usage);
-            printf("Availability: %.2f%%\n", hb_data.availability);
-            printf("Latency: %.2f ms\n", hb_data.latency);
-            printf("------------------------\n");
-            
-            add_to_history(&hb_data);
+        const HeartbeatData *data = &state.latest;
+        output_buffer_printf(body, "%s{\"id\":%u,\"host\":", matched > 0 ? "," : "", state.id);
+        output_buffer_append_json_string(body, data->local_ip);
+        append_str(body, ",\"public_ip\":");
+        output_buffer_append_json_string(body, data->public_ip);
+        append_str(body, ",\"hostname\":");
+        output_buffer_append_json_string(body, data->hostname);
+        output_buffer_printf(body,
+            ",\"last_seen\":%lld,\"age\":%lld,\"interval\":%.3g,\"stale\":%s,\"samples\":%llu",
+            (long long)state.last_seen, (long long)(now - state.last_seen), state.interval,
+            stale ? "true" : "false", (unsigned long long)state.samples);
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            output_buffer_printf(body, ",\"%s\":%.15g", metric_names[m],
+                                 heartbeat_metric_value(data, (HeartbeatMetric)m));
+        }
+        output_buffer_append(body, "}", 1);
+        matched++;
+        json_stream_flush(&stream, false);
+    }
+    output_buffer_printf(body, "],\"count\":%zu,\"total\":%zu}", matched, count);
+    json_stream_flush(&stream, true);
+    json_stream_free(&stream);
+}
+
+// GET /api/heartbeat/stream[?host=...]
+// Server-Sent Events: a "heartbeat" event for every heartbeat accepted from
+// now on (or after Last-Event-ID), and "resync" if the client fell so far
+// behind that events were lost. The connection's loop pumps the stream.
+static void route_get_stream(HttpRequest *req, OutputBuffer *out) {
+    if (req->minor_version == 0) {
+        respond_json_error(out, req, 505, "streaming requires HTTP/1.1");
+        return;
+    }
+    
+    char host[MAX_VALUE_LEN];
+    bool filtered = get_query_param(req->query, "host", host, sizeof(host));
+    
+    bool resume = false;
+    unsigned long long last_id = 0;
+    size_t id_len;
+    const char *id = http_get_header(req, "Last-Event-ID", &id_len);
+    if (id && id_len > 0 && id_len < 21) {
+        char digits[21];
+        memcpy(digits, id, id_len);
+        digits[id_len] = '\0';
+        char *end;
+        last_id = strtoull(digits, &end, 10);
+        resume = *end == '\0';
+    }
+    
+    req->keep_alive = true;
+    http_respond_chunked(out, req, 200, "text/event-stream", NULL);
+    if (req->head || !req->stream) return;
+    
+    stream_subscribe(req->stream, filtered ? host : NULL, resume, last_id);
+    size_t mark = http_chunk_begin(out);
+    append_str(out, "retry: 1000\n\n");
+    http_chunk_end(out, mark);
+}
+
+static void append_metric(OutputBuffer *out, const char *name, const char *help,
+                          const char *type, unsigned long long value) {
+    output_buffer_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                         name, help, name, type, name, value);
+}
+
+// GET /metrics: Prometheus text exposition
+static void route_get_metrics(HttpRequest *req, OutputBuffer *out) {
+    OutputBuffer body;
+    output_buffer_init(&body);
+    metrics_render(&body);
+    
+    append_metric(&body, "heartbeat_history_records", "Heartbeats held in the history rings.",
+                  "gauge", get_history_count());
+    append_metric(&body, "heartbeat_history_capacity", "Capacity of the history rings.",
+                  "gauge", get_history_capacity());
+    append_metric(&body, "heartbeat_history_shards", "Shards the history is split into.",
+                  "gauge", history_shard_count);
+    append_metric(&body, "heartbeat_tsdb_hosts", "Hosts with a time series.",
+                  "gauge", tsdb_host_count());
+    append_metric(&body, "heartbeat_tsdb_raw_bytes", "Memory held by compressed raw sample blocks.",
+                  "gauge", tsdb_raw_bytes());
+    append_metric(&body, "heartbeat_tsdb_raw_late_dropped_total",
+                  "Late samples older than the open raw block, kept only in rollups.",
+                  "counter", tsdb_raw_late_dropped());
+    
+    SnapshotStats snapshots;
+    history_snapshot_get_stats(&snapshots);
+    append_metric(&body, "heartbeat_history_snapshot_hits_total", "History reads served from a cached snapshot.",
+                  "counter", snapshots.hits);
+    append_metric(&body, "heartbeat_history_snapshot_builds_total", "History snapshots serialized.",
+                  "counter", snapshots.builds);
+    
+    if (udp_listener_enabled()) {
+        UdpStats udp;
+        udp_get_stats(&udp);
+        append_metric(&body, "heartbeat_udp_datagrams_total", "UDP datagrams received.",
+                      "counter", udp.datagrams);
+        append_metric(&body, "heartbeat_udp_malformed_total", "UDP datagrams that could not be parsed.",
+                      "counter", udp.malformed);
+        append_metric(&body, "heartbeat_udp_samples_rejected_total",
+                      "UDP samples that failed validation or were stamped out of range.",
+                      "counter", udp.samples_rejected);
+        append_metric(&body, "heartbeat_udp_frames_lost_total", "UDP frames missing from sender sequences.",
+                      "counter", udp.frames_lost);
+    }
+    AnomalyStats anomalies;
+    anomaly_get_stats(&anomalies);
+    append_metric(&body, "heartbeat_anomaly_hosts", "Hosts with anomaly detector state.",
+                  "gauge", anomalies.hosts);
+    append_metric(&body, "heartbeat_anomalies_total", "Metric values flagged as anomalous.",
+                  "counter", anomalies.flagged);
+    append_metric(&body, "heartbeat_anomaly_untracked_total", "Samples from hosts the detector had no room for.",
+                  "counter", anomalies.untracked);
+    if (ratelimit_enabled()) {
+        RateLimitStats limits;
+        ratelimit_get_stats(&limits);
+        append_metric(&body, "heartbeat_ratelimit_sources", "Source addresses with a token bucket.",
+                      "gauge", limits.sources);
+        append_metric(&body, "heartbeat_ratelimit_allowed_total", "Connections and datagrams admitted by the rate limit.",
+                      "counter", limits.allowed);
+        append_metric(&body, "heartbeat_ratelimit_limited_total", "Connections and datagrams refused by the rate limit.",
+                      "counter", limits.limited);
+        append_metric(&body, "heartbeat_ratelimit_evictions_total", "Token buckets evicted to make room for new sources.",
+                      "counter", limits.evictions);
+    }
+    RulesStats rules;
+    rules_get_stats(&rules);
+    append_metric(&body, "heartbeat_alert_rules", "Alert rules loaded.",
+                  "gauge", rules.rules);
+    append_metric(&body, "heartbeat_alert_rule_evaluations_total", "Alert rules evaluated on ingest.",
+                  "counter", rules.evaluated);
+    append_metric(&body, "heartbeat_alerts_fired_total", "Alert rule firings.",
+                  "counter", rules.fired);
+    append_metric(&body, "heartbeat_alert_states", "Rule and host pairs with alert state.",
+                  "gauge", rules.states);
+    append_metric(&body, "heartbeat_alert_untracked_total", "Matching evaluations the alert state table had no room for.",
+                  "counter", rules.untracked);
+    append_metric(&body, "heartbeat_alert_file_errors_total", "Alert firings that could not be written to the alert file.",
+                  "counter", rules.file_errors);
+    StreamStats stream;
+    stream_get_stats(&stream);
+    append_metric(&body, "heartbeat_stream_subscribers", "Open /api/heartbeat/stream connections.",
+                  "gauge", stream.subscribers);
+    append_metric(&body, "heartbeat_stream_resyncs_total", "Times a stream subscriber fell a full ring behind.",
+                  "counter", stream.resyncs);
+    append_metric(&body, "heartbeat_stream_dropped_total", "Events lagging subscribers skipped.",
+                  "counter", stream.dropped);
+    if (store_enabled()) {
+        StoreStats store;
+        store_get_stats(&store);
+        append_metric(&body, "heartbeat_store_segments", "Segment files retained on disk.",
+                      "gauge", store.segments);
+        append_metric(&body, "heartbeat_store_write_errors_total", "Records the segment store failed to write.",
+                      "counter", store.write_errors);
+    }
+    
+    http_respond(out, req, 200, "text/plain; version=0.0.4", body.data, body.len);
+    output_buffer_free(&body);
+}
+
+typedef void (*RouteHandler)(HttpRequest *req, OutputBuffer *out);
+
+typedef struct {
+    const char *method;
+    const char *path;
+    RouteHandler handler;
+} Route;
+
+static const Route routes[] = {
+    { "GET",  "/api/heartbeat/history",    route_get_history },
+    { "POST", "/api/heartbeat",            route_post_heartbeat },
+    { "POST", "/api/heartbeat/batch",      route_post_batch },
+    { "GET",  "/api/heartbeat/udp",        route_get_udp_stats },
+    { "GET",  "/api/heartbeat/stats",      route_get_stats },
+    { "GET",  "/api/heartbeat/anomalies",  route_get_anomalies },
+    { "GET",  "/api/heartbeat/alerts",     route_get_alerts },
+    { "GET",  "/api/heartbeat/stream",     route_get_stream },
+    { "GET",  "/api/hosts",                route_get_hosts },
+    { "GET",  "/metrics",                  route_get_metrics },
+};
+
+static bool span_is(const char *span, size_t len, const char *str) {
+    return strlen(str) == len && memcmp(span, str, len) == 0;
+}
+
+// Dispatch on exact method + path. HEAD is served by the GET handler.
+static void dispatch_request(HttpRequest *req, OutputBuffer *out) {
+    bool path_found = false;
+    metrics_inc(COUNTER_HTTP_REQUESTS);
+    
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        const Route *route = &routes[i];
+        if (!span_is(req->path, req->path_len, route->path)) continue;
+        
+        path_found = true;
+        if (span_is(req->method, req->method_len, route->method) ||
+            (req->head && strcmp(route->method, "GET") == 0)) {
+            route->handler(req, out);
+            return;
+        }
+    }
+    
+    if (path_found) {
+        respond_text(out, req, 405, "Method Not Allowed");
+    } else {
+        respond_text(out, req, 404, "Not Found");
+    }
+}
+
+// Handle one raw JSON heartbeat (not wrapped in HTTP)
+static void handle_raw_json(char *json, OutputBuffer *out) {
+    HeartbeatData hb_data = {0};
+    if (process_json_data(json, &hb_data)) {
+        log_heartbeat("tcp", &hb_data);
+        add_to_history(&hb_data);
+        
+        append_str(out, "OK");
+    } else {
+        metrics_inc(COUNTER_HEARTBEATS_REJECTED);
+        log_warn("heartbeat_rejected", "source=tcp bytes=%zu", strlen(json));
+        append_str(out, "Invalid JSON data");
+    }
+}
+
+// Length of the JSON object at the start of data once its closing brace has
+// arrived, or 0 while it is still incomplete. Scanning resumes where the
+// previous call stopped.
+static size_t scan_json_object(ProtocolState *state, const char *data, size_t len) {
+    for (size_t i = state->json_scan; i < len; i++) {
+        char c = data[i];
+        if (state->json_in_string) {
+            if (state->json_escape) state->json_escape = false;
+            else if (c == '\\') state->json_escape = true;
+            else if (c == '"') state->json_in_string = false;
+        } else if (c == '"') {
+            state->json_in_string = true;
+        } else if (c == '{' || c == '[') {
+            state->json_depth++;
+        } else if ((c == '}' || c == ']') && --state->json_depth == 0) {
+            state->json_scan = i + 1;
+            return i + 1;
+        }
+    }
+    state->json_scan = len;
+    return 0;
+}
+
+// Answer one binary frame. Returns false on a protocol error.
+static bool handle_binary_frame(ProtocolState *state, const HbFrame *frame, OutputBuffer *out) {
+    uint8_t reply[HB_HEADER_SIZE + 4];
+    
+    switch (frame->type) {
+    case HB_FRAME_HELLO: {
+        if (frame->length < 2 || frame->length < 2 + frame->payload[1]) return false;
+        size_t name_len = frame->payload[1];
+        if (name_len >= MAX_HOSTNAME_LEN) name_len = MAX_HOSTNAME_LEN - 1;
+        memcpy(state->hostname, frame->payload + 2, name_len);
+        state->hostname[name_len] = '\0';
+        
+        uint8_t version = frame->payload[0] < HB_VERSION ? frame->payload[0] : HB_VERSION;
+        hb_encode_header(reply, HB_FRAME_HELLO, 2, frame->seq);
+        reply[HB_HEADER_SIZE] = version;
+        reply[HB_HEADER_SIZE + 1] = 0;
+        output_buffer_append(out, (const char *)reply, HB_HEADER_SIZE + 2);
+        return version > 0;
+    }
+    case HB_FRAME_SAMPLES: {
+        long count = hb_samples_count(frame);
+        if (count < 0) return false;
+        
+        time_t now = time(NULL);
+        unsigned accepted = 0, rejected = 0;
+        for (long i = 0; i < count; i++) {
+            HbSample sample;
+            HeartbeatData hb_data;
+            hb_frame_sample(frame, (size_t)i, &sample);
+            hb_sample_to_heartbeat(&sample, &hb_data);
+            memcpy(hb_data.hostname, state->hostname, MAX_HOSTNAME_LEN);
             
-            const char *http_response = 
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: text/plain\r\n"
-                "Connection: close\r\n"
-                "Content-Length: 2\r\n\r\n"
-                "OK";
-            send(client_socket, http_response, strlen(http_response), 0);
+            time_t timestamp;
+            if (!validate_metrics(&hb_data) || !hb_sample_time(&sample, now, &timestamp)) {
+                rejected++;
+                continue;
+            }
+            add_to_history_at(&hb_data, timestamp);
+            accepted++;
+        }
+        if (rejected > 0) {
+            metrics_add(COUNTER_HEARTBEATS_REJECTED, rejected);
+            log_warn("binary_frame", "seq=%u accepted=%u rejected=%u",
+                     frame->seq, accepted, rejected);
         } else {
-            const char *http_response = 
-                "HTTP/1.1 400 Bad Request\r\n"
-                "Content-Type: text/plain\r\n"
-                "Connection: close\r\n"
-                "Content-Length: 16\r\n\r\n"
-                "Invalid data sent";
-            send(client_socket, http_response, strlen(http_response), 0);
+            log_info_sampled("binary_frame", "seq=%u accepted=%u", frame->seq, accepted);
+        }
+        
+        hb_encode_header(reply, HB_FRAME_ACK, 4, frame->seq);
+        reply[HB_HEADER_SIZE] = (uint8_t)(accepted >> 8);
+        reply[HB_HEADER_SIZE + 1] = (uint8_t)accepted;
+        reply[HB_HEADER_SIZE + 2] = (uint8_t)(rejected >> 8);
+        reply[HB_HEADER_SIZE + 3] = (uint8_t)rejected;
+        output_buffer_append(out, (const char *)reply, HB_HEADER_SIZE + 4);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+void protocol_state_init(ProtocolState *state) {
+    memset(state, 0, sizeof(*state));
+    state->mode = PROTO_UNKNOWN;
+    http_parser_reset(&state->http);
+}
+
+void protocol_state_free(ProtocolState *state) {
+    stream_unsubscribe(&state->stream);
+}
+
+// Consume complete requests from data[0..len) and append their responses to
+// out. data must have one spare byte past len. Returns the number of bytes
+// consumed; a trailing partial request is left for the next call. *close_after
+// is set once the connection should be closed after the output is flushed.
+size_t process_input(ProtocolState *state, char *data, size_t len, bool eof,
+                     OutputBuffer *out, bool *close_after) {
+    size_t consumed = 0;
+    
+    // A stream subscriber has nothing more to say
+    if (state->mode == PROTO_STREAM) {
+        if (eof) *close_after = true;
+        return len;
+    }
+    
+    while (consumed < len && !*close_after) {
+        char *start = data + consumed;
+        size_t avail = len - consumed;
+        
+        if (state->mode == PROTO_UNKNOWN) {
+            if (start[0] == '{') state->mode = PROTO_RAW_JSON;
+            else if (hb_is_frame_start((const uint8_t *)start, avail)) state->mode = PROTO_BINARY;
+            else state->mode = PROTO_HTTP;
         }
+        
+        if (state->mode == PROTO_BINARY) {
+            // Frames are answered in order until the peer closes
+            HbFrame frame;
+            size_t frame_len;
+            uint64_t parse_start = metrics_now();
+            HbParseStatus status = hb_parse_frame((const uint8_t *)start, avail, &frame, &frame_len);
+            if (status == HB_PARSE_INCOMPLETE) break;
+            metrics_observe(STAGE_PARSE, parse_start);
+            if (status == HB_PARSE_ERROR || !handle_binary_frame(state, &frame, out)) {
+                metrics_inc(COUNTER_PARSE_ERRORS);
+                *close_after = true;
+                consumed = len;
+                break;
+            }
+            consumed += frame_len;
+            continue;
+        }
+        
+        if (state->mode == PROTO_RAW_JSON) {
+            // One heartbeat per connection, then close (legacy TCP behavior)
+            size_t end = scan_json_object(state, start, avail);
+            if (end == 0 && !eof && avail < RAW_JSON_MAX_SIZE) break;
+            if (end == 0) end = avail;
+            
+            log_debug("raw_json", "bytes=%zu", end);
+            char saved = start[end];
+            start[end] = '\0';
+            handle_raw_json(start, out);
+            start[end] = saved;
+            consumed += end;
+            *close_after = true;
+            break;
+        }
+        
+        HttpRequest req;
+        size_t request_len;
+        HttpParseStatus status = http_parse(&state->http, start, avail, &req, &request_len);
+        if (status == HTTP_PARSE_INCOMPLETE) {
+            // Large uploads (batches) wait for this before sending the body
+            if (state->http.headers_done && state->http.expect_continue &&
+                !state->http.continue_sent) {
+                append_str(out, "HTTP/1.1 100 Continue\r\n\r\n");
+                state->http.continue_sent = true;
+            }
+            break;
+        }
+        if (status == HTTP_PARSE_ERROR) {
+            metrics_inc(COUNTER_PARSE_ERRORS);
+            log_warn("http_error", "status=%d", state->http.error_status);
+            respond_text(out, NULL, state->http.error_status,
+                         http_status_text(state->http.error_status));
+            *close_after = true;
+            consumed = len;
+            break;
+        }
+        
+        log_debug("http_request", "method=%.*s path=%.*s bytes=%zu",
+                  (int)req.method_len, req.method, (int)req.path_len, req.path, request_len);
+        req.stream = &state->stream;
+        dispatch_request(&req, out);
+        http_request_done(&state->http, start, request_len);
+        consumed += request_len;
+        
+        if (state->stream.active) {
+            // Anything pipelined behind the stream request is dropped
+            state->mode = PROTO_STREAM;
+            consumed = len;
+            break;
+        }
+        if (!req.keep_alive) {
+            *close_after = true;
+        }
+    }
+    
+    // A peer that half-closed mid-request will never complete it
+    if (eof && consumed < len && !*close_after && state->mode == PROTO_HTTP) {
+        respond_text(out, NULL, 400, "Bad Request");
+        *close_after = true;
+        consumed = len;
+    }
+    if (eof) {
+        *close_after = true;
+    }
+    return consumed;
+}
+
+// Send everything in out; false once the peer is gone
+static bool send_all(int fd, OutputBuffer *out) {
+    size_t sent = 0;
+    uint64_t start = metrics_now();
+    while (sent < out->len) {
+        ssize_t n = send(fd, out->data + sent, out->len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += (size_t)n;
     }
-    else {
-        const char *http_response = 
-            "HTTP/1.1 404 Not Found\r\n"
-            "Content-Type: text/plain\r\n"
-            "Connection: close\r\n"
-            "Content-Length: 9\r\n\r\n"
-            "Not Found";
-        send(client_socket, http_response, strlen(http_response), 0);
+    if (out->len > 0) metrics_observe(STAGE_RESPOND, start);
+    metrics_add(COUNTER_BYTES_WRITTEN, sent);
+    bool ok = sent == out->len;
+    out->len = 0;
+    return ok;
+}
+
+// Thread-per-connection streams poll the broadcast ring on a timer and end
+// when a write fails (at the latest on the next keepalive)
+static void serve_stream(int fd, StreamSubscriber *sub, OutputBuffer *out) {
+    while (1) {
+        if (stream_pump(sub, out, time(NULL)) && !send_all(fd, out)) return;
+        usleep(STREAM_FLUSH_INTERVAL_MS * 1000);
     }
+}
+
+// Handle client connection (thread-per-connection model)
+void *handle_client(void *arg) {
+    int client_socket = *(int *)arg;
+    free(arg);
+    
+    // Idle persistent connections give their thread back after a while
+    struct timeval timeout = { .tv_sec = HTTP_KEEPALIVE_TIMEOUT, .tv_usec = 0 };
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
     
+    ProtocolState state;
+    protocol_state_init(&state);
+    OutputBuffer in, out;
+    output_buffer_init(&in);
+    output_buffer_init(&out);
+    bool close_after = false;
+    
+    while (!close_after) {
+        if (!output_buffer_reserve(&in, BUFFER_SIZE + 1)) break;
+        ssize_t valread = read(client_socket, in.data + in.len, BUFFER_SIZE);
+        if (valread < 0) break;
+        in.len += (size_t)valread;
+        metrics_add(COUNTER_BYTES_READ, (uint64_t)valread);
+        
+        size_t consumed = process_input(&state, in.data, in.len, valread == 0, &out, &close_after);
+        memmove(in.data, in.data + consumed, in.len - consumed);
+        in.len -= consumed;
+        
+        if (!send_all(client_socket, &out)) {
+            close_after = true;
+        }
+        if (!close_after && state.mode == PROTO_STREAM) {
+            serve_stream(client_socket, &state.stream, &out);
+            close_after = true;
+        }
+    }
+    
+    protocol_state_free(&state);
+    output_buffer_free(&in);
+    output_buffer_free(&out);
     close(client_socket);
+    metrics_inc(COUNTER_CONNECTIONS_CLOSED);
     return NULL;
 }
 
@@ -459,8 +1928,14 @@ void *run_tcp_server(void *arg) {
             continue;
         }
         
-        printf("New TCP connection from %s:%d\n", 
-               inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+        if (!ratelimit_admit(*new_socket, &address, TCP_PORT, metrics_now())) {
+            free(new_socket);
+            continue;
+        }
+        
+        metrics_inc(COUNTER_CONNECTIONS_ACCEPTED);
+        log_debug("accept", "port=TCP peer=%s:%d",
+                  inet_ntoa(address.sin_addr), ntohs(address.sin_port));
         
         pthread_t thread_id;
         if (pthread_create(&thread_id, NULL, handle_client, (void*)new_socket) < 0) {
@@ -530,8 +2005,14 @@ void *run_http_server(void *arg) {
             continue;
         }
         
-        printf("New HTTP connection from %s:%d\n", 
-               inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+        if (!ratelimit_admit(*new_socket, &address, HTTP_PORT, metrics_now())) {
+            free(new_socket);
+            continue;
+        }
+        
+        metrics_inc(COUNTER_CONNECTIONS_ACCEPTED);
+        log_debug("accept", "port=HTTP peer=%s:%d",
+                  inet_ntoa(address.sin_addr), ntohs(address.sin_port));
         
         pthread_t thread_id;
         if (pthread_create(&thread_id, NULL, handle_client, (void*)new_socket) < 0) {
@@ -2,21 +2,30 @@
 #define HEARTBEAT_SERVER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <netinet/in.h>
+#include <pthread.h>
 
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 4096
 #define MAX_KEY_LEN 64
 #define MAX_VALUE_LEN 128
 #define MAX_IP_LEN INET_ADDRSTRLEN
+#define MAX_HOSTNAME_LEN 64
 #define HTTP_PORT 8080
 #define TCP_PORT 8081
-#define MAX_HEARTBEATS 100
+#define UDP_PORT 8082
+#define MAX_LATENCY_MS 10000.0
+#define RAW_JSON_MAX_SIZE 65536
+#define BATCH_MAX_RECORDS 100000   // per POST /api/heartbeat/batch
+#define MAX_HEARTBEATS 100  // default history capacity, see set_history_capacity
+#define EVENT_LOOP_THREADS 4
 
 typedef struct {
     char local_ip[MAX_IP_LEN];
     char public_ip[MAX_IP_LEN];
+    char hostname[MAX_HOSTNAME_LEN];    // optional, empty when not sent
     double cpu_usage;
     double memory_usage;
     double disk_usage;
@@ -24,28 +33,74 @@ typedef struct {
     double latency;
 } HeartbeatData;
 
-// Structure for storing heartbeat history
+// Numeric heartbeat fields, in HeartbeatData order
+typedef enum {
+    METRIC_CPU_USAGE,
+    METRIC_MEMORY_USAGE,
+    METRIC_DISK_USAGE,
+    METRIC_AVAILABILITY,
+    METRIC_LATENCY,
+    METRIC_COUNT
+} HeartbeatMetric;
+
+extern const char *const metric_names[METRIC_COUNT];
+
+// One history record. Records live in a preallocated ring; next links the
+// newest record to older ones so the history can still be walked as a list
+// while holding history_mutex with no appends in flight.
 typedef struct HeartbeatNode {
     HeartbeatData data;
     time_t timestamp;
+    uint8_t anomalies;                  // (1 << HeartbeatMetric) bits flagged on ingest
     struct HeartbeatNode *next;
 } HeartbeatNode;
 
-// Global variables for heartbeat history (extern for testing)
+// Growable buffer a response is assembled in before it is written out
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} OutputBuffer;
+
+// Global variables for heartbeat history (extern for testing). heartbeat_history
+// points at the newest ring slot; history_mutex guards clearing and resizing.
 extern HeartbeatNode *heartbeat_history;
 extern pthread_mutex_t history_mutex;
 extern int heartbeat_count;
 
 // Function declarations
 void add_to_history(HeartbeatData *data);
+void add_to_history_at(const HeartbeatData *data, time_t timestamp);
+void add_batch_to_history(const HeartbeatData *data, const time_t *timestamps, size_t count);
 void clear_heartbeat_history(void);
+bool set_history_capacity(size_t capacity);
+size_t get_history_capacity(void);
+size_t snapshot_history(HeartbeatNode **out, size_t max);
 char* get_history_json();
 bool process_json_data(const char *json_str, HeartbeatData *hb_data);
+bool process_json_data_generic(const char *json_str, HeartbeatData *hb_data);
 void url_decode(char *dst, const char *src, size_t dst_size);
 bool parse_key_value(const char *pair, char *key, size_t key_len, char *value, size_t value_len);
 bool validate_ip(const char *ip);
 bool validate_percentage(double value);
 bool validate_latency(double value);
+bool validate_metrics(const HeartbeatData *data);
+void output_buffer_init(OutputBuffer *buf);
+bool output_buffer_reserve(OutputBuffer *buf, size_t extra);
+bool output_buffer_append(OutputBuffer *buf, const char *data, size_t len);
+void output_buffer_free(OutputBuffer *buf);
+bool output_buffer_printf(OutputBuffer *buf, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+bool output_buffer_append_json_string(OutputBuffer *buf, const char *str);
+double heartbeat_metric_value(const HeartbeatData *data, HeartbeatMetric metric);
+bool get_query_param(const char *query, const char *name, char *value, size_t value_len);
+
+// Per-connection protocol state; defined in heartbeat_http.h
+typedef struct ProtocolState ProtocolState;
+void protocol_state_init(ProtocolState *state);
+void protocol_state_free(ProtocolState *state);
+size_t process_input(ProtocolState *state, char *data, size_t len, bool eof,
+                     OutputBuffer *out, bool *close_after);
 void *handle_client(void *arg);
 void *run_tcp_server(void *arg);
 void *run_http_server(void *arg);
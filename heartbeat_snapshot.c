@@ -0,0 +1,201 @@
+#include "heartbeat_snapshot.h"
+#include "heartbeat_history.h"
+#include "heartbeat_json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// cache_mutex only covers looking up a slot and taking a reference to its
+// current snapshot, never serialization. build_mutex makes the readers that
+// find a slot stale wait for one rebuild instead of each doing their own.
+typedef struct {
+    pthread_mutex_t build_mutex;
+    HistorySnapshot *current;
+    size_t limit;
+    bool pretty;
+    bool used;
+} SnapshotSlot;
+
+static SnapshotSlot slots[SNAPSHOT_CACHE_SLOTS];
+static size_t next_victim;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static uint64_t hits;
+static uint64_t builds;
+
+static void init_cache(void) {
+    for (size_t i = 0; i < SNAPSHOT_CACHE_SLOTS; i++) {
+        pthread_mutex_init(&slots[i].build_mutex, NULL);
+    }
+}
+
+void history_snapshot_etag(char *etag, size_t size, uint64_t generation,
+                           size_t limit, bool pretty, ContentCoding coding) {
+    const char *name = content_coding_name(coding);
+    snprintf(etag, size, "\"h%llx-%zu%s%s%s\"", (unsigned long long)generation,
+             limit, pretty ? "p" : "", name ? "-" : "", name ? name : "");
+}
+
+void history_snapshot_put(HistorySnapshot *snap) {
+    if (snap && __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (int i = 0; i < CODING_COUNT; i++) {
+            if (snap->encoded[i]) {
+                output_buffer_free(snap->encoded[i]);
+                free(snap->encoded[i]);
+            }
+        }
+        free(snap);
+    }
+}
+
+static OutputBuffer *encode_snapshot(const HistorySnapshot *snap, ContentCoding coding) {
+    OutputBuffer *encoded = malloc(sizeof(OutputBuffer));
+    if (!encoded) return NULL;
+    output_buffer_init(encoded);
+    
+    Compressor c;
+    bool ok = compressor_init(&c, coding);
+    for (size_t off = 0; ok && off < snap->len; off += HISTORY_CHUNK_SIZE) {
+        size_t n = snap->len - off < HISTORY_CHUNK_SIZE ? snap->len - off : HISTORY_CHUNK_SIZE;
+        ok = compressor_write(&c, encoded, snap->data + off, n, off + n == snap->len);
+    }
+    compressor_end(&c);
+    if (!ok) {
+        output_buffer_free(encoded);
+        free(encoded);
+        return NULL;
+    }
+    return encoded;
+}
+
+const char *history_snapshot_body(HistorySnapshot *snap, ContentCoding *coding, size_t *len) {
+    if (compress_worthwhile(*coding, snap->len)) {
+        OutputBuffer *encoded = __atomic_load_n(&snap->encoded[*coding], __ATOMIC_ACQUIRE);
+        if (!encoded && (encoded = encode_snapshot(snap, *coding)) != NULL) {
+            // Readers racing to compress the same snapshot keep the first result
+            OutputBuffer *expected = NULL;
+            if (!__atomic_compare_exchange_n(&snap->encoded[*coding], &expected, encoded, false,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                output_buffer_free(encoded);
+                free(encoded);
+                encoded = expected;
+            }
+        }
+        if (encoded) {
+            *len = encoded->len;
+            return encoded->data;
+        }
+    }
+    *coding = CODING_IDENTITY;
+    *len = snap->len;
+    return snap->data;
+}
+
+static bool slot_matches(const SnapshotSlot *slot, size_t limit, bool pretty) {
+    return slot->used && slot->limit == limit && slot->pretty == pretty;
+}
+
+// The slot for (limit, pretty), taking over the next slot round-robin when
+// none matches. Caller holds cache_mutex.
+static SnapshotSlot *find_slot(size_t limit, bool pretty) {
+    SnapshotSlot *free_slot = NULL;
+    for (size_t i = 0; i < SNAPSHOT_CACHE_SLOTS; i++) {
+        if (slot_matches(&slots[i], limit, pretty)) return &slots[i];
+        if (!slots[i].used && !free_slot) free_slot = &slots[i];
+    }
+    SnapshotSlot *slot = free_slot;
+    if (!slot) {
+        slot = &slots[next_victim];
+        next_victim = (next_victim + 1) % SNAPSHOT_CACHE_SLOTS;
+        history_snapshot_put(slot->current);
+        slot->current = NULL;
+    }
+    slot->limit = limit;
+    slot->pretty = pretty;
+    slot->used = true;
+    return slot;
+}
+
+// A new reference to the slot's snapshot if it is at least as new as
+// generation. Caller holds cache_mutex.
+static HistorySnapshot *take_current(SnapshotSlot *slot, uint64_t generation) {
+    HistorySnapshot *snap = slot->current;
+    if (!snap || snap->generation < generation) return NULL;
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+    return snap;
+}
+
+static HistorySnapshot *build_snapshot(size_t limit, bool pretty) {
+    // Read the generation before the rings: appends that land during the
+    // build make the snapshot newer than its tag, never older
+    uint64_t generation = get_history_generation();
+
+    HistoryJsonWriter writer;
+    history_json_writer_init(&writer, get_history_rings(), get_history_shard_count(),
+                             limit, pretty);
+    OutputBuffer body;
+    output_buffer_init(&body);
+    while (!history_json_write(&writer, &body, SIZE_MAX)) {
+    }
+
+    HistorySnapshot *snap = malloc(sizeof(HistorySnapshot) + body.len + 1);
+    if (snap) {
+        snap->generation = generation;
+        snap->limit = limit;
+        snap->pretty = pretty;
+        history_snapshot_etag(snap->etag, sizeof(snap->etag), generation, limit, pretty,
+                              CODING_IDENTITY);
+        snap->refs = 1;
+        memset(snap->encoded, 0, sizeof(snap->encoded));
+        snap->len = body.len;
+        memcpy(snap->data, body.data, body.len);
+        snap->data[body.len] = '\0';
+        __atomic_fetch_add(&builds, 1, __ATOMIC_RELAXED);
+    }
+    output_buffer_free(&body);
+    return snap;
+}
+
+HistorySnapshot *history_snapshot_get(size_t limit, bool pretty) {
+    pthread_once(&cache_once, init_cache);
+    uint64_t generation = get_history_generation();
+
+    pthread_mutex_lock(&cache_mutex);
+    SnapshotSlot *slot = find_slot(limit, pretty);
+    HistorySnapshot *snap = take_current(slot, generation);
+    pthread_mutex_unlock(&cache_mutex);
+    if (snap) {
+        __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+        return snap;
+    }
+
+    pthread_mutex_lock(&slot->build_mutex);
+    // Whoever held build_mutex before us may have rebuilt it already
+    pthread_mutex_lock(&cache_mutex);
+    snap = slot_matches(slot, limit, pretty) ? take_current(slot, generation) : NULL;
+    pthread_mutex_unlock(&cache_mutex);
+    if (snap) {
+        __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+    } else if ((snap = build_snapshot(limit, pretty)) != NULL) {
+        HistorySnapshot *old = NULL;
+        pthread_mutex_lock(&cache_mutex);
+        // The slot may have been handed to another key meanwhile; then the
+        // snapshot is only ours
+        if (slot_matches(slot, limit, pretty)) {
+            old = slot->current;
+            __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+            slot->current = snap;
+        }
+        pthread_mutex_unlock(&cache_mutex);
+        history_snapshot_put(old);
+    }
+    pthread_mutex_unlock(&slot->build_mutex);
+    return snap;
+}
+
+void history_snapshot_get_stats(SnapshotStats *stats) {
+    stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    stats->builds = __atomic_load_n(&builds, __ATOMIC_RELAXED);
+}
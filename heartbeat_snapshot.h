@@ -0,0 +1,53 @@
+#ifndef HEARTBEAT_SNAPSHOT_H
+#define HEARTBEAT_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "heartbeat_server.h"
+#include "heartbeat_compress.h"
+
+// Serialized history responses, cached per (limit, pretty) and tagged with
+// the history generation they were built at. A reader whose generation still
+// matches takes a reference to the cached bytes; the first reader after an
+// append rebuilds them once and swaps the new snapshot in, while readers of
+// the old one keep it until they drop their reference. Compressed bodies
+// are produced on first request and kept with the snapshot.
+
+#define SNAPSHOT_CACHE_SLOTS 4
+#define SNAPSHOT_ETAG_LEN 64
+
+typedef struct {
+    uint64_t generation;
+    size_t limit;
+    bool pretty;
+    char etag[SNAPSHOT_ETAG_LEN];
+    uint32_t refs;
+    OutputBuffer *encoded[CODING_COUNT];    // compressed bodies, set once
+    size_t len;
+    char data[];                            // len bytes, then a NUL
+} HistorySnapshot;
+
+// The quoted entity tag of the history array at generation, as sent to
+// clients negotiating coding. snap->etag is the identity one.
+void history_snapshot_etag(char *etag, size_t size, uint64_t generation,
+                           size_t limit, bool pretty, ContentCoding coding);
+
+// A referenced snapshot of the current history (limit 0 means all retained),
+// or NULL if it could not be allocated. Release it with history_snapshot_put.
+HistorySnapshot *history_snapshot_get(size_t limit, bool pretty);
+
+void history_snapshot_put(HistorySnapshot *snap);
+
+// The body to send for coding: the identity bytes, or the compressed ones
+// when compress_worthwhile says so. *coding is set to what was returned.
+const char *history_snapshot_body(HistorySnapshot *snap, ContentCoding *coding, size_t *len);
+
+typedef struct {
+    uint64_t hits;
+    uint64_t builds;
+} SnapshotStats;
+
+void history_snapshot_get_stats(SnapshotStats *stats);
+
+#endif /* HEARTBEAT_SNAPSHOT_H */
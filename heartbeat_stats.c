@@ -0,0 +1,184 @@
+#include "heartbeat_stats.h"
+#include "heartbeat_history.h"
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+static const int windows[] = { 60, 300, 900 };
+
+// The fleet window is kept per history shard so ingest threads with a shard
+// of their own never share a lock; threads without one use shard 0's.
+typedef struct {
+    pthread_mutex_t lock;
+    StatsWindow window;
+} FleetShard;
+
+static FleetShard fleet[MAX_HISTORY_SHARDS];
+static pthread_once_t fleet_once = PTHREAD_ONCE_INIT;
+
+// (MAX_LATENCY_MS / STATS_LATENCY_MIN) ^ (1 / (STATS_BINS - 1)), computed once
+static double latency_log_gamma;
+static pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
+
+static void init_gamma(void) {
+    latency_log_gamma = log(MAX_LATENCY_MS / STATS_LATENCY_MIN) / (STATS_BINS - 1);
+}
+
+static void init_fleet(void) {
+    for (int i = 0; i < MAX_HISTORY_SHARDS; i++) {
+        pthread_mutex_init(&fleet[i].lock, NULL);
+    }
+}
+
+static int bin_index(HeartbeatMetric metric, double v) {
+    int bin;
+    if (metric == METRIC_LATENCY) {
+        if (v < STATS_LATENCY_MIN) return 0;
+        bin = 1 + (int)(log(v / STATS_LATENCY_MIN) / latency_log_gamma);
+    } else {
+        bin = (int)v;
+    }
+    if (bin < 0) bin = 0;
+    if (bin >= STATS_BINS) bin = STATS_BINS - 1;
+    return bin;
+}
+
+// Representative value of a bin: its midpoint (geometric for latency)
+static double bin_value(HeartbeatMetric metric, int bin) {
+    if (metric == METRIC_LATENCY) {
+        if (bin == 0) return STATS_LATENCY_MIN / 2;
+        return STATS_LATENCY_MIN * exp(((double)bin - 0.5) * latency_log_gamma);
+    }
+    return bin + 0.5;
+}
+
+bool stats_window_supported(int window) {
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        if (windows[i] == window) return true;
+    }
+    return false;
+}
+
+static void sketch_add(StatsSketch *s, HeartbeatMetric metric, double v) {
+    if (s->count == 0 || v < s->min) s->min = v;
+    if (s->count == 0 || v > s->max) s->max = v;
+    s->count++;
+    s->sum += v;
+    s->bins[bin_index(metric, v)]++;
+}
+
+static void sketch_merge(StatsSketch *into, const StatsSketch *from) {
+    if (from->count == 0) return;
+    if (into->count == 0 || from->min < into->min) into->min = from->min;
+    if (into->count == 0 || from->max > into->max) into->max = from->max;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (int b = 0; b < STATS_BINS; b++) into->bins[b] += from->bins[b];
+}
+
+static double sketch_quantile(const StatsSketch *s, HeartbeatMetric metric, double q) {
+    uint64_t rank = (uint64_t)ceil(q * s->count);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BINS; b++) {
+        seen += s->bins[b];
+        if (seen >= rank) {
+            // The exact extremes are known, so never answer outside them
+            double v = bin_value(metric, b);
+            return v < s->min ? s->min : v > s->max ? s->max : v;
+        }
+    }
+    return s->max;
+}
+
+void stats_window_add(StatsWindow *w, const double *values, time_t timestamp) {
+    pthread_once(&gamma_once, init_gamma);
+
+    time_t start = timestamp - timestamp % STATS_BUCKET_SECONDS;
+    StatsBucket *bucket = &w->buckets[(start / STATS_BUCKET_SECONDS) % STATS_BUCKETS];
+    if (bucket->start != start) {
+        if (bucket->start > start) return;  // older than anything the ring keeps
+        memset(bucket, 0, sizeof(*bucket));
+        bucket->start = start;
+    }
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        sketch_add(&bucket->metrics[m], (HeartbeatMetric)m, values[m]);
+    }
+}
+
+// Fold the buckets of w that fall in the last window seconds into merged
+static void window_merge(const StatsWindow *w, int window, time_t now, StatsSketch *merged) {
+    time_t from = now - window;
+    from -= from % STATS_BUCKET_SECONDS;
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        const StatsBucket *bucket = &w->buckets[i];
+        if (bucket->start < from || bucket->start > now || bucket->metrics[0].count == 0) continue;
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            sketch_merge(&merged[m], &bucket->metrics[m]);
+        }
+    }
+}
+
+static void summarize(const StatsSketch *merged, StatsSummary *out) {
+    pthread_once(&gamma_once, init_gamma);
+
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const StatsSketch *s = &merged[m];
+        StatsSummary *summary = &out[m];
+        memset(summary, 0, sizeof(*summary));
+        summary->count = s->count;
+        if (s->count == 0) continue;
+        summary->min = s->min;
+        summary->max = s->max;
+        summary->mean = s->sum / s->count;
+        summary->p50 = sketch_quantile(s, (HeartbeatMetric)m, 0.50);
+        summary->p95 = sketch_quantile(s, (HeartbeatMetric)m, 0.95);
+        summary->p99 = sketch_quantile(s, (HeartbeatMetric)m, 0.99);
+    }
+}
+
+void stats_window_query(const StatsWindow *w, int window, time_t now, StatsSummary *out) {
+    StatsSketch merged[METRIC_COUNT];
+    memset(merged, 0, sizeof(merged));
+    window_merge(w, window, now, merged);
+    summarize(merged, out);
+}
+
+void stats_record_fleet(const HeartbeatData *data, const time_t *timestamps, size_t count) {
+    pthread_once(&fleet_once, init_fleet);
+    int shard = get_thread_history_shard();
+    FleetShard *f = &fleet[shard >= 0 ? shard : 0];
+
+    pthread_mutex_lock(&f->lock);
+    for (size_t i = 0; i < count; i++) {
+        double values[METRIC_COUNT];
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            values[m] = heartbeat_metric_value(&data[i], (HeartbeatMetric)m);
+        }
+        stats_window_add(&f->window, values, timestamps[i]);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+void stats_query_fleet(int window, time_t now, StatsSummary *out) {
+    pthread_once(&fleet_once, init_fleet);
+    StatsSketch merged[METRIC_COUNT];
+    memset(merged, 0, sizeof(merged));
+
+    for (size_t i = 0; i < get_history_shard_count(); i++) {
+        pthread_mutex_lock(&fleet[i].lock);
+        window_merge(&fleet[i].window, window, now, merged);
+        pthread_mutex_unlock(&fleet[i].lock);
+    }
+    summarize(merged, out);
+}
+
+void stats_clear_fleet(void) {
+    pthread_once(&fleet_once, init_fleet);
+    for (int i = 0; i < MAX_HISTORY_SHARDS; i++) {
+        pthread_mutex_lock(&fleet[i].lock);
+        memset(&fleet[i].window, 0, sizeof(fleet[i].window));
+        pthread_mutex_unlock(&fleet[i].lock);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef HEARTBEAT_STATS_H
+#define HEARTBEAT_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+
+// Sliding-window aggregates, kept incrementally on insert. A window is a
+// ring of one-minute buckets, each holding a mergeable sketch per metric:
+// count, sum, min, max and a fixed-bin histogram for quantiles. A query
+// merges at most STATS_BUCKETS buckets, whatever the size of the history.
+
+#define STATS_BUCKET_SECONDS 60
+#define STATS_BUCKETS 16            // 15 complete minutes plus the current one
+#define STATS_BINS 100
+
+// Percentages use one bin per percent. Latency bins are logarithmic from
+// STATS_LATENCY_MIN to MAX_LATENCY_MS, about 12% wide.
+#define STATS_LATENCY_MIN 0.1
+
+typedef struct {
+    uint32_t count;
+    double sum;
+    double min;
+    double max;
+    uint32_t bins[STATS_BINS];
+} StatsSketch;
+
+typedef struct {
+    time_t start;               // multiple of STATS_BUCKET_SECONDS
+    StatsSketch metrics[METRIC_COUNT];
+} StatsBucket;
+
+// The caller serializes access
+typedef struct {
+    StatsBucket buckets[STATS_BUCKETS];
+} StatsWindow;
+
+typedef struct {
+    uint64_t count;
+    double min;
+    double max;
+    double mean;
+    double p50;
+    double p95;
+    double p99;
+} StatsSummary;
+
+// Windows answered: 60, 300 and 900 seconds
+bool stats_window_supported(int window);
+
+// Add one sample; values are indexed by HeartbeatMetric. Samples older than
+// the ring are dropped.
+void stats_window_add(StatsWindow *w, const double *values, time_t timestamp);
+
+// Summarize the buckets covering the last window seconds before now (whole
+// buckets, so up to one extra minute). out has METRIC_COUNT entries.
+void stats_window_query(const StatsWindow *w, int window, time_t now, StatsSummary *out);
+
+// Fleet-wide window fed by every history insert, kept per history shard and
+// merged on query
+void stats_record_fleet(const HeartbeatData *data, const time_t *timestamps, size_t count);
+void stats_query_fleet(int window, time_t now, StatsSummary *out);
+
+// Drop the fleet-wide aggregates (for testing)
+void stats_clear_fleet(void);
+
+#endif /* HEARTBEAT_STATS_H */
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+
+#include "heartbeat_store.h"
+#include "heartbeat_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_SEGMENT_MAGIC "HBSTORE1"
+#define STORE_RECORD_MAGIC 0x48425231u     // "HBR1"
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t capacity;          // records in this segment
+    uint64_t first_seq;         // number of the segment's first record
+    uint8_t reserved[40];
+} SegmentHeader;
+
+// A record becomes valid when its magic is stored, after everything else.
+// Recovery stops at the first record that is not valid.
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;          // FNV-1a of the bytes after this field
+    int64_t timestamp;
+    double cpu_usage;
+    double memory_usage;
+    double disk_usage;
+    double availability;
+    double latency;
+    char local_ip[MAX_IP_LEN];
+    char public_ip[MAX_IP_LEN];
+    char hostname[MAX_HOSTNAME_LEN];
+    uint8_t reserved[8];
+} StoreRecord;
+
+_Static_assert(sizeof(SegmentHeader) == 64, "segment header layout changed");
+_Static_assert(sizeof(StoreRecord) == 160, "store record layout changed");
+
+typedef struct {
+    uint64_t first_seq;
+    time_t last_timestamp;      // newest record, for age-based retention
+} SegmentInfo;
+
+// A full segment waiting for its final msync and munmap. Only the sync
+// thread unmaps, so it can msync the active segment without holding lock.
+typedef struct RetiredMap {
+    uint8_t *map;
+    size_t size;
+    struct RetiredMap *next;
+} RetiredMap;
+
+static bool enabled = false;
+static char store_dir[PATH_MAX];
+static size_t segment_records;
+static size_t max_segments;
+static time_t max_age;
+
+// Retained segments, oldest first; the last one is being appended to
+static SegmentInfo *segments;
+static size_t segment_count;
+
+static uint8_t *active_map;
+static size_t active_size;
+static size_t active_capacity;
+static size_t write_index;
+static size_t synced_index;
+static uint64_t next_seq;          // first record number of the next segment
+static RetiredMap *retired;
+static uint8_t *spare_map;         // next segment, preallocated by the sync thread
+static StoreStats stats;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t sync_thread;
+static bool sync_running = false;
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t record_checksum(const StoreRecord *rec) {
+    const uint8_t *p = (const uint8_t *)rec + offsetof(StoreRecord, timestamp);
+    const uint8_t *end = (const uint8_t *)rec + sizeof(*rec);
+    uint32_t h = 2166136261u;
+    while (p < end) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool record_valid(const StoreRecord *rec) {
+    return rec->magic == STORE_RECORD_MAGIC && rec->checksum == record_checksum(rec);
+}
+
+static StoreRecord *record_at(uint8_t *map, size_t index) {
+    return (StoreRecord *)(map + sizeof(SegmentHeader)) + index;
+}
+
+static size_t segment_size(size_t capacity) {
+    return sizeof(SegmentHeader) + capacity * sizeof(StoreRecord);
+}
+
+// store_dir plus "/segment-", 20 digits, ".hbs" and the NUL
+#define SEGMENT_PATH_SIZE (PATH_MAX + 34)
+
+static bool segment_path(char *path, size_t size, uint64_t first_seq) {
+    int n = snprintf(path, size, "%s/segment-%020llu.hbs", store_dir, (unsigned long long)first_seq);
+    if (n < 0 || (size_t)n >= size) {
+        fprintf(stderr, "store segment path too long\n");
+        return false;
+    }
+    return true;
+}
+
+// Where the sync thread preallocates the next segment. Not a segment name,
+// so a leftover spare is never replayed.
+static bool spare_path(char *path, size_t size) {
+    int n = snprintf(path, size, "%s/spare-segment.tmp", store_dir);
+    return n >= 0 && (size_t)n < size;
+}
+
+static void record_from_heartbeat(StoreRecord *rec, const HeartbeatData *data, time_t timestamp) {
+    rec->timestamp = (int64_t)timestamp;
+    rec->cpu_usage = data->cpu_usage;
+    rec->memory_usage = data->memory_usage;
+    rec->disk_usage = data->disk_usage;
+    rec->availability = data->availability;
+    rec->latency = data->latency;
+    memcpy(rec->local_ip, data->local_ip, MAX_IP_LEN);
+    memcpy(rec->public_ip, data->public_ip, MAX_IP_LEN);
+    memcpy(rec->hostname, data->hostname, MAX_HOSTNAME_LEN);
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+    rec->checksum = record_checksum(rec);
+    __atomic_store_n(&rec->magic, STORE_RECORD_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void record_to_heartbeat(const StoreRecord *rec, HeartbeatData *data, time_t *timestamp) {
+    *timestamp = (time_t)rec->timestamp;
+    data->cpu_usage = rec->cpu_usage;
+    data->memory_usage = rec->memory_usage;
+    data->disk_usage = rec->disk_usage;
+    data->availability = rec->availability;
+    data->latency = rec->latency;
+    memcpy(data->local_ip, rec->local_ip, MAX_IP_LEN);
+    memcpy(data->public_ip, rec->public_ip, MAX_IP_LEN);
+    memcpy(data->hostname, rec->hostname, MAX_HOSTNAME_LEN);
+    data->local_ip[MAX_IP_LEN - 1] = '\0';
+    data->public_ip[MAX_IP_LEN - 1] = '\0';
+    data->hostname[MAX_HOSTNAME_LEN - 1] = '\0';
+}
+
+// Map an existing segment read-write and check its header. On success
+// *capacity is the segment's record count.
+static uint8_t *map_segment(uint64_t first_seq, size_t *size, size_t *capacity) {
+    char path[SEGMENT_PATH_SIZE];
+    if (!segment_path(path, sizeof(path), first_seq)) return NULL;
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("store segment open failed");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SegmentHeader)) {
+        close(fd);
+        return NULL;
+    }
+    uint8_t *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("store segment mmap failed");
+        return NULL;
+    }
+
+    const SegmentHeader *header = (const SegmentHeader *)map;
+    if (memcmp(header->magic, STORE_SEGMENT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->record_size != sizeof(StoreRecord) || header->first_seq != first_seq ||
+        segment_size(header->capacity) != (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    *capacity = header->capacity;
+    return map;
+}
+
+// Create, preallocate and map a new empty segment at path
+static uint8_t *create_segment(const char *path, uint64_t first_seq, size_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("store segment create failed");
+        return NULL;
+    }
+    // Reserve the blocks now so a full disk fails here rather than as SIGBUS
+    size_t size = segment_size(capacity);
+    int err = posix_fallocate(fd, 0, (off_t)size);
+    if (err != 0) {
+        errno = err;
+        perror("store segment fallocate failed");
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("store segment mmap failed");
+        unlink(path);
+        return NULL;
+    }
+
+    SegmentHeader *header = (SegmentHeader *)map;
+    memcpy(header->magic, STORE_SEGMENT_MAGIC, sizeof(header->magic));
+    header->record_size = sizeof(StoreRecord);
+    header->capacity = (uint32_t)capacity;
+    header->first_seq = first_seq;
+    return map;
+}
+
+static void remove_segment_file(uint64_t first_seq) {
+    char path[SEGMENT_PATH_SIZE];
+    if (!segment_path(path, sizeof(path), first_seq)) return;
+    if (unlink(path) < 0 && errno != ENOENT) {
+        perror("store segment unlink failed");
+    }
+}
+
+// Drop the oldest segments beyond the count or age limits. The active
+// segment is never dropped. Caller holds store_lock (or is store_open).
+static void apply_retention(time_t now) {
+    size_t drop = 0;
+    while (segment_count - drop > 1) {
+        const SegmentInfo *oldest = &segments[drop];
+        bool too_many = segment_count - drop > max_segments;
+        bool too_old = max_age > 0 && oldest->last_timestamp < now - max_age;
+        if (!too_many && !too_old) break;
+        remove_segment_file(oldest->first_seq);
+        drop++;
+    }
+    if (drop > 0) {
+        memmove(segments, segments + drop, (segment_count - drop) * sizeof(SegmentInfo));
+        segment_count -= drop;
+        stats.segments = segment_count;
+    }
+}
+
+static bool add_segment_info(uint64_t first_seq, time_t last_timestamp) {
+    // max_segments + 1 entries are needed between a roll and its retention pass
+    SegmentInfo *grown = realloc(segments, (segment_count + 1) * sizeof(SegmentInfo));
+    if (!grown) return false;
+    segments = grown;
+    segments[segment_count].first_seq = first_seq;
+    segments[segment_count].last_timestamp = last_timestamp;
+    segment_count++;
+    stats.segments = segment_count;
+    return true;
+}
+
+// Move the spare into place as segment first_seq. Caller holds store_lock.
+static uint8_t *take_spare(uint64_t first_seq) {
+    char from[SEGMENT_PATH_SIZE], to[SEGMENT_PATH_SIZE];
+    if (!spare_map || !spare_path(from, sizeof(from)) || !segment_path(to, sizeof(to), first_seq)) {
+        return NULL;
+    }
+    uint8_t *map = spare_map;
+    spare_map = NULL;
+    ((SegmentHeader *)map)->first_seq = first_seq;
+    if (rename(from, to) < 0) {
+        perror("store spare rename failed");
+        munmap(map, segment_size(segment_records));
+        unlink(from);
+        return NULL;
+    }
+    return map;
+}
+
+// Preallocate the next segment off the append path, so a roll only renames
+// a file and swaps pointers. Only the sync thread (or store_open) calls this.
+static void prepare_spare(void) {
+    pthread_mutex_lock(&store_lock);
+    bool have = spare_map != NULL;
+    pthread_mutex_unlock(&store_lock);
+    char path[SEGMENT_PATH_SIZE];
+    if (have || !spare_path(path, sizeof(path))) return;
+
+    uint8_t *map = create_segment(path, 0, segment_records);
+    if (!map) return;
+    pthread_mutex_lock(&store_lock);
+    spare_map = map;
+    pthread_mutex_unlock(&store_lock);
+}
+
+// Retire the full active segment and start the next one, from the spare
+// when the sync thread has one ready. Caller holds store_lock.
+static bool roll_segment(void) {
+    if (active_map) {
+        RetiredMap *old = malloc(sizeof(RetiredMap));
+        if (!old) return false;
+        old->map = active_map;
+        old->size = active_size;
+        old->next = retired;
+        retired = old;
+        active_map = NULL;
+    }
+
+    uint64_t first_seq = next_seq;
+    uint8_t *map = take_spare(first_seq);
+    if (!map) {
+        char path[SEGMENT_PATH_SIZE];
+        if (!segment_path(path, sizeof(path), first_seq)) return false;
+        map = create_segment(path, first_seq, segment_records);
+    }
+    if (!map) return false;
+    if (!add_segment_info(first_seq, 0)) {
+        munmap(map, segment_size(segment_records));
+        remove_segment_file(first_seq);
+        return false;
+    }
+    active_map = map;
+    active_size = segment_size(segment_records);
+    active_capacity = segment_records;
+    write_index = 0;
+    synced_index = 0;
+    next_seq = first_seq + segment_records;
+
+    apply_retention(time(NULL));
+    return true;
+}
+
+void store_append(const HeartbeatData *data, time_t timestamp) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&store_lock);
+    if ((!active_map || write_index == active_capacity) && !roll_segment()) {
+        // Retried on the next append
+        if (stats.write_errors++ == 0) {
+            log_error("store_write_failed", "dir=%s", store_dir);
+        }
+        pthread_mutex_unlock(&store_lock);
+        return;
+    }
+    record_from_heartbeat(record_at(active_map, write_index), data, timestamp);
+    write_index++;
+    SegmentInfo *info = &segments[segment_count - 1];
+    if (timestamp > info->last_timestamp) info->last_timestamp = timestamp;
+    stats.records_written++;
+    pthread_mutex_unlock(&store_lock);
+}
+
+// msync what was appended since the last pass and release retired segments
+static void sync_segments(void) {
+    pthread_mutex_lock(&store_lock);
+    uint8_t *map = active_map;
+    size_t from = synced_index, to = write_index;
+    synced_index = write_index;
+    RetiredMap *done = retired;
+    retired = NULL;
+    apply_retention(time(NULL));
+    pthread_mutex_unlock(&store_lock);
+
+    if (map && to > from) {
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)record_at(map, from) & ~(uintptr_t)(page - 1);
+        uintptr_t end = (uintptr_t)record_at(map, to);
+        if (msync((void *)start, end - start, MS_SYNC) < 0) {
+            perror("store msync failed");
+        }
+    }
+
+    while (done) {
+        RetiredMap *next = done->next;
+        if (msync(done->map, done->size, MS_SYNC) < 0) {
+            perror("store msync failed");
+        }
+        munmap(done->map, done->size);
+        free(done);
+        done = next;
+    }
+}
+
+static void *run_sync_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&sync_mutex);
+    while (sync_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += STORE_SYNC_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (STORE_SYNC_INTERVAL_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&sync_cond, &sync_mutex, &deadline);
+
+        pthread_mutex_unlock(&sync_mutex);
+        sync_segments();
+        prepare_spare();
+        pthread_mutex_lock(&sync_mutex);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+    return NULL;
+}
+
+static int compare_seq(const void *a, const void *b) {
+    uint64_t x = ((const SegmentInfo *)a)->first_seq;
+    uint64_t y = ((const SegmentInfo *)b)->first_seq;
+    return x < y ? -1 : x > y;
+}
+
+// Collect the segment files in store_dir, oldest first
+static bool list_segments(void) {
+    DIR *dir = opendir(store_dir);
+    if (!dir) {
+        perror("store directory open failed");
+        return false;
+    }
+    struct dirent *entry;
+    bool ok = true;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long first_seq;
+        int end = 0;
+        if (sscanf(entry->d_name, "segment-%20llu.hbs%n", &first_seq, &end) != 1 ||
+            end == 0 || entry->d_name[end] != '\0') {
+            continue;
+        }
+        if (!add_segment_info(first_seq, 0)) {
+            ok = false;
+            break;
+        }
+    }
+    closedir(dir);
+    if (segment_count > 1) qsort(segments, segment_count, sizeof(SegmentInfo), compare_seq);
+    return ok;
+}
+
+// Replay the valid records of one mapped segment. Returns how many there are.
+static size_t replay_segment(uint8_t *map, size_t capacity, SegmentInfo *info,
+                             time_t cutoff, StoreReplayFn replay,
+                             HeartbeatData *data, time_t *timestamps) {
+    size_t valid = 0, batch = 0;
+    for (; valid < capacity; valid++) {
+        const StoreRecord *rec = record_at(map, valid);
+        if (!record_valid(rec)) break;
+        if ((time_t)rec->timestamp > info->last_timestamp) {
+            info->last_timestamp = (time_t)rec->timestamp;
+        }
+        if (!replay || (time_t)rec->timestamp < cutoff) continue;
+
+        record_to_heartbeat(rec, &data[batch], &timestamps[batch]);
+        if (++batch == STORE_REPLAY_BATCH) {
+            replay(data, timestamps, batch);
+            batch = 0;
+        }
+    }
+    if (batch > 0) replay(data, timestamps, batch);
+    return valid;
+}
+
+int store_open(const StoreConfig *config, StoreReplayFn replay) {
+    if (enabled || !config->dir) return -1;
+    if (snprintf(store_dir, sizeof(store_dir), "%s", config->dir) >= (int)sizeof(store_dir)) {
+        fprintf(stderr, "store directory name too long\n");
+        return -1;
+    }
+    segment_records = config->segment_records ? config->segment_records : STORE_SEGMENT_RECORDS;
+    max_segments = config->max_segments ? config->max_segments : STORE_DEFAULT_MAX_SEGMENTS;
+    max_age = config->max_age;
+    next_seq = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    if (mkdir(store_dir, 0755) < 0 && errno != EEXIST) {
+        perror("store directory create failed");
+        return -1;
+    }
+    char spare[SEGMENT_PATH_SIZE];
+    if (spare_path(spare, sizeof(spare))) unlink(spare);
+    if (!list_segments()) {
+        store_close();
+        return -1;
+    }
+
+    // Drop segments beyond the count limit before spending time replaying them
+    time_t now = time(NULL);
+    time_t cutoff = max_age > 0 ? now - max_age : 0;
+    if (segment_count > max_segments) {
+        size_t drop = segment_count - max_segments;
+        for (size_t i = 0; i < drop; i++) remove_segment_file(segments[i].first_seq);
+        memmove(segments, segments + drop, max_segments * sizeof(SegmentInfo));
+        segment_count = max_segments;
+    }
+
+    HeartbeatData *data = calloc(STORE_REPLAY_BATCH, sizeof(HeartbeatData));
+    time_t *timestamps = calloc(STORE_REPLAY_BATCH, sizeof(time_t));
+    if (!data || !timestamps) {
+        free(data);
+        free(timestamps);
+        store_close();
+        return -1;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < segment_count; i++) {
+        SegmentInfo info = segments[i];
+        size_t size, capacity;
+        uint8_t *map = map_segment(info.first_seq, &size, &capacity);
+        if (!map) {
+            // Left on disk for inspection; new segments are numbered past it
+            if (info.first_seq >= next_seq) next_seq = info.first_seq + 1;
+            log_warn("store_segment_skipped", "dir=%s first_seq=%llu",
+                     store_dir, (unsigned long long)info.first_seq);
+            continue;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        size_t valid = replay_segment(map, capacity, &info, cutoff, replay, data, timestamps);
+        stats.records_recovered += valid;
+        segments[kept++] = info;
+
+        if (info.first_seq + capacity > next_seq) next_seq = info.first_seq + capacity;
+        if (i + 1 == segment_count && valid < capacity) {
+            // Keep appending after the last valid record. Anything past it
+            // is from a torn write and must not resurface later.
+            for (size_t j = valid; j < capacity; j++) {
+                StoreRecord *rec = record_at(map, j);
+                if (rec->magic != 0) rec->magic = 0;
+            }
+            active_map = map;
+            active_size = size;
+            active_capacity = capacity;
+            write_index = synced_index = valid;
+        } else {
+            munmap(map, size);
+        }
+    }
+    free(data);
+    free(timestamps);
+    segment_count = kept;
+    stats.segments = segment_count;
+
+    apply_retention(now);
+    prepare_spare();
+
+    sync_running = true;
+    if (pthread_create(&sync_thread, NULL, run_sync_thread, NULL) != 0) {
+        perror("could not create store sync thread");
+        sync_running = false;
+        store_close();
+        return -1;
+    }
+
+    __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+    printf("Store %s: %zu segment(s), %llu record(s) recovered\n", store_dir,
+           segment_count, (unsigned long long)stats.records_recovered);
+    return 0;
+}
+
+bool store_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+void store_get_stats(StoreStats *out) {
+    pthread_mutex_lock(&store_lock);
+    *out = stats;
+    pthread_mutex_unlock(&store_lock);
+}
+
+void store_close(void) {
+    __atomic_store_n(&enabled, false, __ATOMIC_RELEASE);
+
+    if (sync_running) {
+        pthread_mutex_lock(&sync_mutex);
+        sync_running = false;
+        pthread_cond_signal(&sync_cond);
+        pthread_mutex_unlock(&sync_mutex);
+        pthread_join(sync_thread, NULL);
+    }
+    sync_segments();
+
+    pthread_mutex_lock(&store_lock);
+    if (active_map) {
+        munmap(active_map, active_size);
+        active_map = NULL;
+    }
+    if (spare_map) {
+        munmap(spare_map, segment_size(segment_records));
+        spare_map = NULL;
+        char spare[SEGMENT_PATH_SIZE];
+        if (spare_path(spare, sizeof(spare))) unlink(spare);
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = 0;
+    next_seq = 0;
+    active_capacity = 0;
+    write_index = synced_index = 0;
+    pthread_mutex_unlock(&store_lock);
+}
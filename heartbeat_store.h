@@ -0,0 +1,53 @@
+#ifndef HEARTBEAT_STORE_H
+#define HEARTBEAT_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+
+// Append-only on-disk history. Heartbeats are written as fixed-size records
+// into memory-mapped segment files named segment-<first record number>.hbs.
+// A background thread msyncs what was written; retention deletes whole
+// segments, oldest first. Records are in host byte order.
+
+#define STORE_SEGMENT_RECORDS 65536         // about 10 MB per segment
+#define STORE_DEFAULT_MAX_SEGMENTS 64
+#define STORE_SYNC_INTERVAL_MS 1000
+#define STORE_REPLAY_BATCH 1024
+
+typedef struct {
+    const char *dir;            // created if missing
+    size_t segment_records;     // records per new segment; 0 for the default
+    size_t max_segments;        // 0 for the default
+    time_t max_age;             // seconds; 0 keeps segments regardless of age
+} StoreConfig;
+
+typedef struct {
+    uint64_t segments;
+    uint64_t records_written;   // since store_open
+    uint64_t records_recovered;
+    uint64_t write_errors;
+} StoreStats;
+
+// Receives recovered records, oldest first, in batches
+typedef void (*StoreReplayFn)(const HeartbeatData *data, const time_t *timestamps, size_t count);
+
+// Open the store, replay the retained records through replay (may be NULL)
+// and start the sync thread. Appends are ignored until this succeeds, so
+// replay may feed add_batch_to_history without writing the records twice.
+int store_open(const StoreConfig *config, StoreReplayFn replay);
+
+bool store_enabled(void);
+
+// Append one record. Called with the history ring's writer_mutex held, so
+// records reach the store in history order.
+void store_append(const HeartbeatData *data, time_t timestamp);
+
+void store_get_stats(StoreStats *out);
+
+// Stop the sync thread, flush and unmap everything
+void store_close(void);
+
+#endif /* HEARTBEAT_STORE_H */
@@ -0,0 +1,107 @@
+#include "heartbeat_stream.h"
+#include "heartbeat_history.h"
+#include "heartbeat_http.h"
+#include "heartbeat_json.h"
+#include "heartbeat_log.h"
+#include <string.h>
+#include <pthread.h>
+
+// The broadcast ring is a HistoryRing: append number n is event id n, and a
+// subscriber whose next id has been overwritten finds out from the slot seq.
+static HistoryRing ring;
+static bool ring_ready;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static uint64_t subscribers;
+static uint64_t resyncs;
+static uint64_t dropped;
+
+static void init_ring(void) {
+    ring_ready = history_ring_alloc(&ring, STREAM_RING_CAPACITY);
+    if (!ring_ready) {
+        log_error("stream_ring_alloc_failed", "capacity=%d", STREAM_RING_CAPACITY);
+    }
+}
+
+void stream_publish(const HeartbeatData *data, const time_t *timestamps, size_t count) {
+    if (__atomic_load_n(&subscribers, __ATOMIC_ACQUIRE) == 0) return;
+
+    pthread_mutex_lock(&ring.writer_mutex);
+    for (size_t i = 0; i < count; i++) {
+        history_ring_append(&ring, &data[i], timestamps[i], 0);
+    }
+    pthread_mutex_unlock(&ring.writer_mutex);
+}
+
+void stream_subscribe(StreamSubscriber *sub, const char *host, bool resume, uint64_t last_id) {
+    pthread_once(&ring_once, init_ring);
+    memset(sub, 0, sizeof(*sub));
+    if (!ring_ready) return;
+
+    if (host) {
+        strncpy(sub->host, host, MAX_HOSTNAME_LEN - 1);
+    }
+    uint64_t head = history_ring_head(&ring);
+    sub->cursor = resume && last_id < head ? last_id + 1 : head;
+    sub->last_write = time(NULL);
+    sub->active = true;
+    __atomic_fetch_add(&subscribers, 1, __ATOMIC_RELEASE);
+}
+
+void stream_unsubscribe(StreamSubscriber *sub) {
+    if (!sub->active) return;
+    sub->active = false;
+    __atomic_fetch_sub(&subscribers, 1, __ATOMIC_RELEASE);
+}
+
+static bool matches(const StreamSubscriber *sub, const HeartbeatData *data) {
+    return sub->host[0] == '\0' ||
+           strcmp(sub->host, data->local_ip) == 0 ||
+           strcmp(sub->host, data->hostname) == 0;
+}
+
+bool stream_pump(StreamSubscriber *sub, OutputBuffer *out, time_t now) {
+    if (!sub->active) return false;
+
+    size_t mark = http_chunk_begin(out);
+    size_t start = out->len;
+    uint64_t head = history_ring_head(&ring);
+
+    while (sub->cursor < head && out->len - start < STREAM_MAX_CHUNK) {
+        HeartbeatNode node;
+        if (!history_ring_read(&ring, sub->cursor, &node)) {
+            // Lapped: skip to the live head rather than replay a backlog
+            // the subscriber is already too slow for
+            head = history_ring_head(&ring);
+            uint64_t missed = head - sub->cursor;
+            __atomic_fetch_add(&resyncs, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&dropped, missed, __ATOMIC_RELAXED);
+            output_buffer_printf(out, "event: resync\ndata: {\"dropped\":%llu}\n\n",
+                                 (unsigned long long)missed);
+            sub->cursor = head;
+            break;
+        }
+        if (matches(sub, &node.data)) {
+            output_buffer_printf(out, "id: %llu\nevent: heartbeat\ndata: ",
+                                 (unsigned long long)sub->cursor);
+            json_append_heartbeat(out, &node, false);
+            output_buffer_append(out, "\n\n", 2);
+        }
+        sub->cursor++;
+    }
+
+    if (out->len == start && now - sub->last_write >= STREAM_KEEPALIVE_SECONDS) {
+        output_buffer_append(out, ": keepalive\n\n", 13);
+    }
+    bool wrote = out->len > start;
+    http_chunk_end(out, mark);
+    if (wrote) sub->last_write = now;
+    return wrote;
+}
+
+void stream_get_stats(StreamStats *stats) {
+    stats->subscribers = __atomic_load_n(&subscribers, __ATOMIC_RELAXED);
+    stats->published = ring_ready ? history_ring_head(&ring) : 0;
+    stats->resyncs = __atomic_load_n(&resyncs, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
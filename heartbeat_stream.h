@@ -0,0 +1,51 @@
+#ifndef HEARTBEAT_STREAM_H
+#define HEARTBEAT_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "heartbeat_server.h"
+
+// Live heartbeat fan-out for GET /api/heartbeat/stream (Server-Sent Events).
+// Accepted heartbeats are published into one bounded broadcast ring; every
+// subscriber keeps its own cursor into it and is pumped by its event loop.
+// Publishing never waits on a subscriber: one that falls a full ring behind
+// is resynced to the live head and told how many events it missed.
+
+#define STREAM_RING_CAPACITY 4096
+#define STREAM_FLUSH_INTERVAL_MS 100    // how often loops with subscribers pump them
+#define STREAM_MAX_CHUNK 65536          // event bytes written per pump
+#define STREAM_KEEPALIVE_SECONDS 15     // comment line sent to idle subscribers
+
+typedef struct {
+    uint64_t cursor;                    // next broadcast index to send
+    char host[MAX_HOSTNAME_LEN];        // local_ip or hostname filter; empty for all
+    time_t last_write;
+    bool active;
+} StreamSubscriber;
+
+typedef struct {
+    uint64_t subscribers;
+    uint64_t published;                 // while anyone was subscribed
+    uint64_t resyncs;                   // times a subscriber was lapped
+    uint64_t dropped;                   // events those subscribers missed
+} StreamStats;
+
+// Publish count heartbeats; does nothing while there are no subscribers
+void stream_publish(const HeartbeatData *data, const time_t *timestamps, size_t count);
+
+// Start sending events published from now on, or, when resume is set, from
+// the event after last_id (the SSE Last-Event-ID). host may be NULL.
+void stream_subscribe(StreamSubscriber *sub, const char *host, bool resume, uint64_t last_id);
+
+void stream_unsubscribe(StreamSubscriber *sub);
+
+// Append one HTTP chunk with the events sub has not seen yet, or a keepalive
+// comment if it has been idle for STREAM_KEEPALIVE_SECONDS. Returns false
+// when there was nothing to write.
+bool stream_pump(StreamSubscriber *sub, OutputBuffer *out, time_t now);
+
+void stream_get_stats(StreamStats *stats);
+
+#endif /* HEARTBEAT_STREAM_H */
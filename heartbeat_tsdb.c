@@ -0,0 +1,540 @@
+#include "heartbeat_tsdb.h"
+#include "heartbeat_gorilla.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Hash slots for each of the ip and hostname tables; power of two. Each
+// series has one ip key and at most one hostname alias, so both tables stay
+// under a quarter full; aliases are also refused past TSDB_ALIAS_LOAD_LIMIT.
+#define TSDB_HASH_SLOTS (TSDB_MAX_HOSTS * 4)
+#define TSDB_ALIAS_LOAD_LIMIT (TSDB_HASH_SLOTS / 2)
+
+typedef struct {
+    TsRollup *buckets;
+    size_t capacity;
+    uint64_t head;      // buckets ever opened
+    int step;
+} RollupRing;
+
+typedef struct {
+    char local_ip[MAX_IP_LEN];
+    char hostname[MAX_HOSTNAME_LEN];
+    pthread_mutex_t lock;
+    GorillaBlock *raw_blocks[TSDB_RAW_BLOCKS];  // sealed; the oldest is replaced
+    uint64_t raw_sealed;                        // blocks ever sealed
+    GorillaEncoder raw_open;                    // the newest samples
+    time_t raw_last;                            // newest raw timestamp
+    uint32_t id;
+    const char *alias;                          // key of its hostname slot; under host_table_lock
+    HeartbeatData latest;
+    time_t last_seen;
+    uint64_t samples;
+    double interval;                            // EWMA of heartbeat spacing; 0: unknown
+    RollupRing rollups[TSDB_ROLLUP_LEVELS];
+    StatsWindow *stats;
+} HostSeries;
+
+typedef struct {
+    const char *key;    // the series' local_ip
+    HostSeries *series;
+} HostSlot;
+
+typedef struct {
+    char *key;          // heap copy of the hostname
+    HostSeries *series;
+} AliasSlot;
+
+static const int rollup_steps[TSDB_ROLLUP_LEVELS] = { 60, 300, 3600 };
+static const size_t rollup_capacity[TSDB_ROLLUP_LEVELS] = {
+    TSDB_ROLLUP_1M_BUCKETS, TSDB_ROLLUP_5M_BUCKETS, TSDB_ROLLUP_1H_BUCKETS
+};
+
+static HostSlot host_slots[TSDB_HASH_SLOTS];
+static AliasSlot alias_slots[TSDB_HASH_SLOTS];
+static size_t alias_total = 0;
+static HostSeries *host_series[TSDB_MAX_HOSTS];
+static size_t host_total = 0;
+static pthread_rwlock_t host_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static size_t raw_bytes;    // sealed raw blocks across every series
+static uint64_t raw_late_dropped;
+
+// FNV-1a
+static uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// ip slot holding key, or the empty slot where it would go; NULL if the
+// probe covers the whole table
+static HostSlot *find_slot(const char *key) {
+    uint32_t i = hash_key(key) & (TSDB_HASH_SLOTS - 1);
+    for (size_t probes = 0; probes < TSDB_HASH_SLOTS; probes++) {
+        if (!host_slots[i].key || strcmp(host_slots[i].key, key) == 0) return &host_slots[i];
+        i = (i + 1) & (TSDB_HASH_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Lock-free, so ingest threads never share the table lock's cache line.
+// ip slots are only ever filled, series first and then the key, so a
+// reader sees either an empty slot or a complete one.
+static HostSeries *lookup_ip(const char *key) {
+    uint32_t i = hash_key(key) & (TSDB_HASH_SLOTS - 1);
+    const char *slot_key;
+    for (size_t probes = 0; probes < TSDB_HASH_SLOTS; probes++) {
+        if (!(slot_key = __atomic_load_n(&host_slots[i].key, __ATOMIC_ACQUIRE))) break;
+        if (strcmp(slot_key, key) == 0) {
+            return __atomic_load_n(&host_slots[i].series, __ATOMIC_ACQUIRE);
+        }
+        i = (i + 1) & (TSDB_HASH_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Alias slot holding key, or the empty slot where it would go; NULL if the
+// probe covers the whole table. Caller holds host_table_lock.
+static AliasSlot *find_alias(const char *key) {
+    uint32_t i = hash_key(key) & (TSDB_HASH_SLOTS - 1);
+    for (size_t probes = 0; probes < TSDB_HASH_SLOTS; probes++) {
+        if (!alias_slots[i].key || strcmp(alias_slots[i].key, key) == 0) return &alias_slots[i];
+        i = (i + 1) & (TSDB_HASH_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Empty an alias slot and shift later entries of its probe run back into
+// the gap, so lookups never need tombstones. Caller holds the write lock.
+static void remove_alias(AliasSlot *slot) {
+    uint32_t i = (uint32_t)(slot - alias_slots);
+    slot->series->alias = NULL;
+    free(slot->key);
+    for (uint32_t j = (i + 1) & (TSDB_HASH_SLOTS - 1); alias_slots[j].key;
+         j = (j + 1) & (TSDB_HASH_SLOTS - 1)) {
+        // An entry may fill the gap unless its home lies between the gap and it
+        uint32_t home = hash_key(alias_slots[j].key) & (TSDB_HASH_SLOTS - 1);
+        if (((j - home) & (TSDB_HASH_SLOTS - 1)) >= ((j - i) & (TSDB_HASH_SLOTS - 1))) {
+            alias_slots[i] = alias_slots[j];
+            i = j;
+        }
+    }
+    alias_slots[i].key = NULL;
+    alias_slots[i].series = NULL;
+    alias_total--;
+}
+
+// A local_ip, or failing that a hostname alias
+static HostSeries *lookup_series(const char *key) {
+    HostSeries *series = lookup_ip(key);
+    if (series) return series;
+
+    pthread_rwlock_rdlock(&host_table_lock);
+    AliasSlot *alias = find_alias(key);
+    if (alias && alias->key) series = alias->series;
+    pthread_rwlock_unlock(&host_table_lock);
+    return series;
+}
+
+static HostSeries *create_series(const HeartbeatData *data) {
+    HostSeries *series = calloc(1, sizeof(HostSeries));
+    if (!series) return NULL;
+
+    for (int level = 0; level < TSDB_ROLLUP_LEVELS; level++) {
+        series->rollups[level].buckets = calloc(rollup_capacity[level], sizeof(TsRollup));
+        if (!series->rollups[level].buckets) {
+            for (int j = 0; j < level; j++) free(series->rollups[j].buckets);
+            free(series);
+            return NULL;
+        }
+        series->rollups[level].capacity = rollup_capacity[level];
+        series->rollups[level].step = rollup_steps[level];
+    }
+    series->stats = calloc(1, sizeof(StatsWindow));
+    if (!series->stats) {
+        for (int level = 0; level < TSDB_ROLLUP_LEVELS; level++) free(series->rollups[level].buckets);
+        free(series);
+        return NULL;
+    }
+    snprintf(series->local_ip, sizeof(series->local_ip), "%s", data->local_ip);
+    gorilla_encoder_init(&series->raw_open);
+    pthread_mutex_init(&series->lock, NULL);
+    return series;
+}
+
+static size_t block_size(const GorillaBlock *block) {
+    return sizeof(GorillaBlock) + (block->bits + 7) / 8;
+}
+
+static void free_series(HostSeries *series) {
+    for (int level = 0; level < TSDB_ROLLUP_LEVELS; level++) {
+        free(series->rollups[level].buckets);
+    }
+    free(series->stats);
+    for (size_t i = 0; i < TSDB_RAW_BLOCKS; i++) {
+        if (series->raw_blocks[i]) {
+            __atomic_fetch_sub(&raw_bytes, block_size(series->raw_blocks[i]), __ATOMIC_RELAXED);
+            free(series->raw_blocks[i]);
+        }
+    }
+    gorilla_encoder_free(&series->raw_open);
+    pthread_mutex_destroy(&series->lock);
+    free(series);
+}
+
+// Find or create the series for data->local_ip
+static HostSeries *get_series(const HeartbeatData *data) {
+    HostSeries *series = lookup_ip(data->local_ip);
+    if (series) return series;
+
+    pthread_rwlock_wrlock(&host_table_lock);
+    HostSlot *slot = find_slot(data->local_ip);
+    series = slot ? slot->series : NULL;
+    if (slot && !series && host_total < TSDB_MAX_HOSTS && (series = create_series(data))) {
+        series->id = (uint32_t)host_total;
+        host_series[host_total++] = series;
+        slot->series = series;
+        __atomic_store_n(&slot->key, series->local_ip, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&host_table_lock);
+    return series;
+}
+
+// Point hostname at series, dropping the series' old alias. A hostname
+// taken by another series moves to this one. Hostname changes are rare, so
+// this takes the table write lock. Lookups try local_ip keys first, so a
+// hostname never shadows a host's local_ip.
+static void register_alias(HostSeries *series, const char *hostname) {
+    pthread_rwlock_wrlock(&host_table_lock);
+    if (series->alias) remove_alias(find_alias(series->alias));
+    AliasSlot *alias = find_alias(hostname);
+    if (alias && alias->key) {
+        alias->series->alias = NULL;
+        alias->series = series;
+        series->alias = alias->key;
+    } else if (alias && alias_total < TSDB_ALIAS_LOAD_LIMIT && (alias->key = strdup(hostname))) {
+        alias->series = series;
+        series->alias = alias->key;
+        alias_total++;
+    }
+    pthread_rwlock_unlock(&host_table_lock);
+
+    pthread_mutex_lock(&series->lock);
+    snprintf(series->hostname, sizeof(series->hostname), "%s", hostname);
+    pthread_mutex_unlock(&series->lock);
+}
+
+static TsRollup *bucket_at(RollupRing *ring, uint64_t index) {
+    return &ring->buckets[index % ring->capacity];
+}
+
+static uint64_t raw_first_block(const HostSeries *series) {
+    return series->raw_sealed > TSDB_RAW_BLOCKS ? series->raw_sealed - TSDB_RAW_BLOCKS : 0;
+}
+
+static GorillaBlock *raw_block_at(HostSeries *series, uint64_t index) {
+    return series->raw_blocks[index % TSDB_RAW_BLOCKS];
+}
+
+static uint64_t rollup_first(const RollupRing *ring) {
+    return ring->head > ring->capacity ? ring->head - ring->capacity : 0;
+}
+
+static void bucket_add(TsRollup *bucket, const double *values) {
+    bucket->count++;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        float v = (float)values[m];
+        if (bucket->count == 1 || v < bucket->min[m]) bucket->min[m] = v;
+        if (bucket->count == 1 || v > bucket->max[m]) bucket->max[m] = v;
+        bucket->avg[m] += (v - bucket->avg[m]) / (float)bucket->count;
+    }
+}
+
+// First index in [lo, hi) whose bucket start is >= start
+static uint64_t rollup_lower_bound(RollupRing *ring, uint64_t lo, uint64_t hi, time_t start) {
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (bucket_at(ring, mid)->start < start) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void rollup_add(RollupRing *ring, time_t timestamp, const double *values) {
+    time_t start = timestamp - timestamp % ring->step;
+
+    if (ring->head > 0) {
+        TsRollup *newest = bucket_at(ring, ring->head - 1);
+        if (newest->start == start) {
+            bucket_add(newest, values);
+            return;
+        }
+        if (newest->start > start) {
+            // Late sample: fold it into its bucket if that is still retained
+            uint64_t first = rollup_first(ring);
+            uint64_t i = rollup_lower_bound(ring, first, ring->head, start);
+            if (i < ring->head && bucket_at(ring, i)->start == start) {
+                bucket_add(bucket_at(ring, i), values);
+            }
+            return;
+        }
+    }
+
+    TsRollup *bucket = bucket_at(ring, ring->head++);
+    memset(bucket, 0, sizeof(*bucket));
+    bucket->start = start;
+    bucket_add(bucket, values);
+}
+
+// Move the open block into the sealed ring, dropping the oldest block once
+// TSDB_RAW_BLOCKS are held. Caller holds the series lock.
+static void seal_raw_block(HostSeries *series) {
+    GorillaBlock *block = gorilla_seal(&series->raw_open);
+    if (!block) return;     // out of memory: keep filling the open block
+    GorillaBlock **slot = &series->raw_blocks[series->raw_sealed++ % TSDB_RAW_BLOCKS];
+    if (*slot) {
+        __atomic_fetch_sub(&raw_bytes, block_size(*slot), __ATOMIC_RELAXED);
+        free(*slot);
+    }
+    *slot = block;
+    __atomic_fetch_add(&raw_bytes, block_size(block), __ATOMIC_RELAXED);
+}
+
+// Put a sample stamped before raw_last into the open block, which is
+// re-encoded in time order. False if it could not be re-encoded; the open
+// block is then unchanged. Caller holds the series lock.
+static bool raw_insert_open(HostSeries *series, time_t timestamp, const double *values) {
+    TsSample samples[TSDB_RAW_BLOCK_SAMPLES];
+    size_t n = 0;
+    GorillaDecoder dec;
+    gorilla_decoder_init_open(&dec, &series->raw_open);
+    while (n < TSDB_RAW_BLOCK_SAMPLES && gorilla_next(&dec, &samples[n])) n++;
+
+    GorillaEncoder enc;
+    gorilla_encoder_init(&enc);
+    bool inserted = false, ok = true;
+    for (size_t i = 0; i <= n && ok; i++) {
+        if (!inserted && (i == n || samples[i].timestamp > timestamp)) {
+            ok = gorilla_append(&enc, timestamp, values);
+            inserted = true;
+        }
+        if (i < n && ok) ok = gorilla_append(&enc, samples[i].timestamp, samples[i].values);
+    }
+    if (!ok) {
+        gorilla_encoder_free(&enc);
+        return false;
+    }
+    gorilla_encoder_free(&series->raw_open);
+    series->raw_open = enc;
+    return true;
+}
+
+bool tsdb_record(const HeartbeatData *data, time_t timestamp) {
+    HostSeries *series = get_series(data);
+    if (!series) return false;
+
+    double values[METRIC_COUNT];
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        values[m] = heartbeat_metric_value(data, (HeartbeatMetric)m);
+    }
+
+    pthread_mutex_lock(&series->lock);
+
+    bool renamed = data->hostname[0] && strcmp(series->hostname, data->hostname) != 0;
+
+    // Late heartbeats (say, replayed from a sender's queue) go into the
+    // rollups and stats at their own time but do not replace the latest state
+    if (series->samples == 0 || timestamp >= series->last_seen) {
+        if (series->samples > 0 && timestamp > series->last_seen) {
+            double gap = (double)(timestamp - series->last_seen);
+            // An outage should read as stale, not teach the host a long interval
+            if (series->interval > 0 && gap > 4 * series->interval) gap = 4 * series->interval;
+            series->interval = series->interval > 0 ? 0.8 * series->interval + 0.2 * gap : gap;
+        }
+        series->latest = *data;
+        series->last_seen = timestamp;
+    }
+    series->samples++;
+
+    // Keep raw samples sorted so range queries can skip whole blocks and
+    // deltas stay small. A late sample is inserted in order while the open
+    // block still covers its time; one older than that is only counted.
+    bool appended;
+    if ((series->raw_sealed == 0 && series->raw_open.count == 0) || timestamp >= series->raw_last) {
+        if ((appended = gorilla_append(&series->raw_open, timestamp, values))) {
+            series->raw_last = timestamp;
+        }
+    } else if (series->raw_open.count > 0 && timestamp >= series->raw_open.first) {
+        appended = raw_insert_open(series, timestamp, values);
+    } else {
+        appended = false;
+        __atomic_fetch_add(&raw_late_dropped, 1, __ATOMIC_RELAXED);
+    }
+    if (appended && series->raw_open.count == TSDB_RAW_BLOCK_SAMPLES) seal_raw_block(series);
+
+    for (int level = 0; level < TSDB_ROLLUP_LEVELS; level++) {
+        rollup_add(&series->rollups[level], timestamp, values);
+    }
+    stats_window_add(series->stats, values, timestamp);
+
+    pthread_mutex_unlock(&series->lock);
+
+    if (renamed) {
+        register_alias(series, data->hostname);
+    }
+    return true;
+}
+
+bool tsdb_step_supported(int step) {
+    if (step == 0) return true;
+    for (int level = 0; level < TSDB_ROLLUP_LEVELS; level++) {
+        if (rollup_steps[level] == step) return true;
+    }
+    return false;
+}
+
+static void fill_info(HostSeries *series, TsHostInfo *info) {
+    if (!info) return;
+    memcpy(info->local_ip, series->local_ip, MAX_IP_LEN);
+    memcpy(info->hostname, series->hostname, MAX_HOSTNAME_LEN);
+}
+
+ssize_t tsdb_query_raw(const char *host, time_t since, time_t until,
+                       TsSample *out, size_t max, TsHostInfo *info) {
+    HostSeries *series = lookup_series(host);
+    if (!series) return -1;
+
+    pthread_mutex_lock(&series->lock);
+    fill_info(series, info);
+
+    // Blocks are in time order: skip those that end before since, then
+    // decode forward until until or max
+    uint64_t lo = raw_first_block(series), hi = series->raw_sealed;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (raw_block_at(series, mid)->last < since) lo = mid + 1;
+        else hi = mid;
+    }
+
+    size_t n = 0;
+    bool done = false;
+    for (uint64_t b = lo; b <= series->raw_sealed && n < max && !done; b++) {
+        GorillaDecoder dec;
+        if (b < series->raw_sealed) {
+            gorilla_decoder_init(&dec, raw_block_at(series, b));
+        } else {
+            gorilla_decoder_init_open(&dec, &series->raw_open);
+        }
+        TsSample sample;
+        while (n < max && gorilla_next(&dec, &sample)) {
+            if (sample.timestamp > until) {
+                done = true;
+                break;
+            }
+            if (sample.timestamp >= since) out[n++] = sample;
+        }
+    }
+
+    pthread_mutex_unlock(&series->lock);
+    return (ssize_t)n;
+}
+
+ssize_t tsdb_query_rollup(const char *host, int step, time_t since, time_t until,
+                          TsRollup *out, size_t max, TsHostInfo *info) {
+    int level;
+    for (level = 0; level < TSDB_ROLLUP_LEVELS; level++) {
+        if (rollup_steps[level] == step) break;
+    }
+    if (level == TSDB_ROLLUP_LEVELS) return -1;
+
+    HostSeries *series = lookup_series(host);
+    if (!series) return -1;
+
+    pthread_mutex_lock(&series->lock);
+    fill_info(series, info);
+
+    // The bucket containing since starts at most step - 1 seconds before it
+    RollupRing *ring = &series->rollups[level];
+    uint64_t i = rollup_lower_bound(ring, rollup_first(ring), ring->head,
+                                    since - since % step);
+
+    size_t n = 0;
+    for (; i < ring->head && n < max; i++) {
+        TsRollup *bucket = bucket_at(ring, i);
+        if (bucket->start > until) break;
+        out[n++] = *bucket;
+    }
+
+    pthread_mutex_unlock(&series->lock);
+    return (ssize_t)n;
+}
+
+bool tsdb_query_stats(const char *host, int window, time_t now,
+                      StatsSummary *out, TsHostInfo *info) {
+    HostSeries *series = lookup_series(host);
+    if (!series) return false;
+
+    pthread_mutex_lock(&series->lock);
+    fill_info(series, info);
+    stats_window_query(series->stats, window, now, out);
+    pthread_mutex_unlock(&series->lock);
+    return true;
+}
+
+size_t tsdb_raw_bytes(void) {
+    return __atomic_load_n(&raw_bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t tsdb_raw_late_dropped(void) {
+    return __atomic_load_n(&raw_late_dropped, __ATOMIC_RELAXED);
+}
+
+bool tsdb_host_state(size_t id, TsHostState *out) {
+    pthread_rwlock_rdlock(&host_table_lock);
+    HostSeries *series = id < host_total ? host_series[id] : NULL;
+    pthread_rwlock_unlock(&host_table_lock);
+    if (!series) return false;
+
+    pthread_mutex_lock(&series->lock);
+    out->id = series->id;
+    out->latest = series->latest;
+    out->last_seen = series->last_seen;
+    out->samples = series->samples;
+    out->interval = series->interval > 0 ? series->interval : TSDB_DEFAULT_INTERVAL;
+    pthread_mutex_unlock(&series->lock);
+    return true;
+}
+
+bool tsdb_host_stale(const TsHostState *state, time_t now) {
+    return (double)(now - state->last_seen) > TSDB_STALE_INTERVALS * state->interval;
+}
+
+size_t tsdb_host_count(void) {
+    pthread_rwlock_rdlock(&host_table_lock);
+    size_t count = host_total;
+    pthread_rwlock_unlock(&host_table_lock);
+    return count;
+}
+
+void tsdb_clear(void) {
+    pthread_rwlock_wrlock(&host_table_lock);
+    for (size_t i = 0; i < TSDB_HASH_SLOTS; i++) {
+        host_slots[i].key = NULL;
+        host_slots[i].series = NULL;
+        free(alias_slots[i].key);
+        alias_slots[i].key = NULL;
+        alias_slots[i].series = NULL;
+    }
+    alias_total = 0;
+    for (size_t i = 0; i < host_total; i++) {
+        free_series(host_series[i]);
+        host_series[i] = NULL;
+    }
+    host_total = 0;
+    __atomic_store_n(&raw_late_dropped, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&host_table_lock);
+}
@@ -0,0 +1,103 @@
+#ifndef HEARTBEAT_TSDB_H
+#define HEARTBEAT_TSDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "heartbeat_server.h"
+#include "heartbeat_stats.h"
+
+// Per-host retention. Raw samples are kept Gorilla-compressed
+// (heartbeat_gorilla.h) in blocks of TSDB_RAW_BLOCK_SAMPLES; with 10 s
+// heartbeats the sealed blocks hold a day.
+#define TSDB_MAX_HOSTS 16384
+#define TSDB_RAW_BLOCK_SAMPLES 120
+#define TSDB_RAW_BLOCKS 72
+// The sealed blocks plus the open one: the most a series holds, so the
+// most a raw query returns
+#define TSDB_RAW_SAMPLES ((TSDB_RAW_BLOCKS + 1) * TSDB_RAW_BLOCK_SAMPLES)
+
+// A host is stale once it has been silent for TSDB_STALE_INTERVALS of its
+// expected interval, learned from its heartbeats (TSDB_DEFAULT_INTERVAL
+// until it has sent two)
+#define TSDB_DEFAULT_INTERVAL 10
+#define TSDB_STALE_INTERVALS 3
+#define TSDB_ROLLUP_1M_BUCKETS 120      // 2 hours
+#define TSDB_ROLLUP_5M_BUCKETS 288      // 1 day
+#define TSDB_ROLLUP_1H_BUCKETS 168      // 1 week
+#define TSDB_ROLLUP_LEVELS 3
+
+// One raw sample
+typedef struct {
+    time_t timestamp;
+    double values[METRIC_COUNT];
+} TsSample;
+
+// Aggregate of the samples whose timestamp falls in [start, start + step)
+typedef struct {
+    time_t start;
+    uint32_t count;
+    float min[METRIC_COUNT];
+    float max[METRIC_COUNT];
+    float avg[METRIC_COUNT];
+} TsRollup;
+
+// Identity of the host a query resolved to
+typedef struct {
+    char local_ip[MAX_IP_LEN];
+    char hostname[MAX_HOSTNAME_LEN];
+} TsHostInfo;
+
+// Latest state of one host
+typedef struct {
+    uint32_t id;                        // dense, assigned in order of first heartbeat
+    HeartbeatData latest;               // newest heartbeat, hostname included
+    time_t last_seen;                   // its timestamp
+    uint64_t samples;
+    double interval;                    // expected seconds between heartbeats
+} TsHostState;
+
+// Record a heartbeat in its host's series. Returns false when the host table
+// is full and the host is new.
+bool tsdb_record(const HeartbeatData *data, time_t timestamp);
+
+// Steps answered from a rollup level; 0 means raw samples
+bool tsdb_step_supported(int step);
+
+// Copy up to max raw samples with since <= timestamp <= until, oldest first.
+// host may be a local_ip or a hostname. Returns -1 for an unknown host.
+ssize_t tsdb_query_raw(const char *host, time_t since, time_t until,
+                       TsSample *out, size_t max, TsHostInfo *info);
+
+// Copy up to max rollup buckets of the given step that overlap
+// [since, until], oldest first. Returns -1 for an unknown host or step.
+ssize_t tsdb_query_rollup(const char *host, int step, time_t since, time_t until,
+                          TsRollup *out, size_t max, TsHostInfo *info);
+
+// Summarize the host's last window seconds into out[METRIC_COUNT] (see
+// stats_window_query). Returns false for an unknown host.
+bool tsdb_query_stats(const char *host, int window, time_t now,
+                      StatsSummary *out, TsHostInfo *info);
+
+// Number of hosts with a series; their ids are 0 to count - 1
+size_t tsdb_host_count(void);
+
+// Copy the latest state of host id. Returns false for an unknown id.
+bool tsdb_host_state(size_t id, TsHostState *out);
+
+// True if the host has not been heard from for TSDB_STALE_INTERVALS
+bool tsdb_host_stale(const TsHostState *state, time_t now);
+
+// Memory held by sealed raw blocks across every series
+size_t tsdb_raw_bytes(void);
+
+// Late samples left out of the raw tier because their block was already
+// sealed (the rollups and stats still have them)
+uint64_t tsdb_raw_late_dropped(void);
+
+// Drop every series (for testing; nothing else may run concurrently)
+void tsdb_clear(void);
+
+#endif /* HEARTBEAT_TSDB_H */
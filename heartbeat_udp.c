@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+
+#include "heartbeat_udp.h"
+#include "heartbeat_binary.h"
+#include "heartbeat_metrics.h"
+#include "heartbeat_ratelimit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Open addressing, kept under half full
+#define UDP_SENDER_SLOTS (UDP_MAX_SENDERS * 2)
+
+typedef struct {
+    bool used;
+    uint32_t addr;
+    uint16_t port;
+    UdpSeqWindow window;
+} UdpSender;
+
+// Touched only by the receiving thread, except stats, which is copied out
+// under stats_mutex
+static UdpSender *senders;
+static UdpStats stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int udp_fd = -1;
+static pthread_t udp_thread;
+
+// Pending samples for the next add_batch_to_history
+static HeartbeatData *batch_data;
+static time_t *batch_timestamps;
+static size_t batch_count;
+
+bool udp_seq_accept(UdpSeqWindow *w, uint32_t seq, UdpStats *st) {
+    if (!w->active) {
+        w->active = true;
+        w->first = w->highest = seq;
+        w->seen = 1;
+        return true;
+    }
+
+    if (seq > w->highest) {
+        uint32_t gap = seq - w->highest;
+        st->frames_lost += gap - 1;
+        w->seen = gap >= UDP_SEQ_WINDOW ? 0 : w->seen << gap;
+        w->seen |= 1;
+        w->highest = seq;
+        return true;
+    }
+
+    uint32_t offset = w->highest - seq;
+    if (offset < UDP_SEQ_WINDOW) {
+        uint64_t bit = 1ULL << offset;
+        if (w->seen & bit) {
+            st->frames_duplicate++;
+            return false;
+        }
+        w->seen |= bit;
+    } else if (seq <= UDP_SEQ_WINDOW) {
+        // Far behind and near the start: the sender restarted its counter
+        w->first = w->highest = seq;
+        w->seen = 1;
+        return true;
+    }
+
+    // A frame that was counted lost turned up late
+    st->frames_reordered++;
+    if (seq < w->first) {
+        w->first = seq;
+    } else if (st->frames_lost > 0) {
+        st->frames_lost--;
+    }
+    return true;
+}
+
+static UdpSeqWindow *sender_window(const struct sockaddr_in *addr) {
+    uint32_t key = addr->sin_addr.s_addr;
+    uint16_t port = addr->sin_port;
+    uint32_t i = (key * 2654435761u ^ port * 40503u) & (UDP_SENDER_SLOTS - 1);
+
+    while (senders[i].used) {
+        if (senders[i].addr == key && senders[i].port == port) return &senders[i].window;
+        i = (i + 1) & (UDP_SENDER_SLOTS - 1);
+    }
+    if (stats.senders >= UDP_MAX_SENDERS) return NULL;
+
+    senders[i].used = true;
+    senders[i].addr = key;
+    senders[i].port = port;
+    stats.senders++;
+    return &senders[i].window;
+}
+
+static void flush_batch(void) {
+    add_batch_to_history(batch_data, batch_timestamps, batch_count);
+    batch_count = 0;
+}
+
+static void queue_sample(const HeartbeatData *data, time_t timestamp) {
+    if (batch_count == UDP_MAX_BATCH_SAMPLES) flush_batch();
+    batch_data[batch_count] = *data;
+    batch_timestamps[batch_count] = timestamp;
+    batch_count++;
+}
+
+static void handle_binary_datagram(const uint8_t *data, size_t len,
+                                   const struct sockaddr_in *from, time_t now) {
+    while (len > 0) {
+        HbFrame frame;
+        size_t frame_len;
+        long count;
+        if (hb_parse_frame(data, len, &frame, &frame_len) != HB_PARSE_COMPLETE ||
+            (count = hb_samples_count(&frame)) < 0) {
+            stats.malformed++;
+            return;
+        }
+        data += frame_len;
+        len -= frame_len;
+
+        UdpSeqWindow *window = sender_window(from);
+        if (window && !udp_seq_accept(window, frame.seq, &stats)) continue;
+
+        for (long i = 0; i < count; i++) {
+            HbSample sample;
+            HeartbeatData hb_data;
+            hb_frame_sample(&frame, (size_t)i, &sample);
+            hb_sample_to_heartbeat(&sample, &hb_data);
+            time_t timestamp;
+            if (!validate_metrics(&hb_data) || !hb_sample_time(&sample, now, &timestamp)) {
+                stats.samples_rejected++;
+                continue;
+            }
+            queue_sample(&hb_data, timestamp);
+            stats.samples_accepted++;
+        }
+    }
+}
+
+static void handle_datagram(char *data, size_t len, const struct sockaddr_in *from, time_t now) {
+    if (len > 0 && data[0] == '{') {
+        HeartbeatData hb_data;
+        memset(&hb_data, 0, sizeof(hb_data));
+        data[len] = '\0';
+        if (process_json_data(data, &hb_data)) {
+            queue_sample(&hb_data, now);
+            stats.samples_accepted++;
+        } else {
+            stats.samples_rejected++;
+        }
+    } else if (hb_is_frame_start((const uint8_t *)data, len)) {
+        handle_binary_datagram((const uint8_t *)data, len, from, now);
+    } else {
+        stats.malformed++;
+    }
+}
+
+static void *run_udp_listener(void *arg) {
+    (void)arg;
+    // One spare byte per buffer for the JSON terminator
+    char (*buffers)[UDP_MAX_DATAGRAM + 1] = malloc(UDP_BATCH * sizeof(*buffers));
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    if (!buffers) {
+        perror("malloc failed");
+        return NULL;
+    }
+
+    while (1) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = UDP_MAX_DATAGRAM;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        // Block for the first datagram, then take whatever else is queued
+        int n = recvmmsg(udp_fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("recvmmsg failed");
+            break;
+        }
+
+        time_t now = time(NULL);
+        uint64_t now_ns = metrics_now();
+        pthread_mutex_lock(&stats_mutex);
+        for (int i = 0; i < n; i++) {
+            stats.datagrams++;
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                stats.malformed++;
+                continue;
+            }
+            // Datagrams from over-limit sources are dropped unparsed
+            if (!ratelimit_allow(addrs[i].sin_addr, now_ns)) continue;
+            handle_datagram(buffers[i], msgs[i].msg_len, &addrs[i], now);
+        }
+        pthread_mutex_unlock(&stats_mutex);
+        flush_batch();
+    }
+
+    free(buffers);
+    return NULL;
+}
+
+int start_udp_listener(int port) {
+    senders = calloc(UDP_SENDER_SLOTS, sizeof(UdpSender));
+    batch_data = malloc(UDP_MAX_BATCH_SAMPLES * sizeof(HeartbeatData));
+    batch_timestamps = malloc(UDP_MAX_BATCH_SAMPLES * sizeof(time_t));
+    if (!senders || !batch_data || !batch_timestamps) {
+        perror("UDP listener allocation failed");
+        return -1;
+    }
+
+    udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (udp_fd < 0) {
+        perror("UDP socket creation failed");
+        return -1;
+    }
+
+    // Absorb bursts from large fleets reporting on the same tick
+    int rcvbuf = UDP_RECV_BUFFER;
+    setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(udp_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("UDP bind failed");
+        close(udp_fd);
+        udp_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&udp_thread, NULL, run_udp_listener, NULL) != 0) {
+        perror("could not create UDP listener thread");
+        close(udp_fd);
+        udp_fd = -1;
+        return -1;
+    }
+    pthread_detach(udp_thread);
+
+    printf("UDP Server listening on port %d...\n", port);
+    return 0;
+}
+
+bool udp_listener_enabled(void) {
+    return udp_fd >= 0;
+}
+
+void udp_get_stats(UdpStats *out) {
+    pthread_mutex_lock(&stats_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&stats_mutex);
+}
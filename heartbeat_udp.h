@@ -0,0 +1,51 @@
+#ifndef HEARTBEAT_UDP_H
+#define HEARTBEAT_UDP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "heartbeat_server.h"
+
+#define UDP_BATCH 64                // datagrams per recvmmsg call
+#define UDP_MAX_DATAGRAM 8192       // larger datagrams are counted as malformed
+#define UDP_MAX_BATCH_SAMPLES 1024  // samples appended per locked section
+#define UDP_MAX_SENDERS 16384       // senders tracked for loss accounting
+#define UDP_SEQ_WINDOW 64           // recent sequence numbers remembered per sender
+#define UDP_RECV_BUFFER (4 * 1024 * 1024)
+
+// Datagrams carry either one raw JSON heartbeat or binary SAMPLES frames
+// (heartbeat_binary.h). Only binary frames have a sequence number, so loss,
+// duplicate and reordering counts cover binary senders only.
+typedef struct {
+    uint64_t datagrams;
+    uint64_t malformed;             // unparseable or truncated datagrams
+    uint64_t samples_accepted;
+    uint64_t samples_rejected;      // failed validation or stamped out of range
+    uint64_t frames_lost;           // sequence numbers skipped and never seen
+    uint64_t frames_duplicate;      // dropped: sequence number already seen
+    uint64_t frames_reordered;      // arrived after a later frame
+    uint64_t senders;               // senders being tracked
+} UdpStats;
+
+// Sliding window over one sender's frame sequence numbers
+typedef struct {
+    bool active;
+    uint32_t first;
+    uint32_t highest;
+    uint64_t seen;                  // bit i: highest - i was received
+} UdpSeqWindow;
+
+// Record seq in w, updating the loss/duplicate/reorder counters in stats.
+// Returns false when the frame is a duplicate and should be dropped.
+bool udp_seq_accept(UdpSeqWindow *w, uint32_t seq, UdpStats *stats);
+
+// Bind port and start the receiving thread. Returns 0 on success.
+int start_udp_listener(int port);
+
+// Is the UDP listener running?
+bool udp_listener_enabled(void);
+
+// Copy the current counters
+void udp_get_stats(UdpStats *stats);
+
+#endif /* HEARTBEAT_UDP_H */
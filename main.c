@@ -1,9 +1,51 @@
 #include "heartbeat_server.h"
+#include "heartbeat_event_loop.h"
+#include "heartbeat_history.h"
+#include "heartbeat_udp.h"
+#include "heartbeat_log.h"
+#include "heartbeat_store.h"
+#include "heartbeat_compress.h"
+#include "heartbeat_rules.h"
+#include "heartbeat_ratelimit.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <unistd.h>
 
-int main() {
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--loops N | --shards N] [--history N] [--udp] [--threaded]\n"
+            "          [--log-level LEVEL] [--log-sample N]\n"
+            "          [--data-dir DIR] [--retention-segments N] [--retention-hours N]\n"
+            "          [--gzip-level N] [--gzip-min-bytes N]\n"
+            "          [--rules FILE] [--alerts-file FILE]\n"
+            "          [--rate-limit N] [--rate-burst N] [--rate-limit-drop]\n"
+            "  --loops N          number of epoll event-loop threads (default %d)\n"
+            "  --shards N         N event loops, each with its own SO_REUSEPORT listeners\n"
+            "                     and history shard, pinned to a CPU (0: one per CPU)\n"
+            "  --history N        heartbeat records kept in memory (default %d)\n"
+            "  --udp              also accept heartbeat datagrams on UDP port %d\n"
+            "  --threaded         legacy model: one thread per accepted connection\n"
+            "  --log-level LEVEL  debug, info, warn, error or off (default warn)\n"
+            "  --log-sample N     log 1 in N accepted heartbeats at info (default %d)\n"
+            "  --data-dir DIR     persist history in segment files under DIR\n"
+            "  --retention-segments N  segments kept on disk (default %d)\n"
+            "  --retention-hours N     delete segments older than N hours (default: keep)\n"
+            "  --gzip-level N     compression level for API responses, 0 (off) to 9 (default %d)\n"
+            "  --gzip-min-bytes N smallest response body worth compressing (default %d)\n"
+            "  --rules FILE       evaluate the alert rules in FILE on every heartbeat\n"
+            "  --alerts-file FILE append alert firings to FILE as JSON lines\n"
+            "  --rate-limit N     connections and UDP datagrams per second per source IP\n"
+            "                     (default 0: unlimited); over-limit HTTP clients get 429\n"
+            "  --rate-burst N     tokens a source may save up (default: the rate)\n"
+            "  --rate-limit-drop  close over-limit connections without a 429\n",
+            prog, EVENT_LOOP_THREADS, MAX_HEARTBEATS, UDP_PORT, LOG_DEFAULT_SAMPLE_RATE,
+            STORE_DEFAULT_MAX_SEGMENTS, COMPRESS_DEFAULT_LEVEL, COMPRESS_DEFAULT_MIN_SIZE);
+}
+
+// Legacy model: one accept thread per port, one detached thread per client
+static int run_threaded(void) {
     pthread_t http_thread, tcp_thread;
     
     // Start HTTP server thread
@@ -25,4 +67,163 @@ int main() {
     pthread_join(tcp_thread, NULL);
     
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    int loops = EVENT_LOOP_THREADS;
+    int shards = -1;
+    bool threaded = false;
+    bool udp = false;
+    StoreConfig store = {0};
+    const char *rules_path = NULL;
+    const char *alerts_path = NULL;
+    double rate_limit = 0;
+    double rate_burst = -1;
+    RateLimitAction rate_action = RATELIMIT_REJECT;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threaded") == 0) {
+            threaded = true;
+        } else if (strcmp(argv[i], "--udp") == 0) {
+            udp = true;
+        } else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc) {
+            loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shards = atoi(argv[++i]);
+            if (shards < 0 || shards > MAX_HISTORY_SHARDS) {
+                fprintf(stderr, "Invalid shard count: %s (at most %d)\n", argv[i], MAX_HISTORY_SHARDS);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            long capacity = atol(argv[++i]);
+            if (capacity <= 0 || !set_history_capacity((size_t)capacity)) {
+                fprintf(stderr, "Invalid history capacity: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            LogLevel level;
+            if (!log_parse_level(argv[++i], &level)) {
+                fprintf(stderr, "Invalid log level: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            log_set_level(level);
+        } else if (strcmp(argv[i], "--log-sample") == 0 && i + 1 < argc) {
+            int rate = atoi(argv[++i]);
+            if (rate <= 0) {
+                fprintf(stderr, "Invalid log sample rate: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            log_set_sample_rate((unsigned)rate);
+        } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
+            store.dir = argv[++i];
+        } else if (strcmp(argv[i], "--retention-segments") == 0 && i + 1 < argc) {
+            long segments = atol(argv[++i]);
+            if (segments <= 0) {
+                fprintf(stderr, "Invalid segment retention: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            store.max_segments = (size_t)segments;
+        } else if (strcmp(argv[i], "--retention-hours") == 0 && i + 1 < argc) {
+            long hours = atol(argv[++i]);
+            if (hours <= 0) {
+                fprintf(stderr, "Invalid retention hours: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            store.max_age = (time_t)hours * 3600;
+        } else if (strcmp(argv[i], "--gzip-level") == 0 && i + 1 < argc) {
+            char *end;
+            long level = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || !compress_set_level((int)level)) {
+                fprintf(stderr, "Invalid compression level: %s (0-9)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--gzip-min-bytes") == 0 && i + 1 < argc) {
+            long bytes = atol(argv[++i]);
+            if (bytes < 0) {
+                fprintf(stderr, "Invalid compression threshold: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            compress_set_min_size((size_t)bytes);
+        } else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc) {
+            rules_path = argv[++i];
+        } else if (strcmp(argv[i], "--alerts-file") == 0 && i + 1 < argc) {
+            alerts_path = argv[++i];
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            rate_limit = atof(argv[++i]);
+            if (rate_limit < 0) {
+                fprintf(stderr, "Invalid rate limit: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--rate-burst") == 0 && i + 1 < argc) {
+            rate_burst = atof(argv[++i]);
+            if (rate_burst < 1) {
+                fprintf(stderr, "Invalid rate burst: %s (at least 1)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--rate-limit-drop") == 0) {
+            rate_action = RATELIMIT_DROP;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (shards >= 0) {
+        if (threaded) {
+            fprintf(stderr, "--shards needs the event-loop model, not --threaded\n");
+            return EXIT_FAILURE;
+        }
+        if (shards == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            shards = cpus < 1 ? 1 : cpus > MAX_HISTORY_SHARDS ? MAX_HISTORY_SHARDS : (int)cpus;
+        }
+        if (!set_history_shards((size_t)shards)) {
+            fprintf(stderr, "Failed to split history into %d shards\n", shards);
+            return EXIT_FAILURE;
+        }
+        loops = shards;
+    }
+    
+    if (!ratelimit_configure(rate_limit, rate_burst < 0 ? rate_limit : rate_burst, rate_action)) {
+        fprintf(stderr, "Invalid rate limit settings\n");
+        return EXIT_FAILURE;
+    }
+    
+    if (log_start_flusher() != 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // Rebuild history from disk before any listener accepts new heartbeats
+    if (store.dir && store_open(&store, add_batch_to_history) != 0) {
+        fprintf(stderr, "Failed to open store in %s\n", store.dir);
+        exit(EXIT_FAILURE);
+    }
+    
+    // Rules are loaded after the replay so recovered records do not fire alerts
+    if (alerts_path && rules_set_event_file(alerts_path) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (rules_path && rules_load(rules_path) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    if (udp && start_udp_listener(UDP_PORT) != 0) {
+        fprintf(stderr, "Failed to start UDP listener\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (threaded) {
+        return run_threaded();
+    }
+    
+    if (start_event_loops(loops, shards >= 0) != 0) {
+        fprintf(stderr, "Failed to start event loops\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    printf("Server started with HTTP port %d and TCP port %d\n", HTTP_PORT, TCP_PORT);
+    
+    join_event_loops();
+    
+    return 0;
+}
@@ -21,12 +21,47 @@ void test_parse_key_value(void);
 void test_process_json_data_valid(void);
 void test_process_json_data_invalid(void);
 void test_process_json_data_missing_fields(void);
+void test_json_decoder_matches_jsonc(void);
 
 // History management tests
 void test_add_to_history(void);
 void test_history_capacity(void);
 void test_get_history_json(void);
 void test_empty_history(void);
+void test_history_ring_wraparound(void);
+void test_history_snapshot(void);
+void test_history_streaming(void);
+void test_history_snapshot_cache(void);
+void test_response_compression(void);
 void test_concurrent_history_access(void);
+void test_history_shards(void);
+
+// Per-host time series tests
+void test_tsdb_raw_range(void);
+void test_tsdb_compressed_blocks(void);
+void test_tsdb_host_table(void);
+void test_tsdb_rollups(void);
+void test_tsdb_window_stats(void);
+void test_anomaly_detection(void);
+void test_alert_rules(void);
+
+// HTTP protocol tests
+void test_http_parse_incremental(void);
+void test_http_pipelining(void);
+void test_rate_limit(void);
+void test_batch_endpoint(void);
+void test_metrics_merge_shards(void);
+void test_stream_subscribers(void);
+
+// Binary protocol tests
+void test_binary_frames(void);
+void test_udp_sequence_window(void);
+void test_add_batch_to_history(void);
+
+// Logging tests
+void test_log_levels_and_sampling(void);
+
+// Persistence tests
+void test_store_recovery_and_retention(void);
 
 #endif /* TEST_HEARTBEAT_H */
\ No newline at end of file
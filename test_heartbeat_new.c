@@ -6,6 +6,24 @@
 #include "unity.h"
 #include "test_heartbeat.h"
 #include "heartbeat_server.h"
+#include "heartbeat_history.h"
+#include "heartbeat_tsdb.h"
+#include "heartbeat_http.h"
+#include "heartbeat_binary.h"
+#include "heartbeat_udp.h"
+#include "heartbeat_log.h"
+#include "heartbeat_store.h"
+#include "heartbeat_metrics.h"
+#include "heartbeat_stats.h"
+#include "heartbeat_stream.h"
+#include "heartbeat_snapshot.h"
+#include "heartbeat_compress.h"
+#include "heartbeat_anomaly.h"
+#include "heartbeat_rules.h"
+#include "heartbeat_ratelimit.h"
+#include <zlib.h>
+#include <dirent.h>
+#include <unistd.h>
 
 // Test setup function
 void setUp(void) {
@@ -170,6 +188,44 @@ void test_process_json_data_missing_fields(void) {
     TEST_ASSERT_FALSE(process_json_data(missing_fields_json, &data));
 }
 
+// Test that the single-pass decoder agrees with the json-c path
+void test_json_decoder_matches_jsonc(void) {
+    const char *inputs[] = {
+        "{\"local_ip\":\"10.0.0.1\",\"public_ip\":\"8.8.8.8\",\"cpu_usage\":45.5,"
+        "\"memory_usage\":60.2,\"disk_usage\":75,\"availability\":99.9,\"latency\":12.5}",
+        // numeric fields coerced from strings, booleans and null
+        "{\"local_ip\":\"10.0.0.1\",\"public_ip\":\"8.8.8.8\",\"cpu_usage\":\"45.5\","
+        "\"memory_usage\":true,\"disk_usage\":null,\"availability\":\"x\",\"latency\":[1]}",
+        // the last duplicate wins
+        "{\"local_ip\":\"bad\",\"public_ip\":\"8.8.8.8\",\"cpu_usage\":1,\"memory_usage\":2,"
+        "\"disk_usage\":3,\"availability\":4,\"latency\":5,\"local_ip\":\"10.0.0.1\"}",
+        // IP given as a number, then an escaped hostname
+        "{\"local_ip\":10,\"public_ip\":\"8.8.8.8\",\"cpu_usage\":1,\"memory_usage\":2,"
+        "\"disk_usage\":3,\"availability\":4,\"latency\":5}",
+        "{\"local_ip\":\"10.0.0.1\",\"public_ip\":\"8.8.8.8\",\"hostname\":\"a\\\"b\","
+        "\"cpu_usage\":1e1,\"memory_usage\":2,\"disk_usage\":3,\"availability\":4,"
+        "\"latency\":5,\"extra\":{\"nested\":[1,2,{}]}}",
+        // json-c extensions the fast path leaves to json-c
+        "{\"local_ip\":\"10.0.0.1\",\"public_ip\":\"8.8.8.8\",\"cpu_usage\":1,"
+        "\"memory_usage\":2,\"disk_usage\":3,\"availability\":4,\"latency\":5,}",
+        "{'local_ip':'10.0.0.1'}",
+        "{\"latency\":NaN}",
+        "",
+    };
+    
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        HeartbeatData fast, generic;
+        memset(&fast, 0, sizeof(fast));
+        memset(&generic, 0, sizeof(generic));
+        bool fast_ok = process_json_data(inputs[i], &fast);
+        bool generic_ok = process_json_data_generic(inputs[i], &generic);
+        TEST_ASSERT_EQUAL_MESSAGE(generic_ok, fast_ok, inputs[i]);
+        if (generic_ok) {
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(&generic, &fast, sizeof(fast), inputs[i]);
+        }
+    }
+}
+
 // Test adding to history
 void test_add_to_history(void) {
     HeartbeatData data = {
@@ -293,24 +349,10 @@ void test_get_history_json(void) {
     json_object_put(parsed_json);
     free(json);
 
-    // Clean test data with mutex protection
-    if (pthread_mutex_lock(&history_mutex) != 0) {
-        TEST_FAIL_MESSAGE("Failed to lock mutex for cleanup");
-        return;
-    }
-    
-    HeartbeatNode *current = heartbeat_history;
-    while (current != NULL) {
-        HeartbeatNode *next = current->next;
-        free(current);
-        current = next;
-    }
-    heartbeat_history = NULL;
-    heartbeat_count = 0;
-    
-    if (pthread_mutex_unlock(&history_mutex) != 0) {
-        TEST_FAIL_MESSAGE("Failed to unlock mutex after cleanup");
-    }
+    // Clean test data through the proper API
+    clear_heartbeat_history();
+    TEST_ASSERT_EQUAL_INT(0, heartbeat_count);
+    TEST_ASSERT_NULL(heartbeat_history);
 }
 
 // Test empty history
@@ -331,6 +373,1007 @@ void test_empty_history(void) {
     }
 }
 
+// Test that the ring overwrites the oldest record once full
+void test_history_ring_wraparound(void) {
+    HeartbeatData data = {
+        .local_ip = "10.0.0.1",
+        .public_ip = "8.8.8.8",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    
+    TEST_ASSERT_TRUE(set_history_capacity(3));
+    for (int i = 0; i < 5; i++) {
+        data.cpu_usage = i;
+        add_to_history(&data);
+    }
+    
+    TEST_ASSERT_EQUAL_INT(3, heartbeat_count);
+    
+    // Walking the list visits the three newest records, newest first
+    int node_count = 0;
+    double expected = 4.0;
+    for (HeartbeatNode *current = heartbeat_history; current; current = current->next) {
+        TEST_ASSERT_EQUAL_FLOAT(expected, current->data.cpu_usage);
+        expected -= 1.0;
+        node_count++;
+    }
+    TEST_ASSERT_EQUAL_INT(3, node_count);
+    
+    TEST_ASSERT_TRUE(set_history_capacity(MAX_HISTORY));
+}
+
+// Test copying a snapshot of the history
+void test_history_snapshot(void) {
+    HeartbeatData data = {
+        .local_ip = "10.0.0.1",
+        .public_ip = "8.8.8.8",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    
+    for (int i = 0; i < MAX_HISTORY + 10; i++) {
+        data.cpu_usage = i % 100;
+        add_to_history(&data);
+    }
+    
+    HeartbeatNode *snapshot;
+    size_t count = snapshot_history(&snapshot, 5);
+    TEST_ASSERT_EQUAL_UINT(5, count);
+    TEST_ASSERT_NOT_NULL(snapshot);
+    
+    // Newest first: the last value appended was (MAX_HISTORY + 9) % 100
+    TEST_ASSERT_EQUAL_FLOAT((MAX_HISTORY + 9) % 100, snapshot[0].data.cpu_usage);
+    TEST_ASSERT_EQUAL_FLOAT((MAX_HISTORY + 5) % 100, snapshot[4].data.cpu_usage);
+    TEST_ASSERT_EQUAL_PTR(&snapshot[1], snapshot[0].next);
+    TEST_ASSERT_NULL(snapshot[4].next);
+    free(snapshot);
+    
+    count = snapshot_history(&snapshot, MAX_HISTORY * 2);
+    TEST_ASSERT_EQUAL_UINT(MAX_HISTORY, count);
+    free(snapshot);
+}
+
+// Test per-host raw range queries
+void test_tsdb_raw_range(void) {
+    HeartbeatData data = {
+        .local_ip = "10.1.0.1",
+        .public_ip = "8.8.8.8",
+        .hostname = "web-1",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    
+    tsdb_clear();
+    for (int i = 0; i < 10; i++) {
+        data.cpu_usage = i;
+        TEST_ASSERT_TRUE(tsdb_record(&data, 1000 + i * 10));
+    }
+    
+    TsSample samples[TSDB_RAW_SAMPLES];
+    TsHostInfo info;
+    ssize_t n = tsdb_query_raw("10.1.0.1", 1035, 1070, samples, TSDB_RAW_SAMPLES, &info);
+    TEST_ASSERT_EQUAL_INT(4, n);
+    TEST_ASSERT_EQUAL_INT(1040, samples[0].timestamp);
+    TEST_ASSERT_EQUAL_FLOAT(4.0, samples[0].values[METRIC_CPU_USAGE]);
+    TEST_ASSERT_EQUAL_INT(1070, samples[3].timestamp);
+    TEST_ASSERT_EQUAL_STRING("web-1", info.hostname);
+    
+    // The hostname is an alias for the same series
+    n = tsdb_query_raw("web-1", 0, 2000, samples, 2, &info);
+    TEST_ASSERT_EQUAL_INT(2, n);
+    TEST_ASSERT_EQUAL_STRING("10.1.0.1", info.local_ip);
+
+    TEST_ASSERT_EQUAL_INT(-1, tsdb_query_raw("10.9.9.9", 0, 2000, samples, 1, NULL));
+
+    // A host that keeps renaming holds one alias, even after more names
+    // than the hostname table has slots
+    int renames = TSDB_MAX_HOSTS * 4 + 10;
+    for (int i = 0; i < renames; i++) {
+        snprintf(data.hostname, sizeof(data.hostname), "h-%d", i);
+        TEST_ASSERT_TRUE(tsdb_record(&data, 2000 + i));
+    }
+    // With every sealed block full, a query for all of it still reaches the
+    // newest samples in the open block
+    n = tsdb_query_raw("10.1.0.1", 0, 2000 + renames, samples, TSDB_RAW_SAMPLES, NULL);
+    TEST_ASSERT_TRUE(n > TSDB_RAW_BLOCKS * TSDB_RAW_BLOCK_SAMPLES);
+    TEST_ASSERT_EQUAL_INT(2000 + renames - 1, samples[n - 1].timestamp);
+    TEST_ASSERT_EQUAL_INT(-1, tsdb_query_raw("web-1", 0, 2000, samples, 1, NULL));
+    TEST_ASSERT_EQUAL_INT(-1, tsdb_query_raw("h-0", 0, 2000, samples, 1, NULL));
+    snprintf(data.hostname, sizeof(data.hostname), "h-%d", renames - 1);
+    TEST_ASSERT_EQUAL_INT(1, tsdb_query_raw(data.hostname, 0, 2000 + renames, samples, 1, &info));
+    TEST_ASSERT_EQUAL_STRING("10.1.0.1", info.local_ip);
+
+    // A second host taking the name takes the alias
+    strcpy(data.local_ip, "10.1.0.2");
+    TEST_ASSERT_TRUE(tsdb_record(&data, 3000));
+    TEST_ASSERT_EQUAL_INT(1, tsdb_query_raw(data.hostname, 0, 2000 + renames, samples, 1, &info));
+    TEST_ASSERT_EQUAL_STRING("10.1.0.2", info.local_ip);
+    tsdb_clear();
+}
+
+// Test that raw samples survive Gorilla compression exactly, across block
+// boundaries, irregular intervals and a clock jump
+void test_tsdb_compressed_blocks(void) {
+    HeartbeatData data = {
+        .local_ip = "10.1.0.2",
+        .public_ip = "8.8.8.8",
+        .disk_usage = 70.0,
+        .availability = 100.0
+    };
+    enum { COUNT = 3 * TSDB_RAW_BLOCK_SAMPLES + 7 };
+    static TsSample expected[COUNT];
+    static TsSample samples[COUNT];
+    
+    tsdb_clear();
+    time_t ts = 1000;
+    for (int i = 0; i < COUNT; i++) {
+        ts += i == 200 ? 1000000 : 10 + (i % 7 == 0 ? 3 : 0);
+        data.cpu_usage = (i * 37 % 1000) / 10.0;
+        data.memory_usage = 40.0 + i / 50;
+        data.latency = i % 11 == 0 ? 0.001 * i : 12.5;
+        TEST_ASSERT_TRUE(tsdb_record(&data, ts));
+        expected[i].timestamp = ts;
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            expected[i].values[m] = heartbeat_metric_value(&data, (HeartbeatMetric)m);
+        }
+    }
+    TEST_ASSERT_TRUE(tsdb_raw_bytes() > 0);
+    TEST_ASSERT_TRUE(tsdb_raw_bytes() < 3 * TSDB_RAW_BLOCK_SAMPLES * sizeof(TsSample) / 2);
+    
+    ssize_t n = tsdb_query_raw("10.1.0.2", 0, ts, samples, COUNT, NULL);
+    TEST_ASSERT_EQUAL_INT(COUNT, n);
+    for (int i = 0; i < COUNT; i++) {
+        TEST_ASSERT_EQUAL_INT(expected[i].timestamp, samples[i].timestamp);
+        TEST_ASSERT_EQUAL_MEMORY(expected[i].values, samples[i].values, sizeof(samples[i].values));
+    }
+    
+    // A range spanning the first block boundary
+    int first = TSDB_RAW_BLOCK_SAMPLES - 2;
+    n = tsdb_query_raw("10.1.0.2", expected[first].timestamp, expected[first + 3].timestamp,
+                       samples, COUNT, NULL);
+    TEST_ASSERT_EQUAL_INT(4, n);
+    TEST_ASSERT_EQUAL_INT(expected[first + 3].timestamp, samples[3].timestamp);
+    tsdb_clear();
+}
+
+// Test the latest-state host table and /api/hosts filters
+void test_tsdb_host_table(void) {
+    HeartbeatData data = {
+        .local_ip = "10.1.0.4",
+        .public_ip = "8.8.8.8",
+        .cpu_usage = 50.0,
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 10.0
+    };
+    tsdb_clear();
+    tsdb_record(&data, 1000);
+    data.cpu_usage = 95.0;
+    tsdb_record(&data, 1010);
+    data.cpu_usage = 1.0;
+    tsdb_record(&data, 990);    // late: kept in the series only
+    strcpy(data.local_ip, "10.1.0.5");
+    data.cpu_usage = 20.0;
+    tsdb_record(&data, 1000);
+    
+    TsHostState state;
+    TEST_ASSERT_EQUAL_size_t(2, tsdb_host_count());
+    TEST_ASSERT_TRUE(tsdb_host_state(0, &state));
+    TEST_ASSERT_EQUAL_UINT32(0, state.id);
+    TEST_ASSERT_EQUAL_STRING("10.1.0.4", state.latest.local_ip);
+    TEST_ASSERT_EQUAL_FLOAT(95.0, (float)state.latest.cpu_usage);
+    TEST_ASSERT_EQUAL_INT(1010, state.last_seen);
+    TEST_ASSERT_EQUAL_UINT64(3, state.samples);
+    TEST_ASSERT_EQUAL_FLOAT(10.0, (float)state.interval);
+    TEST_ASSERT_FALSE(tsdb_host_stale(&state, 1030));
+    TEST_ASSERT_TRUE(tsdb_host_stale(&state, 1041));
+    TEST_ASSERT_FALSE(tsdb_host_state(2, &state));
+    
+    char request[] = "GET /api/hosts?cpu_gt=90&stale=true HTTP/1.0\r\n\r\n";
+    OutputBuffer out;
+    output_buffer_init(&out);
+    ProtocolState state_in;
+    protocol_state_init(&state_in);
+    bool close_after = false;
+    process_input(&state_in, request, strlen(request), false, &out, &close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    
+    struct json_object *parsed = json_tokener_parse(strstr(out.data, "\r\n\r\n") + 4);
+    TEST_ASSERT_NOT_NULL(parsed);
+    struct json_object *hosts, *count, *host;
+    json_object_object_get_ex(parsed, "hosts", &hosts);
+    json_object_object_get_ex(parsed, "count", &count);
+    TEST_ASSERT_EQUAL_INT(1, json_object_get_int(count));
+    json_object_object_get_ex(json_object_array_get_idx(hosts, 0), "host", &host);
+    TEST_ASSERT_EQUAL_STRING("10.1.0.4", json_object_get_string(host));
+    json_object_put(parsed);
+    
+    // A filter on no known metric is an error, not an unfiltered table
+    char unknown[] = "GET /api/hosts?cpu_usage_gt=1&load_gt=90 HTTP/1.0\r\n\r\n";
+    out.len = 0;
+    close_after = false;
+    protocol_state_init(&state_in);
+    process_input(&state_in, unknown, strlen(unknown), false, &out, &close_after);
+    TEST_ASSERT_EQUAL_MEMORY("400", out.data + 9, 3);
+    
+    // A fleet bigger than one chunk is streamed
+    for (int i = 0; i < 200; i++) {
+        snprintf(data.local_ip, sizeof(data.local_ip), "10.2.%d.%d", i / 250, i % 250 + 1);
+        tsdb_record(&data, 1000);
+    }
+    char fleet[] = "GET /api/hosts HTTP/1.1\r\n\r\n";
+    out.len = 0;
+    close_after = false;
+    protocol_state_init(&state_in);
+    process_input(&state_in, fleet, strlen(fleet), false, &out, &close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "Transfer-Encoding: chunked"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "\"count\":202,\"total\":202}"));
+    TEST_ASSERT_EQUAL_STRING("0\r\n\r\n", out.data + out.len - 5);
+    
+    protocol_state_free(&state_in);
+    output_buffer_free(&out);
+    tsdb_clear();
+}
+
+// Test incrementally maintained rollups
+void test_tsdb_rollups(void) {
+    HeartbeatData data = {
+        .local_ip = "10.1.0.2",
+        .public_ip = "8.8.8.8",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    
+    tsdb_clear();
+    // Two minutes of samples every 10 s: cpu 0..5 then 10..15
+    for (int i = 0; i < 12; i++) {
+        data.cpu_usage = i < 6 ? i : i + 4;
+        tsdb_record(&data, 600 + i * 10);
+    }
+    
+    TsRollup buckets[4];
+    ssize_t n = tsdb_query_rollup("10.1.0.2", 60, 0, 10000, buckets, 4, NULL);
+    TEST_ASSERT_EQUAL_INT(2, n);
+    TEST_ASSERT_EQUAL_INT(600, buckets[0].start);
+    TEST_ASSERT_EQUAL_UINT32(6, buckets[0].count);
+    TEST_ASSERT_EQUAL_FLOAT(0.0, buckets[0].min[METRIC_CPU_USAGE]);
+    TEST_ASSERT_EQUAL_FLOAT(5.0, buckets[0].max[METRIC_CPU_USAGE]);
+    TEST_ASSERT_EQUAL_FLOAT(2.5, buckets[0].avg[METRIC_CPU_USAGE]);
+    TEST_ASSERT_EQUAL_FLOAT(12.5, buckets[1].avg[METRIC_CPU_USAGE]);
+    
+    // since inside the second bucket still returns that bucket
+    n = tsdb_query_rollup("10.1.0.2", 60, 690, 10000, buckets, 4, NULL);
+    TEST_ASSERT_EQUAL_INT(1, n);
+    TEST_ASSERT_EQUAL_INT(660, buckets[0].start);
+    
+    n = tsdb_query_rollup("10.1.0.2", 3600, 0, 10000, buckets, 4, NULL);
+    TEST_ASSERT_EQUAL_INT(1, n);
+    TEST_ASSERT_EQUAL_UINT32(12, buckets[0].count);
+    
+    TEST_ASSERT_EQUAL_INT(-1, tsdb_query_rollup("10.1.0.2", 42, 0, 10000, buckets, 4, NULL));
+    
+    // A sample arriving two minutes late lands in its own minute, and in
+    // time order among the raw samples
+    data.cpu_usage = 20.0;
+    tsdb_record(&data, 720);
+    data.cpu_usage = 50.0;
+    tsdb_record(&data, 600);
+    n = tsdb_query_rollup("10.1.0.2", 60, 0, 10000, buckets, 4, NULL);
+    TEST_ASSERT_EQUAL_INT(3, n);
+    TEST_ASSERT_EQUAL_UINT32(7, buckets[0].count);
+    TEST_ASSERT_EQUAL_FLOAT(50.0, buckets[0].max[METRIC_CPU_USAGE]);
+    TEST_ASSERT_EQUAL_UINT32(6, buckets[1].count);
+    TEST_ASSERT_EQUAL_INT(720, buckets[2].start);
+    TEST_ASSERT_EQUAL_UINT32(1, buckets[2].count);
+    TEST_ASSERT_EQUAL_FLOAT(20.0, buckets[2].max[METRIC_CPU_USAGE]);
+    
+    TsSample samples[16];
+    n = tsdb_query_raw("10.1.0.2", 0, 10000, samples, 16, NULL);
+    TEST_ASSERT_EQUAL_INT(14, n);
+    TEST_ASSERT_EQUAL_INT(600, samples[1].timestamp);
+    TEST_ASSERT_EQUAL_FLOAT(50.0, samples[1].values[METRIC_CPU_USAGE]);
+    TEST_ASSERT_EQUAL_INT(610, samples[2].timestamp);
+    TEST_ASSERT_EQUAL_INT(720, samples[13].timestamp);
+    TEST_ASSERT_EQUAL_UINT64(0, tsdb_raw_late_dropped());
+    tsdb_clear();
+}
+
+// Test windowed per-host and fleet-wide summaries
+void test_tsdb_window_stats(void) {
+    HeartbeatData data = {
+        .local_ip = "10.1.0.3",
+        .public_ip = "8.8.8.8",
+        .hostname = "db-1",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    
+    tsdb_clear();
+    // One sample five minutes before the rest
+    data.cpu_usage = 100.0;
+    tsdb_record(&data, 5700);
+    // Then 100 samples spread over two minutes: cpu 0.2 .. 99.2
+    for (int i = 0; i < 100; i++) {
+        data.cpu_usage = i + 0.2;
+        data.latency = 10.0 + i;
+        tsdb_record(&data, 6000 + i);
+    }
+    
+    StatsSummary summary[METRIC_COUNT];
+    TsHostInfo info;
+    TEST_ASSERT_TRUE(tsdb_query_stats("db-1", 60, 6099, summary, &info));
+    TEST_ASSERT_EQUAL_STRING("10.1.0.3", info.local_ip);
+    StatsSummary *cpu = &summary[METRIC_CPU_USAGE];
+    TEST_ASSERT_EQUAL_UINT64(100, cpu->count);
+    TEST_ASSERT_EQUAL_FLOAT(0.2f, (float)cpu->min);
+    TEST_ASSERT_EQUAL_FLOAT(99.2f, (float)cpu->max);
+    TEST_ASSERT_EQUAL_FLOAT(49.7f, (float)cpu->mean);
+    TEST_ASSERT_FLOAT_WITHIN(1.0f, 49.2f, (float)cpu->p50);
+    TEST_ASSERT_FLOAT_WITHIN(1.0f, 94.2f, (float)cpu->p95);
+    TEST_ASSERT_FLOAT_WITHIN(1.0f, 98.2f, (float)cpu->p99);
+    // Latency bins are logarithmic, about 12% wide
+    TEST_ASSERT_FLOAT_WITHIN(59.0f * 0.12f, 59.0f, (float)summary[METRIC_LATENCY].p50);
+    TEST_ASSERT_FLOAT_WITHIN(104.0f * 0.12f, 104.0f, (float)summary[METRIC_LATENCY].p95);
+    
+    // Only the 15 minute window reaches back to the early sample
+    tsdb_query_stats("10.1.0.3", 300, 6099, summary, NULL);
+    TEST_ASSERT_EQUAL_UINT64(100, summary[METRIC_CPU_USAGE].count);
+    tsdb_query_stats("10.1.0.3", 900, 6099, summary, NULL);
+    TEST_ASSERT_EQUAL_UINT64(101, summary[METRIC_CPU_USAGE].count);
+    TEST_ASSERT_EQUAL_FLOAT(100.0f, (float)summary[METRIC_CPU_USAGE].max);
+    
+    TEST_ASSERT_FALSE(tsdb_query_stats("10.9.9.9", 60, 6099, summary, NULL));
+    TEST_ASSERT_FALSE(stats_window_supported(120));
+    
+    // The fleet window merges every host
+    HeartbeatData fleet[2] = { data, data };
+    strcpy(fleet[1].local_ip, "10.1.0.4");
+    fleet[0].cpu_usage = 10.0;
+    fleet[1].cpu_usage = 30.0;
+    time_t timestamps[2] = { 6090, 6095 };
+    stats_clear_fleet();
+    stats_record_fleet(fleet, timestamps, 2);
+    stats_query_fleet(60, 6099, summary);
+    TEST_ASSERT_EQUAL_UINT64(2, summary[METRIC_CPU_USAGE].count);
+    TEST_ASSERT_EQUAL_FLOAT(20.0f, (float)summary[METRIC_CPU_USAGE].mean);
+    stats_clear_fleet();
+    tsdb_clear();
+}
+
+// Test that the EWMA detector flags a CPU spike once a host has warmed up
+void test_anomaly_detection(void) {
+    HeartbeatData data = {
+        .local_ip = "10.1.0.9",
+        .public_ip = "8.8.8.8",
+        .hostname = "web-9",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.9,
+        .latency = 10.0
+    };
+    anomaly_clear();
+    time_t now = time(NULL);
+    for (int i = 0; i < 2 * ANOMALY_WARMUP_SAMPLES; i++) {
+        data.cpu_usage = 20.0 + (i % 3);
+        TEST_ASSERT_EQUAL_UINT8(0, anomaly_observe(&data, now));
+    }
+    
+    data.cpu_usage = 95.0;
+    add_to_history_at(&data, now);
+    TEST_ASSERT_EQUAL_UINT8(1u << METRIC_CPU_USAGE, heartbeat_history->anomalies);
+    char *json = get_history_json();
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"anomalies\":[\"cpu_usage\"]"));
+    free(json);
+    
+    AnomalyEvent events[4];
+    TEST_ASSERT_EQUAL_size_t(1, anomaly_recent("web-9", events, 4));
+    TEST_ASSERT_EQUAL_INT(METRIC_CPU_USAGE, events[0].metric);
+    TEST_ASSERT_TRUE(events[0].z > ANOMALY_Z_THRESHOLD);
+    TEST_ASSERT_EQUAL_size_t(0, anomaly_recent("10.1.0.10", events, 4));
+    
+    AnomalyStats stats;
+    anomaly_get_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.hosts);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.flagged);
+    anomaly_clear();
+}
+
+// Test that compiled rules fire per host after N consecutive matches, only
+// for hosts in their prefix, and respect their cooldown
+void test_alert_rules(void) {
+    char err[256];
+    rules_clear();
+    TEST_ASSERT_EQUAL_INT(-1, rules_compile("ok cpu_usage > 1\n\nbad cpu_usage >> 1\n", err, sizeof(err)));
+    TEST_ASSERT_EQUAL_STRING("line 3: unknown operator '>>'", err);
+    TEST_ASSERT_EQUAL_INT(0, rules_compile(
+        "# name  conditions  options\n"
+        "hot   cpu_usage > 90 for 3 in 10.1.0.0/16\n"
+        "other cpu_usage > 90 in 10.2.0.0/16\n"
+        "slow  latency >= 500 and cpu_usage > 50 cooldown 60   # any host\n",
+        err, sizeof(err)));
+    
+    char path[] = "/tmp/heartbeat_alerts_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    TEST_ASSERT_EQUAL_INT(0, rules_set_event_file(path));
+    
+    HeartbeatData data = {
+        .local_ip = "10.1.2.3",
+        .public_ip = "8.8.8.8",
+        .hostname = "web-3",
+        .cpu_usage = 95.0,
+        .latency = 10.0
+    };
+    time_t now = time(NULL);
+    TEST_ASSERT_EQUAL_size_t(0, rules_evaluate(&data, now));
+    TEST_ASSERT_EQUAL_size_t(0, rules_evaluate(&data, now + 10));
+    TEST_ASSERT_EQUAL_size_t(1, rules_evaluate(&data, now + 20));
+    TEST_ASSERT_EQUAL_size_t(0, rules_evaluate(&data, now + 30));   // still the same excursion
+    data.cpu_usage = 10.0;
+    rules_evaluate(&data, now + 40);
+    data.cpu_usage = 95.0;
+    for (int i = 0; i < 3; i++) rules_evaluate(&data, now + 50 + i * 10);
+    
+    // A host outside 10.1/16 never reaches the "hot" rule
+    strcpy(data.local_ip, "10.2.0.1");
+    strcpy(data.hostname, "db-1");
+    TEST_ASSERT_EQUAL_size_t(1, rules_evaluate(&data, now));
+    
+    data.latency = 600.0;
+    TEST_ASSERT_EQUAL_size_t(1, rules_evaluate(&data, now + 10));
+    data.latency = 20.0;
+    rules_evaluate(&data, now + 20);
+    data.latency = 600.0;
+    TEST_ASSERT_EQUAL_size_t(0, rules_evaluate(&data, now + 30));   // within the cooldown
+    TEST_ASSERT_EQUAL_size_t(0, rules_evaluate(&data, now + 60));
+    TEST_ASSERT_EQUAL_size_t(1, rules_evaluate(&data, now + 70));   // cooldown over, still high
+    TEST_ASSERT_EQUAL_size_t(0, rules_evaluate(&data, now + 80));
+    
+    RuleEvent events[8];
+    TEST_ASSERT_EQUAL_size_t(2, rules_recent("hot", NULL, events, 8));
+    TEST_ASSERT_EQUAL_STRING("10.1.2.3", events[0].local_ip);
+    TEST_ASSERT_EQUAL_UINT32(3, events[0].samples);
+    TEST_ASSERT_EQUAL_size_t(3, rules_recent(NULL, "db-1", events, 8));
+    TEST_ASSERT_EQUAL_STRING("slow", events[0].rule);
+    TEST_ASSERT_EQUAL_INT(now + 70, events[0].timestamp);
+    TEST_ASSERT_EQUAL_UINT32(3, events[0].samples);
+    TEST_ASSERT_TRUE(events[0].values[METRIC_LATENCY] == 600.0);
+    
+    RulesStats stats;
+    rules_get_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT64(3, stats.rules);
+    TEST_ASSERT_EQUAL_UINT64(5, stats.fired);
+    TEST_ASSERT_EQUAL_UINT64(2 * 8 + 2 * 7, stats.evaluated);
+    
+    // Every firing was appended to the file as one JSON line
+    rules_set_event_file(NULL);
+    FILE *file = fopen(path, "r");
+    TEST_ASSERT_NOT_NULL(file);
+    char line[1024];
+    int lines = 0;
+    while (fgets(line, sizeof(line), file)) {
+        struct json_object *event = json_tokener_parse(line);
+        TEST_ASSERT_NOT_NULL(event);
+        json_object_put(event);
+        lines++;
+    }
+    fclose(file);
+    unlink(path);
+    TEST_ASSERT_EQUAL_INT(5, lines);
+    rules_clear();
+}
+
+// Test that each source's bucket refills at the configured rate, that a
+// full table evicts sources, and that refused HTTP clients get a 429
+void test_rate_limit(void) {
+    const uint64_t second = 1000000000ull;
+    TEST_ASSERT_TRUE(ratelimit_configure(2, 3, RATELIMIT_REJECT));
+    ratelimit_clear();
+    struct in_addr a = { .s_addr = htonl(0x0a000001) };
+    struct in_addr b = { .s_addr = htonl(0x0a000002) };
+    uint64_t now = 10 * second;
+    for (int i = 0; i < 3; i++) TEST_ASSERT_TRUE(ratelimit_allow(a, now));
+    TEST_ASSERT_FALSE(ratelimit_allow(a, now));
+    TEST_ASSERT_TRUE(ratelimit_allow(b, now));
+    TEST_ASSERT_TRUE(ratelimit_allow(a, now + second / 2));
+    TEST_ASSERT_FALSE(ratelimit_allow(a, now + second / 2));
+    
+    int fds[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    struct sockaddr_in peer = { .sin_family = AF_INET, .sin_addr = a };
+    TEST_ASSERT_FALSE(ratelimit_admit(fds[0], &peer, HTTP_PORT, now + second / 2));
+    char response[256];
+    ssize_t n = read(fds[1], response, sizeof(response) - 1);
+    TEST_ASSERT_TRUE(n > 0);
+    response[n] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, strncmp(response, "HTTP/1.1 429 ", 13));
+    TEST_ASSERT_NOT_NULL(strstr(response, "Retry-After: 1\r\n"));
+    TEST_ASSERT_EQUAL_INT(0, read(fds[1], response, sizeof(response)));   // closed
+    close(fds[1]);
+    
+    RateLimitStats stats;
+    ratelimit_get_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT64(2, stats.sources);
+    TEST_ASSERT_EQUAL_UINT64(5, stats.allowed);
+    TEST_ASSERT_EQUAL_UINT64(3, stats.limited);
+    
+    // Twice as many sources as fit: every stripe fills, then evicts
+    for (uint32_t i = 0; i < 2 * RATELIMIT_MAX_SOURCES; i++) {
+        struct in_addr addr = { .s_addr = htonl(0x0b000000 + i) };
+        ratelimit_allow(addr, now);
+    }
+    ratelimit_get_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT64(RATELIMIT_MAX_SOURCES, stats.sources);
+    TEST_ASSERT_EQUAL_UINT64(2 * RATELIMIT_MAX_SOURCES + 2 - RATELIMIT_MAX_SOURCES, stats.evictions);
+    
+    ratelimit_configure(0, 0, RATELIMIT_REJECT);
+    ratelimit_clear();
+}
+
+// Test that the history is streamed as chunks that decode to valid JSON
+void test_history_streaming(void) {
+    HeartbeatData data = {
+        .local_ip = "10.3.0.1",
+        .public_ip = "8.8.8.8",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    clear_heartbeat_history();
+    for (int i = 0; i < 3; i++) {
+        data.cpu_usage = i;
+        add_to_history(&data);
+    }
+    
+    char request[] = "GET /api/heartbeat/history?limit=2 HTTP/1.1\r\n\r\n";
+    OutputBuffer out;
+    output_buffer_init(&out);
+    ProtocolState state;
+    protocol_state_init(&state);
+    bool close_after = false;
+    process_input(&state, request, strlen(request), false, &out, &close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "Transfer-Encoding: chunked"));
+    
+    // Reassemble the chunked body
+    char body[BUFFER_SIZE] = "";
+    char *p = strstr(out.data, "\r\n\r\n") + 4;
+    size_t size;
+    while ((size = strtoul(p, &p, 16)) > 0) {
+        strncat(body, p + 2, size);
+        p += 2 + size + 2;
+    }
+    TEST_ASSERT_EQUAL_STRING("\r\n\r\n", p);
+    
+    struct json_object *parsed = json_tokener_parse(body);
+    TEST_ASSERT_NOT_NULL(parsed);
+    TEST_ASSERT_EQUAL_INT(2, json_object_array_length(parsed));
+    struct json_object *cpu;
+    json_object_object_get_ex(json_object_array_get_idx(parsed, 0), "cpu_usage", &cpu);
+    TEST_ASSERT_EQUAL_FLOAT(2.0, (float)json_object_get_double(cpu));
+    
+    json_object_put(parsed);
+    output_buffer_free(&out);
+    clear_heartbeat_history();
+}
+
+// Test that history reads share a cached snapshot until the next append and
+// that a matching If-None-Match gets a 304
+void test_history_snapshot_cache(void) {
+    HeartbeatData data = {
+        .local_ip = "10.3.0.2",
+        .public_ip = "8.8.8.8",
+        .cpu_usage = 10.0,
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    add_to_history(&data);
+    
+    HistorySnapshot *first = history_snapshot_get(0, false);
+    HistorySnapshot *again = history_snapshot_get(0, false);
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_EQUAL_PTR(first, again);
+    history_snapshot_put(again);
+    
+    uint64_t generation = get_history_generation();
+    add_to_history(&data);
+    TEST_ASSERT_TRUE(get_history_generation() > generation);
+    HistorySnapshot *second = history_snapshot_get(0, false);
+    TEST_ASSERT_TRUE(second != first);
+    TEST_ASSERT_TRUE(strcmp(first->etag, second->etag) != 0);
+    // The swapped-out snapshot stays readable while referenced
+    struct json_object *parsed = json_tokener_parse(first->data);
+    TEST_ASSERT_EQUAL_INT(1, json_object_array_length(parsed));
+    json_object_put(parsed);
+    history_snapshot_put(first);
+    
+    // Clearing must not bring back an old generation
+    generation = get_history_generation();
+    clear_heartbeat_history();
+    TEST_ASSERT_TRUE(get_history_generation() > generation);
+    
+    char request[256];
+    snprintf(request, sizeof(request),
+             "GET /api/heartbeat/history HTTP/1.1\r\nIf-None-Match: W/\"x\", %s\r\n\r\n",
+             second->etag);
+    history_snapshot_put(second);
+    OutputBuffer out;
+    output_buffer_init(&out);
+    ProtocolState state;
+    protocol_state_init(&state);
+    bool close_after = false;
+    process_input(&state, request, strlen(request), false, &out, &close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "HTTP/1.1 200"));
+    
+    char etag[SNAPSHOT_ETAG_LEN];
+    char *tag = strstr(out.data, "ETag: ");
+    TEST_ASSERT_NOT_NULL(tag);
+    sscanf(tag + 6, "%63s", etag);
+    snprintf(request, sizeof(request),
+             "GET /api/heartbeat/history HTTP/1.1\r\nIf-None-Match: %s\r\n\r\n", etag);
+    out.len = 0;
+    process_input(&state, request, strlen(request), false, &out, &close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "HTTP/1.1 304 Not Modified"));
+    TEST_ASSERT_NULL(strstr(out.data, "Content-Length"));
+    
+    protocol_state_free(&state);
+    output_buffer_free(&out);
+}
+
+// Test Accept-Encoding negotiation and a gzip history response
+void test_response_compression(void) {
+    HttpRequest req;
+    memset(&req, 0, sizeof(req));
+    req.header_count = 1;
+    req.headers[0].name = "Accept-Encoding";
+    req.headers[0].name_len = strlen("Accept-Encoding");
+    const char *cases[][2] = {
+        { "gzip, deflate", "gzip" },
+        { "gzip;q=0, deflate", "deflate" },
+        { "deflate;q=1.0, gzip;q=0.5", "deflate" },
+        { "br, *;q=0.1", "gzip" },
+        { "identity", NULL },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        req.headers[0].value = cases[i][0];
+        req.headers[0].value_len = strlen(cases[i][0]);
+        const char *name = content_coding_name(compress_negotiate(&req));
+        if (cases[i][1]) {
+            TEST_ASSERT_EQUAL_STRING(cases[i][1], name);
+        } else {
+            TEST_ASSERT_NULL(name);
+        }
+    }
+    
+    HeartbeatData data = {
+        .local_ip = "10.3.0.3",
+        .public_ip = "8.8.8.8",
+        .cpu_usage = 10.0,
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    for (int i = 0; i < 50; i++) add_to_history(&data);
+    
+    char request[] = "GET /api/heartbeat/history HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n";
+    OutputBuffer out;
+    output_buffer_init(&out);
+    ProtocolState state;
+    protocol_state_init(&state);
+    bool close_after = false;
+    process_input(&state, request, strlen(request), false, &out, &close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "Content-Encoding: gzip\r\n"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "Vary: Accept-Encoding\r\n"));
+    
+    // Reassemble the chunked body, then inflate it
+    OutputBuffer gz;
+    output_buffer_init(&gz);
+    char *p = strstr(out.data, "\r\n\r\n") + 4;
+    size_t size;
+    while ((size = strtoul(p, &p, 16)) > 0) {
+        output_buffer_append(&gz, p + 2, size);
+        p += 2 + size + 2;
+    }
+    char json[BUFFER_SIZE * 4];
+    uLongf json_len = sizeof(json) - 1;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    TEST_ASSERT_EQUAL_INT(Z_OK, inflateInit2(&zs, 15 + 16));
+    zs.next_in = (Bytef *)gz.data;
+    zs.avail_in = (uInt)gz.len;
+    zs.next_out = (Bytef *)json;
+    zs.avail_out = (uInt)json_len;
+    TEST_ASSERT_EQUAL_INT(Z_STREAM_END, inflate(&zs, Z_FINISH));
+    json[zs.total_out] = '\0';
+    inflateEnd(&zs);
+    TEST_ASSERT_TRUE(gz.len < zs.total_out / 4);
+    
+    struct json_object *parsed = json_tokener_parse(json);
+    TEST_ASSERT_NOT_NULL(parsed);
+    TEST_ASSERT_EQUAL_INT(50, json_object_array_length(parsed));
+    json_object_put(parsed);
+    
+    protocol_state_free(&state);
+    output_buffer_free(&gz);
+    output_buffer_free(&out);
+}
+
+// Test the batch endpoint with a JSON array and NDJSON
+void test_batch_endpoint(void) {
+    const char *hb = "{\"local_ip\":\"10.6.0.1\",\"public_ip\":\"8.8.8.8\",\"cpu_usage\":1,"
+                     "\"memory_usage\":2,\"disk_usage\":3,\"availability\":4,\"latency\":5}";
+    char body[1024], request[1200];
+    
+    OutputBuffer out;
+    output_buffer_init(&out);
+    clear_heartbeat_history();
+    
+    snprintf(body, sizeof(body), "[%s, {\"cpu_usage\":1}, %s]", hb, hb);
+    snprintf(request, sizeof(request),
+             "POST /api/heartbeat/batch HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    snprintf(body, sizeof(body), "%s\n\nnot json\n%s", hb, hb);
+    size_t first_len = strlen(request);
+    snprintf(request + first_len, sizeof(request) - first_len,
+             "POST /api/heartbeat/batch HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s", strlen(body), body);
+    
+    ProtocolState state;
+    protocol_state_init(&state);
+    bool close_after = false;
+    size_t consumed = process_input(&state, request, strlen(request), false, &out, &close_after);
+    TEST_ASSERT_EQUAL_size_t(strlen(request), consumed);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "{\"accepted\":2,\"rejected\":1,\"results\":[\"ok\",\"invalid\",\"ok\"]}"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "{\"accepted\":2,\"rejected\":1,\"results\":[\"ok\",\"invalid\",\"ok\"]}HTTP"));
+    TEST_ASSERT_EQUAL_INT(4, heartbeat_count);
+    
+    output_buffer_free(&out);
+    clear_heartbeat_history();
+    tsdb_clear();
+}
+
+// Test a request whose bytes arrive in several pieces
+void test_http_parse_incremental(void) {
+    char buf[256];
+    const char *raw = "POST /api/heartbeat?x=1 HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhello";
+    size_t total = strlen(raw);
+    HttpParser parser;
+    HttpRequest req;
+    size_t consumed = 0;
+    
+    http_parser_reset(&parser);
+    for (size_t len = 1; len < total; len++) {
+        memcpy(buf, raw, len);
+        TEST_ASSERT_EQUAL_INT(HTTP_PARSE_INCOMPLETE, http_parse(&parser, buf, len, &req, &consumed));
+    }
+    memcpy(buf, raw, total);
+    buf[total] = 'Z';
+    TEST_ASSERT_EQUAL_INT(HTTP_PARSE_COMPLETE, http_parse(&parser, buf, total, &req, &consumed));
+    TEST_ASSERT_EQUAL_size_t(total, consumed);
+    TEST_ASSERT_EQUAL_INT(14, req.path_len);
+    TEST_ASSERT_EQUAL_STRING("x=1", req.query);
+    TEST_ASSERT_EQUAL_STRING("hello", req.body);
+    TEST_ASSERT_TRUE(req.keep_alive);
+    TEST_ASSERT_NOT_NULL(http_get_header(&req, "content-length", NULL));
+    http_request_done(&parser, buf, consumed);
+    TEST_ASSERT_EQUAL_CHAR('Z', buf[total]);
+    
+    const char *bad = "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n";
+    TEST_ASSERT_EQUAL_INT(HTTP_PARSE_ERROR, http_parse(&parser, (char *)strcpy(buf, bad), strlen(bad), &req, &consumed));
+    TEST_ASSERT_EQUAL_INT(400, parser.error_status);
+    
+    // A query string that would not fit is refused rather than clipped
+    static char longer[HTTP_MAX_HEADER_SIZE];
+    int n = snprintf(longer, sizeof(longer), "GET /api/hosts?cpu_gt=1&pad=%0*d HTTP/1.1\r\n\r\n",
+                     HTTP_MAX_QUERY_LEN, 0);
+    http_parser_reset(&parser);
+    TEST_ASSERT_EQUAL_INT(HTTP_PARSE_ERROR, http_parse(&parser, longer, (size_t)n, &req, &consumed));
+    TEST_ASSERT_EQUAL_INT(414, parser.error_status);
+}
+
+// Test pipelined keep-alive requests, including a body larger than one read
+void test_http_pipelining(void) {
+    char form[8192];
+    int form_len = snprintf(form, sizeof(form),
+        "local_ip=10.2.0.1&public_ip=8.8.8.8&cpu_usage=1&memory_usage=2"
+        "&disk_usage=3&availability=4&latency=5&hostname=");
+    memset(form + form_len, 'h', 5000);
+    form_len += 5000;
+    form[form_len] = '\0';
+    
+    OutputBuffer in, out;
+    output_buffer_init(&in);
+    output_buffer_init(&out);
+    output_buffer_printf(&in, "POST /api/heartbeat HTTP/1.1\r\nContent-Length: %d\r\n\r\n%s",
+                         form_len, form);
+    output_buffer_printf(&in, "GET /api/heartbeat HTTP/1.1\r\n\r\n");
+    output_buffer_printf(&in, "GET /missing HTTP/1.0\r\n\r\n");
+    output_buffer_reserve(&in, 1);
+    
+    ProtocolState state;
+    protocol_state_init(&state);
+    bool close_after = false;
+    clear_heartbeat_history();
+    
+    // Everything but the final byte: two responses, the third request pending
+    size_t consumed = process_input(&state, in.data, in.len - 1, false, &out, &close_after);
+    TEST_ASSERT_FALSE(close_after);
+    TEST_ASSERT_EQUAL_INT(1, heartbeat_count);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "HTTP/1.1 200 OK"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "HTTP/1.1 405 Method Not Allowed"));
+    
+    out.len = 0;
+    consumed += process_input(&state, in.data + consumed, in.len - consumed, false, &out, &close_after);
+    TEST_ASSERT_EQUAL_size_t(in.len, consumed);
+    TEST_ASSERT_TRUE(close_after);
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "HTTP/1.1 404 Not Found"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "Connection: close"));
+    
+    clear_heartbeat_history();
+    output_buffer_free(&in);
+    output_buffer_free(&out);
+}
+
+// Test binary frames: sample encoding and a HELLO + SAMPLES exchange
+void test_binary_frames(void) {
+    HeartbeatData data = {
+        .local_ip = "10.4.0.1",
+        .public_ip = "8.8.8.8",
+        .cpu_usage = 45.5,
+        .memory_usage = 60.25,
+        .disk_usage = 75.0,
+        .availability = 99.9,
+        .latency = 12.34
+    };
+    HbSample sample, decoded;
+    time_t taken = time(NULL) - 30;
+    TEST_ASSERT_TRUE(hb_sample_from_heartbeat(&data, taken, &sample));
+    
+    uint8_t input[128];
+    size_t len = 0;
+    hb_encode_header(input, HB_FRAME_HELLO, 2 + 4, 0);
+    memcpy(input + HB_HEADER_SIZE, "\x01\x04node", 6);
+    len += HB_HEADER_SIZE + 6;
+    hb_encode_header(input + len, HB_FRAME_SAMPLES, 2 + HB_SAMPLE_SIZE, 7);
+    input[len + HB_HEADER_SIZE] = 0;
+    input[len + HB_HEADER_SIZE + 1] = 1;
+    hb_encode_sample(input + len + HB_HEADER_SIZE + 2, &sample);
+    len += HB_HEADER_SIZE + 2 + HB_SAMPLE_SIZE;
+    TEST_ASSERT_EQUAL_size_t(52, len);
+    
+    hb_decode_sample(input + len - HB_SAMPLE_SIZE, &decoded);
+    TEST_ASSERT_EQUAL_MEMORY(&sample, &decoded, sizeof(sample));
+    
+    clear_heartbeat_history();
+    OutputBuffer out;
+    output_buffer_init(&out);
+    ProtocolState state;
+    protocol_state_init(&state);
+    bool close_after = false;
+    
+    // Deliver everything but the last byte first
+    size_t consumed = process_input(&state, (char *)input, len - 1, false, &out, &close_after);
+    TEST_ASSERT_EQUAL_size_t(HB_HEADER_SIZE + 6, consumed);
+    consumed += process_input(&state, (char *)input + consumed, len - consumed, false, &out, &close_after);
+    TEST_ASSERT_EQUAL_size_t(len, consumed);
+    TEST_ASSERT_FALSE(close_after);
+    
+    HbFrame frame;
+    size_t frame_len;
+    TEST_ASSERT_EQUAL_INT(HB_PARSE_COMPLETE, hb_parse_frame((uint8_t *)out.data, out.len, &frame, &frame_len));
+    TEST_ASSERT_EQUAL_INT(HB_FRAME_HELLO, frame.type);
+    TEST_ASSERT_EQUAL_INT(HB_PARSE_COMPLETE, hb_parse_frame((uint8_t *)out.data + frame_len,
+                                                            out.len - frame_len, &frame, &frame_len));
+    TEST_ASSERT_EQUAL_INT(HB_FRAME_ACK, frame.type);
+    TEST_ASSERT_EQUAL_UINT32(7, frame.seq);
+    TEST_ASSERT_EQUAL_UINT8(1, frame.payload[1]);
+    
+    TEST_ASSERT_EQUAL_INT(1, heartbeat_count);
+    TEST_ASSERT_EQUAL_STRING("10.4.0.1", heartbeat_history->data.local_ip);
+    TEST_ASSERT_EQUAL_STRING("node", heartbeat_history->data.hostname);
+    TEST_ASSERT_EQUAL_INT(taken, heartbeat_history->timestamp);
+    TEST_ASSERT_EQUAL_FLOAT(60.25, (float)heartbeat_history->data.memory_usage);
+    TEST_ASSERT_EQUAL_FLOAT(12.34, (float)heartbeat_history->data.latency);
+    
+    // A sample stamped far in the future (or before retention) is refused
+    uint32_t stamps[] = { 0xFFFFFFFFu, (uint32_t)(time(NULL) - HB_MAX_SAMPLE_AGE - 60) };
+    for (size_t i = 0; i < 2; i++) {
+        sample.timestamp = stamps[i];
+        hb_encode_header(input, HB_FRAME_SAMPLES, 2 + HB_SAMPLE_SIZE, 8);
+        input[HB_HEADER_SIZE] = 0;
+        input[HB_HEADER_SIZE + 1] = 1;
+        hb_encode_sample(input + HB_HEADER_SIZE + 2, &sample);
+        out.len = 0;
+        len = HB_HEADER_SIZE + 2 + HB_SAMPLE_SIZE;
+        TEST_ASSERT_EQUAL_size_t(len, process_input(&state, (char *)input, len, false, &out, &close_after));
+        TEST_ASSERT_EQUAL_INT(HB_PARSE_COMPLETE, hb_parse_frame((uint8_t *)out.data, out.len, &frame, &frame_len));
+        TEST_ASSERT_EQUAL_INT(HB_FRAME_ACK, frame.type);
+        TEST_ASSERT_EQUAL_UINT8(0, frame.payload[1]);
+        TEST_ASSERT_EQUAL_UINT8(1, frame.payload[3]);
+    }
+    TEST_ASSERT_EQUAL_INT(1, heartbeat_count);
+    TEST_ASSERT_EQUAL_INT(taken, heartbeat_history->timestamp);
+    
+    output_buffer_free(&out);
+    clear_heartbeat_history();
+    tsdb_clear();
+}
+
+// Test UDP loss, duplicate and reordering accounting
+void test_udp_sequence_window(void) {
+    UdpSeqWindow window = {0};
+    UdpStats stats = {0};
+    
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 1, &stats));
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 2, &stats));
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 5, &stats));     // 3 and 4 missing
+    TEST_ASSERT_EQUAL_UINT64(2, stats.frames_lost);
+    TEST_ASSERT_FALSE(udp_seq_accept(&window, 2, &stats));    // duplicate
+    TEST_ASSERT_EQUAL_UINT64(1, stats.frames_duplicate);
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 3, &stats));     // late, not lost
+    TEST_ASSERT_EQUAL_UINT64(1, stats.frames_lost);
+    TEST_ASSERT_EQUAL_UINT64(1, stats.frames_reordered);
+    TEST_ASSERT_FALSE(udp_seq_accept(&window, 3, &stats));
+    
+    // A sender that restarts its counter is not a flood of duplicates
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 1000, &stats));
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 1, &stats));
+    TEST_ASSERT_TRUE(udp_seq_accept(&window, 2, &stats));
+    TEST_ASSERT_EQUAL_UINT64(2, stats.frames_duplicate);
+}
+
+// Test appending a batch in one locked section
+void test_add_batch_to_history(void) {
+    HeartbeatData batch[3];
+    time_t timestamps[3] = { 100, 200, 300 };
+    memset(batch, 0, sizeof(batch));
+    for (int i = 0; i < 3; i++) {
+        snprintf(batch[i].local_ip, MAX_IP_LEN, "10.5.0.%d", i + 1);
+        strcpy(batch[i].public_ip, "8.8.8.8");
+    }
+    
+    clear_heartbeat_history();
+    add_batch_to_history(batch, timestamps, 3);
+    TEST_ASSERT_EQUAL_INT(3, heartbeat_count);
+    TEST_ASSERT_EQUAL_STRING("10.5.0.3", heartbeat_history->data.local_ip);
+    TEST_ASSERT_EQUAL_INT(300, heartbeat_history->timestamp);
+    TEST_ASSERT_EQUAL_INT(200, heartbeat_history->next->timestamp);
+    clear_heartbeat_history();
+    tsdb_clear();
+}
+
 #define NUM_TEST_THREADS 5
 #define HEARTBEATS_PER_THREAD 20
 
@@ -388,6 +1431,282 @@ void test_concurrent_history_access(void) {
     pthread_mutex_unlock(&history_mutex);
 }
 
+// Test that sharded history is merged newest first on read
+void test_history_shards(void) {
+    HeartbeatData data = {
+        .local_ip = "10.6.0.1",
+        .public_ip = "8.8.8.8",
+        .memory_usage = 60.0,
+        .disk_usage = 70.0,
+        .availability = 99.0,
+        .latency = 100.0
+    };
+    size_t capacity = get_history_capacity();
+    TEST_ASSERT_TRUE(set_history_shards(2));
+    TEST_ASSERT_EQUAL_UINT(2, get_history_shard_count());
+    stats_clear_fleet();
+    
+    // Interleave timestamps across the two shards as two loops would
+    for (int i = 0; i < 6; i++) {
+        set_thread_history_shard(i % 2);
+        data.cpu_usage = i;
+        add_to_history_at(&data, 1000 + i);
+    }
+    set_thread_history_shard(-1);
+    TEST_ASSERT_EQUAL_UINT(3, history_ring_count(get_history_shard(0)));
+    TEST_ASSERT_EQUAL_UINT(3, history_ring_count(get_history_shard(1)));
+    TEST_ASSERT_EQUAL_UINT(6, get_history_count());
+    
+    HeartbeatNode *snapshot;
+    size_t count = snapshot_history(&snapshot, 4);
+    TEST_ASSERT_EQUAL_UINT(4, count);
+    for (size_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_INT(1005 - (int)i, (int)snapshot[i].timestamp);
+    }
+    TEST_ASSERT_EQUAL_PTR(&snapshot[1], snapshot[0].next);
+    free(snapshot);
+    
+    char *json = get_history_json();
+    struct json_object *array = json_tokener_parse(json);
+    free(json);
+    TEST_ASSERT_NOT_NULL(array);
+    TEST_ASSERT_EQUAL_INT(6, json_object_array_length(array));
+    struct json_object *oldest, *timestamp;
+    oldest = json_object_array_get_idx(array, 5);
+    TEST_ASSERT_TRUE(json_object_object_get_ex(oldest, "timestamp", &timestamp));
+    TEST_ASSERT_EQUAL_INT(1000, json_object_get_int(timestamp));
+    json_object_put(array);
+    
+    // The fleet window merges the shards' windows
+    StatsSummary summary[METRIC_COUNT];
+    stats_query_fleet(60, 1005, summary);
+    TEST_ASSERT_EQUAL_UINT64(6, summary[METRIC_CPU_USAGE].count);
+    TEST_ASSERT_EQUAL_FLOAT(5.0f, (float)summary[METRIC_CPU_USAGE].max);
+    
+    // Without a shard of its own a writer routes by host
+    clear_heartbeat_history();
+    add_to_history_at(&data, 2000);
+    add_to_history_at(&data, 2001);
+    TEST_ASSERT_TRUE(history_ring_count(get_history_shard(0)) == 2 ||
+                     history_ring_count(get_history_shard(1)) == 2);
+    
+    TEST_ASSERT_TRUE(set_history_shards(1));
+    TEST_ASSERT_TRUE(set_history_capacity(capacity));
+    stats_clear_fleet();
+    tsdb_clear();
+}
+
+// Test stream filtering and the resync of a subscriber the ring lapped
+void test_stream_subscribers(void) {
+    HeartbeatData data[2] = {
+        { .local_ip = "10.7.0.1", .public_ip = "8.8.8.8", .hostname = "edge-1", .latency = 1.0 },
+        { .local_ip = "10.7.0.2", .public_ip = "8.8.8.8", .latency = 2.0 }
+    };
+    time_t timestamps[2] = { 1000, 1001 };
+    
+    StreamSubscriber all, edge;
+    stream_subscribe(&all, NULL, false, 0);
+    stream_subscribe(&edge, "edge-1", false, 0);
+    stream_publish(data, timestamps, 2);
+    
+    OutputBuffer out;
+    output_buffer_init(&out);
+    TEST_ASSERT_TRUE(stream_pump(&all, &out, 1001));
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "10.7.0.1"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "10.7.0.2"));
+    
+    out.len = 0;
+    TEST_ASSERT_TRUE(stream_pump(&edge, &out, 1001));
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "10.7.0.1"));
+    TEST_ASSERT_NULL(strstr(out.data, "10.7.0.2"));
+    
+    // Nothing new, and not idle long enough for a keepalive
+    out.len = 0;
+    TEST_ASSERT_FALSE(stream_pump(&all, &out, 1001));
+    TEST_ASSERT_EQUAL_UINT(0, out.len);
+    
+    // Publishing never waits: a full ring later the subscriber is resynced
+    StreamStats before;
+    stream_get_stats(&before);
+    for (int i = 0; i <= STREAM_RING_CAPACITY; i++) {
+        stream_publish(data, timestamps, 1);
+    }
+    TEST_ASSERT_TRUE(stream_pump(&all, &out, 1001));
+    output_buffer_reserve(&out, 1);
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "event: resync"));
+    StreamStats after;
+    stream_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT64(before.resyncs + 1, after.resyncs);
+    TEST_ASSERT_EQUAL_UINT64(before.subscribers, after.subscribers);
+    
+    stream_unsubscribe(&all);
+    stream_unsubscribe(&edge);
+    stream_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT64(before.subscribers - 2, after.subscribers);
+    output_buffer_free(&out);
+}
+
+static int log_argument_evaluations = 0;
+
+static int count_evaluation(void) {
+    return ++log_argument_evaluations;
+}
+
+// Levels gate formatting and sampling keeps 1 in N successes
+void test_log_levels_and_sampling(void) {
+    int fds[2];
+    TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+    log_set_output(fds[1]);
+    log_set_sample_rate(4);
+    
+    // Below the threshold the arguments are never evaluated
+    log_set_level(LOG_LEVEL_WARN);
+    log_info("test", "n=%d", count_evaluation());
+    log_info_sampled("test", "n=%d", count_evaluation());
+    TEST_ASSERT_EQUAL_INT(0, log_argument_evaluations);
+    
+    log_set_level(LOG_LEVEL_INFO);
+    for (int i = 0; i < 8; i++) {
+        log_info_sampled("sampled", "i=%d", i);
+    }
+    log_warn("failure", "reason=%s", "always logged");
+    log_debug("hidden", "n=%d", count_evaluation());
+    log_flush();
+    
+    char buf[4096];
+    ssize_t n = read(fds[0], buf, sizeof(buf) - 1);
+    TEST_ASSERT_TRUE(n > 0);
+    buf[n] = '\0';
+    
+    int lines = 0;
+    for (char *p = buf; (p = strchr(p, '\n')); p++) lines++;
+    TEST_ASSERT_EQUAL_INT(3, lines);
+    TEST_ASSERT_NOT_NULL(strstr(buf, "level=info event=sampled i=0\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "level=info event=sampled i=4\n"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "level=warn event=failure reason=always logged\n"));
+    TEST_ASSERT_EQUAL_INT(0, log_argument_evaluations);
+    
+    LogLevel level;
+    TEST_ASSERT_TRUE(log_parse_level("error", &level));
+    TEST_ASSERT_EQUAL_INT(LOG_LEVEL_ERROR, level);
+    TEST_ASSERT_FALSE(log_parse_level("verbose", &level));
+    
+    log_set_level(LOG_DEFAULT_LEVEL);
+    log_set_sample_rate(LOG_DEFAULT_SAMPLE_RATE);
+    log_set_output(STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static size_t count_segment_files(const char *dir) {
+    size_t count = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, "segment-", 8) == 0) count++;
+    }
+    if (d) closedir(d);
+    return count;
+}
+
+// Records survive a reopen and old segments are deleted whole
+void test_store_recovery_and_retention(void) {
+    char dir[] = "/tmp/heartbeat_store_XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    StoreConfig config = { .dir = dir, .segment_records = 4, .max_segments = 3 };
+    
+    TEST_ASSERT_EQUAL_INT(0, store_open(&config, add_batch_to_history));
+    HeartbeatData hb_data = {
+        .local_ip = "10.1.0.1", .public_ip = "8.8.8.8", .hostname = "db-1",
+        .cpu_usage = 0.0, .memory_usage = 40.0, .disk_usage = 50.0,
+        .availability = 99.0, .latency = 5.0
+    };
+    for (int i = 0; i < 10; i++) {
+        hb_data.cpu_usage = i;
+        add_to_history_at(&hb_data, 1000 + i);
+    }
+    store_close();
+    TEST_ASSERT_EQUAL_size_t(3, count_segment_files(dir));
+    
+    // Recovery rebuilds the ring from the mapped records
+    clear_heartbeat_history();
+    TEST_ASSERT_EQUAL_INT(0, store_open(&config, add_batch_to_history));
+    StoreStats stats;
+    store_get_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT64(10, stats.records_recovered);
+    TEST_ASSERT_EQUAL_INT(10, heartbeat_count);
+    TEST_ASSERT_EQUAL_STRING("db-1", heartbeat_history->data.hostname);
+    TEST_ASSERT_EQUAL_FLOAT(9.0f, (float)heartbeat_history->data.cpu_usage);
+    TEST_ASSERT_EQUAL_INT(1009, (int)heartbeat_history->timestamp);
+    
+    // Appends continue in the partial segment, then a fourth segment pushes
+    // the oldest out
+    for (int i = 10; i < 13; i++) {
+        hb_data.cpu_usage = i;
+        add_to_history_at(&hb_data, 1000 + i);
+    }
+    store_get_stats(&stats);
+    TEST_ASSERT_EQUAL_UINT64(3, stats.segments);
+    store_close();
+    TEST_ASSERT_EQUAL_size_t(3, count_segment_files(dir));
+    
+    clear_heartbeat_history();
+    TEST_ASSERT_EQUAL_INT(0, store_open(&config, add_batch_to_history));
+    TEST_ASSERT_EQUAL_INT(9, heartbeat_count);
+    TEST_ASSERT_EQUAL_FLOAT(12.0f, (float)heartbeat_history->data.cpu_usage);
+    store_close();
+    
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    TEST_ASSERT_EQUAL_INT(0, system(command));
+}
+
+#define METRICS_TEST_THREADS 4
+#define METRICS_TEST_EVENTS 1000
+
+static void *metrics_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < METRICS_TEST_EVENTS; i++) {
+        metrics_inc(COUNTER_HTTP_REQUESTS);
+        metrics_observe(STAGE_RESPOND, metrics_now());
+    }
+    return NULL;
+}
+
+// Per-thread shards add up at scrape time, including exited threads'
+void test_metrics_merge_shards(void) {
+    uint64_t before = metrics_counter_total(COUNTER_HTTP_REQUESTS);
+    
+    pthread_t threads[METRICS_TEST_THREADS];
+    for (int i = 0; i < METRICS_TEST_THREADS; i++) {
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, metrics_worker, NULL));
+    }
+    for (int i = 0; i < METRICS_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    metrics_inc(COUNTER_HTTP_REQUESTS);
+    
+    TEST_ASSERT_EQUAL_UINT64(before + METRICS_TEST_THREADS * METRICS_TEST_EVENTS + 1,
+                             metrics_counter_total(COUNTER_HTTP_REQUESTS));
+    
+    OutputBuffer out;
+    output_buffer_init(&out);
+    metrics_render(&out);
+    TEST_ASSERT_TRUE(output_buffer_reserve(&out, 1));
+    out.data[out.len] = '\0';
+    TEST_ASSERT_NOT_NULL(strstr(out.data, "# TYPE heartbeat_http_requests_total counter\n"));
+    TEST_ASSERT_NOT_NULL(strstr(out.data,
+        "heartbeat_stage_duration_seconds_count{stage=\"respond\"} "));
+    TEST_ASSERT_NOT_NULL(strstr(out.data,
+        "heartbeat_stage_duration_seconds_bucket{stage=\"respond\",le=\"+Inf\"} "));
+    output_buffer_free(&out);
+}
+
 // Main test runner
 int main(void) {
     UNITY_BEGIN();
@@ -403,13 +1722,48 @@ int main(void) {
     RUN_TEST(test_process_json_data_valid);
     RUN_TEST(test_process_json_data_invalid);
     RUN_TEST(test_process_json_data_missing_fields);
+    RUN_TEST(test_json_decoder_matches_jsonc);
     
     // History management tests
     RUN_TEST(test_add_to_history);
     RUN_TEST(test_history_capacity);
     RUN_TEST(test_get_history_json);
     RUN_TEST(test_empty_history);
+    RUN_TEST(test_history_ring_wraparound);
+    RUN_TEST(test_history_snapshot);
+    RUN_TEST(test_history_streaming);
+    RUN_TEST(test_history_snapshot_cache);
+    RUN_TEST(test_response_compression);
     RUN_TEST(test_concurrent_history_access);
+    RUN_TEST(test_history_shards);
+    
+    // Per-host time series tests
+    RUN_TEST(test_tsdb_raw_range);
+    RUN_TEST(test_tsdb_compressed_blocks);
+    RUN_TEST(test_tsdb_host_table);
+    RUN_TEST(test_tsdb_rollups);
+    RUN_TEST(test_tsdb_window_stats);
+    RUN_TEST(test_anomaly_detection);
+    RUN_TEST(test_alert_rules);
+    
+    // HTTP protocol tests
+    RUN_TEST(test_http_parse_incremental);
+    RUN_TEST(test_http_pipelining);
+    RUN_TEST(test_rate_limit);
+    RUN_TEST(test_batch_endpoint);
+    RUN_TEST(test_metrics_merge_shards);
+    RUN_TEST(test_stream_subscribers);
+    
+    // Binary protocol tests
+    RUN_TEST(test_binary_frames);
+    RUN_TEST(test_udp_sequence_window);
+    RUN_TEST(test_add_batch_to_history);
+    
+    // Logging tests
+    RUN_TEST(test_log_levels_and_sampling);
+    
+    // Persistence tests
+    RUN_TEST(test_store_recovery_and_retention);
     
     return UNITY_END();
 }
\ No newline at end of file